@@ -9,90 +9,293 @@
 #include <signal.h>
 #include <sys/stat.h>
 #include <errno.h>
-#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "transfer.h"
+#include "event_loop.h"
+#include "backend_pool.h"
+#include "tar_stream.h"
+#include "archive_cache.h"
+#include "store_index.h"
+#include "upload.h"
+#include "compress.h"
+#include "uring_io.h"
+#include "stats.h"
+#include "trace.h"
+#include "read_cache.h"
+#include "shard_map.h"
+#include "delta.h"
+#include "group_commit.h"
+#include "segment_store.h"
+#include "checksum.h"
+#include "scheduler.h"
+#include "parallel_gzip.h"
 
-#define DEBUG 1
 
 #define SMAIN_SERVER_IP "127.0.0.1"
 
 #define SMAIN_SERVER_PORT 4020
 #define STEXT_SERVER_PORT 4014
-#define SPDF_SERVER_PORT 4014
+#define SPDF_SERVER_PORT 4015
 
 #define BUFFER_SIZE 1024
 
+#define MAX_COMMANDS 8
+
+// Largest number of stores a display lists, in cursor order: ./smain, every Spdf node and every Stext node
+#define DISPLAY_SOURCES (1 + SHARD_TYPES * 2 * SHARD_NODES_MAX)
+
+// Longest a backend may stay silent while display waits for its files
+#define DISPLAY_TIMEOUT_MS 5000
+
+// Largest chunk the statuses of a batch are sent in
+#define BATCH_STATUS_CHUNK (16 * 1024)
+
+/**
+ * @brief Outcome of a display request, reported in its result message.
+ */
+struct display_reply
+{
+  char next_cursor[BUFFER_SIZE / 2]; // Cursor of the next page if the listing was cut at the limit, else ""
+  char missing[BUFFER_SIZE / 4];     // Servers whose files are missing or incomplete, else ""
+};
+
+/**
+ * @brief A backend queried by display.
+ */
+struct display_backend
+{
+  const char *name;
+  struct backend_pool *pool;
+  int socket;     // -1 once the backend has answered or failed
+  uint64_t count; // Files relayed to the client
+  int draining;   // The page is full, the rest of the answer is read and dropped
+  int failed;     // Dropped before all its files for the page were relayed
+};
+
+/**
+ * @brief Handle the communication with a connected client.
+ *
+ * @param client_socket The client socket.
+ */
+void prcclient(int client_socket);
+
 /**
  * @brief Process the client's commands.
  *
  * @param socket The client socket.
- * @param command_str The command string received from the client.
+ * @param request The header of the command frame received from the client.
+ * @param args The command arguments received in the command frame payload.
+ */
+void process_command(int socket, const struct frame_header *request, char *args);
+
+/**
+ * @brief Run one of the client's commands, leaving its result to the caller.
+ *
+ * @param socket The client socket.
+ * @param request The header of the command frame received from the client.
+ * @param args The command arguments received in the command frame payload.
+ * @param message The buffer to store the result message.
+ * @param size The size of the message buffer.
+ * @return int Returns 1 if the command succeeded, 0 otherwise.
+ */
+int run_command(int socket, const struct frame_header *request, char *args, char *message, size_t size);
+
+/**
+ * @brief Store the result message of a command.
+ *
+ * @param message The buffer to store the result message.
+ * @param size The size of the message buffer.
+ * @param success Whether the command succeeded.
+ * @param text The result message.
+ * @return int Returns success.
+ */
+int command_result(char *message, size_t size, int success, const char *text);
+
+/**
+ * @brief Process the "batch" command, running the requests that follow it and sending their statuses.
+ *
+ * @param socket The client socket.
+ * @param request_id The id of the batch.
+ * @param commands The array of command arguments.
+ * @param message The buffer to store the result message of the batch.
+ * @param size The size of the message buffer.
+ * @return int Returns 1 if every request of the batch succeeded, 0 if some failed, -1 if the batch was not run.
  */
-void process_command(int socket, char *command_str);
+int process_batch(int socket, uint32_t request_id, char *commands[], char *message, size_t size);
 
 /**
  * @brief Process the "ufile" command.
  *
  * @param socket The client socket.
+ * @param request_id The id of the request being processed.
  * @param commands The array of command arguments.
  * @return int Returns 1 if the file was successfully received, -1 otherwise.
  */
-int process_ufile(int socket, char *commands[]);
+int process_ufile(int socket, uint32_t request_id, char *commands[]);
 
 /**
  * @brief Process the "dfile" command.
  *
  * @param socket The client socket.
+ * @param request_id The id of the request being processed.
  * @param commands The array of command arguments.
  * @return int Returns 1 if the file was successfully downloaded, -1 otherwise.
  */
-int process_dfile(int socket, char *commands[]);
+int process_dfile(int socket, uint32_t request_id, char *commands[]);
 
 /**
  * @brief Process the "rmfile" command.
  *
- * @param socket The client socket.
+ * @param request_id The id of the request being processed.
  * @param commands The array of command arguments.
  * @return int Returns 1 if the file was successfully removed, -1 otherwise.
  */
-int process_rmfile(int socket, char *commands[]);
+int process_rmfile(uint32_t request_id, char *commands[]);
+
+/**
+ * @brief Process the "uresume" command, on the server the file goes to.
+ *
+ * @param request_id The id of the request being processed.
+ * @param commands The array of command arguments.
+ * @param offset The buffer to store the committed size of the upload and the compression accepted, as the result
+ *               message.
+ * @param size The size of the offset buffer.
+ * @return int Returns 1 if the upload was looked up, -1 otherwise.
+ */
+int process_uresume(uint32_t request_id, char *commands[], char *offset, size_t size);
+
+/**
+ * @brief Process the "ulink" command, on the server the file goes to.
+ *
+ * @param request_id The id of the request being processed.
+ * @param commands The array of command arguments.
+ * @param reason The buffer to store why the file was not linked.
+ * @param size The size of the reason buffer.
+ * @return int Returns 1 if the server stored the file without its body, 0 if the client has to upload it, -1 otherwise.
+ */
+int process_ulink(uint32_t request_id, char *commands[], char *reason, size_t size);
+
+/**
+ * @brief Process the "usig" command, on the server the file goes to.
+ *
+ * @param socket The client socket.
+ * @param request_id The id of the request being processed.
+ * @param commands The array of command arguments.
+ * @param reason The buffer to store why no signatures were sent.
+ * @param size The size of the reason buffer.
+ * @return int Returns 1 if the signatures of the stored file were sent, 0 if the client has to upload the whole file,
+ *             -1 otherwise.
+ */
+int process_usig(int socket, uint32_t request_id, char *commands[], char *reason, size_t size);
+
+/**
+ * @brief Process the "udelta" command, on the server the file goes to.
+ *
+ * @param socket The client socket.
+ * @param request_id The id of the request being processed.
+ * @param commands The array of command arguments.
+ * @return int Returns 1 if the file was rebuilt from the delta and stored, -1 otherwise.
+ */
+int process_udelta(int socket, uint32_t request_id, char *commands[]);
 
 /**
  * @brief Process the "display" command.
  *
  * @param socket The client socket.
+ * @param request_id The id of the request being processed.
  * @param commands The array of command arguments.
+ * @param reply Set to the cursor of the next page and the servers that did not answer.
  * @return int Returns 1 if the files were successfully displayed, -1 otherwise.
  */
-int process_display(int socket, char *commands[]);
+int process_display(int socket, uint32_t request_id, char *commands[], struct display_reply *reply);
 
 /**
  * @brief Process the "dtar" command.
  *
  * @param socket The client socket.
+ * @param request_id The id of the request being processed.
  * @param commands The array of command arguments.
  * @return int Returns 1 if the tar file was successfully downloaded, -1 otherwise.
  */
-int process_dtar(int socket, char *commands[]);
+int process_dtar(int socket, uint32_t request_id, char *commands[]);
 
 /**
- * @brief Send a file to the client.
+ * @brief Send a file to the client as a data frame, using the transmit path selected with --send-mode, or as a
+ *        chunked body of compressed chunks if the client accepts them.
  *
  * @param socket The client socket.
+ * @param request_id The id of the request the file belongs to.
  * @param file_path The path of the file to send.
- * @return int Returns 1 if the file was successfully sent, -1 otherwise.
+ * @param deflate 1 if the client accepts compressed chunks, 0 otherwise.
+ * @param checked 1 if the client checks the download, which then ends with its checksum, 0 otherwise.
+ * @param range The byte range of the file to send, {0, UINT64_MAX} for the whole file.
+ * @return int Returns 1 if the file was successfully sent, -1 otherwise or if the range starts past the end of the file.
  */
-int send_file(int socket, const char *file_path);
+int send_file(int socket, uint32_t request_id, const char *file_path, int deflate, int checked,
+              struct byte_range range);
 
 /**
- * @brief Send a file to the server.
+ * @brief Relay a file upload from the client to the server as the bytes arrive.
+ *
+ * A resumable upload is relayed chunk by chunk, so the server commits every chunk the client got through, and so is
+ * the body of a delta.
  *
+ * @param client_socket The client socket, positioned at the upload's data frame.
  * @param socket_to_server The server socket.
+ * @param request_id The id of the request being forwarded.
+ * @param command The upload command opcode (OP_UFILE or OP_UDELTA).
  * @param file_name The name of the file to send.
- * @param file_size The size of the file to send.
  * @param destination_path The destination path of the file on the server.
- * @return int Returns 1 if the file was successfully sent, -1 otherwise.
+ * @param upload_args The upload id, file size and offset of a resumable upload, followed by the stripe and the number
+ *                    of stripes of a striped upload, or the file size, hash and block size of a delta, or NULL.
+ * @return int Returns 1 if the server stored the file, -1 otherwise.
+ */
+int relay_file_to_server(int client_socket, int socket_to_server, uint32_t request_id, uint8_t command,
+                         const char *file_name, const char *destination_path, const char *upload_args);
+
+/**
+ * @brief Ask the server where a resumable upload continues.
+ *
+ * @param socket_to_server The server socket.
+ * @param request_id The id of the request being forwarded.
+ * @param commands The array of command arguments.
+ * @param offset The buffer to store the committed size of the upload.
+ * @param size The size of the offset buffer.
+ * @return int Returns 1 if the server looked the upload up, -1 otherwise.
+ */
+int resume_upload_on_server(int socket_to_server, uint32_t request_id, char *commands[], char *offset, size_t size);
+
+/**
+ * @brief Ask the server to store a file of known content without its body.
+ *
+ * @param socket_to_server The server socket.
+ * @param request_id The id of the request being forwarded.
+ * @param commands The array of command arguments.
+ * @param reason The buffer to store why the file was not linked.
+ * @param size The size of the reason buffer.
+ * @return int Returns 1 if the server linked the file, 0 if it did not, -1 otherwise.
+ */
+int link_file_on_server(int socket_to_server, uint32_t request_id, char *commands[], char *reason, size_t size);
+
+/**
+ * @brief Relay the block signatures of a stored file from the server to the client.
+ *
+ * @param client_socket The client socket.
+ * @param socket_to_server The server socket.
+ * @param request_id The id of the request being forwarded.
+ * @param commands The array of command arguments.
+ * @param reason The buffer to store why the server sent no signatures.
+ * @param size The size of the reason buffer.
+ * @return int Returns 1 if the signatures were relayed, 0 if the server has none, -1 otherwise.
  */
-int send_file_to_server(int socket_to_server, const char *file_name, int file_size, const char *destination_path);
+int sign_file_on_server(int client_socket, int socket_to_server, uint32_t request_id, char *commands[], char *reason,
+                        size_t size);
 
 /**
  * @brief Receive a file from the client.
@@ -100,126 +303,295 @@ int send_file_to_server(int socket_to_server, const char *file_name, int file_si
  * @param client_socket The client socket.
  * @param dir_path The directory path to save the file.
  * @param file_name The name of the file to receive.
- * @param file_size The size of the file to receive.
  * @return int Returns 1 if the file was successfully received, -1 otherwise.
  */
-int receive_file(int client_socket, const char *dir_path, const char *file_name, int file_size);
+int receive_file(int client_socket, const char *dir_path, const char *file_name);
 
 /**
- * @brief Receive a file from the server.
+ * @brief Receive a resumable upload from the client, continuing at an offset.
  *
- * @param socket_to_server The server socket.
- * @param file_path The path to save the received file.
+ * @param client_socket The client socket.
+ * @param dir_path The directory path to save the file.
+ * @param file_name The name of the file to receive.
+ * @param upload_id The upload id chosen by the client.
+ * @param file_size The size of the whole file.
+ * @param offset The offset of the file the upload body starts at.
+ * @param stripe The stripe of a striped upload, 0 otherwise.
+ * @param stripes The number of stripes of the upload, 1 for an upload that is not striped.
+ * @return int Returns 1 if the file, or the stripe, is complete, -1 otherwise.
+ */
+int receive_resumable_file(int client_socket, const char *dir_path, const char *file_name, const char *upload_id,
+                           uint64_t file_size, uint64_t offset, unsigned stripe, unsigned stripes);
+
+/**
+ * @brief Receive a data frame body into a file.
+ *
+ * The remaining bytes are drained if the file cannot be written, so the stream stays framed. A checksum trailer
+ * after the content is checked once the file is written, and stored with the file.
+ *
+ * @param socket The socket to receive from.
+ * @param file_path The path of the file to write.
+ * @param file_size The number of bytes to receive, without the checksum trailer.
+ * @param checked 1 if a checksum trailer follows the content, 0 otherwise.
  * @return int Returns 1 if the file was successfully received, -1 otherwise.
  */
-int receive_file_from_server(int socket_to_server, const char *file_path);
+int receive_file_body(int socket, const char *file_path, uint64_t file_size, int checked);
+
+/**
+ * @brief Relay a file download from the server to the client as the bytes arrive.
+ *
+ * Compressed chunks are passed on as they are, the relay never inflates them. A whole file is copied into the read
+ * cache on the way, a range of a file is not.
+ *
+ * @param client_socket The client socket.
+ * @param socket_to_server The server socket.
+ * @param request_id The id of the request being forwarded.
+ * @param file_path The path of the file on the server.
+ * @param deflate 1 if the client accepts compressed chunks, 0 otherwise.
+ * @param checked 1 if the client checks the download, 0 otherwise.
+ * @param range The byte range of the file to relay, {0, UINT64_MAX} for the whole file.
+ * @return int Returns 1 if the file was successfully relayed, 0 if the server failed before sending any of it,
+ *             -1 otherwise.
+ */
+int relay_file_from_server(int client_socket, int socket_to_server, uint32_t request_id, const char *file_path,
+                           int deflate, int checked, struct byte_range range);
+
+/**
+ * @brief Relay the body of a download from the server to the client, a single data frame or every chunk of a
+ *        chunked body, flags included.
+ *
+ * @param client_socket The client socket.
+ * @param socket_to_server The server socket.
+ * @param request_id The id of the request being forwarded.
+ * @param message The buffer to store the server's result if it failed in place of the body or of a chunk.
+ * @param size The size of the message buffer.
+ * @param fill The copy of a download being added to the read cache, or NULL.
+ * @return int Returns 1 if the body was relayed, 0 if the server failed, -1 if either side broke. A client gone part
+ *             way has the rest of the body and the server's result drained, so the server connection can be reused;
+ *             a server cutting the body short shuts both sides down.
+ */
+int relay_body_from_server(int client_socket, int socket_to_server, uint32_t request_id, char *message, size_t size,
+                           struct read_cache_fill *fill);
 
 /**
  * @brief Remove a file from the client.
  *
- * @param socket The client socket.
  * @param file_path The path of the file to remove.
  * @return int Returns 1 if the file was successfully removed, -1 otherwise.
  */
-int remove_file(int socket, const char *file_path);
+int remove_file(const char *file_path);
 
 /**
  * @brief Remove a file from the server.
  *
  * @param socket_to_server The server socket.
+ * @param request_id The id of the request being forwarded.
  * @param file_name The name of the file to remove.
  * @return int Returns 1 if the file was successfully removed, -1 otherwise.
  */
-int remove_file_from_server(int socket_to_server, const char *file_name);
+int remove_file_from_server(int socket_to_server, uint32_t request_id, const char *file_name);
+
+/**
+ * @brief Remove a file from a backend node.
+ *
+ * @param node The node.
+ * @param request_id The id of the request being forwarded.
+ * @param file_name The path of the file to remove.
+ * @return int Returns 1 if the file was successfully removed, -1 otherwise.
+ */
+int remove_file_from_node(struct shard_node *node, uint32_t request_id, const char *file_name);
 
 /**
  * @brief Display the files in a directory on the client.
  *
+ * Every Spdf and Stext node is queried at the same time and, after the files of ./smain, their batches are relayed
+ * to the client as they arrive, as one chunked data frame body, so the listing takes as long as the slowest server and
+ * its memory does not depend on the size of the listing. A server that fails or stays silent for longer than
+ * DISPLAY_TIMEOUT_MS is dropped, and named in reply->missing. At most limit files are sent, starting at the
+ * offset of every store given by the cursor.
+ *
  * @param socket The client socket.
+ * @param request_id The id of the request the listing belongs to.
  * @param dir_path The directory path to display.
+ * @param limit The largest number of files to send, 0 for all.
+ * @param backends The stores to list, from list_display_backends.
+ * @param sources The number of stores.
+ * @param offsets The number of files to skip in every store.
+ * @param reply Set to the cursor of the next page and the servers that did not answer.
  * @return int Returns 1 if the files were successfully displayed, -1 otherwise.
  */
-int display_files(int socket, const char *dir_path);
+int display_files(int socket, uint32_t request_id, const char *dir_path, uint64_t limit,
+                  struct display_backend backends[], int sources, const uint64_t offsets[], struct display_reply *reply);
 
 /**
- * @brief Display the files in a directory on the server.
+ * @brief Get the stores a display lists, in cursor order: ./smain, every Spdf node and every Stext node.
  *
- * @param socket_to_server The server socket.
+ * @param backends Set to the stores, DISPLAY_SOURCES entries.
+ * @return int Returns the number of stores.
+ */
+int list_display_backends(struct display_backend backends[]);
+
+/**
+ * @brief Send the display command to a backend, without waiting for its answer.
+ *
+ * @param backend The backend, its socket is set to -1 if it is unreachable.
+ * @param request_id The id of the request being forwarded.
  * @param dir_path The directory path to display.
- * @param txt_file_paths The file paths of the text files.
- * @return int Returns 1 if the files were successfully displayed, -1 otherwise.
+ * @param offset The number of files the server skips.
+ * @param limit The largest number of files the server sends, 0 for all.
+ * @return int Returns 1 if the command was sent, -1 otherwise.
+ */
+int display_files_from_server(struct display_backend *backend, uint32_t request_id, const char *dir_path, uint64_t offset,
+                              uint64_t limit);
+
+/**
+ * @brief Relay the next batch of files a backend sent to the client.
+ *
+ * Only as many files as there is room for on the page are relayed, the rest of the backend's answer is dropped.
+ * The backend is released once it has answered, or failed.
+ *
+ * @param client_socket The client socket.
+ * @param backend The backend, whose socket is readable.
+ * @param request_id The id of the request being forwarded.
+ * @param room The number of files that still fit on the page.
+ * @return int Returns the number of files relayed, -1 if the backend failed, -2 if the client stream broke.
+ */
+int relay_display_batch(int client_socket, struct display_backend *backend, uint32_t request_id, uint64_t room);
+
+/**
+ * @brief Stop waiting for a backend, dropping its connection.
+ *
+ * @param backend The backend.
+ * @param reason Why the backend is dropped, for the log.
  */
-int display_files_from_server(int socket_to_server, const char *dir_path, char *txt_file_paths);
+void drop_display_backend(struct display_backend *backend, const char *reason);
 
 /**
- * @brief Send a tar file to the client.
+ * @brief Send the tar file of a directory to the client, from the archive cache if the directory has not changed.
  *
  * @param socket The client socket.
- * @param tar_name The name of the tar file to send.
+ * @param request_id The id of the request the tar file belongs to.
+ * @param source_path The directory to archive.
+ * @param level The gzip level of the archive, TAR_PLAIN for a plain tar archive.
+ * @param checked 1 if the client checks the download, whose frames then end with their checksums, 0 otherwise.
  * @return int Returns 1 if the tar file was successfully sent, -1 otherwise.
  */
-int send_tar(int socket, const char *tar_name);
+int send_tar(int socket, uint32_t request_id, const char *source_path, int level, int checked);
 
 /**
- * @brief Create a tar file.
+ * @brief Relay a tar file from the server to the client, chunk by chunk as it is generated or as one cached frame.
  *
- * @param tar_name The name of the tar file to create.
- * @param source_path The source path of the files to include in the tar file.
- * @return int Returns 1 if the tar file was successfully created, -1 otherwise.
+ * @param client_socket The client socket.
+ * @param socket_to_server The server socket.
+ * @param request_id The id of the request being forwarded.
+ * @param level The gzip level to ask the server for, TAR_PLAIN for a plain tar archive.
+ * @param checked 1 to ask the server for checked frames, if the client checks the download, 0 otherwise.
+ * @return int Returns 1 if the tar file was successfully relayed, -1 otherwise.
  */
-int create_tar(const char *tar_name, const char *source_path);
+int relay_tar_from_server(int client_socket, int socket_to_server, uint32_t request_id, int level, int checked);
 
 /**
- * @brief Create directories if they do not exist.
+ * @brief Send one tar file joined from the archives of several nodes to the client.
  *
- * @param path The path of the directories to create.
- * @return int Returns 0 if the directories were successfully created, -1 otherwise.
+ * Every node is asked for its plain archive in turn, and the entries are relayed into a single archive as they
+ * arrive, gzipped by Smain if requested. A node that fails, or whose archive does not match its checksums, fails the
+ * whole tar file.
+ *
+ * @param client_socket The client socket.
+ * @param members The nodes to archive.
+ * @param request_id The id of the request being forwarded.
+ * @param level The gzip level of the archive, TAR_PLAIN for a plain tar archive.
+ * @param checked 1 if the client checks the download, whose chunks then end with their checksums, 0 otherwise.
+ * @return int Returns 1 if the tar file was successfully sent, -1 otherwise.
  */
-int create_directories(const char *path);
+int relay_merged_tar(int client_socket, const struct shard_members *members, uint32_t request_id, int level,
+                     int checked);
 
 /**
- * @brief Traverse a directory and collect file paths.
+ * @brief Append the plain tar archive of one node to a merged archive.
  *
- * @param root The root directory.
- * @param dir_path The current directory path.
- * @param file_paths The collected file paths.
+ * @param merge The merged archive.
+ * @param socket_to_server The server socket.
+ * @param request_id The id of the request being forwarded.
+ * @param name The name of the node, for the log.
+ * @return int Returns 1 if the archive was appended, -1 otherwise.
  */
-void traverse_directory(const char *root, const char *dir_path, char *file_paths);
+int merge_tar_from_server(struct tar_merge *merge, int socket_to_server, uint32_t request_id, const char *name);
 
 /**
- * @brief Tokenize a command string.
+ * @brief Move every file whose node changed with the last change of the node registry, run by the rebalancer.
+ */
+void rebalance_files(void);
+
+/**
+ * @brief Move the files of one node that the current membership places elsewhere.
  *
- * @param cmd_str The command string to tokenize.
- * @param commands The array to store the command arguments.
- * @return int Returns the number of command arguments.
+ * @param node The node of the previous membership.
+ * @param type The type of the node.
+ * @param moved Increased by the number of files moved.
+ * @param failed Increased by the number of files that could not be moved.
+ * @return int Returns 1 if the node was listed, -1 otherwise.
  */
-int tokenize_command(char *cmd_str, char *commands[]);
+int rebalance_node(struct shard_node *node, int type, int *moved, int *failed);
 
 /**
- * @brief Send a message to the client with acknowledgement.
+ * @brief Move one file between nodes: download it, upload it to its new node, remove it from the old one.
  *
- * @param socket The client socket.
- * @param message The message to send.
- * @param ack_message The acknowledgement message to receive.
- * @return int Returns the number of bytes sent if the message was successfully sent, -1 otherwise.
+ * @param from The node holding the file.
+ * @param to The node the file is placed on.
+ * @param file_path The path of the file in the store.
+ * @return int Returns 1 if the file was moved, 0 if it was gone from the old node, -1 otherwise.
  */
-int send_with_acknowledgement(int socket, const char *message, char *ack_message);
+int move_file(struct shard_node *from, struct shard_node *to, const char *file_path);
 
 /**
- * @brief Receive a message from the client with acknowledgement.
+ * @brief Get every file stored on a node.
  *
- * @param socket The client socket.
- * @param ack_message The acknowledgement message to send.
- * @param message The received message.
- * @return int Returns the number of bytes received if the message was successfully received, -1 otherwise.
+ * @param node The node.
+ * @param listing Set to the display lines of the files, to be freed by the caller.
+ * @return int Returns 1 if the node was listed, -1 otherwise.
+ */
+int list_files_on_node(struct shard_node *node, char **listing);
+
+/**
+ * @brief Create directories if they do not exist.
+ *
+ * @param path The path of the directories to create.
+ * @return int Returns 0 if the directories were successfully created, -1 otherwise.
+ */
+int create_directories(const char *path);
+
+/**
+ * @brief Tokenize a command string.
+ *
+ * @param cmd_str The command string to tokenize.
+ * @param commands The array to store the command arguments.
+ * @param max_commands The capacity of the commands array.
+ * @return int Returns the number of command arguments.
+ */
+int tokenize_command(char *cmd_str, char *commands[], int max_commands);
+
+/**
+ * @brief Parse the command line options and apply them to the server configuration.
+ *
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments.
  */
-int receive_with_acknowledgement(int socket, const char *ack_message, char *message);
+void parse_options(int argc, char *argv[]);
 
 int server_socket; // Global variable for the server socket
 
-int stext_server_socket; // Global variable for the stext server socket
+int stext_pool_size = DEFAULT_POOL_SIZE; // Maximum connections to each stext node per process
+
+int spdf_pool_size = DEFAULT_POOL_SIZE; // Maximum connections to each spdf node per process
 
-int spdf_server_socket; // Global variable for the spdf server socket
+const char *nodes_file = NULL; // Registry of the stext and spdf nodes, set with --nodes
+
+int metrics_port = 0; // Port of the Prometheus metrics endpoint, set with --metrics-port
+
+unsigned trace_sample = 0; // Trace one in every trace_sample requests, set with --trace-sample
+
+const char *trace_file = NULL; // File the trace lines are appended to, set with --trace-file
 
 /**
  * @brief Handles the SIGINT signal by closing the server sockets and exiting the program.
@@ -233,8 +605,10 @@ void handle_sigint(int sig)
 {
   printf("\nClosing socket...\n", sig);
   close(server_socket);
-  close(stext_server_socket);
-  close(spdf_server_socket);
+  for (int type = 0; type < SHARD_TYPES; type++)
+    for (int previous = 0; previous < 2; previous++)
+      for (int i = 0; i < shard_members(type, previous)->count; i++)
+        backend_pool_close(shard_members(type, previous)->nodes[i]->pool);
   exit(0);
 }
 
@@ -243,8 +617,8 @@ void handle_sigint(int sig)
  * @brief Main server program for Smain server.
  *
  * This program creates a server socket, binds it to a specific port, and listens for incoming connections.
- * When a client connects, a child process is forked to handle the client.
- * The server communicates with other servers (stext_server and spdf_server) using TCP sockets.
+ * Clients are served by pre-spawned event loop workers, or in the fork model by a child process forked per client.
+ * The server communicates with other servers (stext_server and spdf_server) through pools of TCP connections.
  * The server also creates directories if they do not exist.
  *
  * @note This program assumes the existence of the following constants:
@@ -252,11 +626,10 @@ void handle_sigint(int sig)
  * - `SMAIN_SERVER_PORT`: Port number for the Smain server
  * - `STEXT_SERVER_PORT`: Port number for the Stext server
  * - `SPDF_SERVER_PORT`: Port number for the Spdf server
- * - `DEBUG`: Flag indicating whether to print debug messages
  *
  * @return 0 on success, -1 on failure
  */
-int main()
+int main(int argc, char *argv[])
 {
   int client_socket;
   struct sockaddr_in server_addr, client_addr;
@@ -267,22 +640,89 @@ int main()
   // Register signal handler for SIGINT
   signal(SIGINT, handle_sigint);
 
-  // create ./smain, ./tar directories if they do not exist
+  // Parse command line options
+  parse_options(argc, argv);
+
+  // create ./smain directory if it does not exist
   if (create_directories("./smain") != 0)
   {
     perror("Failed to create directories");
     exit(EXIT_FAILURE);
   }
-  if (create_directories("./tar") != 0)
+
+  // dtar archives are cached until the next write, the cache is shared by all processes forked below
+  if (archive_cache_init("./cache/smain") != 0)
+    fprintf(stderr, "Archive cache disabled\n");
+
+  // files downloaded from stext and spdf are cached for later dfiles, the cache is shared by all processes forked below
+  if (read_cache_init("./cache/smain-files") != 0)
+    fprintf(stderr, "Read cache disabled\n");
+
+  // partial resumable uploads of .c files are kept outside the store until they are complete
+  if (upload_init("./uploads/smain") != 0)
+    exit(EXIT_FAILURE);
+
+  // with --durable, uploads of .c files committed at about the same time by any process share one sync of the store
+  if (group_commit_init("./smain") != 0)
+    exit(EXIT_FAILURE);
+
+  // with --segment-store small .c files are appended to segments instead of stored as files of their own
+  if (segment_store_init("./segments/smain") != 0)
+    exit(EXIT_FAILURE);
+
+  // an epoll worker serves its connections one request at a time, a bulk request waiting for a slot or paced would
+  // stall the metadata requests of every other client of the worker
+  if (server_model != SERVER_MODEL_FORK &&
+      (scheduler_bulk_slots > 0 || scheduler_client_rate > 0 || scheduler_weights_file != NULL))
   {
-    perror("Failed to create directories");
+    fprintf(stderr, "--bulk-slots, --client-bandwidth and --client-weights need --server-model fork\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // bulk transfers of all processes forked below share the bulk slots and the client rates
+  if (scheduler_init() != 0)
+    exit(EXIT_FAILURE);
+
+  // the local part of display is answered from an index of ./smain built once here, kept current by ufile and rmfile
+  if (store_index_init("./smain") != 0)
+  {
+    fprintf(stderr, "Failed to build the store index\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Place .txt and .pdf files over the stext and spdf nodes of the registry, one node each without it; connection
+  // pools to the nodes are opened by the process serving a client
+  int default_ports[SHARD_TYPES] = {STEXT_SERVER_PORT, SPDF_SERVER_PORT};
+  int pool_sizes[SHARD_TYPES] = {stext_pool_size, spdf_pool_size};
+  if (shard_map_init(nodes_file, SMAIN_SERVER_IP, default_ports, pool_sizes, rebalance_files) != 0)
+  {
+    fprintf(stderr, "Failed to read the node registry\n");
     exit(EXIT_FAILURE);
   }
-  // Connect to the stext server
-  connect_to_server(&stext_server_socket, SMAIN_SERVER_IP, STEXT_SERVER_PORT);
 
-  // Connect to the spdf server
-  connect_to_server(&spdf_server_socket, SMAIN_SERVER_IP, SPDF_SERVER_PORT);
+  // every process forked below writes its trace lines to the same file
+  if (trace_init("smain", trace_sample, trace_file) != 0)
+    exit(EXIT_FAILURE);
+
+  // request statistics are shared by all processes forked below
+  if (stats_init("smain") != 0)
+    fprintf(stderr, "Request statistics disabled\n");
+  else if (metrics_port > 0 && stats_start_metrics(metrics_port) != 0)
+    exit(EXIT_FAILURE);
+
+  if (server_model == SERVER_MODEL_EPOLL)
+  {
+    // Every worker listens on the port itself, the kernel balances connections with SO_REUSEPORT
+    if (open_worker_listeners(SMAIN_SERVER_PORT) != 0)
+    {
+      perror("Failed to open listening sockets");
+      exit(EXIT_FAILURE);
+    }
+    printf("Smain server listening on port %d (send mode: %s, io engine: %s, server model: %s, workers: %d)\n",
+           SMAIN_SERVER_PORT, send_mode_name(file_send_mode), io_engine_name(file_io_engine), server_model_name(server_model),
+           event_workers);
+    exit(run_event_loop(process_command) == 0 ? 0 : EXIT_FAILURE);
+  }
 
   // Create socket
   server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -304,14 +744,15 @@ int main()
   }
 
   // Listen for connections
-  if (listen(server_socket, 10) < 0)
+  if (listen(server_socket, SOMAXCONN) < 0)
   {
     perror("Listen failed");
     close(server_socket);
     exit(EXIT_FAILURE);
   }
 
-  printf("Smain server listening on port %d\n", SMAIN_SERVER_PORT);
+  printf("Smain server listening on port %d (send mode: %s, io engine: %s, server model: %s)\n", SMAIN_SERVER_PORT,
+         send_mode_name(file_send_mode), io_engine_name(file_io_engine), server_model_name(server_model));
 
   while (1)
   {
@@ -323,8 +764,10 @@ int main()
       continue;
     }
     // Fork a child process to handle the client
-    if (DEBUG)
+    if (log_level >= LOG_DEBUG)
       printf("Forking child process for new Client\n");
+    // catch up with the changes made by other clients, so the child starts with a current index
+    store_index_sync();
     child_pid = fork();
     if (child_pid == 0)
     {
@@ -337,6 +780,9 @@ int main()
     {
       // Parent process
       close(client_socket);
+      // reap the children of clients that have disconnected
+      while (waitpid(-1, NULL, WNOHANG) > 0)
+        ;
     }
     else
     {
@@ -348,6 +794,159 @@ int main()
   return 0;
 }
 
+void parse_options(int argc, char *argv[])
+{
+  static struct option long_options[] = {
+      {"send-mode", required_argument, NULL, 's'},
+      {"io-engine", required_argument, NULL, 'u'},
+      {"server-model", required_argument, NULL, 'm'},
+      {"workers", required_argument, NULL, 'w'},
+      {"no-cpu-affinity", no_argument, NULL, 'A'},
+      {"stext-pool-size", required_argument, NULL, 't'},
+      {"spdf-pool-size", required_argument, NULL, 'p'},
+      {"inotify", no_argument, NULL, 'i'},
+      {"compress-level", required_argument, NULL, 'l'},
+      {"read-cache-size", required_argument, NULL, 'c'},
+      {"nodes", required_argument, NULL, 'n'},
+      {"log-level", required_argument, NULL, 'L'},
+      {"metrics-port", required_argument, NULL, 'M'},
+      {"trace-sample", required_argument, NULL, 'T'},
+      {"trace-file", required_argument, NULL, 'F'},
+      {"durable", no_argument, NULL, 'D'},
+      {"commit-window", required_argument, NULL, 'W'},
+      {"commit-batch", required_argument, NULL, 'B'},
+      {"segment-store", no_argument, NULL, 'g'},
+      {"segment-max-file", required_argument, NULL, 'G'},
+      {"bulk-slots", required_argument, NULL, 'b'},
+      {"client-bandwidth", required_argument, NULL, 'r'},
+      {"client-weights", required_argument, NULL, 'C'},
+      {"gzip-threads", required_argument, NULL, 'j'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int option;
+  while ((option = getopt_long(argc, argv, "s:u:m:w:At:p:il:c:n:L:M:T:F:DW:B:gG:b:r:C:j:", long_options, NULL)) != -1)
+  {
+    switch (option)
+    {
+    case 's':
+      // transmit path for file bodies: sendfile, splice or buffered
+      if (parse_send_mode(optarg, &file_send_mode) != 0)
+      {
+        fprintf(stderr, "Unknown send mode: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 't':
+      // maximum number of connections to each stext node
+      stext_pool_size = atoi(optarg);
+      break;
+    case 'p':
+      // maximum number of connections to each spdf node
+      spdf_pool_size = atoi(optarg);
+      break;
+    case 'u':
+      // I/O engine for file bodies: stdio or uring
+      if (parse_io_engine(optarg, &file_io_engine) != 0)
+      {
+        fprintf(stderr, "Unknown io engine: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'm':
+      // one process per client (fork) or event loop workers (epoll)
+      if (parse_server_model(optarg, &server_model) != 0)
+      {
+        fprintf(stderr, "Unknown server model: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'w':
+      // number of event loop worker processes
+      event_workers = atoi(optarg);
+      break;
+    case 'A':
+      // let the scheduler place the event loop workers
+      event_cpu_affinity = 0;
+      break;
+    case 'i':
+      // also follow files added to or removed from ./smain by other programs
+      store_index_inotify = 1;
+      break;
+    case 'l':
+      // zlib level of compressed downloads, 1 is fastest
+      compress_level = atoi(optarg);
+      break;
+    case 'c':
+      // megabytes of downloaded stext and spdf files kept for later dfiles, 0 disables the cache
+      read_cache_capacity = strtoull(optarg, NULL, 10) * 1024 * 1024;
+      break;
+    case 'n':
+      // registry file of the stext and spdf nodes, re-read when it changes
+      nodes_file = optarg;
+      break;
+    case 'L':
+      // info, or debug to also print every command and the steps of its processing
+      if (parse_log_level(optarg, &log_level) != 0)
+      {
+        fprintf(stderr, "Unknown log level: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'M':
+      // serve the request statistics in the Prometheus text format on this port
+      metrics_port = atoi(optarg);
+      break;
+    case 'T':
+      // trace one in every n requests, on top of the requests that arrive traced
+      trace_sample = strtoul(optarg, NULL, 10);
+      break;
+    case 'F':
+      trace_file = optarg;
+      break;
+    case 'D':
+      // acknowledge uploads of .c files only once they are on disk
+      durable_writes = 1;
+      break;
+    case 'W':
+      // microseconds a group commit waits for more uploads to share its sync
+      commit_window_us = strtoul(optarg, NULL, 10);
+      break;
+    case 'B':
+      // uploads that end the wait of a group commit early
+      commit_batch = strtoul(optarg, NULL, 10);
+      break;
+    case 'g':
+      // append small files to segment files instead of storing each as a file of its own
+      segment_store_enabled = 1;
+      break;
+    case 'G':
+      // largest file, in bytes, appended to a segment
+      segment_max_file = strtoull(optarg, NULL, 10);
+      break;
+    case 'b':
+      // bulk transfers running at once over all processes, shared fairly between clients, 0 for no limit
+      scheduler_bulk_slots = strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      // megabytes per second each client may move through file bodies, 0 for no limit
+      scheduler_client_rate = strtoull(optarg, NULL, 10) * 1024 * 1024;
+      break;
+    case 'C':
+      // file of "address weight [megabytes per second]" lines for clients with a share of their own
+      scheduler_weights_file = optarg;
+      break;
+    case 'j':
+      // threads compressing every gzipped dtar archive, 0 for one per CPU
+      parallel_gzip_threads = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [--send-mode sendfile|splice|buffered] [--io-engine stdio|uring] [--server-model fork|epoll] [--workers n] [--no-cpu-affinity] [--stext-pool-size n] [--spdf-pool-size n] [--inotify] [--compress-level n] [--read-cache-size mb] [--nodes file] [--log-level info|debug] [--metrics-port n] [--trace-sample n] [--trace-file path] [--durable] [--commit-window us] [--commit-batch n] [--segment-store] [--segment-max-file bytes] [--bulk-slots n] [--client-bandwidth mb] [--client-weights file] [--gzip-threads n]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
 void prcclient(int client_socket)
 {
   // Declare a structure to hold client address information
@@ -360,29 +959,39 @@ void prcclient(int client_socket)
 
   // Print the client's IP address and port number
   printf("Client connected: %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+  stats_connection_opened();
 
   // Enter an infinite loop to continuously receive commands from the client
   while (1)
   {
-    // Declare a buffer to hold the received command
-    char command[BUFFER_SIZE];
+    // Receive a command frame from the client
+    struct frame_header request;
+    int result = recv_frame_header(client_socket, &request);
 
-    // Receive a command from the client with acknowledgement
-    int bytes_received = receive_with_acknowledgement(client_socket, "ack", command);
-
-    // Check if there was an error receiving the command
-    if (bytes_received < 0)
+    // Check if there was an error receiving the command or the client disconnected
+    if (result < 0)
     {
       // Print an error message and break the loop
       perror("Failed to receive command");
       break;
     }
+    if (result == 0)
+      break;
+
+    // Receive the command arguments
+    char args[MAX_ARGS_SIZE];
+    if (recv_frame_payload(client_socket, &request, args, sizeof(args)) < 0)
+    {
+      perror("Failed to receive command arguments");
+      break;
+    }
 
     // Print the received command
-    printf("Command received: %s\n", command);
+    if (log_level >= LOG_DEBUG)
+      printf("Command received: %s %s\n", opcode_name(request.opcode), args);
 
     // Process the received command
-    process_command(client_socket, command);
+    process_command(client_socket, &request, args);
   }
 
   // Close the client socket after exiting the loop
@@ -390,203 +999,430 @@ void prcclient(int client_socket)
 
   // Print the client's IP address and port number indicating disconnection
   printf("Client disconnected: %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+  stats_connection_closed();
+
+  // print what this connection cost, to compare the transmit paths
+  print_transfer_stats("Connection");
 }
 
-void connect_to_server(int *client_socket, const char *server_ip, int server_port)
+void process_command(int socket, const struct frame_header *request, char *args)
 {
-  struct sockaddr_in server_addr;
+  char message[BUFFER_SIZE];
+  int result;
 
-  // Create socket
-  *client_socket = socket(AF_INET, SOCK_STREAM, 0);
-  if (*client_socket < 0)
-  {
-    perror("Socket creation failed");
-    exit(EXIT_FAILURE);
-  }
+  // every command is timed, whatever its outcome; the requests of a batch are not timed on their own
+  uint64_t start = stats_now();
+  trace_begin(request, args);
 
-  // Connect to server
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(server_port);
-  server_addr.sin_addr.s_addr = inet_addr(server_ip);
-  if (connect(*client_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+  // take up a change of the node registry before the request is placed
+  shard_map_refresh();
+
+  // a bulk transfer waits for its client's share of the bulk slots, metadata requests go straight on
+  scheduler_begin(socket, request->opcode);
+  trace_span("schedule");
+
+  // a batch answers its requests itself and ends with its own result
+  if (request->opcode == OP_BATCH)
   {
-    perror("Connection failed");
-    close(*client_socket);
-    exit(EXIT_FAILURE);
+    if (log_level >= LOG_DEBUG)
+      printf("Processing batch command\n");
+    char *commands[3] = {"batch", NULL, NULL};
+    tokenize_command(args, commands + 1, 1);
+    result = commands[1] != NULL ? process_batch(socket, request->request_id, commands, message, sizeof(message)) : -1;
+    if (result < 0)
+    {
+      // the requests of a rejected batch cannot be told apart from new ones, the connection goes
+      scheduler_end();
+      send_result(socket, request->request_id, 0, "Invalid batch");
+      shutdown(socket, SHUT_RDWR);
+      stats_record_command(request->opcode, start);
+      trace_end();
+      return;
+    }
   }
+  else
+    result = run_command(socket, request, args, message, sizeof(message));
+  scheduler_end();
+  trace_span("process");
+
+  send_result(socket, request->request_id, result, message);
+  stats_record_command(request->opcode, start);
+  trace_end();
 }
 
-void process_command(int socket, char *command_str)
+int command_result(char *message, size_t size, int success, const char *text)
 {
-  // Process the command
-  char *commands[5];
-  // Tokenize the command string
-  int count = tokenize_command(command_str, commands);
-
-  // extract command
-  char *command = commands[0];
+  snprintf(message, size, "%s", text);
+  return success;
+}
 
-  if (strcmp(command, "ufile") == 0)
+int process_batch(int socket, uint32_t request_id, char *commands[], char *message, size_t size)
+{
+  // Sample command: batch count, followed by count requests
+  long count = strtol(commands[1], NULL, 10);
+  if (count <= 0 || count > BATCH_MAX_ITEMS)
   {
-    // Receive File from client
-    if (process_ufile(socket, commands) == 1)
-      send(socket, "File received by server", 24, 0);
-    else
-      send(socket, "Failed to receive file", 23, 0);
+    fprintf(stderr, "Invalid batch size: %s\n", commands[1]);
+    return -1;
   }
-  else if (strcmp(command, "dfile") == 0)
+
+  // the statuses are sent once every request ran, one line per request
+  size_t statuses_size = 0, statuses_capacity = BATCH_STATUS_CHUNK;
+  char *statuses = malloc(statuses_capacity);
+  if (statuses == NULL)
+  {
+    perror("Failed to allocate batch statuses");
+    return -1;
+  }
+
+  long succeeded = 0;
+  for (long i = 0; i < count; i++)
+  {
+    // every request of the batch is an ordinary command frame, an upload followed by its data frame
+    struct frame_header item;
+    char args[MAX_ARGS_SIZE + 1];
+    if (recv_frame_header(socket, &item) != 1 || item.opcode == OP_DATA || item.opcode == OP_RESULT ||
+        recv_frame_payload(socket, &item, args, sizeof(args)) < 0)
+    {
+      fprintf(stderr, "Batch interrupted after %ld of %ld requests\n", i, count);
+      free(statuses);
+      return -1;
+    }
+
+    // downloads, uploads and removals only, the others answer with more than a body
+    char item_message[BUFFER_SIZE];
+    int result;
+    if (item.opcode == OP_UFILE || item.opcode == OP_DFILE || item.opcode == OP_RMFILE)
+      result = run_command(socket, &item, args, item_message, sizeof(item_message));
+    else
+      result = command_result(item_message, sizeof(item_message), 0, "Not allowed in a batch");
+    succeeded += result == 1;
+
+    char line[BUFFER_SIZE + 32];
+    int length = snprintf(line, sizeof(line), "%u %d %s\n", item.request_id, result == 1, item_message);
+    if (statuses_size + length > statuses_capacity)
+    {
+      char *grown = realloc(statuses, statuses_capacity * 2);
+      if (grown == NULL)
+      {
+        perror("Failed to allocate batch statuses");
+        free(statuses);
+        return -1;
+      }
+      statuses = grown;
+      statuses_capacity *= 2;
+    }
+    memcpy(statuses + statuses_size, line, length);
+    statuses_size += length;
+  }
+
+  // send the statuses in chunks of whole lines, then the zero length chunk ending them
+  size_t sent = 0;
+  while (sent < statuses_size)
   {
-    if (DEBUG)
+    size_t length = statuses_size - sent;
+    if (length > BATCH_STATUS_CHUNK)
+    {
+      length = BATCH_STATUS_CHUNK;
+      while (statuses[sent + length - 1] != '\n')
+        length--;
+    }
+    if (send_chunk(socket, request_id, statuses + sent, length) != 0)
+      break;
+    sent += length;
+  }
+  free(statuses);
+  if (sent < statuses_size || send_chunk(socket, request_id, NULL, 0) != 0)
+  {
+    perror("Failed to send batch statuses");
+    return -1;
+  }
+
+  if (log_level >= LOG_DEBUG)
+    printf("Batch of %ld requests, %ld succeeded\n", count, succeeded);
+  snprintf(message, size, "%ld of %ld requests succeeded", succeeded, count);
+  return succeeded == count;
+}
+
+int run_command(int socket, const struct frame_header *request, char *args, char *message, size_t size)
+{
+  // Process the command, commands[0] is the command name as in the text protocol
+  char *commands[MAX_COMMANDS + 1] = {NULL};
+  commands[0] = (char *)opcode_name(request->opcode);
+  // Tokenize the command arguments
+  int count = 1 + tokenize_command(args, commands + 1, MAX_COMMANDS - 1);
+  trace_span("parse");
+
+  uint32_t request_id = request->request_id;
+
+  if (request->opcode == OP_UFILE)
+  {
+    // Receive File from client
+    if (count >= 3 && process_ufile(socket, request_id, commands) == 1)
+      return command_result(message, size, 1, "File received by server");
+    // the body of an invalid command still has to be consumed to keep the stream framed
+    if (count < 3)
+      discard_frame(socket);
+    return command_result(message, size, 0, "Failed to receive file");
+  }
+  else if (request->opcode == OP_DFILE)
+  {
+    if (log_level >= LOG_DEBUG)
       printf("Processing dfile command\n");
     // Send File to client
-    if (process_dfile(socket, commands) == 1)
-      send(socket, "File downloaded", 16, 0);
+    if (count >= 2 && process_dfile(socket, request_id, commands) == 1)
+      return command_result(message, size, 1, "File downloaded");
     else
-      send(socket, "Failed to download file", 24, 0);
+      return command_result(message, size, 0, "Failed to download file");
   }
-  else if (strcmp(command, "rmfile") == 0)
+  else if (request->opcode == OP_RMFILE)
   {
-    if (DEBUG)
+    if (log_level >= LOG_DEBUG)
       printf("Processing rmfile command\n");
     // Remove file
-    if (process_rmfile(socket, commands) == 1)
-      send(socket, "File removed", 13, 0);
+    if (count >= 2 && process_rmfile(request_id, commands) == 1)
+      return command_result(message, size, 1, "File removed");
     else
-      send(socket, "Failed to remove file", 22, 0);
+      return command_result(message, size, 0, "Failed to remove file");
   }
-  else if (strcmp(command, "dtar") == 0)
+  else if (request->opcode == OP_DTAR)
   {
-    if (DEBUG)
+    if (log_level >= LOG_DEBUG)
       printf("Processing dtar command\n");
     // Create tar file and send to client
-    if (process_dtar(socket, commands) == 1)
-      send(socket, "Tar file downloaded", 19, 0);
+    if (count >= 2 && process_dtar(socket, request_id, commands) == 1)
+      return command_result(message, size, 1, "Tar file downloaded");
     else
-      send(socket, "Failed to download tar file", 27, 0);
+      return command_result(message, size, 0, "Failed to download tar file");
   }
-  else if (strcmp(command, "display") == 0)
+  else if (request->opcode == OP_DISPLAY)
   {
-    if (DEBUG)
+    if (log_level >= LOG_DEBUG)
       printf("Processing display command\n");
-    // Display files
-    if (process_display(socket, commands) == 1)
-      send(socket, "File paths saved as file", 24, 0);
+    // Display files, a page cut at the limit tells the client how to ask for the next one
+    struct display_reply reply;
+    if (count >= 2 && process_display(socket, request_id, commands, &reply) == 1)
+    {
+      char missing[BUFFER_SIZE / 2] = "", next_page[BUFFER_SIZE] = "";
+      if (reply.missing[0] != '\0')
+        snprintf(missing, sizeof(missing), " (partial, no files from %s)", reply.missing);
+      if (reply.next_cursor[0] != '\0')
+        snprintf(next_page, sizeof(next_page), ", next page: display %s %s %s", commands[1], commands[2], reply.next_cursor);
+      char text[2 * BUFFER_SIZE];
+      snprintf(text, sizeof(text), "File paths saved as file%s%s", missing, next_page);
+      return command_result(message, size, 1, text);
+    }
     else
-      send(socket, "Failed to get files", 19, 0);
+      return command_result(message, size, 0, "Failed to get files");
+  }
+  else if (request->opcode == OP_URESUME)
+  {
+    if (log_level >= LOG_DEBUG)
+      printf("Processing uresume command\n");
+    // Tell the client where its upload continues
+    char offset[64];
+    if (count >= 4 && process_uresume(request_id, commands, offset, sizeof(offset)) == 1)
+      return command_result(message, size, 1, offset);
+    else
+      return command_result(message, size, 0, "Invalid upload id");
+  }
+  else if (request->opcode == OP_ULINK)
+  {
+    if (log_level >= LOG_DEBUG)
+      printf("Processing ulink command\n");
+    // Store known content without its body, the client uploads it if this fails
+    char reason[BUFFER_SIZE / 4];
+    int result = count >= 5 ? process_ulink(request_id, commands, reason, sizeof(reason)) : -1;
+    if (result == 1)
+      return command_result(message, size, 1, "File received by server");
+    else if (result == 0)
+      return command_result(message, size, 0, reason);
+    else
+      return command_result(message, size, 0, "Failed to link file");
+  }
+  else if (request->opcode == OP_USIG)
+  {
+    if (log_level >= LOG_DEBUG)
+      printf("Processing usig command\n");
+    // Sign the stored file for a delta upload, the client uploads the whole file if this fails
+    char reason[BUFFER_SIZE / 4];
+    int result = count >= 3 ? process_usig(socket, request_id, commands, reason, sizeof(reason)) : -1;
+    if (result == 1)
+      return command_result(message, size, 1, "Signatures sent");
+    else if (result == 0)
+      return command_result(message, size, 0, reason);
+    else
+      return command_result(message, size, 0, "Failed to send signatures");
+  }
+  else if (request->opcode == OP_UDELTA)
+  {
+    if (log_level >= LOG_DEBUG)
+      printf("Processing udelta command\n");
+    // Rebuild the file from the stored one
+    if (count >= 6 && process_udelta(socket, request_id, commands) == 1)
+      return command_result(message, size, 1, "File received by server");
+    if (count < 6)
+      discard_frame(socket);
+    return command_result(message, size, 0, "Failed to apply delta");
+  }
+  else if (request->opcode == OP_STATS)
+  {
+    // Report the request statistics of Smain
+    if (send_stats(socket, request_id) == 1)
+      return command_result(message, size, 1, "Statistics sent");
+    else
+      return command_result(message, size, 0, "Failed to send statistics");
   }
   else
   {
-    if (DEBUG)
+    if (log_level >= LOG_DEBUG)
       printf("Invalid command\n");
-    send(socket, "Invalid command", 15, 0);
+    return command_result(message, size, 0, "Invalid command");
   }
 }
 
-int process_ufile(int socket, char *commands[])
+int process_ufile(int socket, uint32_t request_id, char *commands[])
 {
-  // Sample command: ufile fileName fileSize /destination/path
-  // extract file name, file size and destination path
+  // Sample command: ufile fileName /destination/path, followed by a data frame
+  // extract file name and destination path
   char *filename = commands[1];
-  int file_size = atoi(commands[2]);
 
   // extract file extension
   char *file_extension = strrchr(filename, '.');
   if (file_extension == NULL)
   {
-    perror("Failed to extract file extension");
+    fprintf(stderr, "Failed to extract file extension\n");
+    // the upload body still has to be consumed to keep the stream framed
+    discard_frame(socket);
     return -1;
   }
 
+  // a resumable upload names its upload id, the file size and where it continues
+  int resumable = commands[3] != NULL && commands[4] != NULL && commands[5] != NULL;
+  int striped = resumable && commands[6] != NULL && commands[7] != NULL;
+
+  // .txt and .pdf files go to the node their path is placed on
+  char store_path[512];
+  snprintf(store_path, sizeof(store_path), "%s/%s", commands[2], filename);
+  int type = shard_type_of(filename);
+  if (type >= 0)
+  {
+    struct shard_node *node = shard_owner(type, store_path);
+    int socket_to_server = backend_pool_acquire(node->pool);
+    if (socket_to_server < 0)
+    {
+      discard_frame(socket);
+      return -1;
+    }
+
+    // stream the upload straight through to the backend, nothing is staged on disk
+    char upload_args[BUFFER_SIZE / 4];
+    if (resumable)
+      snprintf(upload_args, sizeof(upload_args), "%s %s %s%s%s%s%s", commands[3], commands[4], commands[5],
+               striped ? " " : "", striped ? commands[6] : "", striped ? " " : "", striped ? commands[7] : "");
+    int result = relay_file_to_server(socket, socket_to_server, request_id, OP_UFILE, filename, commands[2],
+                                      resumable ? upload_args : NULL);
+    backend_pool_release(node->pool, socket_to_server);
+    // the file may have changed even if the upload failed part way
+    read_cache_invalidate(store_path);
+    if (result != 1)
+      return -1;
+
+    // while a rebalance runs, the older copy on the node the path moves away from is dropped, so it is neither
+    // listed nor moved over the new one
+    struct shard_node *previous = shard_previous_owner(type, store_path);
+    if (previous != NULL)
+      remove_file_from_node(previous, request_id, store_path);
+
+    printf("File relayed\n");
+    return 1;
+  }
+
   // create destination path by prepending ./smain/
   char destination_path[256];
   if (strcmp(file_extension, ".c") == 0)
-    snprintf(destination_path, sizeof(destination_path), "./smain/%s", commands[3]);
+    snprintf(destination_path, sizeof(destination_path), "./smain/%s", commands[2]);
   else
     snprintf(destination_path, sizeof(destination_path), "./smain/");
 
-  if (DEBUG)
-    printf("File name: %s, File size: %d, Destination path: %s\n", filename, file_size, destination_path);
+  if (log_level >= LOG_DEBUG)
+    printf("File name: %s, Destination path: %s\n", filename, destination_path);
 
   // receive file content in chunks
-  receive_file(socket, destination_path, filename, file_size);
-
-  // check if file extension is .txt or .pdf
-  if (strcmp(file_extension, ".txt") == 0 || strcmp(file_extension, ".pdf") == 0)
-  {
-    int socket_to_server = (strcmp(file_extension, ".txt") == 0) ? stext_server_socket : spdf_server_socket;
-
-    send_file_to_server(socket_to_server, filename, file_size, commands[3]);
-
-    // get file full path by appending filename to destination path
-    char file_full_path[256];
-    snprintf(file_full_path, sizeof(file_full_path), "%s/%s", destination_path, filename);
-
-    // delete file
-    if (remove(file_full_path) != 0)
-    {
-      perror("Failed to remove file");
-      return -1;
-    }
-  }
+  int result;
+  if (resumable)
+    result = receive_resumable_file(socket, destination_path, filename, commands[3], strtoull(commands[4], NULL, 10),
+                                    strtoull(commands[5], NULL, 10), striped ? atoi(commands[6]) : 0,
+                                    striped ? atoi(commands[7]) : 1);
+  else
+    result = receive_file(socket, destination_path, filename);
+  trace_span("receive");
+  // the store may have changed even if the upload failed part way
+  archive_cache_invalidate();
+  if (result != 1)
+    return -1;
 
   printf("File received\n");
   return 1;
 }
 
-int process_dfile(int socket, char *commands[])
+int process_dfile(int socket, uint32_t request_id, char *commands[])
 {
-  // Sample command: ufile fileName fileSize /destination/path
-  // extract file path
+  // Sample command: dfile /path/to/file [deflate] [crc32c] [range offset length]
+  // extract file path, whether the client accepts compressed chunks or checks the download, and the byte range asked
+  // for
   char *file_path = commands[1];
-
-  int file_fetch = 0;
+  int deflate = has_argument(commands, COMPRESS_CAPABILITY);
+  int checked = has_argument(commands, CHECKSUM_CAPABILITY);
+  struct byte_range range;
+  if (parse_range(commands, &range) < 0)
+    return -1;
 
   // extract file extension
   char *file_extension = strrchr(file_path, '.');
   if (file_extension == NULL)
   {
-    perror("Failed to extract file extension");
+    fprintf(stderr, "Failed to extract file extension\n");
     return -1;
   }
 
-  // check if file extension is .txt
-  if (strcmp(file_extension, ".txt") == 0 || strcmp(file_extension, ".pdf") == 0)
-  {
-    int socket_to_server = (strcmp(file_extension, ".txt") == 0) ? stext_server_socket : spdf_server_socket;
-    file_fetch = 1;
-
-    // receive file from server
-    if (receive_file_from_server(socket_to_server, file_path) != 1)
+  // check if file extension is .txt or .pdf
+  int type = shard_type_of(file_path);
+  if (type >= 0)
+  {
+    // files downloaded recently are answered from the read cache without asking the server
+    int cached = read_cache_send(socket, request_id, file_path, deflate, checked, range);
+    if (cached != 0)
+      return cached;
+
+    // a file not moved yet by a running rebalance is still on its previous node
+    struct shard_node *nodes[2] = {shard_owner(type, file_path), shard_previous_owner(type, file_path)};
+    int result = 0;
+    for (int i = 0; i < 2 && result == 0 && nodes[i] != NULL; i++)
     {
-      perror("Failed to receive file from server");
-      file_fetch = 0;
+      int socket_to_server = backend_pool_acquire(nodes[i]->pool);
+      if (socket_to_server < 0)
+        return -1;
+
+      // stream the file from the server straight to the client, nothing is staged on disk
+      result = relay_file_from_server(socket, socket_to_server, request_id, file_path, deflate, checked, range);
+      backend_pool_release(nodes[i]->pool, socket_to_server);
     }
+    return result == 1 ? 1 : -1;
   }
 
-  if (DEBUG)
+  if (log_level >= LOG_DEBUG)
     printf("Sending file: %s\n", file_path);
 
   // create file path by prepending ./smain/
   char file_full_path[256];
   snprintf(file_full_path, sizeof(file_full_path), "./smain/%s", file_path);
 
-  // receive file content in chunks
-  int result = send_file(socket, file_full_path);
-
-  if (file_fetch == 1)
-  {
-    // delete file
-    if (remove(file_full_path) != 0)
-    {
-      perror("Failed to remove file");
-      return -1;
-    }
-  }
-
-  return result;
+  // send file content
+  return send_file(socket, request_id, file_full_path, deflate, checked, range);
 }
 
-int process_rmfile(int socket, char *commands[])
+int process_rmfile(uint32_t request_id, char *commands[])
 {
   // Sample command: rmfile fileName
   // extract file name
@@ -596,25 +1432,24 @@ int process_rmfile(int socket, char *commands[])
   char *file_extension = strrchr(file_name, '.');
   if (file_extension == NULL)
   {
-    perror("Failed to extract file extension");
+    fprintf(stderr, "Failed to extract file extension\n");
     return -1;
   }
 
   // check if file extension is .txt or .pdf
-  if (strcmp(file_extension, ".txt") == 0 || strcmp(file_extension, ".pdf") == 0)
+  int type = shard_type_of(file_name);
+  if (type >= 0)
   {
-    int socket_to_server = (strcmp(file_extension, ".txt") == 0) ? stext_server_socket : spdf_server_socket;
-    int res = remove_file_from_server(socket_to_server, file_name);
-    // send acknowledgement to client
-    if (send(socket, "ack", 3, 0) < 0)
-    {
-      perror("Failed to send acknowledgement");
-      return -1;
-    }
-    return res;
+    // a file not moved yet by a running rebalance is removed from its previous node
+    int result = remove_file_from_node(shard_owner(type, file_name), request_id, file_name);
+    struct shard_node *previous = shard_previous_owner(type, file_name);
+    if (previous != NULL && remove_file_from_node(previous, request_id, file_name) == 1)
+      result = 1;
+    read_cache_invalidate(file_name);
+    return result;
   }
 
-  if (DEBUG)
+  if (log_level >= LOG_DEBUG)
     printf("Removing file: %s\n", file_name);
 
   // create file path by prepending ./smain/
@@ -622,590 +1457,1371 @@ int process_rmfile(int socket, char *commands[])
   snprintf(file_full_path, sizeof(file_full_path), "./smain/%s", file_name);
 
   // remove file
-  return remove_file(socket, file_full_path);
+  int result = remove_file(file_full_path);
+  if (result == 1)
+    archive_cache_invalidate();
+  return result;
 }
 
-int process_display(int socket, char *commands[])
+int process_uresume(uint32_t request_id, char *commands[], char *offset, size_t size)
 {
-  // Sample command: display /path/to/directory
-  // extract directory path
+  // Sample command: uresume fileName /destination/path upload_id [stripe stripes]
+  // extract file extension
+  char *file_extension = strrchr(commands[1], '.');
+  if (file_extension == NULL)
+  {
+    fprintf(stderr, "Failed to extract file extension\n");
+    return -1;
+  }
+
+  // the node the file goes to holds the upload
+  int type = shard_type_of(commands[1]);
+  if (type >= 0)
+  {
+    char store_path[512];
+    snprintf(store_path, sizeof(store_path), "%s/%s", commands[2], commands[1]);
+    struct shard_node *node = shard_owner(type, store_path);
+    int socket_to_server = backend_pool_acquire(node->pool);
+    if (socket_to_server < 0)
+      return -1;
+
+    int result = resume_upload_on_server(socket_to_server, request_id, commands, offset, size);
+    backend_pool_release(node->pool, socket_to_server);
+    return result;
+  }
+
+  uint64_t committed;
+  unsigned stripe = commands[4] != NULL && commands[5] != NULL ? atoi(commands[4]) : 0;
+  unsigned stripes = commands[4] != NULL && commands[5] != NULL ? atoi(commands[5]) : 1;
+  if (upload_offset(commands[3], stripe, stripes, &committed) != 1)
+  {
+    fprintf(stderr, "Invalid upload id: %s\n", commands[3]);
+    return -1;
+  }
+  // the chunks of the upload may come compressed
+  snprintf(offset, size, "%llu %s", (unsigned long long)committed, COMPRESS_CAPABILITY);
+  return 1;
+}
+
+int process_ulink(uint32_t request_id, char *commands[], char *reason, size_t size)
+{
+  // Sample command: ulink fileName /destination/path sha256 file_size
+  // extract file extension
+  char *file_extension = strrchr(commands[1], '.');
+  if (file_extension == NULL)
+  {
+    fprintf(stderr, "Failed to extract file extension\n");
+    return -1;
+  }
+
+  // only the servers the file could go to deduplicate their stores
+  int type = shard_type_of(commands[1]);
+  if (type >= 0)
+  {
+    char store_path[512];
+    snprintf(store_path, sizeof(store_path), "%s/%s", commands[2], commands[1]);
+    struct shard_node *node = shard_owner(type, store_path);
+    int socket_to_server = backend_pool_acquire(node->pool);
+    if (socket_to_server < 0)
+      return -1;
+
+    int result = link_file_on_server(socket_to_server, request_id, commands, reason, size);
+    backend_pool_release(node->pool, socket_to_server);
+    if (result == 1)
+    {
+      read_cache_invalidate(store_path);
+      // as for ufile, the copy on the node the path is moving away from is dropped
+      struct shard_node *previous = shard_previous_owner(type, store_path);
+      if (previous != NULL)
+        remove_file_from_node(previous, request_id, store_path);
+    }
+    return result;
+  }
+
+  snprintf(reason, size, "Deduplication disabled");
+  return 0;
+}
+
+int process_usig(int socket, uint32_t request_id, char *commands[], char *reason, size_t size)
+{
+  // Sample command: usig fileName /destination/path
+  // extract file extension
+  char *file_extension = strrchr(commands[1], '.');
+  if (file_extension == NULL)
+  {
+    fprintf(stderr, "Failed to extract file extension\n");
+    return -1;
+  }
+
+  // the node the file goes to signs its copy
+  int type = shard_type_of(commands[1]);
+  if (type >= 0)
+  {
+    char store_path[512];
+    snprintf(store_path, sizeof(store_path), "%s/%s", commands[2], commands[1]);
+    struct shard_node *node = shard_owner(type, store_path);
+    int socket_to_server = backend_pool_acquire(node->pool);
+    if (socket_to_server < 0)
+      return -1;
+
+    int result = sign_file_on_server(socket, socket_to_server, request_id, commands, reason, size);
+    backend_pool_release(node->pool, socket_to_server);
+    return result;
+  }
+
+  // create file path by prepending ./smain/, as ufile stores it
+  char file_path[512];
+  if (strcmp(file_extension, ".c") == 0)
+    snprintf(file_path, sizeof(file_path), "./smain/%s/%s", commands[2], commands[1]);
+  else
+    snprintf(file_path, sizeof(file_path), "./smain/%s", commands[1]);
+
+  int result = delta_send_signatures(socket, request_id, file_path);
+  if (result == 0)
+    snprintf(reason, size, "No file to delta against");
+  return result;
+}
+
+int process_udelta(int socket, uint32_t request_id, char *commands[])
+{
+  // Sample command: udelta fileName /destination/path file_size sha256 block_size, followed by a chunked body
+  // extract file extension
+  char *file_extension = strrchr(commands[1], '.');
+  if (file_extension == NULL)
+  {
+    fprintf(stderr, "Failed to extract file extension\n");
+    discard_frame(socket);
+    return -1;
+  }
+
+  // a truncated path would name another file, whose copy the delta would be applied to
+  char store_path[PATH_MAX], file_path[PATH_MAX];
+  int store_length = snprintf(store_path, sizeof(store_path), "%s/%s", commands[2], commands[1]);
+  int file_length = snprintf(file_path, sizeof(file_path), "./smain/%s",
+                             strcmp(file_extension, ".c") == 0 ? store_path : commands[1]);
+  if (store_length < 0 || (size_t)store_length >= sizeof(store_path) || file_length < 0 ||
+      (size_t)file_length >= sizeof(file_path))
+  {
+    fprintf(stderr, "Delta destination too long: %s/%s\n", commands[2], commands[1]);
+    discard_frame(socket);
+    return -1;
+  }
+
+  // the delta goes to the node holding the copy it was computed against, only the changed blocks cross the hop
+  int type = shard_type_of(commands[1]);
+  if (type >= 0)
+  {
+    struct shard_node *node = shard_owner(type, store_path);
+    int socket_to_server = backend_pool_acquire(node->pool);
+    if (socket_to_server < 0)
+    {
+      discard_frame(socket);
+      return -1;
+    }
+
+    char delta_args[BUFFER_SIZE / 4];
+    snprintf(delta_args, sizeof(delta_args), "%s %s %s", commands[3], commands[4], commands[5]);
+    int result = relay_file_to_server(socket, socket_to_server, request_id, OP_UDELTA, commands[1], commands[2],
+                                      delta_args);
+    backend_pool_release(node->pool, socket_to_server);
+    read_cache_invalidate(store_path);
+    if (result != 1)
+      return -1;
+
+    // as for ufile, the copy on the node the path is moving away from is dropped
+    struct shard_node *previous = shard_previous_owner(type, store_path);
+    if (previous != NULL)
+      remove_file_from_node(previous, request_id, store_path);
+
+    printf("Delta relayed\n");
+    return 1;
+  }
+
+  // file_path is the stored file prepended with ./smain/, as ufile stores it
+  // the new file is rebuilt outside the store, next to the partial uploads, and renamed over the stored one
+  char temp_path[512];
+  upload_temp_path(temp_path, sizeof(temp_path));
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  int result = delta_receive(socket, file_path, temp_path, strtoull(commands[3], NULL, 10), commands[4],
+                             strtoul(commands[5], NULL, 10), digest);
+  trace_span("receive");
+  if (result == 1 && rename(temp_path, file_path) != 0)
+  {
+    perror("Failed to store file");
+    remove(temp_path);
+    result = -1;
+  }
+  if (result == 1 && segment_store_remove(file_path) < 0)
+    result = -1;
+  if (result == 1)
+    store_index_update(file_path);
+  archive_cache_invalidate();
+  if (result == 1 && group_commit() != 0)
+    result = -1;
+  if (result != 1)
+    return -1;
+
+  printf("File rebuilt from delta\n");
+  return 1;
+}
+
+int process_display(int socket, uint32_t request_id, char *commands[], struct display_reply *reply)
+{
+  // Sample command: display /path/to/directory [limit [cursor]]
+  // extract directory path, the page size and where the page starts in every store
   char *dir_path = commands[1];
+  uint64_t limit = commands[2] != NULL ? strtoull(commands[2], NULL, 10) : 0;
+  struct display_backend backends[DISPLAY_SOURCES];
+  int sources = list_display_backends(backends);
+  uint64_t offsets[DISPLAY_SOURCES] = {0};
+  if (commands[2] != NULL && commands[3] != NULL)
+  {
+    // one offset per store, a cursor from before a change of the nodes does not fit
+    char *p = commands[3], *end = p;
+    int parsed = 0;
+    while (parsed < sources)
+    {
+      offsets[parsed++] = strtoull(p, &end, 10);
+      if (end == p || *end != ',')
+        break;
+      p = end + 1;
+    }
+    if (parsed != sources || end == p || *end != '\0')
+    {
+      fprintf(stderr, "Invalid cursor: %s\n", commands[3]);
+      return -1;
+    }
+  }
 
-  if (DEBUG)
+  if (log_level >= LOG_DEBUG)
     printf("Displaying files in directory: %s\n", dir_path);
 
   // display files
-  return display_files(socket, dir_path);
+  return display_files(socket, request_id, dir_path, limit, backends, sources, offsets, reply);
 }
 
-int process_dtar(int socket, char *commands[])
+int process_dtar(int socket, uint32_t request_id, char *commands[])
 {
-  // Sample command: dtar /path/to/directory
-  // extract directory path
+  // Sample command: dtar fileType [-z|-z0..-z9] [crc32c]
+  // extract file type
   char *file_type = commands[1];
+  // pdf files are compressed already, a bare "-z" stores them in the gzip stream
+  int default_level = strcmp(file_type, "pdf") == 0 ? TAR_GZIP_STORED : TAR_GZIP_DEFAULT;
+  int level = TAR_PLAIN;
+  for (int i = 2; commands[i] != NULL; i++)
+  {
+    int argument_level = tar_compression_argument(commands[i], default_level);
+    if (argument_level != TAR_PLAIN)
+      level = argument_level;
+  }
+  int checked = has_argument(commands, CHECKSUM_CAPABILITY);
 
-  if (DEBUG)
-    printf("Creating tar file for filetype: %s\n", file_type);
+  if (log_level >= LOG_DEBUG)
+    printf("Streaming tar file for filetype: %s\n", file_type);
 
   // check if file type is txt or pdf
   if (strcmp(file_type, "txt") == 0 || strcmp(file_type, "pdf") == 0)
   {
-    int socket_to_server = (strcmp(file_type, "txt") == 0) ? stext_server_socket : spdf_server_socket;
-    // send dtar string to stext server
-    char ack_message[BUFFER_SIZE];
-    if (send_with_acknowledgement(socket_to_server, "dtar", ack_message) <= 0)
+    struct shard_members members;
+    shard_all_members(strcmp(file_type, "txt") == 0 ? SHARD_TEXT : SHARD_PDF, &members);
+    // the archives of several nodes are joined into one
+    if (members.count > 1)
+      return relay_merged_tar(socket, &members, request_id, level, checked);
+
+    struct shard_node *node = members.nodes[0];
+    int socket_to_server = backend_pool_acquire(node->pool);
+    if (socket_to_server < 0)
+      return -1;
+
+    // the backend generates the archive while the client receives it
+    int result = relay_tar_from_server(socket, socket_to_server, request_id, level, checked);
+    backend_pool_release(node->pool, socket_to_server);
+    return result;
+  }
+  else if (strcmp(file_type, "c") == 0)
+  {
+    return send_tar(socket, request_id, "./smain", level, checked);
+  }
+
+  printf("Invalid file type: %s\n", file_type);
+  return -1;
+}
+
+int send_file(int socket, uint32_t request_id, const char *file_path, int deflate, int checked,
+              struct byte_range range)
+{
+  // a file of the segment store is sent straight out of its segment
+  int found = segment_store_send(socket, request_id, file_path, range, checked);
+  if (found != 0)
+    return found;
+
+  // open file, a missing file is reported through the result frame
+  int fd = open(file_path, O_RDONLY);
+  if (fd < 0)
+  {
+    printf("File not found\n");
+    return -1;
+  }
+
+  // a compressed download cannot take the zero-copy path
+  int sent = send_compressed_file(socket, request_id, fd, deflate, checked, range);
+  if (sent != 0)
+  {
+    close(fd);
+    return sent;
+  }
+
+  // get file size
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0)
+  {
+    perror("Failed to stat file");
+    close(fd);
+    return -1;
+  }
+  uint64_t file_size = file_stat.st_size;
+
+  // a range is sent from its offset, the bytes before it are never read
+  if (clamp_range(&range, file_size) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  // a checked download ends with the checksum of the range, the one stored with the file for the whole file
+  uint32_t crc = 0;
+  if (checked && checksum_file(fd, range, &crc) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  // send data frame header carrying the size of the range
+  if (send_frame_header(socket, OP_DATA, checked ? FRAME_FLAG_CHECKSUM : 0, request_id,
+                        range.length + (checked ? CHECKSUM_SIZE : 0)) != 0)
+  {
+    perror("Failed to send file size");
+    close(fd);
+    return -1;
+  }
+
+  if (log_level >= LOG_DEBUG)
+    printf("File size: %llu\n", (unsigned long long)file_size);
+
+  // send file content through the selected transmit path
+  if (send_file_data(socket, fd, range.offset, range.length) != 0 || (checked && send_checksum(socket, crc) != 0))
+  {
+    // the frame length is already on the wire, so the stream can only be cut
+    perror("Failed to send file");
+    shutdown(socket, SHUT_RDWR);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  if (log_level >= LOG_DEBUG)
+    printf("File sent\n");
+  return 1;
+}
+
+int relay_file_to_server(int client_socket, int socket_to_server, uint32_t request_id, uint8_t command,
+                         const char *file_name, const char *destination_path, const char *upload_args)
+{
+  // receive data frame header carrying the file size
+  struct frame_header data;
+  if (recv_frame_header(client_socket, &data) != 1 || data.opcode != OP_DATA)
+  {
+    perror("Failed to receive file size");
+    return -1;
+  }
+
+  if (log_level >= LOG_DEBUG)
+    printf("Relaying file: %s, File size: %llu\n", file_name, (unsigned long long)data.payload_length);
+
+  // create command arguments
+  char command_str[512];
+  snprintf(command_str, sizeof(command_str), "%s %s%s%s", file_name, destination_path, upload_args != NULL ? " " : "",
+           upload_args != NULL ? upload_args : "");
+
+  if (send_command(socket_to_server, command, request_id, command_str) != 0)
+  {
+    perror("Failed to send command to server");
+    discard_body(client_socket, &data);
+    return -1;
+  }
+
+  // a resumable upload comes as a chunked body, every chunk is passed on as soon as it arrives
+  int chunked = (data.flags & FRAME_FLAG_CHUNKED) != 0;
+  while (1)
+  {
+    // send the data frame header to server before any payload arrives
+    // compressed chunks and checksum trailers are passed on as they are, the server checks them
+    uint32_t flags = data.flags & (FRAME_FLAG_CHUNKED | FRAME_FLAG_COMPRESSED | FRAME_FLAG_CHECKSUM);
+    if (send_frame_header(socket_to_server, OP_DATA, flags, request_id, data.payload_length) != 0)
     {
-      perror("Failed to send dtar command to stext server");
+      perror("Failed to send file to server");
+      discard_body(client_socket, &data);
       return -1;
     }
+    if (chunked && data.payload_length == 0)
+      break;
 
-    // receive acknowledgement from stext server
-    char response[BUFFER_SIZE];
-    int bytes_received = recv(socket_to_server, response, BUFFER_SIZE, 0);
-    if (bytes_received < 0)
+    // pipe the body from the client to the server as it arrives
+    int result = relay_data(client_socket, socket_to_server, data.payload_length);
+    if (result == RELAY_SOURCE_ERROR)
     {
-      perror("Failed to receive acknowledgement from stext server");
+      // the server got a truncated frame, its stream cannot be resynchronised
+      perror("Client failed during upload");
+      shutdown(socket_to_server, SHUT_RDWR);
       return -1;
     }
-  }
-  else if (strcmp(file_type, "c") == 0)
-  {
-    // create tar file
-    char tar_name[256];
-    snprintf(tar_name, sizeof(tar_name), "./tar/%s.tar", file_type);
+    if (result == RELAY_SINK_ERROR)
+    {
+      perror("Failed to send file to server");
+      return -1;
+    }
+    if (!chunked)
+      break;
 
-    if (create_tar(tar_name, "./smain") != 0)
+    if (recv_frame_header(client_socket, &data) != 1 || data.opcode != OP_DATA || !(data.flags & FRAME_FLAG_CHUNKED))
     {
-      perror("Failed to create tar file");
+      // the client went away between chunks, cutting the server's stream keeps the chunks it committed
+      perror("Client failed during upload");
+      shutdown(socket_to_server, SHUT_RDWR);
       return -1;
     }
   }
-  sleep(1);
+  trace_span("relay");
 
-  // create file path
-  char tar_path[256];
-  snprintf(tar_path, sizeof(tar_path), "./tar/%s.tar", file_type);
+  // receive result from server, it is the end-to-end result of the upload; the wait is the server storing the file
+  char response[BUFFER_SIZE] = "";
+  int result = recv_result(socket_to_server, response, sizeof(response));
+  trace_span("backend");
+  if (result != 1)
+  {
+    fprintf(stderr, "Server failed to store file: %s\n", response);
+    return -1;
+  }
+  return 1;
+}
 
-  return send_tar(socket, tar_path);
+int sign_file_on_server(int client_socket, int socket_to_server, uint32_t request_id, char *commands[], char *reason,
+                        size_t size)
+{
+  // send command frame to server
+  char command_str[512];
+  snprintf(command_str, sizeof(command_str), "%s %s", commands[1], commands[2]);
+  if (send_command(socket_to_server, OP_USIG, request_id, command_str) != 0)
+  {
+    perror("Failed to send command to server");
+    return -1;
+  }
+
+  // a server without the file answers with its result in place of the signatures, the reason goes back to the client
+  int result = relay_body_from_server(client_socket, socket_to_server, request_id, reason, size, NULL);
+  if (result != 1)
+    return result;
+
+  char response[BUFFER_SIZE] = "";
+  if (recv_result(socket_to_server, response, sizeof(response)) != 1)
+  {
+    fprintf(stderr, "Failed to sign file on server: %s\n", response);
+    return -1;
+  }
+  return 1;
 }
 
-int send_file(int socket, const char *file_path)
+int receive_file(int client_socket, const char *dir_path, const char *file_name)
 {
-  // open file
-  FILE *file = fopen(file_path, "rb");
-  if (file == NULL)
+  // receive data frame header carrying the file size, and whether a checksum follows the file
+  struct frame_header data;
+  uint64_t file_size;
+  if (recv_frame_header(client_socket, &data) != 1 || data.opcode != OP_DATA)
   {
-    // send with acknowledgement file size -1
-    char ack_message[BUFFER_SIZE];
-    if (send_with_acknowledgement(socket, "-1", ack_message) <= 0)
-    {
-      perror("Failed to send file size");
-      return -1;
-    }
-    printf("File not found\n");
+    perror("Failed to receive file size");
+    return -1;
+  }
+  int checked = frame_content_length(&data, &file_size);
+  if (checked < 0)
+  {
+    discard_payload(client_socket, data.payload_length);
     return -1;
   }
 
-  // get file size
-  fseek(file, 0, SEEK_END);
-  int file_size = ftell(file);
-  fseek(file, 0, SEEK_SET);
+  // create file path
+  char file_path[256];
+  snprintf(file_path, sizeof(file_path), "%s/%s", dir_path, file_name);
 
-  // send file size
-  char ack_message[BUFFER_SIZE];
-  char file_size_str[BUFFER_SIZE];
-  sprintf(file_size_str, "%d", file_size);
+  // a small file is appended to a segment, no directory or file is created for it
+  if (segment_store_accepts(file_size))
+  {
+    int result = segment_store_receive(client_socket, file_path, file_size, checked);
+    if (result == 1)
+      store_index_update(file_path);
+    if (result == 1 && group_commit() != 0)
+      result = -1;
+    return result;
+  }
 
-  printf("Socket: %d\n", socket);
-  if (send_with_acknowledgement(socket, file_size_str, ack_message) <= 0)
+  // Create directories if they do not exist
+  char *dir = strdup(dir_path);
+  if (create_directories(dir) != 0)
   {
-    perror("Failed to send file size");
-    fclose(file);
+    perror("Failed to create directories");
+    free(dir);
+    discard_payload(client_socket, data.payload_length);
     return -1;
   }
+  free(dir);
 
-  if (DEBUG)
-    printf("File size: %d\n", file_size);
+  if (!durable_writes)
+  {
+    int result = receive_file_body(client_socket, file_path, file_size, checked);
+    // a copy in the segment store would hide the new file
+    if (result == 1 && segment_store_remove(file_path) < 0)
+      result = -1;
+    // the file may exist even if the upload failed part way
+    store_index_update(file_path);
+    return result;
+  }
 
-  // send file content
-  char buffer[BUFFER_SIZE];
-  int bytes_read;
-  while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0)
+  // a durable upload is received next to the partial uploads and renamed into the store once it is complete
+  char temp_path[256];
+  upload_temp_path(temp_path, sizeof(temp_path));
+  if (receive_file_body(client_socket, temp_path, file_size, checked) != 1)
   {
-    if (send(socket, buffer, bytes_read, 0) < 0)
-    {
-      perror("Failed to send file");
-      fclose(file);
-      return -1;
-    }
+    remove(temp_path);
+    return -1;
   }
-  fclose(file);
+  if (rename(temp_path, file_path) != 0)
+  {
+    perror("Failed to store file");
+    remove(temp_path);
+    return -1;
+  }
+  if (segment_store_remove(file_path) < 0)
+    return -1;
+  store_index_update(file_path);
 
-  if (DEBUG)
-    printf("File sent, waiting for acknowledgement\n");
-  // receive acknowledgement
-  char response[BUFFER_SIZE];
-  int bytes_received = recv(socket, response, BUFFER_SIZE, 0);
-  if (bytes_received < 0)
+  // the upload is acknowledged once it is on disk, together with the uploads committed at the same time
+  return group_commit() == 0 ? 1 : -1;
+}
+
+int resume_upload_on_server(int socket_to_server, uint32_t request_id, char *commands[], char *offset, size_t size)
+{
+  // send command frame to server
+  char command_str[512];
+  int striped = commands[4] != NULL && commands[5] != NULL;
+  snprintf(command_str, sizeof(command_str), "%s %s %s%s%s%s%s", commands[1], commands[2], commands[3],
+           striped ? " " : "", striped ? commands[4] : "", striped ? " " : "", striped ? commands[5] : "");
+  if (send_command(socket_to_server, OP_URESUME, request_id, command_str) != 0)
+  {
+    perror("Failed to send command to server");
+    return -1;
+  }
+
+  // the result message holds the committed size
+  if (recv_result(socket_to_server, offset, size) != 1)
   {
-    perror("Failed to receive acknowledgement");
+    fprintf(stderr, "Failed to look up upload on server: %s\n", offset);
     return -1;
   }
   return 1;
 }
 
-int send_file_to_server(int socket_to_server, const char *file_name, int file_size, const char *destination_path)
+int link_file_on_server(int socket_to_server, uint32_t request_id, char *commands[], char *reason, size_t size)
+{
+  // send command frame to server
+  char command_str[512];
+  snprintf(command_str, sizeof(command_str), "%s %s %s %s", commands[1], commands[2], commands[3], commands[4]);
+  if (send_command(socket_to_server, OP_ULINK, request_id, command_str) != 0)
+  {
+    perror("Failed to send command to server");
+    return -1;
+  }
+
+  // a failed result is the server's answer, the reason goes back to the client
+  int result = recv_result(socket_to_server, reason, size);
+  if (result < 0)
+    fprintf(stderr, "Failed to link file on server\n");
+  return result;
+}
+
+int receive_resumable_file(int client_socket, const char *dir_path, const char *file_name, const char *upload_id,
+                           uint64_t file_size, uint64_t offset, unsigned stripe, unsigned stripes)
 {
-  // create command string
-  char command_str[256];
-  snprintf(command_str, sizeof(command_str), "ufile %s %d %s", file_name, file_size, destination_path);
-
-  // send full command string to server
-  char ack_message[BUFFER_SIZE];
-  if (send_with_acknowledgement(socket_to_server, command_str, ack_message) <= 0)
-  {
-    perror("Failed to send command to stext server");
-    return -1;
-  }
+  if (log_level >= LOG_DEBUG)
+    printf("Receiving file: %s, File size: %llu, Upload %s from %llu\n", file_name, (unsigned long long)file_size,
+           upload_id, (unsigned long long)offset);
 
   // create file path
   char file_path[256];
-  snprintf(file_path, sizeof(file_path), "./smain/%s", file_name);
+  snprintf(file_path, sizeof(file_path), "%s/%s", dir_path, file_name);
 
-  // send file to server
-  if (send_file(socket_to_server, file_path) != 1)
+  // a small file is completed next to the partial uploads and then appended to a segment, no directory is created
+  // for it
+  char temp_path[256];
+  int segment = stripes == 1 && segment_store_accepts(file_size);
+  if (segment)
+    upload_temp_path(temp_path, sizeof(temp_path));
+  else if (create_directories(dir_path) != 0)
   {
-    perror("Failed to send file to stext server");
+    perror("Failed to create directories");
+    discard_frame(client_socket);
     return -1;
   }
 
-  // receive acknowledgement from server
-  char response[BUFFER_SIZE];
-  int bytes_received = recv(socket_to_server, response, BUFFER_SIZE, 0);
-  if (bytes_received < 0)
+  // the file only appears in the store once every chunk is committed
+  int result = receive_upload(client_socket, upload_id, file_size, offset, stripe, stripes,
+                              segment ? temp_path : file_path);
+  if (result == 1 && (segment ? segment_store_put_file(file_path, temp_path) : segment_store_remove(file_path)) < 0)
   {
-    perror("Failed to receive acknowledgement from stext server");
-    return -1;
+    if (segment)
+      remove(temp_path);
+    result = -1;
   }
-  return 1;
+  if (result == 1)
+    store_index_update(file_path);
+  if (result == 1 && group_commit() != 0)
+    result = -1;
+  return result;
 }
 
-int receive_file(int client_socket, const char *dir_path, const char *file_name, int file_size)
+int receive_file_body(int socket, const char *file_path, uint64_t file_size, int checked)
 {
-  // Create directories if they do not exist
-  char *dir = strdup(dir_path);
-  if (create_directories(dir) != 0)
+  // the content is checked against the trailer that follows it once it is written
+  uint32_t crc = 0;
+
+  // the io_uring engine falls back to stdio when the kernel refuses it, a paced client is received a buffer at a time
+  if (file_io_engine == IO_ENGINE_URING && !scheduler_paced())
   {
-    perror("Failed to create directories");
-    free(dir);
-    return -1;
+    int result = uring_receive_file(socket, file_path, file_size, NULL, checked ? &crc : NULL);
+    if (result != URING_UNSUPPORTED)
+      return checked ? recv_file_checksum(socket, file_path, result, crc) : result;
   }
-  free(dir);
-
-  // create file
-  // create file path
-  char file_path[256];
-  snprintf(file_path, sizeof(file_path), "%s/%s", dir_path, file_name);
 
   FILE *file = fopen(file_path, "wb");
   if (file == NULL)
   {
     perror("Failed to create file");
+    discard_payload(socket, file_size + (checked ? CHECKSUM_SIZE : 0));
     return -1;
   }
 
-  int total_bytes_received = 0;
+  uint64_t total_bytes_received = 0;
 
   while (total_bytes_received < file_size)
   {
-    // receive without acknowledgement file content from client
-    char response[BUFFER_SIZE];
-    int bytes_received = recv(client_socket, response, BUFFER_SIZE, 0);
-    if (bytes_received < 0)
+    // never read past the end of the data frame
+    static char response[TRANSFER_BUFFER_SIZE];
+    size_t bytes_to_receive = sizeof(response);
+    if (file_size - total_bytes_received < bytes_to_receive)
+      bytes_to_receive = file_size - total_bytes_received;
+
+    if (recv_all(socket, response, bytes_to_receive) != 1)
     {
+      // the sender went away, do not keep a truncated file
       perror("Failed to receive file");
       fclose(file);
+      remove(file_path);
       return -1;
     }
 
-    total_bytes_received += bytes_received;
+    total_bytes_received += bytes_to_receive;
+    scheduler_pace(bytes_to_receive);
+    if (checked)
+      crc = crc32c(crc, response, bytes_to_receive);
 
-    if (fwrite(response, 1, bytes_received, file) < 0)
+    if (fwrite(response, 1, bytes_to_receive, file) != bytes_to_receive)
     {
       perror("Failed to write to file");
       fclose(file);
+      discard_payload(socket, file_size - total_bytes_received + (checked ? CHECKSUM_SIZE : 0));
       return -1;
     }
   }
 
-  // send acknowledgement
-  if (send(client_socket, "ack", 3, 0) < 0)
+  int result = 1;
+  if (fclose(file) != 0)
   {
-    perror("Failed to send acknowledgement");
-    fclose(file);
-    return -1;
+    perror("Failed to write to file");
+    result = -1;
   }
-
-  fclose(file);
-  return 0;
+  return checked ? recv_file_checksum(socket, file_path, result, crc) : result;
 }
 
-int receive_file_from_server(int socket_to_server, const char *file_path)
+int relay_file_from_server(int client_socket, int socket_to_server, uint32_t request_id, const char *file_path,
+                           int deflate, int checked, struct byte_range range)
 {
-  // create command string
-  char command_str[256];
-  snprintf(command_str, sizeof(command_str), "dfile %s", file_path);
-
-  // send full command string to stext server
-  char ack_message[BUFFER_SIZE];
-  if (send_with_acknowledgement(socket_to_server, command_str, ack_message) <= 0)
-  {
-    perror("Failed to send command to stext server");
+  // send command frame to server, passing on whether the client accepts compressed chunks or checks the download, and
+  // the range it asked for
+  char command_str[512];
+  int whole_file = range.offset == 0 && range.length == UINT64_MAX;
+  int length = snprintf(command_str, sizeof(command_str), "%s%s%s%s%s", file_path, deflate ? " " : "",
+                        deflate ? COMPRESS_CAPABILITY : "", checked ? " " : "", checked ? CHECKSUM_CAPABILITY : "");
+  if (!whole_file && length < (int)sizeof(command_str))
+    snprintf(command_str + length, sizeof(command_str) - length, " %s %llu %llu", RANGE_ARGUMENT,
+             (unsigned long long)range.offset, (unsigned long long)(range.length == UINT64_MAX ? 0 : range.length));
+  if (send_command(socket_to_server, OP_DFILE, request_id, command_str) != 0)
+  {
+    perror("Failed to send command to server");
     return -1;
   }
 
-  // extract file name
-  char *file_name = strrchr(file_path, '/');
-  if (file_name != NULL)
+  // pipe the body from the server to the client as the server reads it from disk, keeping a copy of a whole file for
+  // later dfiles
+  struct read_cache_fill fill = {.fd = -1};
+  if (whole_file)
+    read_cache_fill_begin(&fill, file_path);
+  char message[BUFFER_SIZE] = "";
+  int result = relay_body_from_server(client_socket, socket_to_server, request_id, message, sizeof(message), &fill);
+  trace_span("relay");
+  if (result != 1)
   {
-    file_name++; // Skip the '/'
-  }
-  else
-  {
-    file_name = file_path; // If no '/' found, use the whole path as file name
+    read_cache_fill_end(&fill, 0);
+    printf("File not found: %s\n", result == 0 ? message : "no response");
+    return result;
   }
 
-  // receive with acknowledgement file size from stext server
-  char file_size_str[BUFFER_SIZE];
-  if (receive_with_acknowledgement(socket_to_server, "ack", file_size_str) <= 0)
+  // receive result from server
+  result = recv_result(socket_to_server, message, sizeof(message));
+  trace_span("backend");
+  if (result != 1)
   {
-    perror("Failed to receive file size from stext server");
+    read_cache_fill_end(&fill, 0);
+    fprintf(stderr, "Failed to relay file from server: %s\n", message);
     return -1;
   }
-  int file_size = atoi(file_size_str);
-
-  if (DEBUG)
-    printf("File size from server: %d\n", file_size);
+  read_cache_fill_end(&fill, 1);
+  return 1;
+}
 
-  if (file_size == -1)
+int relay_body_from_server(int client_socket, int socket_to_server, uint32_t request_id, char *message, size_t size,
+                           struct read_cache_fill *fill)
+{
+  int client_gone = 0;
+  while (1)
   {
-    printf("File not found\n");
-    return -1;
-  }
+    // a failed server answers with its result in place of the body or of the next chunk
+    struct frame_header data;
+    int frame = recv_data_frame(socket_to_server, &data, message, size);
+    if (frame <= 0)
+      return client_gone ? -1 : frame;
+    uint64_t length = data.payload_length;
+    int checked = (data.flags & FRAME_FLAG_CHECKSUM) != 0;
 
-  // receive file from stext server
-  if (receive_file(socket_to_server, "./smain/", file_path, file_size) != 0)
-  {
-    perror("Failed to receive file from stext server");
-    return -1;
+    if (log_level >= LOG_DEBUG)
+      printf("Relaying %llu bytes from server\n", (unsigned long long)length);
+
+    // forward the data frame header so the client starts receiving right away; the client checks the checksum
+    uint32_t flags = data.flags & (FRAME_FLAG_CHUNKED | FRAME_FLAG_COMPRESSED | FRAME_FLAG_CHECKSUM);
+    if (!client_gone && send_frame_header(client_socket, OP_DATA, flags, request_id, length) != 0)
+    {
+      perror("Failed to send data frame");
+      client_gone = 1;
+    }
+    if (frame != 1 && length == 0)
+      break;
+
+    // a download being cached is copied on the way, and once the client is gone the rest of the body is drained
+    int result;
+    if (client_gone)
+      result = discard_payload(socket_to_server, length) != 0 ? RELAY_SOURCE_ERROR : 0;
+    else if (fill != NULL && fill->fd >= 0)
+      result = read_cache_relay(socket_to_server, client_socket, length, frame == 3, checked, fill);
+    else
+      result = relay_data(socket_to_server, client_socket, length);
+    if (result == RELAY_SOURCE_ERROR)
+    {
+      // the server cut the frame short, neither stream can be resynchronised
+      perror("Failed to relay data frame");
+      shutdown(client_socket, SHUT_RDWR);
+      shutdown(socket_to_server, SHUT_RDWR);
+      return -1;
+    }
+    if (result == RELAY_SINK_ERROR)
+    {
+      // the frame was drained from the server, keep going to the end of the body
+      perror("Failed to relay data frame");
+      client_gone = 1;
+    }
+    if (frame == 1)
+      break;
   }
+  if (!client_gone)
+    return 1;
+
+  // the server connection is still framed, taking its result lets it go back to the pool
+  if (recv_result(socket_to_server, message, size) < 0)
+    shutdown(socket_to_server, SHUT_RDWR);
+  return -1;
+}
 
-  // receive acknowledgement from stext server
-  char response[BUFFER_SIZE];
-  int bytes_received = recv(socket_to_server, response, BUFFER_SIZE, 0);
-  if (bytes_received < 0)
+int remove_file(const char *file_path)
+{
+  // a file of the segment store only needs a record in its index
+  int removed = segment_store_remove(file_path);
+  if (removed < 0 || (removed == 0 && remove(file_path) != 0))
   {
-    perror("Failed to receive acknowledgement from stext server");
+    perror("Failed to remove file");
     return -1;
   }
+  store_index_update(file_path);
   return 1;
 }
 
-int remove_file(int socket, const char *file_path)
+int remove_file_from_server(int socket_to_server, uint32_t request_id, const char *file_name)
 {
-  if (remove(file_path) != 0)
+  // send command frame to server
+  if (send_command(socket_to_server, OP_RMFILE, request_id, file_name) != 0)
   {
-    perror("Failed to remove file");
+    perror("Failed to send command to server");
     return -1;
   }
 
-  // send acknowledgement
-  if (send(socket, "ack", 3, 0) < 0)
+  // receive result from server
+  char response[BUFFER_SIZE] = "";
+  if (recv_result(socket_to_server, response, sizeof(response)) != 1)
   {
-    perror("Failed to send acknowledgement");
+    printf("Failed to remove file: %s\n", response);
     return -1;
   }
   return 1;
 }
 
-int remove_file_from_server(int socket_to_server, const char *file_name)
+int remove_file_from_node(struct shard_node *node, uint32_t request_id, const char *file_name)
 {
-  // create command string
-  char command_str[256];
-  snprintf(command_str, sizeof(command_str), "rmfile %s", file_name);
-
-  // send full command string to stext server
-  char ack_message[BUFFER_SIZE];
-  if (send_with_acknowledgement(socket_to_server, command_str, ack_message) <= 0)
-  {
-    perror("Failed to send command to stext server");
+  int socket_to_server = backend_pool_acquire(node->pool);
+  if (socket_to_server < 0)
     return -1;
-  }
 
-  // receive acknowledgement from stext server
-  char response[BUFFER_SIZE];
-  int bytes_received = recv(socket_to_server, response, BUFFER_SIZE, 0);
-  if (bytes_received < 0)
-  {
-    perror("Failed to receive acknowledgement from stext server");
-    return -1;
-  }
+  int result = remove_file_from_server(socket_to_server, request_id, file_name);
+  backend_pool_release(node->pool, socket_to_server);
+  return result;
+}
 
-  if (strcmp(response, "File removed") != 0)
+int list_display_backends(struct display_backend backends[])
+{
+  int count = 0;
+  backends[count++] = (struct display_backend){.name = "smain", .socket = -1};
+  const int types[] = {SHARD_PDF, SHARD_TEXT};
+  for (int t = 0; t < 2; t++)
   {
-    printf("Failed to remove file\n");
-    return -1;
+    struct shard_members members;
+    shard_all_members(types[t], &members);
+    for (int i = 0; i < members.count; i++)
+      backends[count++] = (struct display_backend){.name = members.nodes[i]->name, .pool = members.nodes[i]->pool, .socket = -1};
   }
-  return 1;
+  return count;
 }
 
-int display_files(int socket, const char *dir_path)
+int display_files(int socket, uint32_t request_id, const char *dir_path, uint64_t limit,
+                  struct display_backend backends[], int sources, const uint64_t offsets[], struct display_reply *reply)
 {
+  reply->next_cursor[0] = '\0';
+  reply->missing[0] = '\0';
+
+  // query the spdf and stext nodes first, so they look up their files while the local ones are sent
+  for (int i = 1; i < sources; i++)
+    display_files_from_server(&backends[i], request_id, dir_path, offsets[i], limit);
+
   // create dir path
   char dir_path_full[256];
   snprintf(dir_path_full, sizeof(dir_path_full), "./smain/%s", dir_path);
 
-  // get all files and sub-files in the directory
-  char file_paths[15360] = "";
-  traverse_directory(dir_path_full, dir_path_full, file_paths);
-
-  char pdf_file_paths[5120] = "";
-  display_files_from_server(spdf_server_socket, dir_path, pdf_file_paths);
-
-  // append pdf_file_paths to file_paths
-  strcat(file_paths, pdf_file_paths);
-
-  char txt_file_paths[5120] = "";
-  display_files_from_server(stext_server_socket, dir_path, txt_file_paths);
+  // the local files first, straight from the index of ./smain
+  int result = 1;
+  if (store_index_send_listing(socket, request_id, dir_path_full, offsets[0], limit, &backends[0].count) != 0)
+  {
+    perror("Failed to send file paths");
+    result = -1;
+  }
+  uint64_t total = backends[0].count;
 
-  // append txt_file_paths to file_paths
-  strcat(file_paths, txt_file_paths);
+  // then the batches of the backends, in the order they arrive
+  while (result == 1)
+  {
+    struct pollfd fds[DISPLAY_SOURCES];
+    struct display_backend *polled[DISPLAY_SOURCES];
+    int nfds = 0;
+    for (int i = 1; i < sources; i++)
+    {
+      if (backends[i].socket < 0)
+        continue;
+      fds[nfds].fd = backends[i].socket;
+      fds[nfds].events = POLLIN;
+      polled[nfds++] = &backends[i];
+    }
+    if (nfds == 0)
+      break;
 
-  // get file size
-  int msg_size = strlen(file_paths);
+    // every backend answering in time sends a batch, or its result, within the timeout
+    int ready = poll(fds, nfds, DISPLAY_TIMEOUT_MS);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready <= 0)
+    {
+      for (int i = 0; i < nfds; i++)
+        drop_display_backend(polled[i], ready == 0 ? "timed out" : "poll failed");
+      break;
+    }
 
-  if (msg_size == 0)
-  {
-    // send with acknowledgement file size 0
-    char ack_message[BUFFER_SIZE];
-    if (send_with_acknowledgement(socket, "0", ack_message) <= 0)
+    for (int i = 0; i < nfds && result == 1; i++)
     {
-      perror("Failed to send file size");
+      if (fds[i].revents == 0)
+        continue;
+      int files = relay_display_batch(socket, polled[i], request_id, limit == 0 ? UINT64_MAX : limit - total);
+      if (files == -2)
+        result = -1;
+      else if (files > 0)
+        total += files;
     }
-    return -1;
+
+    // once the page is full the backends' remaining files are dropped
+    for (int i = 1; i < sources && limit != 0 && total >= limit; i++)
+      backends[i].draining = 1;
   }
 
-  // send file size
-  char ack_message[BUFFER_SIZE];
-  char msg_size_str[BUFFER_SIZE];
-  sprintf(msg_size_str, "%d", msg_size);
-  if (send_with_acknowledgement(socket, msg_size_str, ack_message) <= 0)
+  // a backend that did not finish its part is named in the result
+  for (int i = 1; i < sources; i++)
   {
-    perror("Failed to send file size");
-    return -1;
+    if (backends[i].socket >= 0)
+      drop_display_backend(&backends[i], "the client stream broke");
+    if (backends[i].failed)
+      snprintf(reply->missing + strlen(reply->missing), sizeof(reply->missing) - strlen(reply->missing), "%s%s",
+               reply->missing[0] != '\0' ? ", " : "", backends[i].name);
   }
+  if (result != 1)
+    return -1;
 
-  // send content in chunks
-  char buffer[BUFFER_SIZE];
-  int bytes_sent = 0;
-  while (bytes_sent < msg_size)
+  // a page cut at the limit continues after the files sent from every store
+  int later_page = 0;
+  for (int i = 0; i < sources; i++)
   {
-    int bytes_to_send = msg_size - bytes_sent;
-    if (bytes_to_send > BUFFER_SIZE)
-    {
-      bytes_to_send = BUFFER_SIZE;
-    }
-    strncpy(buffer, file_paths + bytes_sent, bytes_to_send);
-    if (send(socket, buffer, bytes_to_send, 0) < 0)
-    {
-      perror("Failed to send file");
-      return -1;
-    }
-    bytes_sent += bytes_to_send;
+    later_page |= offsets[i] != 0;
+    if (limit != 0 && total >= limit)
+      snprintf(reply->next_cursor + strlen(reply->next_cursor), sizeof(reply->next_cursor) - strlen(reply->next_cursor),
+               "%s%llu", i > 0 ? "," : "", (unsigned long long)(offsets[i] + backends[i].count));
   }
 
-  if (DEBUG)
-    printf("File sent, waiting for acknowledgement\n");
+  // an empty listing is reported through the result frame, unless it is a later page
+  if (total == 0 && !later_page)
+    return -1;
 
-  // receive acknowledgement
-  char response[BUFFER_SIZE];
-  int bytes_received = recv(socket, response, BUFFER_SIZE, 0);
-  if (bytes_received < 0)
+  // end the listing
+  if (send_chunk(socket, request_id, NULL, 0) != 0)
   {
-    perror("Failed to receive acknowledgement");
+    perror("Failed to send file paths");
     return -1;
   }
+
+  if (log_level >= LOG_DEBUG)
+    printf("File paths sent: %llu\n", (unsigned long long)total);
   return 1;
 }
 
-int display_files_from_server(int socket_to_server, const char *dir_path, char *txt_file_paths)
+int display_files_from_server(struct display_backend *backend, uint32_t request_id, const char *dir_path, uint64_t offset,
+                              uint64_t limit)
 {
-  // create command string
-  char command_str[256];
-  snprintf(command_str, sizeof(command_str), "display %s", dir_path);
+  backend->socket = backend_pool_acquire(backend->pool);
+  if (backend->socket < 0)
+  {
+    backend->failed = 1;
+    return -1;
+  }
+
+  // a backend that stalls part way through a batch fails like one that stays silent
+  struct timeval timeout = {.tv_sec = DISPLAY_TIMEOUT_MS / 1000, .tv_usec = DISPLAY_TIMEOUT_MS % 1000 * 1000};
+  setsockopt(backend->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-  // send full command string to stext server
-  char ack_message[BUFFER_SIZE];
-  if (send_with_acknowledgement(socket_to_server, command_str, ack_message) <= 0)
+  // send command frame to server, with the page of files to send
+  char args[BUFFER_SIZE];
+  snprintf(args, sizeof(args), "%s %llu %llu", dir_path, (unsigned long long)offset, (unsigned long long)limit);
+  if (send_command(backend->socket, OP_DISPLAY, request_id, args) != 0)
   {
-    perror("Failed to send command to stext server");
+    drop_display_backend(backend, "the command could not be sent");
     return -1;
   }
+  return 1;
+}
 
-  // receive with acknowledgement file size from stext server
-  char file_size_str[BUFFER_SIZE];
-  if (receive_with_acknowledgement(socket_to_server, "ack", file_size_str) <= 0)
+int relay_display_batch(int client_socket, struct display_backend *backend, uint32_t request_id, uint64_t room)
+{
+  // receive the header of the next batch, the server sends its failure result in place of it
+  char message[BUFFER_SIZE] = "";
+  uint64_t chunk_size;
+  int result = recv_data_header(backend->socket, &chunk_size, message, sizeof(message));
+  if (result != 2 || chunk_size > INDEX_BATCH_SIZE)
   {
-    perror("Failed to receive file size from stext server");
+    drop_display_backend(backend, result == 0 ? message : "bad answer");
     return -1;
   }
-  int file_size = atoi(file_size_str);
 
-  // get content in chunks and save to txt_file_paths variable
-  int total_bytes_received = 0;
-  while (total_bytes_received < file_size)
+  if (chunk_size == 0)
   {
-    // receive without acknowledgement file content from stext server
-    char response[BUFFER_SIZE];
-    int bytes_received = recv(socket_to_server, response, BUFFER_SIZE, 0);
-    if (bytes_received < 0)
+    // the listing is complete, the result follows
+    result = recv_result(backend->socket, message, sizeof(message));
+    if (result != 1)
     {
-      perror("Failed to receive file");
+      drop_display_backend(backend, result == 0 ? message : "no result");
       return -1;
     }
+    struct timeval no_timeout = {0};
+    setsockopt(backend->socket, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
+    backend_pool_release(backend->pool, backend->socket);
+    backend->socket = -1;
+    return 0;
+  }
+
+  char batch[INDEX_BATCH_SIZE];
+  if (recv_all(backend->socket, batch, chunk_size) != 1)
+  {
+    drop_display_backend(backend, "batch cut short");
+    return -1;
+  }
+  if (backend->draining)
+    return 0;
 
-    total_bytes_received += bytes_received;
+  // batches hold whole lines, cut the batch after the last file that fits on the page
+  size_t length = 0;
+  uint64_t files = 0;
+  char *line_end;
+  while (files < room && (line_end = memchr(batch + length, '\n', chunk_size - length)) != NULL)
+  {
+    length = line_end - batch + 1;
+    files++;
+  }
+  if (length > 0 && send_chunk(client_socket, request_id, batch, length) != 0)
+  {
+    perror("Failed to send file paths");
+    return -2;
+  }
+  backend->count += files;
+  return files;
+}
 
-    if (strncat(txt_file_paths, response, bytes_received) == NULL)
-    {
-      perror("Failed to write to file");
-      return -1;
-    }
+void drop_display_backend(struct display_backend *backend, const char *reason)
+{
+  fprintf(stderr, "Dropping %s from display: %s\n", backend->name, reason);
+
+  // the rest of its answer is not read, the connection cannot be reused
+  shutdown(backend->socket, SHUT_RDWR);
+  backend_pool_release(backend->pool, backend->socket);
+  backend->socket = -1;
+  // files past a full page are not needed anyway
+  backend->failed = !backend->draining;
+}
+
+int send_tar(int socket, uint32_t request_id, const char *source_path, int level, int checked)
+{
+  if (log_level >= LOG_DEBUG)
+    printf("Sending tar file of: %s\n", source_path);
+
+  return send_cached_tar(socket, request_id, source_path, level, checked);
+}
+
+int relay_tar_from_server(int client_socket, int socket_to_server, uint32_t request_id, int level, int checked)
+{
+  // send command frame to server, with the level resolved here so a bare "-z" means the same on every node
+  char command_str[64] = "";
+  if (level != TAR_PLAIN)
+    snprintf(command_str, sizeof(command_str), "-z%d", level);
+  if (checked)
+    snprintf(command_str + strlen(command_str), sizeof(command_str) - strlen(command_str), "%s%s",
+             level != TAR_PLAIN ? " " : "", CHECKSUM_CAPABILITY);
+  if (send_command(socket_to_server, OP_DTAR, request_id, command_str) != 0)
+  {
+    perror("Failed to send dtar command to server");
+    return -1;
   }
 
-  // send acknowledgement to stext server
-  if (send(socket_to_server, "ack", 3, 0) < 0)
+  // forward every chunk as soon as it arrives, the archive size is not known up front; a cached archive comes as one
+  // data frame of known size
+  char message[BUFFER_SIZE] = "";
+  int result = relay_body_from_server(client_socket, socket_to_server, request_id, message, sizeof(message), NULL);
+  if (result != 1)
   {
-    perror("Failed to send acknowledgement");
+    fprintf(stderr, "Server failed to create tar file: %s\n", result == 0 ? message : "no response");
     return -1;
   }
 
-  // receive acknowledgement from stext server
-  char response[BUFFER_SIZE];
-  int bytes_received = recv(socket_to_server, response, BUFFER_SIZE, 0);
-  if (bytes_received < 0)
+  // receive result from server
+  if (recv_result(socket_to_server, message, sizeof(message)) != 1)
   {
-    perror("Failed to receive acknowledgement from stext server");
+    fprintf(stderr, "Failed to relay tar file from server: %s\n", message);
     return -1;
   }
   return 1;
 }
 
-int send_tar(int socket, const char *tar_name)
+int relay_merged_tar(int client_socket, const struct shard_members *members, uint32_t request_id, int level,
+                     int checked)
 {
-  if (DEBUG)
-    printf("Sending tar file: %s\n", tar_name);
-  // open file
-  FILE *file = fopen(tar_name, "rb");
-  if (file == NULL)
+  struct tar_merge *merge = tar_merge_begin(client_socket, request_id, level, checked);
+  if (merge == NULL)
+    return -1;
+
+  int result = 1;
+  for (int i = 0; i < members->count && result == 1; i++)
   {
-    // send with acknowledgement file size -1
-    char ack_message[BUFFER_SIZE];
-    if (send_with_acknowledgement(socket, "-1", ack_message) <= 0)
+    struct shard_node *node = members->nodes[i];
+    int socket_to_server = backend_pool_acquire(node->pool);
+    if (socket_to_server < 0)
     {
-      perror("Failed to send file size");
-      return -1;
+      result = -1;
+      break;
     }
-    printf("File not found\n");
-    return -1;
+    result = merge_tar_from_server(merge, socket_to_server, request_id, node->name);
+    backend_pool_release(node->pool, socket_to_server);
   }
+  if (result == 1 && tar_merge_finish(merge) != 0)
+    result = -1;
+  tar_merge_free(merge);
+  return result;
+}
 
-  // get file size
-  fseek(file, 0, SEEK_END);
-  int file_size = ftell(file);
-  fseek(file, 0, SEEK_SET);
-
-  // send file size
-  char ack_message[BUFFER_SIZE];
-  char file_size_str[BUFFER_SIZE];
-  sprintf(file_size_str, "%d", file_size);
-  if (send_with_acknowledgement(socket, file_size_str, ack_message) <= 0)
+int merge_tar_from_server(struct tar_merge *merge, int socket_to_server, uint32_t request_id, const char *name)
+{
+  // the archive is gzipped once by Smain, every node sends its archive plain, each frame checked before it is merged
+  if (send_command(socket_to_server, OP_DTAR, request_id, CHECKSUM_CAPABILITY) != 0)
   {
-    perror("Failed to send file size");
-    fclose(file);
+    perror("Failed to send dtar command to server");
     return -1;
   }
 
-  // send file content
-  char buffer[BUFFER_SIZE];
-  int bytes_read;
-  while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0)
+  // a cached archive comes as one data frame of known size, a generated one as chunks
+  char message[BUFFER_SIZE] = "";
+  static char buffer[TAR_CHUNK_SIZE];
+  while (1)
   {
-    if (send(socket, buffer, bytes_read, 0) < 0)
+    struct frame_header data;
+    uint64_t length;
+    int frame = recv_data_frame(socket_to_server, &data, message, sizeof(message));
+    int checked = frame == 1 || frame == 2 ? frame_content_length(&data, &length) : -1;
+    if (checked < 0)
     {
-      perror("Failed to send file");
-      fclose(file);
+      fprintf(stderr, "%s failed to create tar file: %s\n", name, frame == 0 ? message : "bad answer");
+      if (frame != 0)
+        shutdown(socket_to_server, SHUT_RDWR);
+      return -1;
+    }
+    if (frame == 2 && length == 0)
+      break;
+
+    uint32_t crc = 0;
+    while (length > 0)
+    {
+      size_t part = length < sizeof(buffer) ? length : sizeof(buffer);
+      if (recv_all(socket_to_server, buffer, part) != 1 || tar_merge_append(merge, buffer, part) != 0)
+      {
+        // the rest of the archive is not read, the connection cannot be reused
+        perror("Failed to relay tar file");
+        shutdown(socket_to_server, SHUT_RDWR);
+        return -1;
+      }
+      crc = crc32c(crc, buffer, part);
+      length -= part;
+    }
+    // the frame was merged already, a mismatch fails the whole archive
+    int check = checked ? recv_checksum(socket_to_server, crc) : 1;
+    if (check != 1)
+    {
+      fprintf(stderr, "Tar file from %s does not match its checksum\n", name);
+      if (check < 0)
+        shutdown(socket_to_server, SHUT_RDWR);
       return -1;
     }
+    if (frame == 1)
+      break;
   }
-  fclose(file);
 
-  if (DEBUG)
-    printf("File sent, waiting for acknowledgement\n");
-  // receive acknowledgement
-  char response[BUFFER_SIZE];
-  int bytes_received = recv(socket, response, BUFFER_SIZE, 0);
-  if (bytes_received < 0)
+  // receive result from server
+  if (recv_result(socket_to_server, message, sizeof(message)) != 1)
   {
-    perror("Failed to receive acknowledgement");
+    fprintf(stderr, "Failed to relay tar file from %s: %s\n", name, message);
     return -1;
   }
-  return 1;
+  return tar_merge_next(merge) == 0 ? 1 : -1;
 }
 
-/* UTILITY FUNCTIONS */
+/* REBALANCING */
 
-int create_tar(const char *tar_name, const char *source_path)
+void rebalance_files(void)
 {
-  pid_t pid = fork();
-
-  if (pid < 0)
+  // every node of the previous membership may hold files the current one places elsewhere
+  for (int type = 0; type < SHARD_TYPES; type++)
   {
-    perror("Fork failed");
+    const struct shard_members *previous = shard_members(type, 1);
+    for (int i = 0; i < previous->count; i++)
+    {
+      int moved = 0, failed = 0;
+      if (rebalance_node(previous->nodes[i], type, &moved, &failed) != 1)
+        fprintf(stderr, "Failed to list the files of %s\n", previous->nodes[i]->name);
+      printf("Rebalanced %s: %d files moved, %d failed\n", previous->nodes[i]->name, moved, failed);
+    }
+  }
+}
+
+int rebalance_node(struct shard_node *node, int type, int *moved, int *failed)
+{
+  char *listing;
+  if (list_files_on_node(node, &listing) != 1)
     return -1;
+
+  // every line is "name - /path/in/store"
+  char *save;
+  for (char *line = strtok_r(listing, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save))
+  {
+    char *path = strstr(line, " - ");
+    if (path == NULL)
+      continue;
+    path += 3;
+    struct shard_node *owner = shard_owner(type, path);
+    if (shard_same_node(owner, node))
+      continue;
+
+    int result = move_file(node, owner, path);
+    if (result == 1)
+      (*moved)++;
+    else if (result == -1)
+      (*failed)++;
   }
+  free(listing);
+  return 1;
+}
+
+int list_files_on_node(struct shard_node *node, char **listing)
+{
+  int socket_to_server = backend_pool_acquire(node->pool);
+  if (socket_to_server < 0)
+    return -1;
 
-  if (pid == 0)
+  // the whole store, every file on one page
+  if (send_command(socket_to_server, OP_DISPLAY, 0, "/ 0 0") != 0)
   {
-    // Child process
-    char *argv[] = {"tar", "-czf", tar_name, source_path, NULL};
-    execvp("tar", argv);
-    // If execvp returns, it must have failed
-    perror("execvp failed");
+    perror("Failed to send command to server");
+    backend_pool_release(node->pool, socket_to_server);
     return -1;
   }
-  else
+
+  size_t length = 0;
+  char *lines = malloc(1);
+  int result = lines != NULL ? 1 : -1;
+  while (result == 1)
   {
-    // Parent process
-    int status;
-    if (waitpid(pid, &status, 0) == -1)
-    {
-      perror("waitpid failed");
-      return -1;
-    }
-    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    // a node with no files sends its failure result in place of the listing
+    char message[BUFFER_SIZE] = "";
+    uint64_t chunk_size;
+    int frame = recv_data_header(socket_to_server, &chunk_size, message, sizeof(message));
+    if (frame == 0)
+      break;
+    if (frame != 2 || chunk_size > INDEX_BATCH_SIZE)
     {
-      return 0; // Success
+      result = -1;
+      break;
     }
-    else
+    if (chunk_size == 0)
     {
-      fprintf(stderr, "Child process failed with status %d\n", WEXITSTATUS(status));
-      return -1;
+      result = recv_result(socket_to_server, message, sizeof(message));
+      break;
     }
+
+    char *grown = realloc(lines, length + chunk_size + 1);
+    if (grown == NULL || recv_all(socket_to_server, grown + length, chunk_size) != 1)
+      result = -1;
+    lines = grown != NULL ? grown : lines;
+    length += chunk_size;
   }
-  return -1;
+
+  // the rest of the answer is not read, the connection cannot be reused
+  if (result != 1)
+  {
+    shutdown(socket_to_server, SHUT_RDWR);
+    free(lines);
+  }
+  backend_pool_release(node->pool, socket_to_server);
+  if (result != 1)
+    return -1;
+  lines[length] = '\0';
+  *listing = lines;
+  return 1;
+}
+
+int move_file(struct shard_node *from, struct shard_node *to, const char *file_path)
+{
+  char temp_path[256];
+  snprintf(temp_path, sizeof(temp_path), "./uploads/smain/rebalance.%d.tmp", (int)getpid());
+
+  // copy the file from its old node, as a single checked data frame
+  int socket_to_server = backend_pool_acquire(from->pool);
+  if (socket_to_server < 0)
+    return -1;
+  int result = -1;
+  char message[BUFFER_SIZE] = "";
+  char command_str[BUFFER_SIZE];
+  snprintf(command_str, sizeof(command_str), "%s %s", file_path, CHECKSUM_CAPABILITY);
+  if (send_command(socket_to_server, OP_DFILE, 0, command_str) != 0)
+    perror("Failed to send command to server");
+  else
+  {
+    struct frame_header data;
+    uint64_t file_size;
+    int frame = recv_data_frame(socket_to_server, &data, message, sizeof(message));
+    int checked = frame == 1 ? frame_content_length(&data, &file_size) : -1;
+    if (frame == 0)
+      result = 0;
+    else if (checked >= 0 && receive_file_body(socket_to_server, temp_path, file_size, checked) == 1 &&
+             recv_result(socket_to_server, message, sizeof(message)) == 1)
+      result = 1;
+    else if (frame != -1)
+      shutdown(socket_to_server, SHUT_RDWR);
+  }
+  backend_pool_release(from->pool, socket_to_server);
+  if (result != 1)
+  {
+    // a file removed since the listing does not need to move
+    remove(temp_path);
+    return result;
+  }
+
+  // upload it to its new node, under the same directory; listed paths start with "/"
+  char dir_path[256];
+  snprintf(dir_path, sizeof(dir_path), "%s", file_path);
+  char *slash = strrchr(dir_path, '/');
+  char file_name[256];
+  snprintf(file_name, sizeof(file_name), "%s", slash + 1);
+  slash[slash == dir_path ? 1 : 0] = '\0';
+  snprintf(command_str, sizeof(command_str), "%s %s", file_name, dir_path);
+
+  socket_to_server = backend_pool_acquire(to->pool);
+  if (socket_to_server < 0)
+  {
+    remove(temp_path);
+    return -1;
+  }
+  result = -1;
+  if (send_command(socket_to_server, OP_UFILE, 0, command_str) != 0 ||
+      send_file(socket_to_server, 0, temp_path, 0, 1, (struct byte_range){0, UINT64_MAX}) != 1)
+    shutdown(socket_to_server, SHUT_RDWR);
+  else if (recv_result(socket_to_server, message, sizeof(message)) == 1)
+    result = 1;
+  else
+    fprintf(stderr, "%s failed to store %s: %s\n", to->name, file_path, message);
+  backend_pool_release(to->pool, socket_to_server);
+  remove(temp_path);
+  if (result != 1)
+    return -1;
+
+  // only once the new node holds it, the old copy goes
+  if (remove_file_from_node(from, 0, file_path) != 1)
+    fprintf(stderr, "Failed to remove %s from %s after moving it\n", file_path, from->name);
+  if (log_level >= LOG_DEBUG)
+    printf("Moved %s from %s to %s\n", file_path, from->name, to->name);
+  return 1;
 }
 
+/* UTILITY FUNCTIONS */
+
 int create_directories(const char *path)
 {
   // Create directories recursively
@@ -1240,78 +2856,15 @@ int create_directories(const char *path)
   return 0;
 }
 
-void traverse_directory(const char *root, const char *dir_path, char *file_paths)
-{
-  DIR *dir;             // Pointer to the directory stream
-  struct dirent *entry; // Pointer to the directory entry
-
-  // Open the directory specified by dir_path
-  dir = opendir(dir_path);
-  if (dir == NULL)
-  {
-    // If the directory cannot be opened, print an error message and return
-    perror("Failed to open directory");
-    return;
-  }
-
-  // Read each entry in the directory
-  while ((entry = readdir(dir)) != NULL)
-  {
-    // Skip the current directory (".") and parent directory ("..") entries
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-    {
-      continue;
-    }
-
-    // Construct the full path of the current entry
-    char path[256];
-    snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
-
-    // If the entry is a directory, recursively traverse it
-    if (entry->d_type == DT_DIR)
-    {
-      traverse_directory(root, path, file_paths);
-    }
-    // If the entry is a regular file
-    else if (entry->d_type == DT_REG)
-    {
-      // Create a buffer to store the file path relative to the root directory
-      char file_path[256];
-      strncpy(file_path, path + strlen(root), sizeof(file_path));
-
-      // Get the file name from the file path
-      char *file_name = strrchr(file_path, '/');
-      if (file_name != NULL)
-      {
-        file_name++; // Skip the '/' character
-      }
-      else
-      {
-        file_name = file_path; // If no '/' found, use the whole path as the file name
-      }
-
-      // Create a buffer to store the file entry (file name and file path)
-      char file_entry[512];
-      snprintf(file_entry, sizeof(file_entry), "%s - %s\n", file_name, file_path);
-
-      // Append the file entry to the file_paths string
-      strcat(file_paths, file_entry);
-    }
-  }
-
-  // Close the directory stream
-  closedir(dir);
-}
-
-int tokenize_command(char *cmd_str, char *commands[])
+int tokenize_command(char *cmd_str, char *commands[], int max_commands)
 {
   int count = 0; // Initialize a counter to keep track of the number of tokens
 
   // Use strtok to split the input string cmd_str into tokens separated by spaces
   char *token = strtok(cmd_str, " ");
 
-  // Loop through all tokens
-  while (token != NULL)
+  // Loop through all tokens, the commands array never overflows
+  while (token != NULL && count < max_commands)
   {
     // Store the current token in the commands array and increment the counter
     commands[count++] = token;
@@ -1323,58 +2876,3 @@ int tokenize_command(char *cmd_str, char *commands[])
   // Return the total number of tokens found
   return count;
 }
-
-int send_with_acknowledgement(int socket, const char *message, char *ack_message)
-{
-  // Send the message through the socket
-  if (send(socket, message, strlen(message), 0) < 0)
-  {
-    // Print an error message if sending fails
-    perror("Failed to send message");
-    return 0; // Return 0 to indicate failure
-  }
-
-  // Receive the acknowledgement message from the socket
-  int bytes_received = recv(socket, ack_message, BUFFER_SIZE, 0);
-  if (bytes_received < 0)
-  {
-    // Print an error message if receiving fails
-    perror("Failed to receive acknowledgement");
-    return 0; // Return 0 to indicate failure
-  }
-
-  // Null-terminate the received acknowledgement message
-  ack_message[bytes_received] = '\0';
-
-  // Return the length of the sent message to indicate success
-  return strlen(message);
-}
-
-int receive_with_acknowledgement(int socket, const char *ack_message, char *message)
-{
-  // Seek to the beginning of the message in the socket
-  lseek(socket, 0, SEEK_SET);
-
-  // Receive the message from the socket
-  int bytes_received = recv(socket, message, BUFFER_SIZE, 0);
-  if (bytes_received < 0)
-  {
-    // Print an error message if receiving fails
-    perror("Failed to receive message");
-    return 0; // Return 0 to indicate failure
-  }
-
-  // Null-terminate the received message
-  message[bytes_received] = '\0';
-
-  // Send the acknowledgement message through the socket
-  if (send(socket, ack_message, strlen(ack_message), 0) < 0)
-  {
-    // Print an error message if sending fails
-    perror("Failed to send acknowledgement");
-    return 0; // Return 0 to indicate failure
-  }
-
-  // Return the number of bytes received to indicate success
-  return bytes_received;
-}
\ No newline at end of file
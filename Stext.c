@@ -9,18 +9,37 @@
 #include <signal.h>
 #include <sys/stat.h>
 #include <errno.h>
-#include <dirent.h>
-
-#define DEBUG 1
+#include <fcntl.h>
+#include <getopt.h>
+
+#include "protocol.h"
+#include "transfer.h"
+#include "event_loop.h"
+#include "tar_stream.h"
+#include "archive_cache.h"
+#include "store_index.h"
+#include "upload.h"
+#include "blob_store.h"
+#include "compress.h"
+#include "uring_io.h"
+#include "stats.h"
+#include "trace.h"
+#include "delta.h"
+#include "group_commit.h"
+#include "segment_store.h"
+#include "checksum.h"
+#include "parallel_gzip.h"
 
 #define SMAIN_SERVER_IP "127.0.0.1"
 
 #define SMAIN_SERVER_PORT 4020
 #define STEXT_SERVER_PORT 4014
-#define SPDF_SERVER_PORT 4014
+#define SPDF_SERVER_PORT 4015
 
 #define BUFFER_SIZE 1024
 
+#define MAX_COMMANDS 8
+
 /**
  * @brief Function to handle the client process.
  *
@@ -38,9 +57,10 @@ void prcclient(int client_socket);
  * The command is parsed and the appropriate function is called based on the command type.
  *
  * @param socket The socket descriptor for the client connection.
- * @param command_str The command string received from the client.
+ * @param request The header of the command frame received from the client.
+ * @param args The command arguments received in the command frame payload.
  */
-void process_command(int socket, char *command_str);
+void process_command(int socket, const struct frame_header *request, char *args);
 
 /**
  * @brief Function to process the "ufile" command.
@@ -62,10 +82,11 @@ int process_ufile(int socket, char *commands[]);
  * It extracts the file path from the command arguments and sends the file content in chunks to the client.
  *
  * @param socket The socket descriptor for the client connection.
+ * @param request_id The id of the request being processed.
  * @param commands An array of command arguments.
  * @return Returns 1 if the file is successfully sent, 0 otherwise.
  */
-int process_dfile(int socket, char *commands[]);
+int process_dfile(int socket, uint32_t request_id, char *commands[]);
 
 /**
  * @brief Function to process the "rmfile" command.
@@ -73,107 +94,195 @@ int process_dfile(int socket, char *commands[]);
  * This function handles the "rmfile" command, which is used to remove a file.
  * It extracts the file name from the command arguments and removes the file from the server.
  *
- * @param socket The socket descriptor for the client connection.
  * @param commands An array of command arguments.
  * @return Returns 1 if the file is successfully removed, 0 otherwise.
  */
-int process_rmfile(int socket, char *commands[]);
+int process_rmfile(char *commands[]);
+
+/**
+ * @brief Function to process the "uresume" command.
+ *
+ * This function handles the "uresume" command, which asks where a resumable upload continues.
+ * It extracts the upload id from the command arguments and looks up the bytes committed for it.
+ *
+ * @param commands An array of command arguments.
+ * @param offset The buffer to store the committed size followed by the capabilities of the server, as the result
+ *               message.
+ * @param size The size of the offset buffer.
+ * @return Returns 1 if the upload was looked up, -1 otherwise.
+ */
+int process_uresume(char *commands[], char *offset, size_t size);
+
+/**
+ * @brief Function to process the "ulink" command.
+ *
+ * This function handles the "ulink" command, which stores a file of known content without its body.
+ * It extracts the file name, destination path, hash and size from the command arguments and links the file to the
+ * stored content with that hash.
+ *
+ * @param commands An array of command arguments.
+ * @return Returns 1 if the file was linked, 0 if the content is not known, -1 otherwise.
+ */
+int process_ulink(char *commands[]);
+
+/**
+ * @brief Function to process the "usig" command.
+ *
+ * This function handles the "usig" command, which asks for the block signatures of a stored file
+ * before the client uploads a new version of it as a delta.
+ *
+ * @param socket The socket descriptor for the client connection.
+ * @param request_id The id of the request being processed.
+ * @param commands An array of command arguments.
+ * @return Returns 1 if the signatures are sent, 0 if there is no file to sign, -1 otherwise.
+ */
+int process_usig(int socket, uint32_t request_id, char *commands[]);
+
+/**
+ * @brief Function to process the "udelta" command.
+ *
+ * This function handles the "udelta" command, which rebuilds a stored file from the stored copy and a
+ * chunked body of instructions, and stores it as any other upload once its size and hash match.
+ *
+ * @param socket The socket descriptor for the client connection.
+ * @param commands An array of command arguments.
+ * @return Returns 1 if the file is rebuilt and stored, -1 otherwise.
+ */
+int process_udelta(int socket, char *commands[]);
 
 /**
  * @brief Function to process the "display" command.
  *
  * This function handles the "display" command, which is used to display the files in a directory.
- * It extracts the directory path from the command arguments and sends the file paths to the client.
+ * It extracts the directory path, and the page of files asked for, from the command arguments and sends the file
+ * paths to the client.
  *
  * @param socket The socket descriptor for the client connection.
+ * @param request_id The id of the request being processed.
  * @param commands An array of command arguments.
  * @return Returns 1 if the file paths are successfully sent, 0 otherwise.
  */
-int process_display(int socket, char *commands[]);
+int process_display(int socket, uint32_t request_id, char *commands[]);
 
 /**
  * @brief Function to process the "dtar" command.
  *
- * This function handles the "dtar" command, which is used to create a tar file.
- * It extracts the directory path from the command arguments and creates a tar file for the specified directory.
+ * This function handles the "dtar" command, which is used to download a tar file of the store.
+ * The archive is generated while the store is walked and streamed to the socket, gzipped if the
+ * optional "-z" argument is given, at the level of "-z0" to "-z9".
  *
  * @param socket The socket descriptor for the client connection.
+ * @param request_id The id of the request being processed.
  * @param commands An array of command arguments.
- * @return Returns 1 if the tar file is successfully created, 0 otherwise.
+ * @return Returns 1 if the tar file is successfully sent, -1 otherwise.
  */
-int process_dtar(int socket, char *commands[]);
+int process_dtar(int socket, uint32_t request_id, char *commands[]);
 
 /**
  * @brief Function to send a file to the client.
  *
  * This function sends a file to the client.
- * It opens the file, gets the file size, sends the file size to the client, and then sends the file content in chunks.
+ * It opens the file, gets the file size, and sends the file content as a single data frame
+ * through the transmit path selected with --send-mode. A client that accepts compression gets a chunked
+ * body of compressed chunks instead, and a file packed at rest is inflated for any other client.
  *
  * @param socket The socket descriptor for the client connection.
+ * @param request_id The id of the request the file belongs to.
  * @param file_path The path of the file to be sent.
- * @return Returns 1 if the file is successfully sent, -1 otherwise.
+ * @param deflate 1 if the client accepts compressed chunks, 0 otherwise.
+ * @param checked 1 if the client checks the download, which then ends with its checksum, 0 otherwise.
+ * @param range The byte range of the file to send, {0, UINT64_MAX} for the whole file.
+ * @return Returns 1 if the file is successfully sent, -1 otherwise or if the range starts past the end of the file.
  */
-int send_file(int socket, const char *file_path);
+int send_file(int socket, uint32_t request_id, const char *file_path, int deflate, int checked,
+              struct byte_range range);
 
 /**
  * @brief Function to receive a file from the client.
  *
  * This function receives a file from the client and saves it to the specified directory path.
- * It receives the file size from the client, receives the file content in chunks, and saves it to the specified path.
+ * It receives the data frame header carrying the file size, then the file content in chunks.
  *
  * @param client_socket The socket descriptor for the client connection.
  * @param dir_path The directory path where the file should be saved.
  * @param file_name The name of the file to be saved.
- * @param file_size The size of the file to be received.
- * @return Returns 1 if the file is successfully received, 0 otherwise.
+ * @return Returns 1 if the file is successfully received, -1 otherwise.
+ */
+int receive_file(int client_socket, const char *dir_path, const char *file_name);
+
+/**
+ * @brief Function to receive a resumable upload from the client.
+ *
+ * This function receives the chunked body of a resumable upload, continuing at the given offset,
+ * and saves the file to the specified directory path once it is complete.
+ *
+ * @param client_socket The socket descriptor for the client connection.
+ * @param dir_path The directory path where the file should be saved.
+ * @param file_name The name of the file to be saved.
+ * @param upload_id The upload id chosen by the client.
+ * @param file_size The size of the whole file.
+ * @param offset The offset of the file the body starts at.
+ * @param stripe The stripe of a striped upload, 0 otherwise.
+ * @param stripes The number of stripes of the upload, 1 for an upload that is not striped.
+ * @return Returns 1 if the file, or the stripe, is complete, -1 otherwise.
+ */
+int receive_resumable_file(int client_socket, const char *dir_path, const char *file_name, const char *upload_id,
+                           uint64_t file_size, uint64_t offset, unsigned stripe, unsigned stripes);
+
+/**
+ * @brief Function to receive a data frame body into a file.
+ *
+ * This function receives exactly file_size bytes from the socket and writes them to file_path.
+ * If the file cannot be written the remaining bytes are still drained so the stream stays framed.
+ * A checksum trailer after the content is checked once the file is written, and stored with the file.
+ *
+ * @param socket The socket descriptor for the connection.
+ * @param file_path The path of the file to be written.
+ * @param file_size The number of bytes to be received, without the checksum trailer.
+ * @param hash The hash the received bytes are added to, or NULL.
+ * @param checked 1 if a checksum trailer follows the content, 0 otherwise.
+ * @return Returns 1 if the file is successfully received, -1 otherwise.
  */
-int receive_file(int client_socket, const char *dir_path, const char *file_name, int file_size);
+int receive_file_body(int socket, const char *file_path, uint64_t file_size, struct sha256 *hash, int checked);
 
 /**
  * @brief Function to remove a file.
  *
  * This function removes a file from the server.
  *
- * @param socket The socket descriptor for the client connection.
  * @param file_path The path of the file to be removed.
- * @return Returns 1 if the file is successfully removed, 0 otherwise.
+ * @return Returns 1 if the file is successfully removed, -1 otherwise.
  */
-int remove_file(int socket, const char *file_path);
+int remove_file(const char *file_path);
 
 /**
  * @brief Function to display the files in a directory.
  *
- * This function displays the files in a directory.
- * It sends the file paths to the client.
+ * This function displays the files in a directory from the in-memory index of the store.
+ * It sends the file paths to the client in batches, as a chunked data frame body which may be empty.
  *
  * @param socket The socket descriptor for the client connection.
+ * @param request_id The id of the request the listing belongs to.
  * @param dir_path The path of the directory to be displayed.
- * @return Returns 1 if the file paths are successfully sent, 0 otherwise.
+ * @param offset The number of files to skip.
+ * @param limit The largest number of files to send, 0 for all.
+ * @return Returns 1 if the file paths are successfully sent, -1 otherwise.
  */
-int display_files(int socket, const char *dir_path);
+int display_files(int socket, uint32_t request_id, const char *dir_path, uint64_t offset, uint64_t limit);
 
 /**
  * @brief Function to send a tar file to the client.
  *
- * This function sends a tar file to the client.
- * It creates a tar file for the specified directory and sends it to the client.
+ * This function sends the cached tar archive of the store if no write happened since it was built,
+ * otherwise it streams a fresh archive to the client as a chunked data frame body and caches it.
  *
  * @param socket The socket descriptor for the client connection.
- * @param file_type The type of files to include in the tar file.
- * @return Returns 1 if the tar file is successfully created and sent, 0 otherwise.
+ * @param request_id The id of the request the tar file belongs to.
+ * @param level The gzip level of the archive, TAR_PLAIN for a plain tar archive.
+ * @param checked 1 if the client checks the download, whose frames then end with their checksums, 0 otherwise.
+ * @return Returns 1 if the tar file is successfully sent, -1 otherwise.
  */
-int send_tar(int socket, const char *file_type);
-
-/**
- * @brief Function to create a tar file.
- *
- * This function creates a tar file for the specified directory.
- *
- * @param tar_name The name of the tar file to be created.
- * @param source_path The path of the directory to be included in the tar file.
- * @return Returns 0 if the tar file is successfully created, -1 otherwise.
- */
-int create_tar(const char *tar_name, const char *source_path);
+int send_tar(int socket, uint32_t request_id, int level, int checked);
 
 /**
  * @brief Function to create directories.
@@ -185,17 +294,6 @@ int create_tar(const char *tar_name, const char *source_path);
  */
 int create_directories(const char *path);
 
-/**
- * @brief Function to traverse a directory and get the file paths.
- *
- * This function traverses a directory and gets the file paths.
- *
- * @param root The root directory.
- * @param dir_path The path of the directory to be traversed.
- * @param file_paths The buffer to store the file paths.
- */
-void traverse_directory(const char *root, const char *dir_path, char *file_paths);
-
 /**
  * @brief Function to tokenize a command string.
  *
@@ -203,33 +301,21 @@ void traverse_directory(const char *root, const char *dir_path, char *file_paths
  *
  * @param cmd_str The command string to be tokenized.
  * @param commands The array to store the command arguments.
+ * @param max_commands The capacity of the commands array.
  * @return Returns the number of command arguments.
  */
-int tokenize_command(char *cmd_str, char *commands[]);
-
-/**
- * @brief Function to send a message with acknowledgement.
- *
- * This function sends a message to the client and waits for an acknowledgement message.
- *
- * @param socket The socket descriptor for the client connection.
- * @param message The message to be sent.
- * @param ack_message The buffer to store the acknowledgement message.
- * @return Returns the number of bytes received if the acknowledgement is received, -1 otherwise.
- */
-int send_with_acknowledgement(int socket, const char *message, char *ack_message);
+int tokenize_command(char *cmd_str, char *commands[], int max_commands);
 
 /**
- * @brief Function to receive a message with acknowledgement.
+ * @brief Function to parse the command line options.
  *
- * This function receives a message from the client and sends an acknowledgement message.
+ * This function parses the command line options and applies them to the server configuration.
+ * It prints the usage and exits the program on an unknown option.
  *
- * @param socket The socket descriptor for the client connection.
- * @param ack_message The acknowledgement message to be sent.
- * @param message The buffer to store the received message.
- * @return Returns the number of bytes received if the message is received, -1 otherwise.
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments.
  */
-int receive_with_acknowledgement(int socket, const char *ack_message, char *message);
+void parse_options(int argc, char *argv[]);
 
 /**
  * @brief Signal handler for SIGINT.
@@ -243,6 +329,14 @@ void handle_sigint(int sig);
 
 int server_socket; // Global variable for the server socket
 
+int server_port = STEXT_SERVER_PORT; // Port to listen on, set with --port
+
+int metrics_port = 0; // Port of the Prometheus metrics endpoint, set with --metrics-port
+
+unsigned trace_sample = 0; // Trace one in every trace_sample requests, set with --trace-sample
+
+const char *trace_file = NULL; // File the trace lines are appended to, set with --trace-file
+
 void handle_sigint(int sig)
 {
   printf("\nClosing socket...\n", sig);
@@ -258,7 +352,7 @@ void handle_sigint(int sig)
  *
  * @return Returns 0 on success.
  */
-int main()
+int main(int argc, char *argv[])
 {
   int client_socket;
   struct sockaddr_in server_addr, client_addr;
@@ -269,6 +363,9 @@ int main()
   // Register signal handler for SIGINT
   signal(SIGINT, handle_sigint);
 
+  // Parse command line options
+  parse_options(argc, argv);
+
   // create ./stext directories if they do not exist
   if (create_directories("./stext") != 0)
   {
@@ -276,6 +373,63 @@ int main()
     exit(EXIT_FAILURE);
   }
 
+  // dtar archives are cached until the next write, the cache is shared by all processes forked below
+  if (archive_cache_init("./cache/stext") != 0)
+    fprintf(stderr, "Archive cache disabled\n");
+
+  // partial resumable uploads are kept outside the store until they are complete
+  if (upload_init("./uploads/stext") != 0)
+    exit(EXIT_FAILURE);
+
+  // with --dedup every distinct content is stored once, the store paths are links to it; uploads that are
+  // deduplicated or packed at rest are staged in the blob directory
+  if ((blob_store_enabled || compress_at_rest) && blob_store_init("./blobs/stext") != 0)
+    exit(EXIT_FAILURE);
+
+  // with --durable, uploads committed at about the same time by any process share one sync of the store
+  if (group_commit_init("./stext") != 0)
+    exit(EXIT_FAILURE);
+
+  // with --segment-store small files are appended to segments instead of stored as files of their own
+  if (segment_store_enabled && (blob_store_enabled || compress_at_rest))
+  {
+    fprintf(stderr, "--segment-store cannot be combined with --dedup or --compress-at-rest\n");
+    exit(EXIT_FAILURE);
+  }
+  if (segment_store_init("./segments/stext") != 0)
+    exit(EXIT_FAILURE);
+
+  // display is answered from an index of ./stext built once here, kept current by ufile and rmfile
+  if (store_index_init("./stext") != 0)
+  {
+    fprintf(stderr, "Failed to build the store index\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // every process forked below writes its trace lines to the same file
+  if (trace_init("stext", trace_sample, trace_file) != 0)
+    exit(EXIT_FAILURE);
+
+  // request statistics are shared by all processes forked below
+  if (stats_init("stext") != 0)
+    fprintf(stderr, "Request statistics disabled\n");
+  else if (metrics_port > 0 && stats_start_metrics(metrics_port) != 0)
+    exit(EXIT_FAILURE);
+
+  if (server_model == SERVER_MODEL_EPOLL)
+  {
+    // Every worker listens on the port itself, the kernel balances connections with SO_REUSEPORT
+    if (open_worker_listeners(server_port) != 0)
+    {
+      perror("Failed to open listening sockets");
+      exit(EXIT_FAILURE);
+    }
+    printf("Stext server listening on port %d (send mode: %s, io engine: %s, server model: %s, workers: %d)\n",
+           server_port, send_mode_name(file_send_mode), io_engine_name(file_io_engine), server_model_name(server_model),
+           event_workers);
+    exit(run_event_loop(process_command) == 0 ? 0 : EXIT_FAILURE);
+  }
+
   // Create socket
   server_socket = socket(AF_INET, SOCK_STREAM, 0);
   if (server_socket < 0)
@@ -286,7 +440,7 @@ int main()
 
   // Bind socket
   server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(STEXT_SERVER_PORT);
+  server_addr.sin_port = htons(server_port);
   server_addr.sin_addr.s_addr = INADDR_ANY;
   if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
   {
@@ -296,14 +450,15 @@ int main()
   }
 
   // Listen for connections
-  if (listen(server_socket, 10) < 0)
+  if (listen(server_socket, SOMAXCONN) < 0)
   {
     perror("Listen failed");
     close(server_socket);
     exit(EXIT_FAILURE);
   }
 
-  printf("Stext server listening on port %d\n", STEXT_SERVER_PORT);
+  printf("Stext server listening on port %d (send mode: %s, io engine: %s, server model: %s)\n", server_port,
+         send_mode_name(file_send_mode), io_engine_name(file_io_engine), server_model_name(server_model));
 
   while (1)
   {
@@ -315,8 +470,10 @@ int main()
       continue;
     }
     // Fork a child process to handle the client
-    if (DEBUG)
+    if (log_level >= LOG_DEBUG)
       printf("Forking child process for new Client\n");
+    // catch up with the changes made by other clients, so the child starts with a current index
+    store_index_sync();
     child_pid = fork();
     if (child_pid == 0)
     {
@@ -329,6 +486,9 @@ int main()
     {
       // Parent process
       close(client_socket);
+      // reap the children of clients that have disconnected
+      while (waitpid(-1, NULL, WNOHANG) > 0)
+        ;
     }
     else
     {
@@ -340,6 +500,139 @@ int main()
   return 0;
 }
 
+void parse_options(int argc, char *argv[])
+{
+  static struct option long_options[] = {
+      {"send-mode", required_argument, NULL, 's'},
+      {"io-engine", required_argument, NULL, 'u'},
+      {"server-model", required_argument, NULL, 'm'},
+      {"workers", required_argument, NULL, 'w'},
+      {"no-cpu-affinity", no_argument, NULL, 'A'},
+      {"inotify", no_argument, NULL, 'i'},
+      {"dedup", no_argument, NULL, 'd'},
+      {"compress-at-rest", no_argument, NULL, 'z'},
+      {"compress-level", required_argument, NULL, 'l'},
+      {"port", required_argument, NULL, 'P'},
+      {"log-level", required_argument, NULL, 'L'},
+      {"metrics-port", required_argument, NULL, 'M'},
+      {"trace-sample", required_argument, NULL, 'T'},
+      {"trace-file", required_argument, NULL, 'F'},
+      {"durable", no_argument, NULL, 'D'},
+      {"commit-window", required_argument, NULL, 'W'},
+      {"commit-batch", required_argument, NULL, 'B'},
+      {"segment-store", no_argument, NULL, 'g'},
+      {"segment-max-file", required_argument, NULL, 'G'},
+      {"gzip-threads", required_argument, NULL, 'j'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int option;
+  while ((option = getopt_long(argc, argv, "s:u:m:w:Aidzl:P:L:M:T:F:DW:B:gG:j:", long_options, NULL)) != -1)
+  {
+    switch (option)
+    {
+    case 's':
+      // transmit path for file bodies: sendfile, splice or buffered
+      if (parse_send_mode(optarg, &file_send_mode) != 0)
+      {
+        fprintf(stderr, "Unknown send mode: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'u':
+      // I/O engine for file bodies: stdio or uring
+      if (parse_io_engine(optarg, &file_io_engine) != 0)
+      {
+        fprintf(stderr, "Unknown io engine: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'm':
+      // one process per client (fork) or event loop workers (epoll)
+      if (parse_server_model(optarg, &server_model) != 0)
+      {
+        fprintf(stderr, "Unknown server model: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'w':
+      // number of event loop worker processes
+      event_workers = atoi(optarg);
+      break;
+    case 'A':
+      // let the scheduler place the event loop workers
+      event_cpu_affinity = 0;
+      break;
+    case 'i':
+      // also follow files added to or removed from ./stext by other programs
+      store_index_inotify = 1;
+      break;
+    case 'd':
+      // store every distinct file content once
+      blob_store_enabled = 1;
+      break;
+    case 'z':
+      // keep complete files compressed in the store
+      compress_at_rest = 1;
+      break;
+    case 'l':
+      // zlib level of compressed downloads and packed files, 1 is fastest
+      compress_level = atoi(optarg);
+      break;
+    case 'P':
+      // listen on another port, to run several nodes on one host
+      server_port = atoi(optarg);
+      break;
+    case 'L':
+      // info, or debug to also print every command and the steps of its processing
+      if (parse_log_level(optarg, &log_level) != 0)
+      {
+        fprintf(stderr, "Unknown log level: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'M':
+      // serve the request statistics in the Prometheus text format on this port
+      metrics_port = atoi(optarg);
+      break;
+    case 'T':
+      // trace one in every n requests, on top of the requests that arrive traced
+      trace_sample = strtoul(optarg, NULL, 10);
+      break;
+    case 'F':
+      trace_file = optarg;
+      break;
+    case 'D':
+      // acknowledge uploads only once they are on disk
+      durable_writes = 1;
+      break;
+    case 'W':
+      // microseconds a group commit waits for more uploads to share its sync
+      commit_window_us = strtoul(optarg, NULL, 10);
+      break;
+    case 'B':
+      // uploads that end the wait of a group commit early
+      commit_batch = strtoul(optarg, NULL, 10);
+      break;
+    case 'g':
+      // append small files to segment files instead of storing each as a file of its own
+      segment_store_enabled = 1;
+      break;
+    case 'G':
+      // largest file, in bytes, appended to a segment
+      segment_max_file = strtoull(optarg, NULL, 10);
+      break;
+    case 'j':
+      // threads compressing every gzipped dtar archive, 0 for one per CPU
+      parallel_gzip_threads = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [--send-mode sendfile|splice|buffered] [--io-engine stdio|uring] [--server-model fork|epoll] [--workers n] [--no-cpu-affinity] [--inotify] [--dedup] [--compress-at-rest] [--compress-level n] [--port n] [--log-level info|debug] [--metrics-port n] [--trace-sample n] [--trace-file path] [--durable] [--commit-window us] [--commit-batch n] [--segment-store] [--segment-max-file bytes] [--gzip-threads n]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
 void prcclient(int client_socket)
 {
   // print information about the client
@@ -347,141 +640,241 @@ void prcclient(int client_socket)
   socklen_t addr_size = sizeof(client_addr);
   getpeername(client_socket, (struct sockaddr *)&client_addr, &addr_size);
   printf("Client connected: %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+  stats_connection_opened();
   while (1)
   {
-    // Receive command from client
-    char command[BUFFER_SIZE];
-    int bytes_received = receive_with_acknowledgement(client_socket, "ack", command);
-    if (bytes_received < 0)
+    // Receive command frame from client
+    struct frame_header request;
+    int result = recv_frame_header(client_socket, &request);
+    if (result < 0)
     {
       perror("Failed to receive command");
       break;
     }
 
-    if (bytes_received == 0)
+    if (result == 0)
+      break;
+
+    char args[MAX_ARGS_SIZE];
+    if (recv_frame_payload(client_socket, &request, args, sizeof(args)) < 0)
     {
-      printf("Client disconnected: %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+      perror("Failed to receive command arguments");
       break;
     }
+
     // print the command
-    printf("Command received: %s\n", command);
-    process_command(client_socket, command);
+    if (log_level >= LOG_DEBUG)
+      printf("Command received: %s %s\n", opcode_name(request.opcode), args);
+    process_command(client_socket, &request, args);
   }
 
   // Close client socket
   close(client_socket);
   // print information about the client
   printf("Client disconnected: %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+  stats_connection_closed();
+
+  // print what this connection cost, to compare the transmit paths
+  print_transfer_stats("Connection");
 }
 
-void process_command(int socket, char *command_str)
+void process_command(int socket, const struct frame_header *request, char *args)
 {
-  // Process the command
-  char *commands[5];
-  int count = tokenize_command(command_str, commands);
+  // every command is timed, whatever its outcome
+  uint64_t start = stats_now();
+  trace_begin(request, args);
+
+  // Process the command, commands[0] is the command name as in the text protocol
+  char *commands[MAX_COMMANDS + 1] = {NULL};
+  commands[0] = (char *)opcode_name(request->opcode);
+  int count = 1 + tokenize_command(args, commands + 1, MAX_COMMANDS - 1);
+  trace_span("parse");
 
-  char *command = commands[0];
+  uint32_t request_id = request->request_id;
 
-  if (strcmp(command, "ufile") == 0)
+  if (request->opcode == OP_UFILE)
   {
     // Receive File from client
-    if (process_ufile(socket, commands) == 1)
-      send(socket, "File received by server", 14, 0);
+    if (count >= 3 && process_ufile(socket, commands) == 1)
+      send_result(socket, request_id, 1, "File received by server");
     else
-      send(socket, "Failed to receive file", 23, 0);
+    {
+      // the body of an invalid command still has to be consumed to keep the stream framed
+      if (count < 3)
+        discard_frame(socket);
+      send_result(socket, request_id, 0, "Failed to receive file");
+    }
   }
-  else if (strcmp(command, "dfile") == 0)
+  else if (request->opcode == OP_DFILE)
   {
-    if (DEBUG)
+    if (log_level >= LOG_DEBUG)
       printf("Processing dfile command\n");
     // Send File to client
-    if (process_dfile(socket, commands) == 1)
-      send(socket, "File downloaded", 16, 0);
+    if (count >= 2 && process_dfile(socket, request_id, commands) == 1)
+      send_result(socket, request_id, 1, "File downloaded");
     else
-      send(socket, "Failed to download file", 24, 0);
+      send_result(socket, request_id, 0, "Failed to download file");
   }
-  else if (strcmp(command, "rmfile") == 0)
+  else if (request->opcode == OP_RMFILE)
   {
-    if (DEBUG)
+    if (log_level >= LOG_DEBUG)
       printf("Processing rmfile command\n");
     // Remove file
-    if (process_rmfile(socket, commands) == 1)
-      send(socket, "File removed", 13, 0);
+    if (count >= 2 && process_rmfile(commands) == 1)
+      send_result(socket, request_id, 1, "File removed");
     else
-      send(socket, "Failed to remove file", 22, 0);
+      send_result(socket, request_id, 0, "Failed to remove file");
   }
-  else if (strcmp(command, "dtar") == 0)
+  else if (request->opcode == OP_DTAR)
   {
-    if (DEBUG)
+    if (log_level >= LOG_DEBUG)
       printf("Processing dtar command\n");
 
-    if (process_dtar(socket, commands) == 1)
-      send(socket, "Tar file downloaded", 19, 0);
+    if (process_dtar(socket, request_id, commands) == 1)
+      send_result(socket, request_id, 1, "Tar file downloaded");
     else
-      send(socket, "Failed to download tar file", 27, 0);
+      send_result(socket, request_id, 0, "Failed to download tar file");
   }
-  else if (strcmp(command, "display") == 0)
+  else if (request->opcode == OP_DISPLAY)
   {
-    if (DEBUG)
+    if (log_level >= LOG_DEBUG)
       printf("Processing display command\n");
     // Display files
-    if (process_display(socket, commands) == 1)
-      send(socket, "File paths saved as file", 24, 0);
+    if (count >= 2 && process_display(socket, request_id, commands) == 1)
+      send_result(socket, request_id, 1, "File paths saved as file");
+    else
+      send_result(socket, request_id, 0, "Failed to get files");
+  }
+  else if (request->opcode == OP_URESUME)
+  {
+    if (log_level >= LOG_DEBUG)
+      printf("Processing uresume command\n");
+    // Tell the client where its upload continues
+    char offset[64];
+    if (count >= 4 && process_uresume(commands, offset, sizeof(offset)) == 1)
+      send_result(socket, request_id, 1, offset);
+    else
+      send_result(socket, request_id, 0, "Invalid upload id");
+  }
+  else if (request->opcode == OP_ULINK)
+  {
+    if (log_level >= LOG_DEBUG)
+      printf("Processing ulink command\n");
+    // Store known content without its body, the client uploads it if this fails
+    int result = count >= 5 ? process_ulink(commands) : -1;
+    if (result == 1)
+      send_result(socket, request_id, 1, "File received by server");
+    else if (result == 0)
+      send_result(socket, request_id, 0, blob_store_enabled ? "Unknown content" : "Deduplication disabled");
+    else
+      send_result(socket, request_id, 0, "Failed to link file");
+  }
+  else if (request->opcode == OP_USIG)
+  {
+    if (log_level >= LOG_DEBUG)
+      printf("Processing usig command\n");
+    // Sign the stored file, the client uploads the whole file if there is none
+    int result = count >= 3 ? process_usig(socket, request_id, commands) : -1;
+    if (result == 1)
+      send_result(socket, request_id, 1, "Signatures sent");
+    else if (result == 0)
+      send_result(socket, request_id, 0, "No file to delta against");
     else
-      send(socket, "Failed to get files", 19, 0);
+      send_result(socket, request_id, 0, "Failed to send signatures");
+  }
+  else if (request->opcode == OP_UDELTA)
+  {
+    if (log_level >= LOG_DEBUG)
+      printf("Processing udelta command\n");
+    // Rebuild the file from the stored one
+    if (count >= 6 && process_udelta(socket, commands) == 1)
+      send_result(socket, request_id, 1, "File received by server");
+    else
+    {
+      if (count < 6)
+        discard_frame(socket);
+      send_result(socket, request_id, 0, "Failed to apply delta");
+    }
+  }
+  else if (request->opcode == OP_STATS)
+  {
+    // Report the request statistics of this server
+    if (send_stats(socket, request_id) == 1)
+      send_result(socket, request_id, 1, "Statistics sent");
+    else
+      send_result(socket, request_id, 0, "Failed to send statistics");
   }
   else
   {
-    if (DEBUG)
+    if (log_level >= LOG_DEBUG)
       printf("Invalid command\n");
-    send(socket, "Invalid command", 15, 0);
+    send_result(socket, request_id, 0, "Invalid command");
   }
+
+  stats_record_command(request->opcode, start);
+  trace_end();
 }
 
 int process_ufile(int socket, char *commands[])
 {
-  // Sample command: ufile fileName fileSize /destination/path
-  // extract file name, file size and destination path
+  // Sample command: ufile fileName /destination/path, followed by a data frame
+  // extract file name and destination path
   char *filename = commands[1];
-  int file_size = atoi(commands[2]);
   // create destination path by prepending ./text/
   char destination_path[256];
-  snprintf(destination_path, sizeof(destination_path), "./stext/%s", commands[3]);
-
-  if (DEBUG)
-    printf("File name: %s, File size: %d, Destination path: %s\n", filename, file_size, destination_path);
-
-  // receive file content in chunks
-  receive_file(socket, destination_path, filename, file_size);
+  snprintf(destination_path, sizeof(destination_path), "./stext/%s", commands[2]);
+
+  if (log_level >= LOG_DEBUG)
+    printf("File name: %s, Destination path: %s\n", filename, destination_path);
+
+  // receive file content in chunks, a resumable upload names its upload id, the file size and where it continues,
+  // a stripe of a striped upload also names the stripe and the number of stripes
+  int result;
+  if (commands[3] != NULL && commands[4] != NULL && commands[5] != NULL)
+    result = receive_resumable_file(socket, destination_path, filename, commands[3], strtoull(commands[4], NULL, 10),
+                                    strtoull(commands[5], NULL, 10), commands[6] != NULL ? atoi(commands[6]) : 0,
+                                    commands[7] != NULL ? atoi(commands[7]) : 1);
+  else
+    result = receive_file(socket, destination_path, filename);
+  // the store may have changed even if the upload failed part way
+  archive_cache_invalidate();
+  if (result != 1)
+    return -1;
 
   printf("File received\n");
   return 1;
 }
 
-int process_dfile(int socket, char *commands[])
+int process_dfile(int socket, uint32_t request_id, char *commands[])
 {
-  // Sample command: ufile fileName fileSize /destination/path
-  // extract file path
+  // Sample command: dfile /path/to/file [deflate] [crc32c] [range offset length]
+  // extract file path, whether the client accepts compressed chunks and whether it checks the download
   char *file_path = commands[1];
+  int deflate = has_argument(commands, COMPRESS_CAPABILITY);
+  int checked = has_argument(commands, CHECKSUM_CAPABILITY);
+  // and the byte range asked for, the whole file without one
+  struct byte_range range;
+  if (parse_range(commands, &range) < 0)
+    return -1;
 
-  if (DEBUG)
+  if (log_level >= LOG_DEBUG)
     printf("Sending file: %s\n", file_path);
 
   // create file path by prepending ./stext/
   char file_full_path[256];
   snprintf(file_full_path, sizeof(file_full_path), "./stext/%s", file_path);
 
-  // receive file content in chunks
-  return send_file(socket, file_full_path);
+  // send file content in chunks
+  return send_file(socket, request_id, file_full_path, deflate, checked, range);
 }
 
-int process_rmfile(int socket, char *commands[])
+int process_rmfile(char *commands[])
 {
   // Sample command: rmfile fileName
   // extract file name
   char *file_name = commands[1];
 
-  if (DEBUG)
+  if (log_level >= LOG_DEBUG)
     printf("Removing file: %s\n", file_name);
 
   // create file path by prepending ./stext/
@@ -489,319 +882,466 @@ int process_rmfile(int socket, char *commands[])
   snprintf(file_full_path, sizeof(file_full_path), "./stext/%s", file_name);
 
   // remove file
-  return remove_file(socket, file_full_path);
+  int result = remove_file(file_full_path);
+  if (result == 1)
+    archive_cache_invalidate();
+  return result;
+}
+
+int process_uresume(char *commands[], char *offset, size_t size)
+{
+  // Sample command: uresume fileName /destination/path upload_id [stripe stripes]
+  // extract upload id
+  uint64_t committed;
+  unsigned stripe = commands[4] != NULL && commands[5] != NULL ? atoi(commands[4]) : 0;
+  unsigned stripes = commands[4] != NULL && commands[5] != NULL ? atoi(commands[5]) : 1;
+  if (upload_offset(commands[3], stripe, stripes, &committed) != 1)
+  {
+    fprintf(stderr, "Invalid upload id: %s\n", commands[3]);
+    return -1;
+  }
+
+  if (log_level >= LOG_DEBUG)
+    printf("Upload %s continues at %llu\n", commands[3], (unsigned long long)committed);
+
+  // the chunks of the upload may come compressed, and known content may be linked instead of sent
+  snprintf(offset, size, "%llu %s%s%s", (unsigned long long)committed, COMPRESS_CAPABILITY,
+           blob_store_enabled ? " " : "", blob_store_enabled ? BLOB_STORE_CAPABILITY : "");
+  return 1;
+}
+
+int process_ulink(char *commands[])
+{
+  // Sample command: ulink fileName /destination/path sha256 file_size
+  // create destination path by prepending ./stext/
+  char destination_path[256];
+  snprintf(destination_path, sizeof(destination_path), "./stext/%s", commands[2]);
+  if (!blob_store_enabled)
+    return 0;
+
+  if (create_directories(destination_path) != 0)
+  {
+    perror("Failed to create directories");
+    return -1;
+  }
+
+  char file_path[512];
+  snprintf(file_path, sizeof(file_path), "%s/%s", destination_path, commands[1]);
+
+  int result = blob_store_link(commands[3], strtoull(commands[4], NULL, 10), file_path);
+  if (result == 1 && group_commit() != 0)
+    result = -1;
+  if (result == 1)
+  {
+    store_index_update(file_path);
+    archive_cache_invalidate();
+    printf("File linked\n");
+  }
+  else if (log_level >= LOG_DEBUG && result == 0)
+    printf("Unknown content: %s\n", commands[3]);
+  return result;
+}
+
+int process_usig(int socket, uint32_t request_id, char *commands[])
+{
+  // Sample command: usig fileName /destination/path
+  // create file path by prepending ./stext/
+  char file_path[512];
+  snprintf(file_path, sizeof(file_path), "./stext/%s/%s", commands[2], commands[1]);
+
+  if (log_level >= LOG_DEBUG)
+    printf("Signing file: %s\n", file_path);
+
+  return delta_send_signatures(socket, request_id, file_path);
+}
+
+int process_udelta(int socket, char *commands[])
+{
+  // Sample command: udelta fileName /destination/path file_size sha256 block_size, followed by a chunked body
+  // create file path by prepending ./stext/
+  char file_path[512];
+  snprintf(file_path, sizeof(file_path), "./stext/%s/%s", commands[2], commands[1]);
+
+  if (log_level >= LOG_DEBUG)
+    printf("Applying delta to file: %s\n", file_path);
+
+  // the new file is rebuilt outside the store, next to the partial uploads, and committed as they are
+  char temp_path[512];
+  upload_temp_path(temp_path, sizeof(temp_path));
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  int result = delta_receive(socket, file_path, temp_path, strtoull(commands[3], NULL, 10), commands[4],
+                             strtoul(commands[5], NULL, 10), digest);
+  trace_span("receive");
+  if (result == 1 && (compress_file(temp_path) != 0 || blob_store_commit(temp_path, digest, file_path) != 0))
+  {
+    remove(temp_path);
+    result = -1;
+  }
+  if (result == 1 && segment_store_remove(file_path) < 0)
+    result = -1;
+  if (result == 1)
+  {
+    store_index_update(file_path);
+    archive_cache_invalidate();
+    printf("File rebuilt from delta\n");
+  }
+  trace_span("commit");
+  if (result == 1 && group_commit() != 0)
+    result = -1;
+  trace_span("sync");
+  return result;
 }
 
-int process_display(int socket, char *commands[])
+int process_display(int socket, uint32_t request_id, char *commands[])
 {
-  // Sample command: display /path/to/directory
-  // extract directory path
+  // Sample command: display /path/to/directory [offset limit]
+  // extract directory path and the page of files to send
   char *dir_path = commands[1];
+  uint64_t offset = commands[2] != NULL ? strtoull(commands[2], NULL, 10) : 0;
+  uint64_t limit = commands[2] != NULL && commands[3] != NULL ? strtoull(commands[3], NULL, 10) : 0;
 
   // create directory path by prepending ./stext/
   char full_dir_path[256];
   snprintf(full_dir_path, sizeof(full_dir_path), "./stext/%s", dir_path);
 
-  if (DEBUG)
+  if (log_level >= LOG_DEBUG)
     printf("Displaying files in directory: %s\n", full_dir_path);
 
   // display files
-  return display_files(socket, full_dir_path);
+  return display_files(socket, request_id, full_dir_path, offset, limit);
 }
 
-int process_dtar(int socket, char *commands[])
+int process_dtar(int socket, uint32_t request_id, char *commands[])
 {
-  // Sample command: dtar /path/to/directory
-  // extract directory path
-
-  if (DEBUG)
-    printf("Creating tar file for filetype: txt\n");
-
-  // create tar file
-  char tar_name[256];
-  snprintf(tar_name, sizeof(tar_name), "./tar/txt.tar");
-
-  if (create_tar(tar_name, "./stext") != 0)
+  // Sample command: dtar [-z|-z0..-z9] [crc32c]
+  int level = TAR_PLAIN, checked = 0;
+  for (int i = 1; commands[i] != NULL; i++)
   {
-    perror("Failed to create tar file");
-    return -1;
+    int argument_level = tar_compression_argument(commands[i], TAR_GZIP_DEFAULT);
+    if (argument_level != TAR_PLAIN)
+      level = argument_level;
+    checked |= strcmp(commands[i], CHECKSUM_CAPABILITY) == 0;
   }
-  return 1;
+
+  if (log_level >= LOG_DEBUG)
+    printf("Streaming tar file for filetype: txt\n");
+
+  return send_tar(socket, request_id, level, checked);
 }
 
-int send_file(int socket, const char *file_path)
+int send_file(int socket, uint32_t request_id, const char *file_path, int deflate, int checked,
+              struct byte_range range)
 {
-  // open file
-  FILE *file = fopen(file_path, "rb");
-  if (file == NULL)
+  // a file of the segment store is sent straight out of its segment
+  int found = segment_store_send(socket, request_id, file_path, range, checked);
+  if (found != 0)
+    return found;
+
+  // open file, a missing file is reported through the result frame
+  int fd = open(file_path, O_RDONLY);
+  if (fd < 0)
   {
-    // send with acknowledgement file size -1
-    char ack_message[BUFFER_SIZE];
-    if (send_with_acknowledgement(socket, "-1", ack_message) <= 0)
-    {
-      perror("Failed to send file size");
-      return -1;
-    }
     printf("File not found\n");
     return -1;
   }
 
+  // a compressed download, or a file packed at rest, cannot take the zero-copy path
+  int sent = send_compressed_file(socket, request_id, fd, deflate, checked, range);
+  if (sent != 0)
+  {
+    close(fd);
+    return sent;
+  }
+
   // get file size
-  fseek(file, 0, SEEK_END);
-  int file_size = ftell(file);
-  fseek(file, 0, SEEK_SET);
-
-  // send file size
-  char ack_message[BUFFER_SIZE];
-  char file_size_str[BUFFER_SIZE];
-  sprintf(file_size_str, "%d", file_size);
-  if (send_with_acknowledgement(socket, file_size_str, ack_message) <= 0)
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0)
   {
-    perror("Failed to send file size");
-    fclose(file);
+    perror("Failed to stat file");
+    close(fd);
     return -1;
   }
+  uint64_t file_size = file_stat.st_size;
 
-  // send file content
-  char buffer[BUFFER_SIZE];
-  int bytes_read;
-  while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0)
+  // a range is sent from its offset, the bytes before it are never read
+  if (clamp_range(&range, file_size) != 0)
   {
-    if (send(socket, buffer, bytes_read, 0) < 0)
-    {
-      perror("Failed to send file");
-      fclose(file);
-      return -1;
-    }
+    close(fd);
+    return -1;
   }
-  fclose(file);
-
-  if (DEBUG)
-    printf("File sent, waiting for acknowledgement\n");
-  // receive acknowledgement
-  char response[BUFFER_SIZE];
-  int bytes_received = recv(socket, response, BUFFER_SIZE, 0);
-  if (bytes_received < 0)
+
+  // a checked download ends with the checksum of the range, the one stored with the file for the whole file
+  uint32_t crc = 0;
+  if (checked && checksum_file(fd, range, &crc) != 0)
   {
-    perror("Failed to receive acknowledgement");
+    close(fd);
     return -1;
   }
+
+  // send data frame header carrying the size of the range
+  if (send_frame_header(socket, OP_DATA, checked ? FRAME_FLAG_CHECKSUM : 0, request_id,
+                        range.length + (checked ? CHECKSUM_SIZE : 0)) != 0)
+  {
+    perror("Failed to send file size");
+    close(fd);
+    return -1;
+  }
+
+  // send file content through the selected transmit path
+  if (send_file_data(socket, fd, range.offset, range.length) != 0 || (checked && send_checksum(socket, crc) != 0))
+  {
+    // the frame length is already on the wire, so the stream can only be cut
+    perror("Failed to send file");
+    shutdown(socket, SHUT_RDWR);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  if (log_level >= LOG_DEBUG)
+    printf("File sent\n");
   return 1;
 }
 
-int receive_file(int client_socket, const char *dir_path, const char *file_name, int file_size)
+int receive_file(int client_socket, const char *dir_path, const char *file_name)
 {
+  // receive data frame header carrying the file size, and whether a checksum follows the file
+  struct frame_header data;
+  uint64_t file_size;
+  if (recv_frame_header(client_socket, &data) != 1 || data.opcode != OP_DATA)
+  {
+    perror("Failed to receive file size");
+    return -1;
+  }
+  int checked = frame_content_length(&data, &file_size);
+  if (checked < 0)
+  {
+    discard_payload(client_socket, data.payload_length);
+    return -1;
+  }
+
+  if (log_level >= LOG_DEBUG)
+    printf("Receiving file: %s, File size: %llu\n", file_name, (unsigned long long)file_size);
+
+  // create file path
+  char file_path[256];
+  snprintf(file_path, sizeof(file_path), "%s/%s", dir_path, file_name);
+
+  // a small file is appended to a segment, no directory or file is created for it
+  if (segment_store_accepts(file_size))
+  {
+    int result = segment_store_receive(client_socket, file_path, file_size, checked);
+    trace_span("receive");
+    if (result == 1)
+      store_index_update(file_path);
+    trace_span("commit");
+    if (result == 1 && group_commit() != 0)
+      result = -1;
+    trace_span("sync");
+    return result;
+  }
+
   // Create directories if they do not exist
   char *dir = strdup(dir_path);
   if (create_directories(dir) != 0)
   {
     perror("Failed to create directories");
     free(dir);
+    discard_payload(client_socket, data.payload_length);
     return -1;
   }
   free(dir);
 
-  if (DEBUG)
-    printf("Receiving file: %s\n", file_name);
+  if (!blob_store_enabled && !compress_at_rest && !durable_writes)
+  {
+    int result = receive_file_body(client_socket, file_path, file_size, NULL, checked);
+    trace_span("receive");
+    // a copy in the segment store would hide the new file
+    if (result == 1 && segment_store_remove(file_path) < 0)
+      result = -1;
+    // the file may exist even if the upload failed part way
+    store_index_update(file_path);
+    trace_span("commit");
+    return result;
+  }
 
-  // receive with acknowledgement file size
-  char file_size_str[BUFFER_SIZE];
-  if (receive_with_acknowledgement(client_socket, "ack", file_size_str) <= 0)
+  // a deduplicated upload is hashed into a temporary file, and packed, and only then linked into the store; a
+  // durable upload is renamed into it
+  char temp_path[256];
+  if (blob_store_enabled || compress_at_rest)
+    blob_store_temp_path(temp_path, sizeof(temp_path));
+  else
+    upload_temp_path(temp_path, sizeof(temp_path));
+  struct sha256 hash;
+  sha256_init(&hash);
+  if (receive_file_body(client_socket, temp_path, file_size, blob_store_enabled ? &hash : NULL, checked) != 1)
   {
-    perror("Failed to receive file size");
+    remove(temp_path);
+    return -1;
+  }
+  trace_span("receive");
+
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  sha256_final(&hash, digest);
+  if (compress_file(temp_path) != 0 || blob_store_commit(temp_path, digest, file_path) != 0)
+  {
+    remove(temp_path);
     return -1;
   }
+  if (segment_store_remove(file_path) < 0)
+    return -1;
+  store_index_update(file_path);
+  trace_span("commit");
+
+  // the upload is acknowledged once it is on disk, together with the uploads committed at the same time
+  int result = group_commit() == 0 ? 1 : -1;
+  trace_span("sync");
+  return result;
+}
 
-  if (DEBUG)
-    printf("File size: %s\n", file_size_str);
+int receive_resumable_file(int client_socket, const char *dir_path, const char *file_name, const char *upload_id,
+                           uint64_t file_size, uint64_t offset, unsigned stripe, unsigned stripes)
+{
+  if (log_level >= LOG_DEBUG)
+    printf("Receiving file: %s, File size: %llu, Upload %s from %llu\n", file_name, (unsigned long long)file_size,
+           upload_id, (unsigned long long)offset);
 
-  // create file
   // create file path
   char file_path[256];
   snprintf(file_path, sizeof(file_path), "%s/%s", dir_path, file_name);
 
+  // a small file is completed next to the partial uploads and then appended to a segment, no directory is created
+  // for it
+  char temp_path[256];
+  int segment = stripes == 1 && segment_store_accepts(file_size);
+  if (segment)
+    upload_temp_path(temp_path, sizeof(temp_path));
+  else if (create_directories(dir_path) != 0)
+  {
+    perror("Failed to create directories");
+    discard_frame(client_socket);
+    return -1;
+  }
+
+  // the file only appears in the store once every chunk is committed
+  int result = receive_upload(client_socket, upload_id, file_size, offset, stripe, stripes,
+                              segment ? temp_path : file_path);
+  trace_span("receive");
+  if (result == 1 && (segment ? segment_store_put_file(file_path, temp_path) : segment_store_remove(file_path)) < 0)
+  {
+    if (segment)
+      remove(temp_path);
+    result = -1;
+  }
+  if (result == 1)
+    store_index_update(file_path);
+  trace_span("commit");
+  if (result == 1 && group_commit() != 0)
+    result = -1;
+  trace_span("sync");
+  return result;
+}
+
+int receive_file_body(int socket, const char *file_path, uint64_t file_size, struct sha256 *hash, int checked)
+{
+  // the content is checked against the trailer that follows it once it is written
+  uint32_t crc = 0;
+
+  // the io_uring engine falls back to stdio when the kernel refuses it
+  if (file_io_engine == IO_ENGINE_URING)
+  {
+    int result = uring_receive_file(socket, file_path, file_size, hash, checked ? &crc : NULL);
+    if (result != URING_UNSUPPORTED)
+      return checked ? recv_file_checksum(socket, file_path, result, crc) : result;
+  }
+
   FILE *file = fopen(file_path, "wb");
   if (file == NULL)
   {
     perror("Failed to create file");
+    discard_payload(socket, file_size + (checked ? CHECKSUM_SIZE : 0));
     return -1;
   }
 
-  int total_bytes_received = 0;
+  uint64_t total_bytes_received = 0;
 
   while (total_bytes_received < file_size)
   {
-    // receive without acknowledgement file content from client
-    char response[BUFFER_SIZE];
-    int bytes_received = recv(client_socket, response, BUFFER_SIZE, 0);
-    if (bytes_received < 0)
+    // never read past the end of the data frame
+    static char response[TRANSFER_BUFFER_SIZE];
+    size_t bytes_to_receive = sizeof(response);
+    if (file_size - total_bytes_received < bytes_to_receive)
+      bytes_to_receive = file_size - total_bytes_received;
+
+    if (recv_all(socket, response, bytes_to_receive) != 1)
     {
+      // the sender went away, do not keep a truncated file
       perror("Failed to receive file");
       fclose(file);
+      remove(file_path);
       return -1;
     }
 
-    total_bytes_received += bytes_received;
+    total_bytes_received += bytes_to_receive;
+    if (checked)
+      crc = crc32c(crc, response, bytes_to_receive);
+    if (hash != NULL)
+      sha256_update(hash, response, bytes_to_receive);
 
-    if (fwrite(response, 1, bytes_received, file) < 0)
+    if (fwrite(response, 1, bytes_to_receive, file) != bytes_to_receive)
     {
       perror("Failed to write to file");
       fclose(file);
+      discard_payload(socket, file_size - total_bytes_received + (checked ? CHECKSUM_SIZE : 0));
       return -1;
     }
   }
 
-  // send acknowledgement
-  if (send(client_socket, "ack", 3, 0) < 0)
+  int result = 1;
+  if (fclose(file) != 0)
   {
-    perror("Failed to send acknowledgement");
-    fclose(file);
-    return -1;
+    perror("Failed to write to file");
+    result = -1;
   }
-
-  fclose(file);
-  return 0;
+  return checked ? recv_file_checksum(socket, file_path, result, crc) : result;
 }
 
-int remove_file(int socket, const char *file_path)
+int remove_file(const char *file_path)
 {
-  if (remove(file_path) != 0)
+  // a file of the segment store only needs a record in its index, a deduplicated file also drops its content once
+  // no other path references it
+  int removed = segment_store_remove(file_path);
+  if (removed < 0 || (removed == 0 && blob_store_remove(file_path) != 0))
   {
     perror("Failed to remove file");
     return -1;
   }
+  store_index_update(file_path);
   return 1;
 }
 
-int display_files(int socket, const char *dir_path)
+int display_files(int socket, uint32_t request_id, const char *dir_path, uint64_t offset, uint64_t limit)
 {
-  // get all files and sub-files in the directory
-  char file_paths[5120] = "";
-  traverse_directory(dir_path, dir_path, file_paths);
-
-  // send file sizes to the client
-  // get file size
-  int msg_size = strlen(file_paths);
-
-  if (msg_size == 0)
-  {
-    // send with acknowledgement file size 0
-    char ack_message[BUFFER_SIZE];
-    if (send_with_acknowledgement(socket, "0", ack_message) <= 0)
-    {
-      perror("Failed to send file size");
-    }
-    return -1;
-  }
-
-  // send file size
-  char ack_message[BUFFER_SIZE];
-  char msg_size_str[BUFFER_SIZE];
-  sprintf(msg_size_str, "%d", msg_size);
-  if (send_with_acknowledgement(socket, msg_size_str, ack_message) <= 0)
+  // send all files and sub-files in the directory batch by batch, Smain relays them with the other servers
+  uint64_t count;
+  if (store_index_send_listing(socket, request_id, dir_path, offset, limit, &count) != 0 ||
+      send_chunk(socket, request_id, NULL, 0) != 0)
   {
-    perror("Failed to send file size");
+    perror("Failed to send file paths");
     return -1;
   }
 
-  // send content in chunks
-  char buffer[BUFFER_SIZE];
-  int bytes_sent = 0;
-  while (bytes_sent < msg_size)
-  {
-    int bytes_to_send = msg_size - bytes_sent;
-    if (bytes_to_send > BUFFER_SIZE)
-    {
-      bytes_to_send = BUFFER_SIZE;
-    }
-    strncpy(buffer, file_paths + bytes_sent, bytes_to_send);
-    if (send(socket, buffer, bytes_to_send, 0) < 0)
-    {
-      perror("Failed to send file");
-      return -1;
-    }
-    bytes_sent += bytes_to_send;
-  }
-
-  if (DEBUG)
-    printf("File sent, waiting for acknowledgement\n");
-
-  // receive acknowledgement
-  char response[BUFFER_SIZE];
-  int bytes_received = recv(socket, response, BUFFER_SIZE, 0);
-  if (bytes_received < 0)
-  {
-    perror("Failed to receive acknowledgement");
-    return -1;
-  }
+  if (log_level >= LOG_DEBUG)
+    printf("File paths sent: %llu\n", (unsigned long long)count);
   return 1;
 }
 
-int send_tar(int socket, const char *file_type)
+int send_tar(int socket, uint32_t request_id, int level, int checked)
 {
-  // create tar file
-  char tar_name[256];
-  snprintf(tar_name, sizeof(tar_name), "./tar/%s.tar", file_type);
-
-  if (create_tar(tar_name, "./smain") != 0)
+  // the cached archive if the store has not changed, else it is written to the socket while ./stext is walked
+  if (send_cached_tar(socket, request_id, "./stext", level, checked) != 1)
   {
-    perror("Failed to create tar file");
-    return -1;
-  }
-
-  // open file
-  FILE *file = fopen(tar_name, "rb");
-  if (file == NULL)
-  {
-    // send with acknowledgement file size -1
-    char ack_message[BUFFER_SIZE];
-    if (send_with_acknowledgement(socket, "-1", ack_message) <= 0)
-    {
-      perror("Failed to send file size");
-      return -1;
-    }
-    printf("File not found\n");
-    return -1;
-  }
-
-  // get file size
-  fseek(file, 0, SEEK_END);
-  int file_size = ftell(file);
-  fseek(file, 0, SEEK_SET);
-
-  // send file size
-  char ack_message[BUFFER_SIZE];
-  char file_size_str[BUFFER_SIZE];
-  sprintf(file_size_str, "%d", file_size);
-  if (send_with_acknowledgement(socket, file_size_str, ack_message) <= 0)
-  {
-    perror("Failed to send file size");
-    fclose(file);
-    return -1;
-  }
-
-  // send file content
-  char buffer[BUFFER_SIZE];
-  int bytes_read;
-  while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0)
-  {
-    if (send(socket, buffer, bytes_read, 0) < 0)
-    {
-      perror("Failed to send file");
-      fclose(file);
-      return -1;
-    }
-  }
-  fclose(file);
-
-  if (DEBUG)
-    printf("File sent, waiting for acknowledgement\n");
-  // receive acknowledgement
-  char response[BUFFER_SIZE];
-  int bytes_received = recv(socket, response, BUFFER_SIZE, 0);
-  if (bytes_received < 0)
-  {
-    perror("Failed to receive acknowledgement");
+    fprintf(stderr, "Failed to send tar file\n");
     return -1;
   }
   return 1;
@@ -809,52 +1349,6 @@ int send_tar(int socket, const char *file_type)
 
 /* UTILITY FUNCTIONS */
 
-int create_tar(const char *tar_name, const char *source_path)
-{
-  pid_t pid = fork(); // Create a new process by duplicating the calling process
-
-  if (pid < 0)
-  {
-    // If fork() returns a negative value, the creation of a child process was unsuccessful
-    perror("Fork failed"); // Print an error message to stderr
-    return -1;             // Return an error code
-  }
-
-  if (pid == 0)
-  {
-    // This block is executed by the child process
-    char *argv[] = {"tar", "-czf", tar_name, source_path, NULL}; // Arguments for the execvp function
-    execvp("tar", argv);                                         // Replace the current process image with a new process image specified by argv
-    // If execvp returns, it must have failed
-    perror("execvp failed"); // Print an error message to stderr
-    return -1;               // Return an error code
-  }
-  else
-  {
-    // This block is executed by the parent process
-    int status; // Variable to store the status information of the child process
-    if (waitpid(pid, &status, 0) == -1)
-    {
-      // waitpid() waits for the child process to change state
-      perror("waitpid failed"); // Print an error message to stderr
-      return -1;                // Return an error code
-    }
-    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
-    {
-      // WIFEXITED(status) returns true if the child terminated normally
-      // WEXITSTATUS(status) returns the exit status of the child
-      return 0; // Success
-    }
-    else
-    {
-      // If the child process did not terminate normally or exited with a non-zero status
-      fprintf(stderr, "Child process failed with status %d\n", WEXITSTATUS(status)); // Print an error message to stderr
-      return -1;                                                                     // Return an error code
-    }
-  }
-  return -1; // Return an error code if none of the above conditions are met
-}
-
 int create_directories(const char *path)
 {
   char temp[256]; // Buffer to hold the modified path
@@ -899,79 +1393,15 @@ int create_directories(const char *path)
   return 0; // Return success
 }
 
-void traverse_directory(const char *root, const char *dir_path, char *file_paths)
-{
-  DIR *dir;             // Pointer to the directory stream
-  struct dirent *entry; // Pointer to the directory entry
-
-  // Open the directory specified by dir_path
-  dir = opendir(dir_path);
-  if (dir == NULL)
-  {
-    // If the directory cannot be opened, print an error message and return
-    perror("Failed to open directory");
-    return;
-  }
-
-  // Read entries from the directory
-  while ((entry = readdir(dir)) != NULL)
-  {
-    // Skip the current directory (".") and parent directory ("..") entries
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-    {
-      continue;
-    }
-
-    // Construct the full path of the current entry
-    char path[256];
-    snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
-
-    // If the entry is a directory, recursively traverse it
-    if (entry->d_type == DT_DIR)
-    {
-      traverse_directory(root, path, file_paths);
-    }
-    // If the entry is a regular file
-    else if (entry->d_type == DT_REG)
-    {
-      // Create a buffer to hold the relative file path
-      char file_path[256];
-      // Copy the relative file path (excluding the root directory part) into file_path
-      strncpy(file_path, path + strlen(root), sizeof(file_path));
-
-      // Get the file name from the file path
-      char *file_name = strrchr(file_path, '/');
-      if (file_name != NULL)
-      {
-        file_name++; // Skip the '/'
-      }
-      else
-      {
-        file_name = file_path; // If no '/' found, use the whole path as file name
-      }
-
-      // Create a buffer to hold the file entry (file name and relative file path)
-      char file_entry[512];
-      // Format the file entry as "file_name - file_path\n"
-      snprintf(file_entry, sizeof(file_entry), "%s - %s\n", file_name, file_path);
-      // Append the file entry to file_paths
-      strcat(file_paths, file_entry);
-    }
-  }
-
-  // Close the directory stream
-  closedir(dir);
-}
-
-int tokenize_command(char *cmd_str, char *commands[])
+int tokenize_command(char *cmd_str, char *commands[], int max_commands)
 {
   int count = 0; // Initialize a counter to keep track of the number of tokens
 
   // Use strtok to split the input string 'cmd_str' into tokens separated by spaces
   char *token = strtok(cmd_str, " ");
 
-  // Loop through all tokens
-  while (token != NULL)
+  // Loop through all tokens, the commands array never overflows
+  while (token != NULL && count < max_commands)
   {
     // Store the current token in the 'commands' array and increment the counter
     commands[count++] = token;
@@ -983,62 +1413,3 @@ int tokenize_command(char *cmd_str, char *commands[])
   // Return the total number of tokens found
   return count;
 }
-
-int send_with_acknowledgement(int socket, const char *message, char *ack_message)
-{
-  // Attempt to send the message through the socket
-  if (send(socket, message, strlen(message), 0) < 0)
-  {
-    // If sending fails, print an error message and return 0
-    perror("Failed to send message");
-    return 0;
-  }
-
-  // Receive an acknowledgement message from the socket
-  int bytes_received = recv(socket, ack_message, BUFFER_SIZE, 0);
-  if (bytes_received < 0)
-  {
-    // If receiving fails, print an error message and return 0
-    perror("Failed to receive acknowledgement");
-    return 0;
-  }
-
-  // Null-terminate the received acknowledgement message
-  ack_message[bytes_received] = '\0';
-
-  // Return the length of the original message sent
-  return strlen(message);
-}
-
-int receive_with_acknowledgement(int socket, const char *ack_message, char *message)
-{
-  // Seek to the beginning of the message in the socket
-  lseek(socket, 0, SEEK_SET);
-
-  // Receive the message from the socket
-  int bytes_received = recv(socket, message, BUFFER_SIZE, 0);
-
-  // Check if there was an error receiving the message
-  if (bytes_received < 0)
-  {
-    // Print an error message if receiving failed
-    perror("Failed to receive message");
-    // Return 0 to indicate failure
-    return 0;
-  }
-
-  // Null-terminate the received message
-  message[bytes_received] = '\0';
-
-  // Send an acknowledgement message back through the socket
-  if (send(socket, ack_message, strlen(ack_message), 0) < 0)
-  {
-    // Print an error message if sending the acknowledgement failed
-    perror("Failed to send acknowledgement");
-    // Return 0 to indicate failure
-    return 0;
-  }
-
-  // Return the number of bytes received
-  return bytes_received;
-}
\ No newline at end of file
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+#include "transfer.h"
+#include "tar_stream.h"
+#include "checksum.h"
+#include "archive_cache.h"
+
+struct cache_slot
+{
+  int valid;
+  uint64_t generation; // Store generation the cached archive was built at
+};
+
+struct cache_state
+{
+  pthread_mutex_t lock; // Process-shared
+  uint64_t generation;  // Bumped by every write to the store
+  uint64_t hits;
+  uint64_t misses;
+  struct cache_slot slots[1 + 10]; // Plain archive, then the gzipped archive of every level
+};
+
+static struct cache_state *state; // Shared by every process forked after archive_cache_init
+
+static char cache_dir[PATH_MAX / 2];
+
+static void archive_path(char *path, size_t size, int level)
+{
+  if (level == TAR_PLAIN)
+    snprintf(path, size, "%s/archive.tar", cache_dir);
+  else
+    snprintf(path, size, "%s/archive-%d.tar.gz", cache_dir, level);
+}
+
+int archive_cache_init(const char *dir)
+{
+  snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+
+  // create every component of the cache directory
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s", dir);
+  for (char *p = path + 1; *p != '\0'; p++)
+  {
+    if (*p != '/')
+      continue;
+    *p = '\0';
+    mkdir(path, 0755);
+    *p = '/';
+  }
+  if (mkdir(path, 0755) != 0 && errno != EEXIST)
+  {
+    perror("Failed to create archive cache directory");
+    return -1;
+  }
+
+  // archives of an earlier run may not match the store any more
+  DIR *cache = opendir(dir);
+  if (cache != NULL)
+  {
+    struct dirent *entry;
+    while ((entry = readdir(cache)) != NULL)
+    {
+      if (entry->d_name[0] == '.')
+        continue;
+      snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+      unlink(path);
+    }
+    closedir(cache);
+  }
+
+  struct cache_state *shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED)
+  {
+    perror("Failed to map archive cache state");
+    return -1;
+  }
+  memset(shared, 0, sizeof(*shared));
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&shared->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  state = shared;
+  return 0;
+}
+
+void archive_cache_invalidate(void)
+{
+  if (state == NULL)
+    return;
+  pthread_mutex_lock(&state->lock);
+  state->generation++;
+  pthread_mutex_unlock(&state->lock);
+}
+
+static int send_archive_file(int socket, uint32_t request_id, int fd, int checked)
+{
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0)
+    return -1;
+
+  // the checksum of a cached archive is computed by the first checked download and kept with it
+  uint32_t crc = 0;
+  if (checked && checksum_file(fd, (struct byte_range){0, file_stat.st_size}, &crc) != 0)
+    return -1;
+
+  if (send_frame_header(socket, OP_DATA, checked ? FRAME_FLAG_CHECKSUM : 0, request_id,
+                        file_stat.st_size + (checked ? CHECKSUM_SIZE : 0)) != 0)
+    return -1;
+  if (send_file_data(socket, fd, 0, file_stat.st_size) != 0 || (checked && send_checksum(socket, crc) != 0))
+  {
+    // the frame length is already on the wire, so the stream can only be cut
+    shutdown(socket, SHUT_RDWR);
+    return -1;
+  }
+  return 1;
+}
+
+int send_cached_tar(int socket, uint32_t request_id, const char *source_path, int level, int checked)
+{
+  if (state == NULL)
+    return send_tar_stream(socket, request_id, source_path, level, -1, checked) < 0 ? -1 : 1;
+
+  char path[PATH_MAX];
+  archive_path(path, sizeof(path), level);
+  struct cache_slot *slot = &state->slots[level + 1];
+
+  // open under the lock, so the archive cannot be replaced between the check and the open
+  pthread_mutex_lock(&state->lock);
+  uint64_t generation = state->generation;
+  int fd = -1;
+  if (slot->valid && slot->generation == generation)
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0)
+    state->hits++;
+  else
+    state->misses++;
+  unsigned long long hits = state->hits, misses = state->misses;
+  pthread_mutex_unlock(&state->lock);
+
+  char compression[32] = "";
+  if (level != TAR_PLAIN)
+    snprintf(compression, sizeof(compression), " (gzip level %d)", level);
+  printf("Archive cache %s for %s%s (hits %llu, misses %llu)\n", fd >= 0 ? "hit" : "miss", source_path, compression,
+         hits, misses);
+
+  if (fd >= 0)
+  {
+    int result = send_archive_file(socket, request_id, fd, checked);
+    close(fd);
+    return result;
+  }
+
+  // rebuild the archive, keeping a copy of what is streamed
+  char temp_path[PATH_MAX];
+  int copy_fd = -1;
+  // a truncated name could be another file, and renaming it would publish the wrong archive
+  int length = snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, getpid());
+  if (length < 0 || (size_t)length >= sizeof(temp_path))
+    fprintf(stderr, "Cached archive path too long: %s\n", path);
+  else if ((copy_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+    perror("Failed to create cached archive");
+
+  int result = send_tar_stream(socket, request_id, source_path, level, copy_fd, checked);
+  if (copy_fd >= 0)
+  {
+    int complete = close(copy_fd) == 0 && result == 1;
+
+    // publish only if no write happened while the tree was walked
+    pthread_mutex_lock(&state->lock);
+    if (complete && state->generation == generation && rename(temp_path, path) == 0)
+    {
+      slot->generation = generation;
+      slot->valid = 1;
+    }
+    else
+      unlink(temp_path);
+    pthread_mutex_unlock(&state->lock);
+  }
+  return result < 0 ? -1 : 1;
+}
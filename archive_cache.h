@@ -0,0 +1,53 @@
+#ifndef ARCHIVE_CACHE_H
+#define ARCHIVE_CACHE_H
+
+#include <stdint.h>
+
+/*
+ * Cache of the dtar archive of a server's store.
+ *
+ * Every write to the store (ufile, rmfile) bumps a generation counter. The
+ * first dtar after a write streams a freshly generated archive and keeps a
+ * copy of it in the cache directory, one for the plain archive and one for
+ * every gzip level, tagged with the generation it was built at; later dtars
+ * at the same generation are answered from that copy with a single data frame
+ * through the zero-copy transmit path. A copy whose build overlapped a write
+ * is never published.
+ *
+ * The counter, the cache slots and the hit/miss counters live in shared
+ * memory created before the server forks, so every worker and client process
+ * sees the same generation and shares the cached archives. Changes made to
+ * the store behind the server's back are not noticed.
+ */
+
+/**
+ * @brief Set up the cache, to be called before the server forks.
+ *
+ * Archives left in the cache directory by an earlier run are removed.
+ *
+ * @param cache_dir The directory holding the cached archives, outside the store.
+ * @return int Returns 0 on success, -1 if the cache is unavailable (dtar then always rebuilds).
+ */
+int archive_cache_init(const char *cache_dir);
+
+/**
+ * @brief Mark every cached archive as stale, called after the store changed.
+ */
+void archive_cache_invalidate(void);
+
+/**
+ * @brief Send the tar archive of a directory, from the cache when it is current.
+ *
+ * A cached archive is sent as a single data frame of known size, a rebuilt
+ * one as a chunked data frame body while it is cached.
+ *
+ * @param socket The socket to send on.
+ * @param request_id The id of the request the archive answers.
+ * @param source_path The directory to archive.
+ * @param level The gzip level of the archive, TAR_PLAIN for a plain tar archive, see tar_stream.h.
+ * @param checked 1 to follow the archive, or every chunk of it, with its checksum trailer, 0 otherwise.
+ * @return int Returns 1 if the archive was sent, -1 otherwise.
+ */
+int send_cached_tar(int socket, uint32_t request_id, const char *source_path, int level, int checked);
+
+#endif
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "backend_pool.h"
+#include "stats.h"
+#include "trace.h"
+
+// Descriptors below this have their checkout time kept, for the backend call latency
+#define POOL_TRACKED_SOCKETS 4096
+
+struct backend_pool
+{
+  char name[32];
+  char server_ip[64];
+  int server_port;
+
+  pthread_mutex_t lock;
+  pthread_cond_t available;
+  int size;       // Maximum number of connections
+  int open_count; // Connections currently open, idle or checked out
+  int idle_count; // Connections waiting in idle[]
+  int *idle;      // Idle connected sockets
+};
+
+static uint64_t checked_out_at[POOL_TRACKED_SOCKETS]; // stats_now at checkout, indexed by socket
+
+/* HELPERS */
+
+// Start timing the call a checked out connection carries
+static int check_out(int socket)
+{
+  if (socket >= 0 && socket < POOL_TRACKED_SOCKETS)
+    checked_out_at[socket] = stats_now();
+  // the wait for a free connection, or to open one, is a span of a traced request
+  trace_span("checkout");
+  return socket;
+}
+
+/**
+ * @brief Check whether an idle connection can carry a new request.
+ *
+ * A clean connection has nothing to read: readable means the backend closed
+ * it (EOF) or left stray bytes behind, both of which make it unusable.
+ */
+static int connection_is_healthy(int socket)
+{
+  struct pollfd pfd = {.fd = socket, .events = POLLIN};
+  int ready = poll(&pfd, 1, 0);
+  if (ready < 0)
+    return 0;
+  return ready == 0;
+}
+
+static int connect_with_retry(struct backend_pool *pool)
+{
+  int delay_ms = POOL_RETRY_DELAY_MS;
+  for (int attempt = 1; attempt <= POOL_CONNECT_ATTEMPTS; attempt++)
+  {
+    int socket;
+    if (connect_to_server(&socket, pool->server_ip, pool->server_port) == 0)
+      return socket;
+
+    fprintf(stderr, "Connection to %s %s:%d failed (attempt %d of %d)\n", pool->name, pool->server_ip,
+            pool->server_port, attempt, POOL_CONNECT_ATTEMPTS);
+    if (attempt < POOL_CONNECT_ATTEMPTS)
+    {
+      usleep(delay_ms * 1000);
+      delay_ms *= 2;
+    }
+  }
+  return -1;
+}
+
+/* POOL */
+
+struct backend_pool *backend_pool_create(const char *name, const char *server_ip, int server_port, int size)
+{
+  struct backend_pool *pool = calloc(1, sizeof(*pool));
+  if (pool == NULL)
+    return NULL;
+
+  pool->idle = calloc(size > 0 ? size : 1, sizeof(int));
+  if (pool->idle == NULL)
+  {
+    free(pool);
+    return NULL;
+  }
+
+  snprintf(pool->name, sizeof(pool->name), "%s", name);
+  snprintf(pool->server_ip, sizeof(pool->server_ip), "%s", server_ip);
+  pool->server_port = server_port;
+  pool->size = size > 0 ? size : 1;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->available, NULL);
+  return pool;
+}
+
+int backend_pool_acquire(struct backend_pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  while (1)
+  {
+    // Reuse an idle connection if it is still healthy
+    while (pool->idle_count > 0)
+    {
+      int socket = pool->idle[--pool->idle_count];
+      if (connection_is_healthy(socket))
+      {
+        pthread_mutex_unlock(&pool->lock);
+        return check_out(socket);
+      }
+      printf("Dropping stale connection to %s\n", pool->name);
+      close(socket);
+      pool->open_count--;
+    }
+
+    // Open a new connection if the pool is not full
+    if (pool->open_count < pool->size)
+    {
+      pool->open_count++;
+      pthread_mutex_unlock(&pool->lock);
+
+      int socket = connect_with_retry(pool);
+      if (socket < 0)
+      {
+        pthread_mutex_lock(&pool->lock);
+        pool->open_count--;
+        pthread_cond_signal(&pool->available);
+        pthread_mutex_unlock(&pool->lock);
+      }
+      return check_out(socket);
+    }
+
+    // Wait for a connection to be checked back in
+    pthread_cond_wait(&pool->available, &pool->lock);
+  }
+}
+
+void backend_pool_release(struct backend_pool *pool, int socket)
+{
+  if (socket < 0)
+    return;
+  if (socket < POOL_TRACKED_SOCKETS)
+    stats_record_backend(checked_out_at[socket]);
+
+  int healthy = connection_is_healthy(socket);
+
+  pthread_mutex_lock(&pool->lock);
+  if (healthy && pool->idle_count < pool->size)
+  {
+    pool->idle[pool->idle_count++] = socket;
+  }
+  else
+  {
+    close(socket);
+    pool->open_count--;
+  }
+  pthread_cond_signal(&pool->available);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void backend_pool_close(struct backend_pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  while (pool->idle_count > 0)
+  {
+    close(pool->idle[--pool->idle_count]);
+    pool->open_count--;
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void backend_pool_destroy(struct backend_pool *pool)
+{
+  backend_pool_close(pool);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->available);
+  free(pool->idle);
+  free(pool);
+}
+
+int connect_to_server(int *client_socket, const char *server_ip, int server_port)
+{
+  struct sockaddr_in server_addr;
+
+  // Create socket
+  *client_socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (*client_socket < 0)
+  {
+    perror("Socket creation failed");
+    return -1;
+  }
+
+  // Connect to server
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(server_port);
+  server_addr.sin_addr.s_addr = inet_addr(server_ip);
+  if (connect(*client_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+  {
+    perror("Connection failed");
+    close(*client_socket);
+    *client_socket = -1;
+    return -1;
+  }
+
+  // Requests are small frames answered by small frames, do not let Nagle hold them back
+  int flag = 1;
+  setsockopt(*client_socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+  return 0;
+}
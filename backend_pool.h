@@ -0,0 +1,88 @@
+#ifndef BACKEND_POOL_H
+#define BACKEND_POOL_H
+
+/*
+ * Pool of connections from Smain to a backend server (Stext or Spdf).
+ *
+ * Every request checks a connection out, owns it exclusively while it talks
+ * to the backend, and checks it back in, so concurrent clients never
+ * interleave their frames on one stream. Connections are opened lazily, so
+ * processes forked from the one that created the pool never share a socket.
+ * Idle connections are health checked on checkout and replaced if the
+ * backend closed them; failed connects are retried with backoff instead of
+ * terminating the server.
+ */
+
+// Default number of connections per backend
+#define DEFAULT_POOL_SIZE 4
+
+// Connect attempts made before a checkout fails
+#define POOL_CONNECT_ATTEMPTS 3
+
+// Delay before the first reconnect attempt, doubled after every failure
+#define POOL_RETRY_DELAY_MS 100
+
+struct backend_pool;
+
+/**
+ * @brief Create a connection pool for a backend server.
+ *
+ * No connection is opened until the first checkout.
+ *
+ * @param name The name of the backend, used in log messages.
+ * @param server_ip The IP address of the backend.
+ * @param server_port The port of the backend.
+ * @param size The maximum number of connections to the backend.
+ * @return struct backend_pool* The pool, or NULL on allocation failure.
+ */
+struct backend_pool *backend_pool_create(const char *name, const char *server_ip, int server_port, int size);
+
+/**
+ * @brief Check out a connection to the backend.
+ *
+ * Blocks while all connections are checked out. An idle connection that the
+ * backend closed, or that holds unread bytes, is replaced by a new one.
+ *
+ * @param pool The pool.
+ * @return int The connected socket, or -1 if the backend cannot be reached.
+ */
+int backend_pool_acquire(struct backend_pool *pool);
+
+/**
+ * @brief Check a connection back in.
+ *
+ * A connection that was shut down or left with unread bytes after a failed
+ * request is closed instead of being reused.
+ *
+ * @param pool The pool.
+ * @param socket The socket returned by backend_pool_acquire.
+ */
+void backend_pool_release(struct backend_pool *pool, int socket);
+
+/**
+ * @brief Close every idle connection of the pool.
+ *
+ * @param pool The pool.
+ */
+void backend_pool_close(struct backend_pool *pool);
+
+/**
+ * @brief Close every idle connection of the pool and free it.
+ *
+ * No connection of the pool may be checked out.
+ *
+ * @param pool The pool.
+ */
+void backend_pool_destroy(struct backend_pool *pool);
+
+/**
+ * @brief Connect to a server.
+ *
+ * @param client_socket The socket connected to the server.
+ * @param server_ip The IP address of the server.
+ * @param server_port The port of the server.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int connect_to_server(int *client_socket, const char *server_ip, int server_port);
+
+#endif
@@ -0,0 +1,765 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "protocol.h"
+
+#define SMAIN_SERVER_IP "127.0.0.1"
+
+#define SMAIN_SERVER_PORT 4020
+
+#define BUFFER_SIZE 1024
+
+// Largest number of entries in the file size distribution
+#define MAX_SIZES 16
+
+// Largest number of concurrent connections
+#define MAX_CONNECTIONS 1024
+
+// Store directory the benchmark files are uploaded under, one subdirectory per connection; destinations are relative
+// to the store of every server, so the files land in ./smain/bench, ./stext/bench and ./spdf/bench
+#define BENCH_DIRECTORY "bench"
+
+/**
+ * @brief Operations the benchmark mixes.
+ */
+enum bench_op
+{
+  BENCH_UFILE,
+  BENCH_DFILE,
+  BENCH_RMFILE,
+  BENCH_DISPLAY,
+  BENCH_DTAR,
+  BENCH_OPS,
+};
+
+/**
+ * @brief File types the uploads are spread over.
+ */
+enum bench_type
+{
+  BENCH_C,
+  BENCH_TXT,
+  BENCH_PDF,
+  BENCH_TYPES,
+};
+
+static const char *op_names[BENCH_OPS] = {"ufile", "dfile", "rmfile", "display", "dtar"};
+static const char *type_names[BENCH_TYPES] = {"c", "txt", "pdf"};
+
+/**
+ * @brief An entry of the file size distribution.
+ */
+struct weighted_size
+{
+  uint64_t size;
+  unsigned weight;
+};
+
+/**
+ * @brief What the benchmark runs, set from the command line.
+ */
+struct bench_config
+{
+  const char *host;
+  int port;
+  int connections;                     // Concurrent connections, one process each
+  double duration;                     // Seconds every connection runs the mix for
+  unsigned prefill;                    // Files every connection uploads before the mix starts
+  unsigned seed;                       // Seed of the random choices, the connection number is added to it
+  unsigned op_weights[BENCH_OPS];      // Relative frequency of every operation
+  unsigned type_weights[BENCH_TYPES];  // Relative frequency of every file type
+  struct weighted_size sizes[MAX_SIZES];
+  int size_count;
+  const char *label;                   // Name of the run in the results, e.g. the build under test
+};
+
+/**
+ * @brief One timed operation, sent from a connection process to the parent.
+ */
+struct sample
+{
+  uint8_t op;
+  uint8_t ok;
+  uint64_t bytes; // File bytes uploaded or downloaded
+  uint64_t ns;    // Latency of the whole request
+};
+
+/**
+ * @brief A file a connection uploaded and may download or remove.
+ */
+struct remote_file
+{
+  char path[160];
+  uint64_t size;
+};
+
+/**
+ * @brief The state of one connection process.
+ */
+struct connection
+{
+  int socket;
+  int number;
+  unsigned random;
+  uint32_t next_request_id;
+  unsigned uploaded; // Files uploaded so far, names the next one
+  struct remote_file *files;
+  size_t file_count;
+  size_t file_capacity;
+  const char *content; // Bytes uploaded, as large as the largest file size
+};
+
+struct bench_config config = {
+    .host = SMAIN_SERVER_IP,
+    .port = SMAIN_SERVER_PORT,
+    .connections = 8,
+    .duration = 10,
+    .prefill = 4,
+    .seed = 1,
+    .op_weights = {40, 40, 10, 5, 5},
+    .type_weights = {20, 40, 40},
+    .sizes = {{4 * 1024, 50}, {64 * 1024, 30}, {1024 * 1024, 15}, {16 * 1024 * 1024, 5}},
+    .size_count = 4,
+    .label = "default",
+};
+
+/**
+ * @brief Parse the command line into config.
+ *
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ */
+void parse_options(int argc, char *argv[]);
+
+/**
+ * @brief Parse a list of "name=weight" pairs into the weights of the names.
+ *
+ * @param list The list, e.g. "ufile=40,dfile=40".
+ * @param names The names the list may use.
+ * @param count The number of names.
+ * @param weights The weights to set, names left out of the list get 0.
+ * @return int Returns 0 on success, -1 if the list is invalid.
+ */
+int parse_weights(const char *list, const char *names[], int count, unsigned weights[]);
+
+/**
+ * @brief Parse a list of "size:weight" pairs into the file size distribution.
+ *
+ * @param list The list, e.g. "4k:50,1m:10"; sizes take a k, m or g suffix.
+ * @return int Returns 0 on success, -1 if the list is invalid.
+ */
+int parse_sizes(const char *list);
+
+/**
+ * @brief Connect to Smain.
+ *
+ * @return int The connected socket, or -1 on failure.
+ */
+int connect_to_smain(void);
+
+/**
+ * @brief Run the mix on one connection and write its samples to a pipe.
+ *
+ * @param number The number of the connection.
+ * @param output The write end of the pipe to the parent.
+ * @return int Returns 0 on success, -1 if the connection could not be set up.
+ */
+int run_connection(int number, int output);
+
+/**
+ * @brief Run one operation of the mix.
+ *
+ * @param conn The connection.
+ * @param op The operation to run.
+ * @param bytes Set to the file bytes transferred.
+ * @return int Returns 1 if the server completed the request, 0 if it failed it, -1 if the connection broke.
+ */
+int run_operation(struct connection *conn, enum bench_op op, uint64_t *bytes);
+
+/**
+ * @brief Upload a new file of a random type and size.
+ *
+ * @param conn The connection.
+ * @param bytes Set to the size of the file.
+ * @return int Returns 1 if the server stored the file, 0 if it failed, -1 if the connection broke.
+ */
+int bench_ufile(struct connection *conn, uint64_t *bytes);
+
+/**
+ * @brief Send a request answered by an optional body, and receive the body and the result.
+ *
+ * @param conn The connection.
+ * @param opcode The opcode of the request.
+ * @param args The arguments of the request.
+ * @param bytes Set to the body bytes received.
+ * @return int Returns 1 if the request succeeded, 0 if it failed, -1 if the connection broke.
+ */
+int bench_download(struct connection *conn, uint8_t opcode, const char *args, uint64_t *bytes);
+
+/**
+ * @brief Collect the samples of every connection and print the results.
+ *
+ * @param inputs The read ends of the connection pipes.
+ * @param count The number of connections.
+ * @return int Returns 0 on success, -1 if no sample was collected.
+ */
+int report_results(int inputs[], int count);
+
+/**
+ * @brief The main function.
+ *
+ * Forks one process per connection, each of which runs the configured mix
+ * of operations against Smain for the configured duration, and prints the
+ * throughput and latency percentiles of every operation as tab separated
+ * rows, so the results of two builds can be diffed.
+ *
+ * @return Returns 0 on success.
+ */
+int main(int argc, char *argv[])
+{
+  parse_options(argc, argv);
+
+  int inputs[MAX_CONNECTIONS];
+  for (int i = 0; i < config.connections; i++)
+  {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0)
+    {
+      perror("Failed to create pipe");
+      exit(EXIT_FAILURE);
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+      perror("Fork failed");
+      exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+      // the connection only writes its samples, the pipes of the others are not its own
+      close(pipe_fds[0]);
+      for (int j = 0; j < i; j++)
+        close(inputs[j]);
+      exit(run_connection(i, pipe_fds[1]) == 0 ? 0 : EXIT_FAILURE);
+    }
+    close(pipe_fds[1]);
+    inputs[i] = pipe_fds[0];
+  }
+
+  int result = report_results(inputs, config.connections);
+
+  // reap the connection processes
+  while (wait(NULL) > 0)
+    ;
+  return result == 0 ? 0 : EXIT_FAILURE;
+}
+
+void parse_options(int argc, char *argv[])
+{
+  static struct option long_options[] = {
+      {"host", required_argument, NULL, 'H'},
+      {"port", required_argument, NULL, 'P'},
+      {"connections", required_argument, NULL, 'c'},
+      {"duration", required_argument, NULL, 'd'},
+      {"prefill", required_argument, NULL, 'p'},
+      {"mix", required_argument, NULL, 'x'},
+      {"types", required_argument, NULL, 't'},
+      {"sizes", required_argument, NULL, 's'},
+      {"seed", required_argument, NULL, 'r'},
+      {"label", required_argument, NULL, 'L'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int option;
+  while ((option = getopt_long(argc, argv, "H:P:c:d:p:x:t:s:r:L:", long_options, NULL)) != -1)
+  {
+    int valid = 1;
+    switch (option)
+    {
+    case 'H':
+      config.host = optarg;
+      break;
+    case 'P':
+      config.port = atoi(optarg);
+      break;
+    case 'c':
+      // one process per connection
+      config.connections = atoi(optarg);
+      valid = config.connections >= 1 && config.connections <= MAX_CONNECTIONS;
+      break;
+    case 'd':
+      config.duration = atof(optarg);
+      valid = config.duration > 0;
+      break;
+    case 'p':
+      // files uploaded before the mix starts, so dfile and rmfile have targets from the start
+      config.prefill = atoi(optarg);
+      break;
+    case 'x':
+      // e.g. ufile=40,dfile=40,rmfile=10,display=5,dtar=5
+      valid = parse_weights(optarg, op_names, BENCH_OPS, config.op_weights) == 0;
+      break;
+    case 't':
+      // e.g. c=20,txt=40,pdf=40
+      valid = parse_weights(optarg, type_names, BENCH_TYPES, config.type_weights) == 0;
+      break;
+    case 's':
+      // e.g. 4k:50,64k:30,1m:15,16m:5
+      valid = parse_sizes(optarg) == 0;
+      break;
+    case 'r':
+      config.seed = strtoul(optarg, NULL, 10);
+      break;
+    case 'L':
+      config.label = optarg;
+      break;
+    default:
+      valid = 0;
+    }
+    if (!valid)
+    {
+      fprintf(stderr, "Usage: %s [--host ip] [--port n] [--connections n] [--duration s] [--prefill n] [--mix op=weight,...] [--types type=weight,...] [--sizes size:weight,...] [--seed n] [--label name]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+int parse_weights(const char *list, const char *names[], int count, unsigned weights[])
+{
+  char copy[256];
+  snprintf(copy, sizeof(copy), "%s", list);
+  memset(weights, 0, count * sizeof(unsigned));
+
+  unsigned total = 0;
+  char *saveptr;
+  for (char *pair = strtok_r(copy, ",", &saveptr); pair != NULL; pair = strtok_r(NULL, ",", &saveptr))
+  {
+    char *equals = strchr(pair, '=');
+    if (equals == NULL)
+      return -1;
+    *equals = '\0';
+
+    int i = 0;
+    while (i < count && strcmp(names[i], pair) != 0)
+      i++;
+    if (i == count)
+    {
+      fprintf(stderr, "Unknown name in weights: %s\n", pair);
+      return -1;
+    }
+    weights[i] = strtoul(equals + 1, NULL, 10);
+    total += weights[i];
+  }
+  return total > 0 ? 0 : -1;
+}
+
+int parse_sizes(const char *list)
+{
+  char copy[256];
+  snprintf(copy, sizeof(copy), "%s", list);
+
+  config.size_count = 0;
+  char *saveptr;
+  for (char *pair = strtok_r(copy, ",", &saveptr); pair != NULL; pair = strtok_r(NULL, ",", &saveptr))
+  {
+    if (config.size_count == MAX_SIZES)
+      return -1;
+
+    char *end;
+    uint64_t size = strtoull(pair, &end, 10);
+    if (*end == 'k' || *end == 'K')
+      size *= 1024, end++;
+    else if (*end == 'm' || *end == 'M')
+      size *= 1024 * 1024, end++;
+    else if (*end == 'g' || *end == 'G')
+      size *= 1024ULL * 1024 * 1024, end++;
+    if (*end != ':')
+      return -1;
+
+    config.sizes[config.size_count].size = size;
+    config.sizes[config.size_count].weight = strtoul(end + 1, NULL, 10);
+    config.size_count++;
+  }
+  return config.size_count > 0 ? 0 : -1;
+}
+
+int connect_to_smain(void)
+{
+  int client_socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (client_socket < 0)
+  {
+    perror("Socket creation failed");
+    return -1;
+  }
+
+  struct sockaddr_in server_addr = {.sin_family = AF_INET, .sin_port = htons(config.port)};
+  server_addr.sin_addr.s_addr = inet_addr(config.host);
+  if (connect(client_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+  {
+    perror("Connection failed");
+    close(client_socket);
+    return -1;
+  }
+
+  // requests are small frames, do not let Nagle hold them back
+  int flag = 1;
+  setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+  return client_socket;
+}
+
+/* CONNECTIONS */
+
+static uint64_t now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Pick an index with probability proportional to its weight
+static int pick(struct connection *conn, const unsigned weights[], int count)
+{
+  unsigned total = 0;
+  for (int i = 0; i < count; i++)
+    total += weights[i];
+  unsigned choice = rand_r(&conn->random) % total;
+  for (int i = 0; i < count; i++)
+  {
+    if (choice < weights[i])
+      return i;
+    choice -= weights[i];
+  }
+  return count - 1;
+}
+
+static uint64_t pick_size(struct connection *conn)
+{
+  unsigned weights[MAX_SIZES];
+  for (int i = 0; i < config.size_count; i++)
+    weights[i] = config.sizes[i].weight;
+  return config.sizes[pick(conn, weights, config.size_count)].size;
+}
+
+static const char *make_content(void)
+{
+  uint64_t largest = 0;
+  for (int i = 0; i < config.size_count; i++)
+    if (config.sizes[i].size > largest)
+      largest = config.sizes[i].size;
+
+  // printable lines, so text files look like text to the servers
+  char *content = malloc(largest > 0 ? largest : 1);
+  if (content == NULL)
+    return NULL;
+  unsigned random = config.seed;
+  for (uint64_t i = 0; i < largest; i++)
+    content[i] = i % 64 == 63 ? '\n' : 'a' + rand_r(&random) % 26;
+  return content;
+}
+
+int run_connection(int number, int output)
+{
+  struct connection conn = {.number = number, .random = config.seed + number, .next_request_id = 1};
+  conn.content = make_content();
+  if (conn.content == NULL)
+  {
+    perror("Failed to allocate file content");
+    return -1;
+  }
+  conn.socket = connect_to_smain();
+  if (conn.socket < 0)
+    return -1;
+
+  // the mix starts with files to download and remove
+  for (unsigned i = 0; i < config.prefill; i++)
+  {
+    uint64_t bytes;
+    if (bench_ufile(&conn, &bytes) < 0)
+    {
+      fprintf(stderr, "Connection %d broke while uploading its first files\n", number);
+      return -1;
+    }
+  }
+
+  // the samples are buffered and written to the parent at the end, so the pipe never slows down the mix
+  size_t sample_count = 0, sample_capacity = 1024;
+  struct sample *samples = malloc(sample_capacity * sizeof(struct sample));
+  if (samples == NULL)
+    return -1;
+
+  uint64_t deadline = now_ns() + (uint64_t)(config.duration * 1e9);
+  while (now_ns() < deadline)
+  {
+    enum bench_op op = pick(&conn, config.op_weights, BENCH_OPS);
+    // downloads and removals need a file, an upload stands in while there is none
+    if ((op == BENCH_DFILE || op == BENCH_RMFILE) && conn.file_count == 0)
+      op = BENCH_UFILE;
+
+    uint64_t bytes = 0;
+    uint64_t start = now_ns();
+    int result = run_operation(&conn, op, &bytes);
+    uint64_t elapsed = now_ns() - start;
+
+    if (sample_count == sample_capacity)
+    {
+      sample_capacity *= 2;
+      struct sample *grown = realloc(samples, sample_capacity * sizeof(struct sample));
+      if (grown == NULL)
+        break;
+      samples = grown;
+    }
+    samples[sample_count++] = (struct sample){.op = op, .ok = result == 1, .bytes = bytes, .ns = elapsed};
+
+    if (result < 0)
+    {
+      fprintf(stderr, "Connection %d broke during %s\n", number, op_names[op]);
+      break;
+    }
+  }
+  close(conn.socket);
+
+  // a pipe write of a whole buffer may be split, write_all style
+  const char *p = (const char *)samples;
+  size_t remaining = sample_count * sizeof(struct sample);
+  while (remaining > 0)
+  {
+    ssize_t written = write(output, p, remaining);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      break;
+    p += written;
+    remaining -= written;
+  }
+  close(output);
+  free(samples);
+  return 0;
+}
+
+int run_operation(struct connection *conn, enum bench_op op, uint64_t *bytes)
+{
+  char args[BUFFER_SIZE];
+  switch (op)
+  {
+  case BENCH_UFILE:
+    return bench_ufile(conn, bytes);
+  case BENCH_DFILE:
+  {
+    struct remote_file *file = &conn->files[rand_r(&conn->random) % conn->file_count];
+    return bench_download(conn, OP_DFILE, file->path, bytes);
+  }
+  case BENCH_RMFILE:
+  {
+    size_t index = rand_r(&conn->random) % conn->file_count;
+    uint32_t request_id = conn->next_request_id++;
+    if (send_command(conn->socket, OP_RMFILE, request_id, conn->files[index].path) != 0)
+      return -1;
+    char response[BUFFER_SIZE];
+    int result = recv_result(conn->socket, response, sizeof(response));
+    // the file is gone either way as far as the mix is concerned
+    conn->files[index] = conn->files[--conn->file_count];
+    return result;
+  }
+  case BENCH_DISPLAY:
+    snprintf(args, sizeof(args), "%s/c%d", BENCH_DIRECTORY, conn->number);
+    return bench_download(conn, OP_DISPLAY, args, bytes);
+  case BENCH_DTAR:
+    return bench_download(conn, OP_DTAR, type_names[pick(conn, config.type_weights, BENCH_TYPES)], bytes);
+  case BENCH_OPS:
+    break;
+  }
+  return -1;
+}
+
+int bench_ufile(struct connection *conn, uint64_t *bytes)
+{
+  enum bench_type type = pick(conn, config.type_weights, BENCH_TYPES);
+  uint64_t size = pick_size(conn);
+
+  char name[64], destination[96];
+  snprintf(name, sizeof(name), "f%u.%s", conn->uploaded++, type_names[type]);
+  snprintf(destination, sizeof(destination), "%s/c%d", BENCH_DIRECTORY, conn->number);
+
+  // a plain upload, the command frame followed by the data frame, in a single round trip
+  char args[BUFFER_SIZE];
+  snprintf(args, sizeof(args), "%s %s", name, destination);
+  uint32_t request_id = conn->next_request_id++;
+  if (send_command(conn->socket, OP_UFILE, request_id, args) != 0 ||
+      send_frame(conn->socket, OP_DATA, 0, request_id, conn->content, size) != 0)
+    return -1;
+
+  char response[BUFFER_SIZE];
+  int result = recv_result(conn->socket, response, sizeof(response));
+  *bytes = size;
+  if (result != 1)
+    return result;
+
+  if (conn->file_count == conn->file_capacity)
+  {
+    size_t capacity = conn->file_capacity > 0 ? conn->file_capacity * 2 : 64;
+    struct remote_file *files = realloc(conn->files, capacity * sizeof(struct remote_file));
+    if (files == NULL)
+      return 1;
+    conn->files = files;
+    conn->file_capacity = capacity;
+  }
+  struct remote_file *file = &conn->files[conn->file_count++];
+  snprintf(file->path, sizeof(file->path), "%s/%s", destination, name);
+  file->size = size;
+  return 1;
+}
+
+int bench_download(struct connection *conn, uint8_t opcode, const char *args, uint64_t *bytes)
+{
+  uint32_t request_id = conn->next_request_id++;
+  if (send_command(conn->socket, opcode, request_id, args) != 0)
+    return -1;
+
+  char response[BUFFER_SIZE];
+  uint64_t length;
+  int frame = recv_data_header(conn->socket, &length, response, sizeof(response));
+  if (frame <= 0)
+    return frame;
+
+  // a body of known length, or chunks up to the zero length one; the bytes are only counted
+  *bytes = 0;
+  while (1)
+  {
+    if (discard_payload(conn->socket, length) != 0)
+      return -1;
+    *bytes += length;
+    if (frame == 1 || length == 0)
+      break;
+    frame = recv_data_header(conn->socket, &length, response, sizeof(response));
+    if (frame <= 0)
+      return frame;
+  }
+  return recv_result(conn->socket, response, sizeof(response));
+}
+
+/* RESULTS */
+
+static int compare_latency(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Nearest rank percentile of sorted latencies, in microseconds
+static double percentile(const uint64_t *sorted, size_t count, double q)
+{
+  if (count == 0)
+    return 0;
+  size_t rank = (size_t)(q * count);
+  if (rank >= count)
+    rank = count - 1;
+  return sorted[rank] / 1000.0;
+}
+
+static void print_row(const char *name, uint64_t *latencies, size_t count, size_t errors, uint64_t bytes)
+{
+  qsort(latencies, count, sizeof(uint64_t), compare_latency);
+  uint64_t total_ns = 0;
+  for (size_t i = 0; i < count; i++)
+    total_ns += latencies[i];
+
+  // every connection runs for the whole duration, so the rates are per second of the run
+  printf("%s\t%s\t%zu\t%zu\t%.1f\t%.3f\t%.0f\t%.0f\t%.0f\t%.0f\n", config.label, name, count, errors,
+         count / config.duration, bytes / 1e6 / config.duration, count > 0 ? total_ns / 1000.0 / count : 0,
+         percentile(latencies, count, 0.5), percentile(latencies, count, 0.99), percentile(latencies, count, 0.999));
+}
+
+int report_results(int inputs[], int count)
+{
+  size_t sample_count = 0, sample_capacity = 4096;
+  struct sample *samples = malloc(sample_capacity * sizeof(struct sample));
+  if (samples == NULL)
+    return -1;
+
+  // read every pipe to its end, a connection blocks on its write until its turn comes
+  for (int i = 0; i < count; i++)
+  {
+    // a read may end in the middle of a sample, its first bytes are kept until the rest arrives
+    size_t partial = 0;
+    while (1)
+    {
+      if (sample_count == sample_capacity)
+      {
+        sample_capacity *= 2;
+        struct sample *grown = realloc(samples, sample_capacity * sizeof(struct sample));
+        if (grown == NULL)
+          break;
+        samples = grown;
+      }
+      ssize_t bytes_read = read(inputs[i], (char *)&samples[sample_count] + partial,
+                                (sample_capacity - sample_count) * sizeof(struct sample) - partial);
+      if (bytes_read < 0 && errno == EINTR)
+        continue;
+      if (bytes_read <= 0)
+        break;
+      partial += bytes_read;
+      sample_count += partial / sizeof(struct sample);
+      partial %= sizeof(struct sample);
+    }
+    close(inputs[i]);
+  }
+
+  if (sample_count == 0)
+  {
+    fprintf(stderr, "No operation completed\n");
+    free(samples);
+    return -1;
+  }
+
+  // the run's parameters first, as comments, then one row per operation and the total
+  printf("# label %s\n# connections %d\n# duration %.1f\n# seed %u\n", config.label, config.connections,
+         config.duration, config.seed);
+  printf("# mix");
+  for (int op = 0; op < BENCH_OPS; op++)
+    printf(" %s=%u", op_names[op], config.op_weights[op]);
+  printf("\n# types");
+  for (int type = 0; type < BENCH_TYPES; type++)
+    printf(" %s=%u", type_names[type], config.type_weights[type]);
+  printf("\n# sizes");
+  for (int i = 0; i < config.size_count; i++)
+    printf(" %llu:%u", (unsigned long long)config.sizes[i].size, config.sizes[i].weight);
+  printf("\nlabel\top\tcount\terrors\tops_per_s\tmb_per_s\tmean_us\tp50_us\tp99_us\tp999_us\n");
+
+  uint64_t *latencies = malloc(sample_count * sizeof(uint64_t));
+  if (latencies == NULL)
+  {
+    free(samples);
+    return -1;
+  }
+  for (int op = 0; op <= BENCH_OPS; op++)
+  {
+    // the last row covers every operation
+    size_t found = 0, errors = 0;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < sample_count; i++)
+    {
+      if (op < BENCH_OPS && samples[i].op != op)
+        continue;
+      latencies[found++] = samples[i].ns;
+      errors += !samples[i].ok;
+      bytes += samples[i].bytes;
+    }
+    if (found > 0 || op == BENCH_OPS)
+      print_row(op < BENCH_OPS ? op_names[op] : "total", latencies, found, errors, bytes);
+  }
+
+  free(latencies);
+  free(samples);
+  return 0;
+}
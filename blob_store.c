@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "compress.h"
+#include "blob_store.h"
+
+int blob_store_enabled = 0;
+
+static char blob_dir[PATH_MAX / 4];
+
+static unsigned temp_counter; // Numbers the temporary files of this process
+
+/* PATHS */
+
+static void object_path(char *path, size_t size, const char *hex)
+{
+  snprintf(path, size, "%s/objects/%s", blob_dir, hex);
+}
+
+static void inode_path(char *path, size_t size, ino_t inode)
+{
+  snprintf(path, size, "%s/inodes/%llu", blob_dir, (unsigned long long)inode);
+}
+
+static int valid_hex(const char *hex)
+{
+  if (strlen(hex) != SHA256_HEX_SIZE)
+    return 0;
+  for (const char *p = hex; *p != '\0'; p++)
+    if (!isxdigit((unsigned char)*p) || isupper((unsigned char)*p))
+      return 0;
+  return 1;
+}
+
+/* LOCKING */
+
+// Links and unlinks of objects are serialised across processes, the lock file is opened by each process itself
+static int lock_blobs(void)
+{
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/lock", blob_dir);
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd >= 0 && flock(fd, LOCK_EX) != 0)
+  {
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0)
+    perror("Failed to lock blob store");
+  return fd;
+}
+
+static void unlock_blobs(int fd)
+{
+  close(fd);
+}
+
+/* SETUP */
+
+static int make_dir(const char *path)
+{
+  if (mkdir(path, 0755) != 0 && errno != EEXIST)
+  {
+    perror("Failed to create blob directory");
+    return -1;
+  }
+  return 0;
+}
+
+int blob_store_init(const char *dir)
+{
+  snprintf(blob_dir, sizeof(blob_dir), "%s", dir);
+
+  // create every component of the blob directory, then its parts
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s", dir);
+  for (char *p = path + 1; *p != '\0'; p++)
+  {
+    if (*p != '/')
+      continue;
+    *p = '\0';
+    mkdir(path, 0755);
+    *p = '/';
+  }
+  if (make_dir(path) != 0)
+    return -1;
+  const char *parts[] = {"objects", "inodes", "tmp"};
+  for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+  {
+    snprintf(path, sizeof(path), "%s/%s", dir, parts[i]);
+    if (make_dir(path) != 0)
+      return -1;
+  }
+
+  // uploads interrupted by an earlier run are not resumed
+  snprintf(path, sizeof(path), "%s/tmp", dir);
+  DIR *temp_dir = opendir(path);
+  if (temp_dir == NULL)
+    return -1;
+  struct dirent *entry;
+  while ((entry = readdir(temp_dir)) != NULL)
+  {
+    if (entry->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/tmp/%s", dir, entry->d_name);
+    unlink(path);
+  }
+  closedir(temp_dir);
+  return 0;
+}
+
+void blob_store_temp_path(char *path, size_t size)
+{
+  snprintf(path, size, "%s/tmp/%d.%u", blob_dir, (int)getpid(), temp_counter++);
+}
+
+int blob_store_hash_range(int fd, uint64_t offset, uint64_t length, struct sha256 *hash)
+{
+  char buffer[64 * 1024];
+  while (length > 0)
+  {
+    ssize_t bytes_read = pread(fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), offset);
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0)
+      return -1;
+    sha256_update(hash, buffer, bytes_read);
+    offset += bytes_read;
+    length -= bytes_read;
+  }
+  return 0;
+}
+
+/* REFERENCES */
+
+// Remove the object of a file the store no longer references, the caller holds the lock
+static void release_object(int fd)
+{
+  // the object name is the last link of an unreferenced object
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_nlink != 1)
+    return;
+
+  char inode[PATH_MAX], hex[SHA256_HEX_SIZE + 1];
+  inode_path(inode, sizeof(inode), file_stat.st_ino);
+  ssize_t length = readlink(inode, hex, sizeof(hex) - 1);
+  if (length != SHA256_HEX_SIZE)
+    return;
+  hex[length] = '\0';
+
+  char object[PATH_MAX];
+  struct stat object_stat;
+  object_path(object, sizeof(object), hex);
+  if (stat(object, &object_stat) == 0 && object_stat.st_ino == file_stat.st_ino && object_stat.st_dev == file_stat.st_dev)
+  {
+    unlink(object);
+    unlink(inode);
+  }
+}
+
+// Link a path of the store to an object, replacing the path atomically, the caller holds the lock
+static int link_object(const char *object, const char *file_path)
+{
+  char temp_link[PATH_MAX];
+  blob_store_temp_path(temp_link, sizeof(temp_link));
+  if (link(object, temp_link) != 0)
+    return -1;
+
+  // the content the path held before loses a reference
+  int old_fd = open(file_path, O_RDONLY | O_CLOEXEC);
+  int result = rename(temp_link, file_path);
+  // renaming a link over another link of the same file leaves both in place
+  unlink(temp_link);
+  if (old_fd >= 0)
+  {
+    if (result == 0)
+      release_object(old_fd);
+    close(old_fd);
+  }
+  return result;
+}
+
+int blob_store_commit(const char *temp_path, const unsigned char digest[SHA256_DIGEST_SIZE], const char *file_path)
+{
+  if (!blob_store_enabled)
+  {
+    if (rename(temp_path, file_path) != 0)
+    {
+      perror("Failed to store upload");
+      return -1;
+    }
+    return 0;
+  }
+
+  char hex[SHA256_HEX_SIZE + 1], object[PATH_MAX];
+  sha256_hex(digest, hex);
+  object_path(object, sizeof(object), hex);
+
+  int lock = lock_blobs();
+  if (lock < 0)
+    return -1;
+
+  // the upload becomes the object unless the content is stored already
+  int result = -1;
+  if (link(temp_path, object) == 0)
+  {
+    struct stat object_stat;
+    char inode[PATH_MAX];
+    if (stat(object, &object_stat) == 0)
+    {
+      inode_path(inode, sizeof(inode), object_stat.st_ino);
+      unlink(inode);
+      if (symlink(hex, inode) != 0)
+        perror("Failed to record blob inode");
+    }
+    result = 0;
+  }
+  else if (errno == EEXIST)
+    result = 0;
+
+  if (result == 0)
+    result = link_object(object, file_path);
+  if (result != 0)
+    perror("Failed to store upload");
+  unlink(temp_path);
+  unlock_blobs(lock);
+  return result;
+}
+
+int blob_store_link(const char *hex, uint64_t file_size, const char *file_path)
+{
+  if (!blob_store_enabled || !valid_hex(hex))
+    return 0;
+
+  char object[PATH_MAX];
+  object_path(object, sizeof(object), hex);
+
+  int lock = lock_blobs();
+  if (lock < 0)
+    return -1;
+
+  // only content of the size the client announced counts as known, an object may be packed at rest
+  int result = 0;
+  int fd = open(object, O_RDONLY | O_CLOEXEC);
+  uint64_t size;
+  if (fd >= 0 && compress_content_size(fd, &size) >= 0 && size == file_size)
+    result = link_object(object, file_path) == 0 ? 1 : -1;
+  if (fd >= 0)
+    close(fd);
+  unlock_blobs(lock);
+  return result;
+}
+
+int blob_store_remove(const char *file_path)
+{
+  int lock = blob_store_enabled ? lock_blobs() : -1;
+  if (blob_store_enabled && lock < 0)
+    return -1;
+
+  // keep the file open across the unlink, to find out whether its object lost its last reference
+  int fd = blob_store_enabled ? open(file_path, O_RDONLY | O_CLOEXEC) : -1;
+  int result = remove(file_path);
+  if (fd >= 0)
+  {
+    if (result == 0)
+      release_object(fd);
+    close(fd);
+  }
+
+  if (lock >= 0)
+    unlock_blobs(lock);
+  return result == 0 ? 0 : -1;
+}
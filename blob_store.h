@@ -0,0 +1,98 @@
+#ifndef BLOB_STORE_H
+#define BLOB_STORE_H
+
+#include <stdint.h>
+
+#include "sha256.h"
+
+/*
+ * Content-addressed, deduplicated storage for Stext and Spdf, enabled with --dedup.
+ *
+ * Every distinct file content is stored once, as an object named after its
+ * SHA-256 under the blob directory, and every path of the store holding that
+ * content is a hard link to the object. The link count of an object is its
+ * reference count: ufile links a path to the object, rmfile or a ufile
+ * replacing the path unlinks it, and the object is removed once the object
+ * name is its last link. A table of symbolic links from inode number to
+ * object name lets a removal find the object without hashing the file again.
+ *
+ * Uploads are received into a temporary file next to the objects and hashed
+ * as the bytes arrive; once complete, the temporary file becomes the object,
+ * or is dropped if an object with the same content exists. A client that
+ * sends the hash of a file first (ulink) stores known content without
+ * sending its body. A server with the store enabled lists BLOB_STORE_CAPABILITY
+ * in the result of uresume, so clients only hash and link files for servers
+ * that deduplicate. Store paths are always replaced, never written in place,
+ * so one upload cannot change the content behind another path.
+ */
+
+// Word a server lists in the result of uresume when it deduplicates uploads
+#define BLOB_STORE_CAPABILITY "dedup"
+
+/**
+ * @brief Whether uploads are deduplicated, set with --dedup.
+ */
+extern int blob_store_enabled;
+
+/**
+ * @brief Set up the blob directory, to be called before the server forks.
+ *
+ * Temporary files left by an earlier run are removed.
+ *
+ * @param blob_dir The blob directory, on the same file system as the store.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int blob_store_init(const char *blob_dir);
+
+/**
+ * @brief Get a new path for a temporary file an upload is received into.
+ *
+ * @param path The buffer to store the path.
+ * @param size The size of the path buffer.
+ */
+void blob_store_temp_path(char *path, size_t size);
+
+/**
+ * @brief Hash a range of a file.
+ *
+ * @param fd The file.
+ * @param offset The offset the range starts at.
+ * @param length The length of the range.
+ * @param hash The hash the range is added to.
+ * @return int Returns 0 on success, -1 if the range cannot be read.
+ */
+int blob_store_hash_range(int fd, uint64_t offset, uint64_t length, struct sha256 *hash);
+
+/**
+ * @brief Move a complete upload into the store.
+ *
+ * With deduplication the upload becomes the object of its content, or is
+ * removed if the object exists, and the path is linked to the object;
+ * otherwise the upload is renamed to the path.
+ *
+ * @param temp_path The complete upload.
+ * @param digest The SHA-256 of the upload, unused without deduplication.
+ * @param file_path The path in the store, replaced if it exists.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int blob_store_commit(const char *temp_path, const unsigned char digest[SHA256_DIGEST_SIZE], const char *file_path);
+
+/**
+ * @brief Link a path of the store to the object of known content.
+ *
+ * @param hex The hexadecimal SHA-256 of the content.
+ * @param file_size The size of the content.
+ * @param file_path The path in the store, replaced if it exists.
+ * @return int Returns 1 if the path was linked, 0 if the content is unknown, -1 on failure.
+ */
+int blob_store_link(const char *hex, uint64_t file_size, const char *file_path);
+
+/**
+ * @brief Remove a path of the store, and the object it referenced if it was the last reference.
+ *
+ * @param file_path The path in the store.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int blob_store_remove(const char *file_path);
+
+#endif
@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "checksum.h"
+
+// Reflected CRC32C polynomial
+#define CRC32C_POLY 0x82F63B78U
+
+// Bytes read at a time to checksum a file
+#define CHECKSUM_READ_SIZE (256 * 1024)
+
+// Content of the extended attribute, in host byte order
+struct stored_checksum
+{
+  uint32_t crc;
+  uint32_t reserved; // Zero, so the value has no padding
+  uint64_t size;     // Size and modification time of the file the checksum was computed for
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+static uint32_t (*crc32c_run)(uint32_t crc, const unsigned char *p, size_t length);
+static const char *crc32c_name;
+static uint32_t crc32c_table[8][256];
+
+/* IMPLEMENTATIONS */
+
+// Slicing by 8, eight bytes per step through eight tables
+static uint32_t crc32c_tables(uint32_t crc, const unsigned char *p, size_t length)
+{
+  while (length > 0 && ((uintptr_t)p & 7) != 0)
+  {
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    length--;
+  }
+  while (length >= 8)
+  {
+    uint32_t low = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+    uint32_t high = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+    crc = crc32c_table[7][low & 0xff] ^ crc32c_table[6][(low >> 8) & 0xff] ^ crc32c_table[5][(low >> 16) & 0xff] ^
+          crc32c_table[4][low >> 24] ^ crc32c_table[3][high & 0xff] ^ crc32c_table[2][(high >> 8) & 0xff] ^
+          crc32c_table[1][(high >> 16) & 0xff] ^ crc32c_table[0][high >> 24];
+    p += 8;
+    length -= 8;
+  }
+  while (length-- > 0)
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+static void build_tables(void)
+{
+  for (uint32_t i = 0; i < 256; i++)
+  {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+    crc32c_table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; i++)
+    for (int slice = 1; slice < 8; slice++)
+      crc32c_table[slice][i] = crc32c_table[0][crc32c_table[slice - 1][i] & 0xff] ^ (crc32c_table[slice - 1][i] >> 8);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t length)
+{
+  while (length > 0 && ((uintptr_t)p & 7) != 0)
+  {
+    crc = _mm_crc32_u8(crc, *p++);
+    length--;
+  }
+  uint64_t wide = crc;
+  while (length >= 8)
+  {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    wide = _mm_crc32_u64(wide, word);
+    p += 8;
+    length -= 8;
+  }
+  crc = (uint32_t)wide;
+  while (length-- > 0)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char *p, size_t length)
+{
+  while (length > 0 && ((uintptr_t)p & 7) != 0)
+  {
+    crc = __crc32cb(crc, *p++);
+    length--;
+  }
+  while (length >= 8)
+  {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    crc = __crc32cd(crc, word);
+    p += 8;
+    length -= 8;
+  }
+  while (length-- > 0)
+    crc = __crc32cb(crc, *p++);
+  return crc;
+}
+#endif
+
+// Pick the fastest implementation the processor runs, once per process
+static void select_implementation(void)
+{
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2"))
+  {
+    crc32c_name = "sse4.2";
+    crc32c_run = crc32c_sse42;
+    return;
+  }
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+  crc32c_name = "armv8";
+  crc32c_run = crc32c_armv8;
+  return;
+#endif
+  build_tables();
+  crc32c_name = "table";
+  crc32c_run = crc32c_tables;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+  if (crc32c_run == NULL)
+    select_implementation();
+  return ~crc32c_run(~crc, data, length);
+}
+
+const char *crc32c_implementation(void)
+{
+  if (crc32c_run == NULL)
+    select_implementation();
+  return crc32c_name;
+}
+
+/* TRAILERS */
+
+int frame_content_length(const struct frame_header *data, uint64_t *length)
+{
+  *length = data->payload_length;
+  if (!(data->flags & FRAME_FLAG_CHECKSUM))
+    return 0;
+  if (data->payload_length < CHECKSUM_SIZE)
+  {
+    fprintf(stderr, "Data frame too short for its checksum\n");
+    return -1;
+  }
+  *length -= CHECKSUM_SIZE;
+  return 1;
+}
+
+int send_checksum(int socket, uint32_t crc)
+{
+  uint32_t trailer = htonl(crc);
+  return send_all(socket, &trailer, sizeof(trailer), 0);
+}
+
+int recv_checksum(int socket, uint32_t crc)
+{
+  uint32_t trailer;
+  if (recv_all(socket, &trailer, sizeof(trailer)) != 1)
+    return -1;
+  if (ntohl(trailer) != crc)
+  {
+    fprintf(stderr, "Checksum mismatch: received %08x, computed %08x\n", ntohl(trailer), crc);
+    return 0;
+  }
+  return 1;
+}
+
+int recv_file_checksum(int socket, const char *file_path, int received, uint32_t crc)
+{
+  // the trailer is taken off the stream even after a failure, so it stays framed
+  int check = recv_checksum(socket, crc);
+  if (received != 1 || check < 0)
+    return -1;
+  if (check == 0)
+  {
+    remove(file_path);
+    return -1;
+  }
+  checksum_save(file_path, crc);
+  return 1;
+}
+
+int send_checked_frame(int socket, uint32_t flags, uint32_t request_id, const void *data, uint64_t length)
+{
+  if (send_frame_header(socket, OP_DATA, flags | FRAME_FLAG_CHECKSUM, request_id, length + CHECKSUM_SIZE) != 0 ||
+      send_all(socket, data, length, MSG_MORE) != 0)
+    return -1;
+  return send_checksum(socket, crc32c(0, data, length));
+}
+
+/* STORED CHECKSUMS */
+
+int checksum_read(int fd, uint64_t offset, uint64_t length, uint32_t *crc)
+{
+  static unsigned char *buffer;
+  if (buffer == NULL && (buffer = malloc(CHECKSUM_READ_SIZE)) == NULL)
+    return -1;
+
+  *crc = 0;
+  while (length > 0)
+  {
+    ssize_t bytes_read = pread(fd, buffer, length < CHECKSUM_READ_SIZE ? length : CHECKSUM_READ_SIZE, offset);
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0)
+    {
+      perror("Failed to read file to checksum");
+      return -1;
+    }
+    *crc = crc32c(*crc, buffer, bytes_read);
+    offset += bytes_read;
+    length -= bytes_read;
+  }
+  return 0;
+}
+
+static int stored_for(const struct stored_checksum *stored, const struct stat *st)
+{
+  return stored->size == (uint64_t)st->st_size && stored->mtime_sec == st->st_mtim.tv_sec &&
+         stored->mtime_nsec == st->st_mtim.tv_nsec;
+}
+
+int checksum_file(int fd, struct byte_range range, uint32_t *crc)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    return -1;
+  if (range.offset != 0 || range.length != (uint64_t)st.st_size)
+    return checksum_read(fd, range.offset, range.length, crc);
+
+  struct stored_checksum stored;
+  if (fgetxattr(fd, CHECKSUM_XATTR, &stored, sizeof(stored)) == sizeof(stored) && stored_for(&stored, &st))
+  {
+    *crc = stored.crc;
+    return 0;
+  }
+
+  // the file was written without a checksum, or changed since, it is read once and its checksum kept
+  if (checksum_read(fd, 0, st.st_size, crc) != 0)
+    return -1;
+  stored = (struct stored_checksum){
+      .crc = *crc, .size = st.st_size, .mtime_sec = st.st_mtim.tv_sec, .mtime_nsec = st.st_mtim.tv_nsec};
+  if (fsetxattr(fd, CHECKSUM_XATTR, &stored, sizeof(stored), 0) != 0 && errno != ENOTSUP && errno != EACCES &&
+      errno != EPERM)
+    perror("Failed to store checksum");
+  return 0;
+}
+
+void checksum_save(const char *path, uint32_t crc)
+{
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return;
+  struct stored_checksum stored = {
+      .crc = crc, .size = st.st_size, .mtime_sec = st.st_mtim.tv_sec, .mtime_nsec = st.st_mtim.tv_nsec};
+  if (setxattr(path, CHECKSUM_XATTR, &stored, sizeof(stored), 0) != 0 && errno != ENOTSUP)
+    perror("Failed to store checksum");
+}
@@ -0,0 +1,155 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "protocol.h"
+
+/*
+ * CRC32C integrity checks of the bodies on the wire and of the files at rest.
+ *
+ * A data frame flagged FRAME_FLAG_CHECKSUM ends with a checksum trailer: the
+ * CRC32C (Castagnoli) of the payload bytes before it, 4 bytes in network byte
+ * order, counted in the payload length. Every chunk of a chunked body carries
+ * a trailer of its own, so a resumable upload checks each chunk before it is
+ * committed; the zero length chunk ending a body carries none. Compressed
+ * chunks are never flagged, inflating them checks the Adler-32 of their zlib
+ * stream. The sender computes the checksum while it sends and the receiver
+ * while it receives, and a receiver that finds a mismatch fails the request
+ * instead of acknowledging it. A relay passes the frames on untouched.
+ *
+ * Uploads are flagged by the client. A download is flagged when the client
+ * appends the CHECKSUM_CAPABILITY word to the arguments of dfile or dtar;
+ * frames without the flag are taken as before, unchecked.
+ *
+ * The checksum of a stored file is kept in its CHECKSUM_XATTR extended
+ * attribute together with the size and modification time it was computed
+ * for, set when an upload is committed with a checksum known for the whole
+ * file, or else by the first checked download. A file sent through the
+ * zero-copy transmit path is then never read to be checked; a stored
+ * checksum that no longer matches the size or modification time of its file
+ * is computed again. The segment store keeps the checksum of every file in
+ * its index instead. File systems without user extended attributes compute
+ * the checksum on every checked download.
+ *
+ * CRC32C is computed with the SSE4.2 crc32 instruction on x86-64 processors
+ * that have it, with the CRC extension on ARMv8, and with tables otherwise.
+ */
+
+// Size of the checksum trailer of a data frame
+#define CHECKSUM_SIZE 4
+
+// Word a client appends to a download request to have its data frames checked
+#define CHECKSUM_CAPABILITY "crc32c"
+
+// Extended attribute holding the checksum of a stored file
+#define CHECKSUM_XATTR "user.crc32c"
+
+/**
+ * @brief Extend a CRC32C over more bytes.
+ *
+ * @param crc The CRC32C of the bytes before, 0 to start.
+ * @param data The bytes.
+ * @param length The number of bytes.
+ * @return uint32_t The CRC32C of all the bytes so far.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+/**
+ * @brief Get the name of the CRC32C implementation this processor runs.
+ *
+ * @return const char* "sse4.2", "armv8" or "table".
+ */
+const char *crc32c_implementation(void);
+
+/**
+ * @brief Get the length of the content a data frame carries, without its checksum trailer.
+ *
+ * @param data The header of the data frame.
+ * @param length Set to the length of the content.
+ * @return int Returns 1 if a checksum trailer follows the content, 0 if there is none, -1 if the frame is too short
+ *             to hold one.
+ */
+int frame_content_length(const struct frame_header *data, uint64_t *length);
+
+/**
+ * @brief Send the checksum trailer of a data frame whose content was sent.
+ *
+ * @param socket The socket to send on.
+ * @param crc The CRC32C of the content.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int send_checksum(int socket, uint32_t crc);
+
+/**
+ * @brief Receive the checksum trailer of a data frame whose content was received, and check it.
+ *
+ * @param socket The socket to receive from.
+ * @param crc The CRC32C of the content as received.
+ * @return int Returns 1 if the checksums match, 0 on a mismatch, -1 on socket error.
+ */
+int recv_checksum(int socket, uint32_t crc);
+
+/**
+ * @brief Receive the checksum trailer of a file received from a data frame, and check the file against it.
+ *
+ * A file that matches keeps its checksum, see checksum_save; one that does not is removed.
+ *
+ * @param socket The socket to receive from.
+ * @param file_path The file the content was written to.
+ * @param received 1 if the content was received and written whole, -1 if it failed, its bytes drained from the
+ *                 socket unless the connection broke.
+ * @param crc The CRC32C of the content as received.
+ * @return int Returns 1 if the file was received and matches its checksum, -1 otherwise.
+ */
+int recv_file_checksum(int socket, const char *file_path, int received, uint32_t crc);
+
+/**
+ * @brief Send a data frame holding a buffer, flagged FRAME_FLAG_CHECKSUM and followed by its checksum trailer.
+ *
+ * @param socket The socket to send on.
+ * @param flags The other flags of the frame, e.g. FRAME_FLAG_CHUNKED.
+ * @param request_id The request id the frame belongs to.
+ * @param data The content of the frame.
+ * @param length The length of the content.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int send_checked_frame(int socket, uint32_t flags, uint32_t request_id, const void *data, uint64_t length);
+
+/**
+ * @brief Compute the CRC32C of bytes of a file by reading them.
+ *
+ * @param fd The file.
+ * @param offset The offset of the first byte.
+ * @param length The number of bytes.
+ * @param crc Set to the CRC32C of the bytes.
+ * @return int Returns 0 on success, -1 if the file could not be read.
+ */
+int checksum_read(int fd, uint64_t offset, uint64_t length, uint32_t *crc);
+
+/**
+ * @brief Get the CRC32C of a byte range of a stored file, as sent through the zero-copy transmit path.
+ *
+ * The checksum of the whole file is taken from its extended attribute, or
+ * computed and stored there if it has none; other ranges are read.
+ *
+ * @param fd The file.
+ * @param range The byte range, fitted to the file.
+ * @param crc Set to the CRC32C of the range.
+ * @return int Returns 0 on success, -1 if the file could not be read.
+ */
+int checksum_file(int fd, struct byte_range range, uint32_t *crc);
+
+/**
+ * @brief Store the CRC32C of the whole content of a file in its extended attribute.
+ *
+ * A file system without extended attributes leaves the checksum to be
+ * computed when it is needed, this is not a failure.
+ *
+ * @param path The file.
+ * @param crc The CRC32C of its content.
+ */
+void checksum_save(const char *path, uint32_t crc);
+
+#endif
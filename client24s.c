@@ -2,8 +2,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <signal.h>
+#include <time.h>
 #include <arpa/inet.h>
-#include <sys/socket.h>`
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "protocol.h"
+#include "sha256.h"
+#include "compress.h"
+#include "delta.h"
+#include "checksum.h"
+#include "blob_store.h"
 
 #define DEBUG 1
 
@@ -15,12 +30,65 @@
 
 #define BUFFER_SIZE 1024
 
+// Size of the chunks an upload is sent in, an interrupted upload resumes after its last whole chunk
+#define UPLOAD_CHUNK_SIZE (1024 * 1024)
+
+// Size of the reads and writes of file contents
+#define TRANSFER_BUFFER_SIZE (256 * 1024)
+
+// Largest number of connections an upload is striped over, as accepted by the servers
+#define MAX_STREAMS 64
+
+// Largest number of words in a command, the sources of a batch included
+#define MAX_ARGS 128
+
+/**
+ * @brief Progress of one stripe of a striped upload, shared between the client and the process sending the stripe.
+ */
+struct stripe_status
+{
+  uint64_t bytes_sent;         // Bytes of the stripe the server has or was sent
+  char response[BUFFER_SIZE]; // Result message of the stripe
+};
+
+/**
+ * @brief A request of a batch.
+ */
+struct batch_item
+{
+  uint8_t opcode;      // OP_UFILE, OP_DFILE or OP_RMFILE
+  uint32_t request_id; // Request id of the item within the batch
+  char path[512];      // Local file of an upload, remote file of a download or removal
+  int result;          // 1 if the server completed the item, 0 otherwise
+  char message[128];   // Status message of the item
+};
+
+/**
+ * @brief The requests a batch command expands to.
+ */
+struct batch
+{
+  struct batch_item *items;
+  size_t count;
+  size_t capacity;
+};
+
+/**
+ * @brief Connects to the Smain server.
+ *
+ * @return int The connected socket, or -1 on failure.
+ */
+int connect_to_smain(void);
+
 /**
  * @brief Communicates with the server using the specified socket.
  *
  * @param socket The socket to communicate with the server.
+ * @param input The stream commands are read from, up to "exit" or its end.
+ * @param interactive Whether to prompt for commands, a script has its commands echoed instead.
+ * @return int Returns the number of commands that failed.
  */
-void communicate_with_server(int socket);
+int communicate_with_server(int socket, FILE *input, int interactive);
 
 /**
  * @brief Processes the command by sending it to the server and receiving the response.
@@ -28,88 +96,367 @@ void communicate_with_server(int socket);
  * @param socket The socket to communicate with the server.
  * @param cmd_str The command string to process.
  * @param response The response received from the server.
+ * @return int Returns 1 if the command succeeded, 0 if the server rejected it, -1 otherwise.
+ */
+int process_command(int socket, char *cmd_str, char *response);
+
+/**
+ * @brief Adds a request to a batch.
+ *
+ * @param batch The batch.
+ * @param opcode The command of the request.
+ * @param path The local file of an upload, or the remote file of a download or removal.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int add_batch_item(struct batch *batch, uint8_t opcode, const char *path);
+
+/**
+ * @brief Adds an upload of every local file matching a glob pattern to a batch.
+ *
+ * @param batch The batch.
+ * @param pattern The local file, or a glob pattern.
+ * @return int Returns the number of files added, -1 on failure.
+ */
+int add_local_files(struct batch *batch, const char *pattern);
+
+/**
+ * @brief Adds a request for every remote file matching a glob pattern to a batch, as listed by display.
+ *
+ * @param server_socket The socket to communicate with the server.
+ * @param batch The batch.
+ * @param opcode The command of the requests, OP_DFILE or OP_RMFILE.
+ * @param pattern The remote file, or a glob pattern; a * does not match a /.
+ * @param response The result message if the files cannot be listed.
+ * @return int Returns the number of files added, -1 on failure.
+ */
+int add_remote_files(int server_socket, struct batch *batch, uint8_t opcode, const char *pattern, char *response);
+
+/**
+ * @brief Sends the requests of a batch, as written by a separate process while the replies are read.
+ *
+ * @param server_socket The socket to communicate with the server.
+ * @param batch The batch.
+ * @param batch_id The request id of the batch.
+ * @param destination_path The destination path of the uploads on the server, NULL if there are none.
+ * @return int Returns 0 if every request was sent, -1 otherwise.
+ */
+int send_batch_requests(int server_socket, const struct batch *batch, uint32_t batch_id, const char *destination_path);
+
+/**
+ * @brief Runs a batch as one request and prints the status of every item.
+ *
+ * Downloads are saved in the current directory as they arrive.
+ *
+ * @param server_socket The socket to communicate with the server.
+ * @param batch The batch.
+ * @param destination_path The destination path of the uploads on the server, NULL if there are none.
+ * @param response The result message of the batch.
+ * @return int Returns 1 if every item succeeded, 0 if some failed, -1 otherwise.
+ */
+int run_batch(int server_socket, struct batch *batch, const char *destination_path, char *response);
+
+/**
+ * @brief Name a resumable upload after the file and where it goes, so re-running ufile for an unchanged file resumes it.
+ *
+ * @param upload_id The buffer to store the upload id, at least 17 bytes.
+ * @param file_name The name of the file.
+ * @param destination_path The destination path on the server.
+ * @param file_stat The status of the file.
+ */
+void make_upload_id(char *upload_id, const char *file_name, const char *destination_path, const struct stat *file_stat,
+                    unsigned stripes);
+
+/**
+ * @brief Hashes a whole file with SHA-256.
+ *
+ * @param file The file to hash.
+ * @param hex Set to the SHA-256 of the file in hexadecimal, "" if the file cannot be read.
+ */
+void hash_file(FILE *file, char *hex);
+
+/**
+ * @brief Asks the server to store a file whose content it already holds, sending only the hash of the file.
+ *
+ * @param server_socket The socket to communicate with the server.
+ * @param file_name The name of the file.
+ * @param destination_path The destination path on the server.
+ * @param file_size The size of the file.
+ * @param hex The SHA-256 of the file in hexadecimal.
+ * @param response The result message received from the server.
+ * @return int Returns 1 if the server stored the file, 0 if the file has to be uploaded, -1 otherwise.
+ */
+int link_file(int server_socket, const char *file_name, const char *destination_path, uint64_t file_size,
+              const char *hex, char *response);
+
+/**
+ * @brief Gets the type of a file, which tells the server storing it.
+ *
+ * @param file_name The name of the file.
+ * @return int Returns 0 for .c, 1 for .txt and 2 for .pdf files, -1 for files of other types.
+ */
+int upload_type(const char *file_name);
+
+/**
+ * @brief Tells whether the server storing a file deduplicates uploads, as its last uresume result listed.
+ *
+ * @param file_name The name of the file.
+ * @return int Returns 1 if the server deduplicates, 0 if it does not or has not said so yet.
+ */
+int server_dedups(const char *file_name);
+
+/**
+ * @brief Remembers whether the server storing a file deduplicates uploads.
+ *
+ * @param file_name The name of the file.
+ * @param dedup 1 if the server deduplicates, 0 otherwise.
+ */
+void set_server_dedups(const char *file_name, int dedup);
+
+/**
+ * @brief Sends a file as a delta against the older copy the server holds at the destination, only the blocks that
+ *        changed cross the network.
+ *
+ * @param server_socket The socket to communicate with the server.
+ * @param file The file to send.
+ * @param file_name The name of the file.
+ * @param destination_path The destination path on the server.
+ * @param file_size The size of the file.
+ * @param hex The SHA-256 of the file in hexadecimal.
+ * @param response The result message received from the server.
+ * @return int Returns 1 if the server stored the file, 0 if the whole file has to be uploaded, -1 otherwise.
+ */
+int send_delta(int server_socket, FILE *file, const char *file_name, const char *destination_path, uint64_t file_size,
+               const char *hex, char *response);
+
+/**
+ * @brief Sends a range of a file as a resumable upload, continuing where the server's copy of it ends.
+ *
+ * @param server_socket The socket to communicate with the server.
+ * @param file The file to send.
+ * @param message The "fileName /destination/path upload_id" arguments of the upload.
+ * @param file_size The size of the whole file.
+ * @param stripe The stripe sent, 0 if the upload is not striped.
+ * @param stripes The number of stripes of the upload, 1 if it is not striped.
+ * @param start The offset of the file the range starts at.
+ * @param end The offset of the file the range ends at.
+ * @param bytes_sent Updated with the number of bytes of the range the server has or was sent.
+ * @param show_progress Whether to print the percentage of the file sent.
+ * @param response The result message received from the server.
+ * @return int Returns 1 if the server committed the range, 0 if it rejected it, -1 otherwise.
+ */
+int send_range(int server_socket, FILE *file, const char *message, uint64_t file_size, unsigned stripe,
+               unsigned stripes, uint64_t start, uint64_t end, volatile uint64_t *bytes_sent, int show_progress,
+               char *response);
+
+/**
+ * @brief Sends the next chunk of a file compressed, as one chunk of a chunked body.
+ *
+ * @param server_socket The socket to communicate with the server.
+ * @param file The file, positioned at the chunk.
+ * @param request_id The id of the upload request.
+ * @param chunk_size The size of the chunk, at most UPLOAD_CHUNK_SIZE.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int send_compressed_chunk(int server_socket, FILE *file, uint32_t request_id, size_t chunk_size);
+
+/**
+ * @brief Sends a file to the server as stripes over parallel connections, one process per stripe.
+ *
+ * @param file_path The path of the file to send.
+ * @param message The "fileName /destination/path upload_id" arguments of the upload.
+ * @param file_size The size of the file.
+ * @param stripes The number of stripes.
+ * @param response The result message received from the server.
+ * @return int Returns 1 if the file was stored by the server, 0 if the server rejected it, -1 otherwise.
  */
-void process_command(int socket, char *cmd_str, char *response);
+int send_file_striped(const char *file_path, const char *message, uint64_t file_size, unsigned stripes,
+                      char *response);
 
 /**
- * @brief Sends a file to the server.
+ * @brief Sends a file to the server, resuming an earlier upload of the same file that was interrupted, or only its
+ *        hash if the server already holds its content.
  *
  * @param server_socket The socket to communicate with the server.
  * @param file_path The path of the file to send.
  * @param destination_path The destination path on the server.
- * @return int Returns 0 if the file was sent successfully, -1 otherwise.
+ * @param response The result message received from the server.
+ * @return int Returns 1 if the file was stored by the server, 0 if the server rejected it, -1 otherwise.
  */
-int send_file(int server_socket, const char *file_path, const char *destination_path);
+int send_file(int server_socket, const char *file_path, const char *destination_path, char *response);
 
 /**
  * @brief Downloads a file from the server.
  *
  * @param server_socket The socket to communicate with the server.
- * @param file_path The path of the file to download.
- * @return int Returns 0 if the file was downloaded successfully, -1 otherwise.
+ * @param command The download command opcode (OP_DFILE or OP_DTAR).
+ * @param args The command arguments sent to the server.
+ * @param file_path The path of the local file to write.
+ * @param append 1 to append the body to the local file and keep what arrived if the download fails, 0 to replace it.
+ * @param response The result message received from the server.
+ * @return int Returns 1 if the file was downloaded, 0 if the server rejected the request, -1 otherwise.
  */
-int download_file(int server_socket, const char *file_path);
+int download_file(int server_socket, uint8_t command, const char *args, const char *file_path, int append,
+                  char *response);
 
 /**
  * @brief Removes a file from the server.
  *
  * @param server_socket The socket to communicate with the server.
  * @param file_path The path of the file to remove.
- * @return int Returns 0 if the file was removed successfully, -1 otherwise.
+ * @param response The result message received from the server.
+ * @return int Returns 1 if the file was removed, 0 if the server rejected the request, -1 otherwise.
  */
-int remove_file(int server_socket, const char *file_path);
+int remove_file(int server_socket, const char *file_path, char *response);
 
 /**
  * @brief Displays the files in the specified directory on the server.
  *
+ * The listing arrives in batches and is saved to display.txt. With a limit
+ * only one page of files is sent, and the result message tells how to ask
+ * for the next one.
+ *
  * @param server_socket The socket to communicate with the server.
- * @param file_path The path of the directory to display files from.
- * @return int Returns 0 if the files were displayed successfully, -1 otherwise.
+ * @param args The path of the directory to display files from, optionally followed by a limit and a cursor.
+ * @param response The result message received from the server.
+ * @return int Returns 1 if the files were displayed, 0 if the server rejected the request, -1 otherwise.
  */
-int display_files(int server_socket, const char *file_path);
+int display_files(int server_socket, const char *args, char *response);
 
 /**
- * @brief Tokenizes the command string into individual commands.
+ * @brief Print the request statistics of the server.
  *
- * @param cmd_str The command string to tokenize.
- * @param commands An array to store the individual commands.
- * @return int Returns the number of commands tokenized.
+ * @param server_socket The socket to communicate with the server.
+ * @param response The result message received from the server.
+ * @return int Returns 1 if the statistics were printed, 0 if the server rejected the request, -1 otherwise.
  */
-int tokenize_command(char *cmd_str, char *commands[]);
+int show_stats(int server_socket, char *response);
 
 /**
- * @brief Sends a message to the server and waits for an acknowledgement.
+ * @brief Receives the body of a data frame into a local file.
  *
- * @param socket The socket to communicate with the server.
- * @param message The message to send.
- * @param ack_message The acknowledgement message to wait for.
- * @return int Returns 0 if the message was sent and acknowledged successfully, -1 otherwise.
+ * A body that does not match its checksum trailer is not kept: the file is
+ * removed, or cut back to where the appended body started.
+ *
+ * @param server_socket The socket to communicate with the server.
+ * @param file_name The name of the local file to write.
+ * @param file_size The number of bytes to receive, without the checksum trailer.
+ * @param checked 1 if a checksum trailer follows the bytes, 0 otherwise.
+ * @param append 1 to append to the local file, 0 to replace it.
+ * @return int Returns 0 if the file was received successfully, 1 if the body was taken off the stream but could not
+ *             be kept, -1 on socket error.
  */
-int send_with_acknowledgement(int socket, const char *message, char *ack_message);
+int receive_file_body(int server_socket, const char *file_name, uint64_t file_size, int checked, int append);
 
 /**
- * @brief Receives a message from the server and sends an acknowledgement.
+ * @brief Receives a chunked data frame body, whose size is not known up front, into a local file.
  *
- * @param socket The socket to communicate with the server.
- * @param ack_message The acknowledgement message to send.
- * @param message The received message from the server.
- * @return int Returns 0 if the message was received and acknowledged successfully, -1 otherwise.
+ * Every chunk that ends with a checksum trailer is checked against it; a
+ * chunk that does not match fails the body and is not kept.
+ *
+ * @param server_socket The socket to communicate with the server.
+ * @param file_name The name of the local file to write.
+ * @param chunk_size The size of the first chunk without its checksum trailer, whose header was already received.
+ * @param frame The kind of the first chunk as returned by recv_data_header, 3 if it is compressed.
+ * @param checked 1 if a checksum trailer follows the first chunk, 0 otherwise.
+ * @param append 1 to append to the local file and keep the chunks received if the body is cut short, 0 to replace it.
+ * @param response The result message if the server fails part way.
+ * @return int Returns 1 if the whole body was received, 0 if the server failed part way, -1 otherwise.
+ */
+int receive_chunked_body(int server_socket, const char *file_name, uint64_t chunk_size, int frame, int checked,
+                         int append, char *response);
+
+/**
+ * @brief Tokenizes the command string into individual commands.
+ *
+ * @param cmd_str The command string to tokenize.
+ * @param commands An array to store the individual commands.
+ * @param max_commands The capacity of the commands array.
+ * @return int Returns the number of commands tokenized.
  */
-int receive_with_acknowledgement(int socket, const char *ack_message, char *message);
+int tokenize_command(char *cmd_str, char *commands[], int max_commands);
 
-int main()
+uint32_t next_request_id = 1; // Id of the next request sent to the server
+unsigned upload_streams = 1;   // Number of connections a large upload is striped over, set with --streams
+int compress_transfers = 1;    // Whether text files are compressed on the wire, cleared with --no-compress
+int checksum_transfers = 1;    // Whether transfers are checked with CRC32C trailers, cleared with --no-checksum
+int trace_commands = 0;        // Whether every command is sent with a trace id of its own, set with --trace
+int delta_uploads = 0;         // Whether files the server holds an older copy of go as deltas, set with --delta
+int dedup_servers[3];          // Whether the server of every upload_type listed dedup in its last uresume result
+
+int main(int argc, char *argv[])
 {
   int client_socket;
+  const char *script = NULL;
+
+  static struct option long_options[] = {
+      {"streams", required_argument, NULL, 'j'},
+      {"script", required_argument, NULL, 'f'},
+      {"no-compress", no_argument, NULL, 'n'},
+      {"compress-level", required_argument, NULL, 'l'},
+      {"trace", no_argument, NULL, 'T'},
+      {"delta", no_argument, NULL, 'd'},
+      {"no-checksum", no_argument, NULL, 'c'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int option;
+  while ((option = getopt_long(argc, argv, "j:f:nl:Tdc", long_options, NULL)) != -1)
+  {
+    if (option == 'j' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_STREAMS)
+      upload_streams = atoi(optarg);
+    else if (option == 'f')
+      script = optarg;
+    else if (option == 'n')
+      compress_transfers = 0;
+    else if (option == 'l' && atoi(optarg) >= 1 && atoi(optarg) <= 9)
+      compress_level = atoi(optarg);
+    else if (option == 'T')
+      trace_commands = 1;
+    else if (option == 'd')
+      delta_uploads = 1;
+    else if (option == 'c')
+      checksum_transfers = 0;
+    else
+    {
+      fprintf(stderr,
+              "Usage: %s [--streams n] [--script file] [--no-compress] [--compress-level n] [--trace] [--delta] "
+              "[--no-checksum]\n",
+              argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // a script runs without prompts, "-" reads it from stdin
+  FILE *input = stdin;
+  if (script != NULL && strcmp(script, "-") != 0 && (input = fopen(script, "r")) == NULL)
+  {
+    perror("Failed to open script");
+    exit(EXIT_FAILURE);
+  }
+
+  // Connect to Smain server
+  client_socket = connect_to_smain();
+  if (client_socket < 0)
+    exit(EXIT_FAILURE);
+
+  // Communicate with Smain server
+  int failures = communicate_with_server(client_socket, input, script == NULL);
+
+  close(client_socket);
+  // a script fails if any of its commands failed
+  return script != NULL && failures > 0 ? EXIT_FAILURE : 0;
+}
+
+int connect_to_smain(void)
+{
   struct sockaddr_in server_addr;
-  char buffer[BUFFER_SIZE];
-  int bytes_read;
 
   // Create socket
-  client_socket = socket(AF_INET, SOCK_STREAM, 0);
+  int client_socket = socket(AF_INET, SOCK_STREAM, 0);
   if (client_socket < 0)
   {
     perror("Socket creation failed");
-    exit(EXIT_FAILURE);
+    return -1;
   }
 
   // Connect to Smain server
@@ -120,56 +467,108 @@ int main()
   {
     perror("Connection failed");
     close(client_socket);
-    exit(EXIT_FAILURE);
+    return -1;
   }
-
-  // Communicate with Smain server
-  communicate_with_server(client_socket);
-
-  close(client_socket);
-  return 0;
+  return client_socket;
 }
 
-void communicate_with_server(int socket)
+int communicate_with_server(int socket, FILE *input, int interactive)
 {
   char command[BUFFER_SIZE];
   char response[BUFFER_SIZE];
+  int failures = 0;
 
   while (1)
   {
     // Get command from user
-    printf("Enter command: ");
-    fgets(command, BUFFER_SIZE, stdin);
+    if (interactive)
+    {
+      printf("Enter command: ");
+      fflush(stdout);
+    }
+    if (fgets(command, BUFFER_SIZE, input) == NULL)
+      break;
     command[strcspn(command, "\n")] = 0; // Remove newline
     if (strcmp(command, "exit") == 0)
       break;
 
-    if (strcmp(command, "") == 0)
+    if (strcmp(command, "") == 0 || command[0] == '#')
       continue;
+    if (!interactive)
+      printf("> %s\n", command);
+
+    // tag the command with a trace id of its own, the servers write the spans of the request under it
+    if (trace_commands)
+    {
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      command_trace_id = (((uint64_t)now.tv_sec << 32 | (uint64_t)now.tv_nsec) ^ ((uint64_t)getpid() << 44)) | 1;
+      printf("Trace id: %016llx\n", (unsigned long long)command_trace_id);
+    }
 
     // Process the command
-    process_command(socket, command, response);
+    if (process_command(socket, command, response) != 1)
+      failures++;
 
     if (strcmp(response, "") == 0)
       continue;
     // Print the server response
     printf("%s\n", response);
   }
+  return failures;
 }
 
-void process_command(int socket, char *cmd_str, char *response)
+int process_command(int socket, char *cmd_str, char *response)
 {
-  char *commands[3];
-  int count = tokenize_command(cmd_str, commands);
+  char *commands[MAX_ARGS];
+  int count = tokenize_command(cmd_str, commands, MAX_ARGS);
 
+  response[0] = '\0';
   if (count == 0)
-  {
-    strcpy(response, NULL);
-    return;
-  }
+    return -1;
 
   char *command = commands[0];
 
+  // a dfile of a byte range, or resuming a partial local copy, downloads one file
+  int range_command = strcmp(command, "dfile") == 0 &&
+                      ((count == 4 && strspn(commands[2], "0123456789") == strlen(commands[2]) &&
+                        strspn(commands[3], "0123456789") == strlen(commands[3])) ||
+                       (count == 3 && strcmp(commands[1], "-c") == 0));
+
+  // several files, or a pattern, make a batch sent as one request
+  int batch_command = !range_command && (count > 3 || (count == 3 && strcmp(command, "ufile") != 0) ||
+                                         (count >= 2 && strpbrk(commands[1], "*?[") != NULL));
+  if (batch_command && (strcmp(command, "ufile") == 0 || strcmp(command, "dfile") == 0 || strcmp(command, "rmfile") == 0))
+  {
+    // Example: ufile *.c a.txt destination_path, dfile /d/a.txt /d/b.c, rmfile /d/*.txt
+    int upload = strcmp(command, "ufile") == 0;
+    if (upload && count < 3)
+    {
+      strcpy(response, "Invalid Usage \n Usage: ufile filename... destination_path");
+      return -1;
+    }
+
+    struct batch batch = {NULL, 0, 0};
+    int result = 0;
+    for (int i = 1; i < (upload ? count - 1 : count) && result >= 0; i++)
+    {
+      if (upload)
+        result = add_local_files(&batch, commands[i]);
+      else
+        result = add_remote_files(socket, &batch, strcmp(command, "dfile") == 0 ? OP_DFILE : OP_RMFILE, commands[i],
+                                  response);
+    }
+
+    if (result >= 0 && batch.count == 0)
+      strcpy(response, "No matching files");
+    else if (result >= 0)
+      result = run_batch(socket, &batch, upload ? commands[count - 1] : NULL, response);
+    free(batch.items);
+    if (result < 0)
+      printf("Failed to run batch\n");
+    return batch.count == 0 ? -1 : result;
+  }
+
   if (strcmp(command, "ufile") == 0)
   {
     // Upload file
@@ -178,7 +577,7 @@ void process_command(int socket, char *cmd_str, char *response)
     if (count != 3)
     {
       strcpy(response, "Invalid Usage \n Usage: ufile filename destination_path");
-      return;
+      return -1;
     }
 
     char *filename = commands[1];
@@ -189,69 +588,67 @@ void process_command(int socket, char *cmd_str, char *response)
     if (file_extension == NULL)
     {
       strcpy(response, "Invalid file extension");
-      return;
+      return -1;
     }
 
     // if file extension is not .txt or .c or .pdf print error message
     if (strcmp(file_extension, ".txt") != 0 && strcmp(file_extension, ".c") != 0 && strcmp(file_extension, ".pdf") != 0)
     {
       strcpy(response, "Invalid file extension\nSupported file extensions: .txt, .c, .pdf");
-      return;
+      return -1;
     }
 
-    // Send the file to the server
-    if (send_file(socket, filename, destination_path) <= 0)
-    {
+    // Send the file to the server and receive the server response
+    int result = send_file(socket, filename, destination_path, response);
+    if (result < 0)
       printf("Failed to send file\n");
-      return;
-    }
-
-    // Receive the server response
-    if (recv(socket, response, BUFFER_SIZE, 0) < 0)
-    {
-      printf("Failed to receive server response\n");
-      return;
-    }
+    return result;
   }
   else if (strcmp(command, "dfile") == 0)
   {
-    if (count != 2)
-    {
-      strcpy(response, "Invalid Usage \n Usage: dfile filename");
-      return;
-    }
-
-    char *filename = commands[1];
-
-    // add null terminator to file path
-    char *file_path_with_null = malloc(strlen(filename) + 1);
-    strcpy(file_path_with_null, filename);
-    file_path_with_null[strlen(filename)] = '\0';
-
-    // send the command and file path to server separated by a space
-    char message[BUFFER_SIZE];
-    sprintf(message, "dfile %s", filename);
-    char ack_message[BUFFER_SIZE];
-    if (send_with_acknowledgement(socket, message, ack_message) <= 0)
+    // Example: dfile /d/a.pdf, dfile /d/a.pdf 0 65536 for the first 64 KB, dfile -c /d/a.txt to resume
+    if (count != 2 && !range_command)
     {
+      strcpy(response, "Invalid Usage \n Usage: dfile filename... | dfile filename offset length | dfile -c filename");
       return -1;
     }
 
-    // Send the file to the server
-    download_file(socket, filename);
+    int resume = count == 3;
+    char *filename = resume ? commands[2] : commands[1];
+    uint64_t offset = count == 4 ? strtoull(commands[2], NULL, 10) : 0;
+    uint64_t length = count == 4 ? strtoull(commands[3], NULL, 10) : 0;
 
-    // Receive the server response
-    if (recv(socket, response, BUFFER_SIZE, 0) < 0)
+    // a resumed download asks for the rest of the file after the bytes of the local copy
+    if (resume)
     {
-      return;
+      const char *local_name = strrchr(filename, '/') != NULL ? strrchr(filename, '/') + 1 : filename;
+      struct stat local_stat;
+      if (stat(local_name, &local_stat) == 0)
+        offset = local_stat.st_size;
+      printf("Resuming at byte %llu\n", (unsigned long long)offset);
     }
+
+    // Download the file into the current directory, a text file compressed on the wire if the server can, checked
+    // unless --no-checksum
+    char args[BUFFER_SIZE];
+    int deflate = compress_transfers && compress_worthwhile(filename);
+    int args_length = snprintf(args, sizeof(args), "%s%s%s%s%s", filename, deflate ? " " : "",
+                               deflate ? COMPRESS_CAPABILITY : "", checksum_transfers ? " " : "",
+                               checksum_transfers ? CHECKSUM_CAPABILITY : "");
+    if ((offset > 0 || length > 0) && args_length < (int)sizeof(args))
+      snprintf(args + args_length, sizeof(args) - args_length, " %s %llu %llu", RANGE_ARGUMENT, (unsigned long long)offset,
+               (unsigned long long)length);
+    int result = download_file(socket, OP_DFILE, args, filename, resume, response);
+    if (result < 0)
+      printf("Failed to receive server response\n");
+    return result;
   }
   else if (strcmp(command, "rmfile") == 0)
   {
     if (count != 2)
     {
-      strcpy(response, "Invalid Usage \n Usage: rmfile filename");
-      return;
+      strcpy(response, "Invalid Usage \n Usage: rmfile filename...");
+      return -1;
     }
 
     char *filename = commands[1];
@@ -261,171 +658,374 @@ void process_command(int socket, char *cmd_str, char *response)
     if (file_extension == NULL)
     {
       strcpy(response, "Invalid file path");
-      return;
+      return -1;
     }
 
     // remove file from the server
-    remove_file(socket, filename);
-
-    // Receive the server response
-    if (recv(socket, response, BUFFER_SIZE, 0) < 0)
-    {
-      return;
-    }
+    int result = remove_file(socket, filename, response);
+    if (result < 0)
+      printf("Failed to receive server response\n");
+    return result;
   }
   else if (strcmp(command, "dtar") == 0)
   {
-    if (count != 2)
-    {
-      strcpy(response, "Invalid Usage \n Usage: dtar filetype");
-      return;
-    }
-
-    char *filetype = commands[1];
-
-    // add null terminator to filetype
-    char *file_type = malloc(strlen(filetype) + 1);
-    strcpy(file_type, filetype);
-    file_type[strlen(filetype)] = '\0';
-
-    // send the command and file path to server separated by a space
-    char message[BUFFER_SIZE];
-    sprintf(message, "dtar %s", file_type);
-    char ack_message[BUFFER_SIZE];
-    if (send_with_acknowledgement(socket, message, ack_message) <= 0)
+    // -z for the default level of the file type, -z0 (stored) to -z9 for a level of its own
+    if (count < 2 || count > 3 ||
+        (count == 3 && (strncmp(commands[2], "-z", 2) != 0 ||
+                        (commands[2][2] != '\0' &&
+                         (commands[2][2] < '0' || commands[2][2] > '9' || commands[2][3] != '\0')))))
     {
+      strcpy(response, "Invalid Usage \n Usage: dtar filetype [-z|-z0..-z9]");
       return -1;
     }
 
+    char *file_type = commands[1];
+    int gzip = count == 3;
+
     // create tar file name
     char tar_file_name[BUFFER_SIZE];
-    sprintf(tar_file_name, "./%s.tar", file_type);
+    snprintf(tar_file_name, sizeof(tar_file_name), "./%s.tar%s", file_type, gzip ? ".gz" : "");
 
-    // download tar file from the server
-    download_file(socket, tar_file_name);
+    // ask for a gzipped archive at the level given, checked unless --no-checksum
+    char args[BUFFER_SIZE];
+    snprintf(args, sizeof(args), "%s%s%s%s%s", file_type, gzip ? " " : "", gzip ? commands[2] : "",
+             checksum_transfers ? " " : "", checksum_transfers ? CHECKSUM_CAPABILITY : "");
 
-    // Receive the server response
-    if (recv(socket, response, BUFFER_SIZE, 0) < 0)
-    {
-      return;
-    }
+    // download tar file from the server
+    int result = download_file(socket, OP_DTAR, args, tar_file_name, 0, response);
+    if (result < 0)
+      printf("Failed to receive server response\n");
+    return result;
   }
   else if (strcmp(command, "display") == 0)
   {
-    if (count != 2)
+    if (count < 2 || count > 4)
     {
-      strcpy(response, "Invalid Usage \n Usage: display path");
-      return;
+      strcpy(response, "Invalid Usage \n Usage: display path [limit [cursor]]");
+      return -1;
     }
 
-    char *path = commands[1];
+    // the page size and the cursor of the page are passed through
+    char args[BUFFER_SIZE];
+    snprintf(args, sizeof(args), "%s%s%s%s%s", commands[1], count > 2 ? " " : "", count > 2 ? commands[2] : "",
+             count > 3 ? " " : "", count > 3 ? commands[3] : "");
 
-    // Send the file to the server
-    display_files(socket, path);
-
-    // Receive the server response
-    if (recv(socket, response, BUFFER_SIZE, 0) < 0)
+    // Receive the listing from the server
+    int result = display_files(socket, args, response);
+    if (result < 0)
+      printf("Failed to receive server response\n");
+    return result;
+  }
+  else if (strcmp(command, "stats") == 0)
+  {
+    if (count != 1)
     {
-      return;
+      strcpy(response, "Invalid Usage \n Usage: stats");
+      return -1;
     }
+
+    // print the request statistics of Smain
+    int result = show_stats(socket, response);
+    if (result < 0)
+      printf("Failed to receive server response\n");
+    return result;
   }
   else
   {
     strcpy(response, "Invalid command");
+    return -1;
   }
 }
 
-int send_file(int server_socket, const char *file_path, const char *destination_path)
+int add_batch_item(struct batch *batch, uint8_t opcode, const char *path)
 {
-  FILE *file = fopen(file_path, "rb");
-  if (file == NULL)
-  {
-    perror("Failed to open file");
-    return -1;
-  }
-
-  char buffer[BUFFER_SIZE];
-  size_t bytes_read;
-
-  // get file name from file path
-  char *file_name = strrchr(file_path, '/');
-  if (file_name == NULL)
-    file_name = (char *)file_path;
-  else
-    file_name++;
-
-  printf("File name: %s\n", file_name);
-
-  fseek(file, 0, SEEK_END);
-  size_t file_size = ftell(file);
-  fseek(file, 0, SEEK_SET);
-
-  // send the command, fileName, fileSize and destination path to server separated by a space
-  char message[BUFFER_SIZE];
-  sprintf(message, "ufile %s %ld %s", file_name, file_size, destination_path);
-
-  char ack_message[BUFFER_SIZE];
-  if (send_with_acknowledgement(server_socket, message, ack_message) <= 0)
+  if (batch->count == BATCH_MAX_ITEMS || strlen(path) >= sizeof(batch->items[0].path))
   {
-    fclose(file);
+    fprintf(stderr, "Cannot add %s to the batch\n", path);
     return -1;
   }
-
-  // Read file and send its contents
-  while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0)
+  if (batch->count == batch->capacity)
   {
-    // send without acknowledgement file content to server
-    if (send(server_socket, buffer, bytes_read, 0) < 0)
+    size_t capacity = batch->capacity > 0 ? batch->capacity * 2 : 64;
+    struct batch_item *items = realloc(batch->items, capacity * sizeof(struct batch_item));
+    if (items == NULL)
     {
-      perror("Failed to send file");
-      fclose(file);
+      perror("Failed to allocate batch");
       return -1;
     }
+    batch->items = items;
+    batch->capacity = capacity;
+  }
 
-    // Calculate and print the percentage of file sent
-    double percentage_sent = (double)ftell(file) / file_size * 100;
-    printf("\rPercentage of file sent: %.2f%%", percentage_sent);
-    fflush(stdout);
+  struct batch_item *item = &batch->items[batch->count++];
+  item->opcode = opcode;
+  item->request_id = 0;
+  strcpy(item->path, path);
+  item->result = 0;
+  strcpy(item->message, "No status from server");
+  return 0;
+}
 
-    // Add a delay
-    usleep(1000); // Delay for 1 milliseconds
+int add_local_files(struct batch *batch, const char *pattern)
+{
+  glob_t matches;
+  if (glob(pattern, 0, NULL, &matches) != 0)
+  {
+    fprintf(stderr, "No files match %s\n", pattern);
+    return 0;
   }
 
-  // receive acknowledgement from server
-  char response[BUFFER_SIZE];
-  if (recv(server_socket, response, BUFFER_SIZE, 0) < 0)
+  int added = 0;
+  for (size_t i = 0; i < matches.gl_pathc; i++)
   {
-    perror("Failed to receive acknowledgement");
-    fclose(file);
-    return -1;
+    // only the file types the servers store, directories and other files are skipped
+    struct stat file_stat;
+    char *file_extension = strrchr(matches.gl_pathv[i], '.');
+    if (stat(matches.gl_pathv[i], &file_stat) != 0 || !S_ISREG(file_stat.st_mode) || file_extension == NULL ||
+        (strcmp(file_extension, ".txt") != 0 && strcmp(file_extension, ".c") != 0 && strcmp(file_extension, ".pdf") != 0))
+    {
+      printf("Skipping %s\n", matches.gl_pathv[i]);
+      continue;
+    }
+    if (add_batch_item(batch, OP_UFILE, matches.gl_pathv[i]) != 0)
+    {
+      globfree(&matches);
+      return -1;
+    }
+    added++;
   }
-
-  printf("\n");
-
-  fclose(file);
-  return 1;
+  globfree(&matches);
+  return added;
 }
 
-int download_file(int server_socket, const char *file_path)
+int add_remote_files(int server_socket, struct batch *batch, uint8_t opcode, const char *pattern, char *response)
 {
-  // Receive the file size from the server
-  char response[BUFFER_SIZE];
-  if (receive_with_acknowledgement(server_socket, "ack", response) == NULL)
+  const char *wildcard = strpbrk(pattern, "*?[");
+  if (wildcard == NULL)
+    return add_batch_item(batch, opcode, pattern) == 0 ? 1 : -1;
+
+  // list the directory the pattern starts in
+  int dir_length = 0;
+  for (const char *p = pattern; p < wildcard; p++)
+    if (*p == '/')
+      dir_length = p - pattern;
+  char dir_path[512];
+  snprintf(dir_path, sizeof(dir_path), "%.*s", dir_length, pattern);
+
+  uint32_t request_id = next_request_id++;
+  if (send_command(server_socket, OP_DISPLAY, request_id, dir_length > 0 ? dir_path : "/") != 0)
   {
-    perror("Failed to receive file size");
+    perror("Failed to send command");
     return -1;
   }
-  size_t file_size = atoi(response);
-  if (DEBUG)
-    printf("File size: %ld\n", file_size);
 
-  if (file_size == -1)
+  uint64_t chunk_size;
+  int result = recv_data_header(server_socket, &chunk_size, response, BUFFER_SIZE);
+  if (result <= 0)
+    return result < 0 ? -1 : 0;
+
+  // the listing arrives in chunks of whole "name - path" lines, the path relative to the directory
+  int added = 0;
+  char *listing = NULL;
+  while (chunk_size > 0)
   {
-    printf("File not found\n");
-    return -1;
+    char *grown = realloc(listing, chunk_size + 1);
+    if (grown == NULL || recv_all(server_socket, grown, chunk_size) != 1)
+    {
+      perror("Failed to receive listing");
+      free(grown != NULL ? grown : listing);
+      return -1;
+    }
+    listing = grown;
+    listing[chunk_size] = '\0';
+
+    for (char *line = strtok(listing, "\n"); line != NULL && added >= 0; line = strtok(NULL, "\n"))
+    {
+      char *path = strstr(line, " - ");
+      char remote_path[1024];
+      if (path == NULL)
+        continue;
+      snprintf(remote_path, sizeof(remote_path), "%s%s", dir_path, path + 3);
+      if (fnmatch(pattern, remote_path, FNM_PATHNAME) == 0)
+        added = add_batch_item(batch, opcode, remote_path) == 0 ? added + 1 : -1;
+    }
+
+    struct frame_header chunk;
+    if (recv_frame_header(server_socket, &chunk) != 1 || chunk.opcode != OP_DATA)
+    {
+      fprintf(stderr, "Failed to receive listing\n");
+      free(listing);
+      return -1;
+    }
+    chunk_size = chunk.payload_length;
   }
+  free(listing);
 
-  // exract file name from file path
+  if (recv_result(server_socket, response, BUFFER_SIZE) < 0)
+    return -1;
+  response[0] = '\0';
+  return added;
+}
+
+int send_batch_requests(int server_socket, const struct batch *batch, uint32_t batch_id, const char *destination_path)
+{
+  char args[BUFFER_SIZE];
+  snprintf(args, sizeof(args), "%zu", batch->count);
+  if (send_command(server_socket, OP_BATCH, batch_id, args) != 0)
+    return -1;
+
+  static char buffer[TRANSFER_BUFFER_SIZE];
+  for (size_t i = 0; i < batch->count; i++)
+  {
+    const struct batch_item *item = &batch->items[i];
+    if (item->opcode != OP_UFILE)
+    {
+      // a download is checked unless --no-checksum
+      snprintf(args, sizeof(args), "%s%s%s", item->path, item->opcode == OP_DFILE && checksum_transfers ? " " : "",
+               item->opcode == OP_DFILE && checksum_transfers ? CHECKSUM_CAPABILITY : "");
+      if (send_command(server_socket, item->opcode, item->request_id, args) != 0)
+        return -1;
+      continue;
+    }
+
+    // an upload is its command frame and its data frame, the file name without its local directory
+    FILE *file = fopen(item->path, "rb");
+    struct stat file_stat;
+    if (file == NULL || fstat(fileno(file), &file_stat) != 0)
+    {
+      // the server cannot skip an upload it was promised, the batch is cut short
+      perror(item->path);
+      return -1;
+    }
+    const char *file_name = strrchr(item->path, '/') != NULL ? strrchr(item->path, '/') + 1 : item->path;
+    snprintf(args, sizeof(args), "%s %s", file_name, destination_path);
+
+    uint64_t remaining = file_stat.st_size;
+    uint32_t crc = 0;
+    if (send_command(server_socket, OP_UFILE, item->request_id, args) != 0 ||
+        send_frame_header(server_socket, OP_DATA, checksum_transfers ? FRAME_FLAG_CHECKSUM : 0, item->request_id,
+                          remaining + (checksum_transfers ? CHECKSUM_SIZE : 0)) != 0)
+    {
+      fclose(file);
+      return -1;
+    }
+    while (remaining > 0)
+    {
+      size_t bytes_read = fread(buffer, 1, remaining < sizeof(buffer) ? remaining : sizeof(buffer), file);
+      if (bytes_read == 0 || send_all(server_socket, buffer, bytes_read, 0) != 0)
+      {
+        fclose(file);
+        return -1;
+      }
+      crc = crc32c(crc, buffer, bytes_read);
+      remaining -= bytes_read;
+    }
+    fclose(file);
+    if (checksum_transfers && send_checksum(server_socket, crc) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+int run_batch(int server_socket, struct batch *batch, const char *destination_path, char *response)
+{
+  // the items take the request ids following the one of the batch
+  uint32_t batch_id = next_request_id++;
+  for (size_t i = 0; i < batch->count; i++)
+    batch->items[i].request_id = next_request_id++;
+  printf("Sending a batch of %zu requests\n", batch->count);
+
+  // the requests are written by a separate process, so the replies are read while the batch is still going out
+  fflush(stdout);
+  pid_t sender = fork();
+  if (sender < 0)
+  {
+    perror("Fork failed");
+    return -1;
+  }
+  if (sender == 0)
+    _exit(send_batch_requests(server_socket, batch, batch_id, destination_path) == 0 ? 0 : 1);
+
+  // every download arrives in order, a dfile that failed sends nothing
+  int result = 1;
+  struct frame_header frame;
+  int have_frame = 0;
+  for (size_t i = 0; i < batch->count && result == 1; i++)
+  {
+    if (batch->items[i].opcode != OP_DFILE)
+      continue;
+    if (!have_frame && recv_frame_header(server_socket, &frame) != 1)
+      result = -1;
+    have_frame = result == 1;
+    if (result == 1 && frame.opcode == OP_DATA && frame.request_id == batch->items[i].request_id)
+    {
+      const char *file_name = strrchr(batch->items[i].path, '/') != NULL ? strrchr(batch->items[i].path, '/') + 1
+                                                                         : batch->items[i].path;
+      uint64_t file_size;
+      int checked = frame_content_length(&frame, &file_size);
+      if (checked < 0 || receive_file_body(server_socket, file_name, file_size, checked, 0) < 0)
+        result = -1;
+      have_frame = 0;
+    }
+  }
+
+  // then the statuses of all items, or the failure of the whole batch
+  if (result == 1 && !have_frame && recv_frame_header(server_socket, &frame) != 1)
+    result = -1;
+  if (result == 1 && frame.opcode == OP_RESULT)
+  {
+    recv_frame_payload(server_socket, &frame, response, BUFFER_SIZE);
+    result = -1;
+  }
+  while (result == 1 && frame.opcode == OP_DATA && frame.request_id == batch_id && frame.payload_length > 0)
+  {
+    char statuses[BUFFER_SIZE * 32];
+    if (recv_frame_payload(server_socket, &frame, statuses, sizeof(statuses)) < 0)
+    {
+      result = -1;
+      break;
+    }
+    // "request_id status message" lines, a chunk holds whole lines
+    for (char *line = strtok(statuses, "\n"); line != NULL; line = strtok(NULL, "\n"))
+    {
+      char *end;
+      uint32_t request_id = strtoul(line, &end, 10);
+      size_t i = request_id - batch->items[0].request_id;
+      if (i >= batch->count || end[0] != ' ' || end[1] == '\0')
+        continue;
+      batch->items[i].result = end[1] == '1';
+      snprintf(batch->items[i].message, sizeof(batch->items[i].message), "%s", end[2] == ' ' ? end + 3 : "");
+    }
+    if (recv_frame_header(server_socket, &frame) != 1)
+      result = -1;
+  }
+  if (result == 1)
+    result = recv_result(server_socket, response, BUFFER_SIZE);
+
+  // a batch that went wrong part way leaves the sender with nobody to write to
+  if (result < 0)
+  {
+    shutdown(server_socket, SHUT_RDWR);
+    kill(sender, SIGTERM);
+  }
+  waitpid(sender, NULL, 0);
+
+  if (result >= 0)
+    for (size_t i = 0; i < batch->count; i++)
+      printf("%s %s: %s\n", batch->items[i].result ? "ok  " : "FAIL", batch->items[i].path, batch->items[i].message);
+  return result;
+}
+
+int send_file(int server_socket, const char *file_path, const char *destination_path, char *response)
+{
+  FILE *file = fopen(file_path, "rb");
+  if (file == NULL)
+  {
+    perror("Failed to open file");
+    return -1;
+  }
+
+  // get file name from file path
   char *file_name = strrchr(file_path, '/');
   if (file_name == NULL)
     file_name = (char *)file_path;
@@ -434,187 +1034,830 @@ int download_file(int server_socket, const char *file_path)
 
   printf("File name: %s\n", file_name);
 
-  // Receive the file content from the server
-  FILE *file = fopen(file_name, "wb");
-  if (file == NULL)
+  struct stat file_stat;
+  if (fstat(fileno(file), &file_stat) != 0)
   {
-    perror("Failed to open file");
+    perror("Failed to stat file");
+    fclose(file);
     return -1;
   }
+  uint64_t file_size = file_stat.st_size;
 
-  size_t total_bytes_received = 0;
+  // the file is only hashed, and the hash sent, for a server that deduplicates or to check a delta
+  char hex[SHA256_HEX_SIZE + 1] = "";
+  int dedup = server_dedups(file_name);
+  if (dedup || delta_uploads)
+    hash_file(file, hex);
 
-  while (total_bytes_received < file_size)
+  // content the server already holds is stored without sending the body
+  if (dedup && hex[0] != '\0')
   {
-    char response[BUFFER_SIZE];
-    // receive without acknowledgement file content from server
-    int bytes_read = recv(server_socket, response, BUFFER_SIZE, 0);
-    if (bytes_read < 0)
+    int linked = link_file(server_socket, file_name, destination_path, file_size, hex, response);
+    if (linked != 0)
     {
-      perror("Failed to receive file");
+      if (linked == 1)
+        printf("Content already on the server, nothing sent\n");
       fclose(file);
-      return -1;
+      return linked;
     }
+  }
 
-    total_bytes_received += bytes_read;
-
-    if (fwrite(response, 1, bytes_read, file) < 0)
+  // a file the server holds an older copy of goes as the blocks that changed
+  if (delta_uploads)
+  {
+    int sent = send_delta(server_socket, file, file_name, destination_path, file_size, hex, response);
+    if (sent != 0)
     {
-      perror("Failed to write to file");
       fclose(file);
-      return -1;
+      return sent;
     }
+  }
 
-    // Calculate and print the percentage of file received
-    double percentage_received = (double)total_bytes_received / file_size * 100;
-    printf("\rPercentage of file received: %.2f%%", percentage_received);
-    fflush(stdout);
+  // a large file is striped over parallel connections, every stripe gets at least one chunk
+  unsigned stripes = upload_streams;
+  if (file_size / UPLOAD_CHUNK_SIZE < stripes)
+    stripes = file_size / UPLOAD_CHUNK_SIZE > 0 ? file_size / UPLOAD_CHUNK_SIZE : 1;
 
-    usleep(1000); // Delay for 1 milliseconds
-  }
+  // the upload id and the destination come with every part of the upload
+  char upload_id[32];
+  make_upload_id(upload_id, file_name, destination_path, &file_stat, stripes);
 
-  if (DEBUG)
-    printf("\nFile received, sending acknowledgement\n");
+  char message[BUFFER_SIZE];
+  snprintf(message, sizeof(message), "%s %s %s", file_name, destination_path, upload_id);
 
-  // send acknowledgement to server
-  if (send(server_socket, "ack", 3, 0) < 0)
+  int result;
+  if (stripes > 1)
   {
-    perror("Failed to send acknowledgement");
     fclose(file);
+    printf("Sending %u stripes in parallel\n", stripes);
+    result = send_file_striped(file_path, message, file_size, stripes, response);
+  }
+  else
+  {
+    uint64_t bytes_sent = 0;
+    result = send_range(server_socket, file, message, file_size, 0, 1, 0, file_size, &bytes_sent, 1, response);
+    fclose(file);
+  }
+  printf("\n");
+  return result;
+}
+
+void hash_file(FILE *file, char *hex)
+{
+  // a file that cannot be read is left to the upload to report
+  static char buffer[TRANSFER_BUFFER_SIZE];
+  struct sha256 hash;
+  sha256_init(&hash);
+  size_t bytes_read;
+  hex[0] = '\0';
+  while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    sha256_update(&hash, buffer, bytes_read);
+  if (ferror(file))
+    return;
+
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  sha256_final(&hash, digest);
+  sha256_hex(digest, hex);
+}
+
+int link_file(int server_socket, const char *file_name, const char *destination_path, uint64_t file_size,
+              const char *hex, char *response)
+{
+  char args[BUFFER_SIZE];
+  snprintf(args, sizeof(args), "%s %s %s %llu", file_name, destination_path, hex, (unsigned long long)file_size);
+  uint32_t request_id = next_request_id++;
+  if (send_command(server_socket, OP_ULINK, request_id, args) != 0)
+  {
+    perror("Failed to send command");
     return -1;
   }
+  // a failed result only means the server does not hold the content, or no longer deduplicates
+  int result = recv_result(server_socket, response, BUFFER_SIZE);
+  if (result == 0 && strcmp(response, "Deduplication disabled") == 0)
+    set_server_dedups(file_name, 0);
+  return result;
+}
 
-  printf("\n");
+int upload_type(const char *file_name)
+{
+  const char *extension = strrchr(file_name, '.');
+  if (extension == NULL)
+    return -1;
+  if (strcmp(extension, ".c") == 0)
+    return 0;
+  if (strcmp(extension, ".txt") == 0)
+    return 1;
+  if (strcmp(extension, ".pdf") == 0)
+    return 2;
+  return -1;
+}
 
-  fclose(file);
-  return 0;
+int server_dedups(const char *file_name)
+{
+  int type = upload_type(file_name);
+  return type >= 0 && dedup_servers[type];
 }
 
-int remove_file(int server_socket, const char *file_path)
+void set_server_dedups(const char *file_name, int dedup)
 {
-  // send the command and file path to server separated by a space
-  char message[BUFFER_SIZE];
-  sprintf(message, "rmfile %s", file_path);
-  char ack_message[BUFFER_SIZE];
-  if (send_with_acknowledgement(server_socket, message, ack_message) <= 0)
+  int type = upload_type(file_name);
+  if (type >= 0)
+    dedup_servers[type] = dedup;
+}
+
+int send_delta(int server_socket, FILE *file, const char *file_name, const char *destination_path, uint64_t file_size,
+               const char *hex, char *response)
+{
+  // an empty file has no blocks to match, and the server checks the rebuilt file against the hash
+  if (file_size == 0 || hex[0] == '\0')
+    return 0;
+
+  char args[BUFFER_SIZE];
+  snprintf(args, sizeof(args), "%s %s", file_name, destination_path);
+  uint32_t request_id = next_request_id++;
+  if (send_command(server_socket, OP_USIG, request_id, args) != 0)
   {
+    perror("Failed to send command");
     return -1;
   }
 
-  // receive acknowledgement from server
-  char response[BUFFER_SIZE];
-  if (recv(server_socket, response, BUFFER_SIZE, 0) < 0)
+  // a failed result in place of the signatures means there is no older copy to delta against
+  uint64_t length;
+  int frame = recv_data_header(server_socket, &length, response, BUFFER_SIZE);
+  if (frame <= 0)
+    return frame;
+  struct delta_signatures signatures;
+  int received = frame == 1 ? delta_recv_signatures(server_socket, length, &signatures) : -1;
+  if (received < 0)
   {
-    perror("Failed to receive acknowledgement");
+    perror("Failed to receive signatures");
     return -1;
   }
+  int result = recv_result(server_socket, response, BUFFER_SIZE);
+  if (result != 1 || received != 0)
+  {
+    delta_free_signatures(&signatures);
+    return result < 0 ? -1 : 0;
+  }
+
+  // the file is matched against the signatures in place
+  unsigned char *data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+  if (data == MAP_FAILED)
+  {
+    delta_free_signatures(&signatures);
+    return 0;
+  }
+  struct delta_plan plan;
+  uint32_t block_size = signatures.block_size;
+  int computed = delta_compute(data, file_size, &signatures, &plan);
+  delta_free_signatures(&signatures);
 
-  return 1;
+  // a delta resending most of the file saves too little over the whole file, which may go compressed
+  if (computed != 0 || plan.literal_bytes > file_size / 2)
+  {
+    if (computed == 0)
+      delta_free_plan(&plan);
+    munmap(data, file_size);
+    return 0;
+  }
+  printf("Sending delta: %llu of %llu bytes changed\n", (unsigned long long)plan.literal_bytes,
+         (unsigned long long)file_size);
+
+  snprintf(args, sizeof(args), "%s %s %llu %s %u", file_name, destination_path, (unsigned long long)file_size, hex,
+           block_size);
+  request_id = next_request_id++;
+  if (send_command(server_socket, OP_UDELTA, request_id, args) != 0 ||
+      delta_send_plan(server_socket, request_id, data, &plan) != 0)
+  {
+    perror("Failed to send delta");
+    result = -1;
+  }
+  else
+  {
+    // a delta the server could not apply leaves the whole file to upload
+    result = recv_result(server_socket, response, BUFFER_SIZE);
+    if (result < 0)
+      perror("Failed to receive result");
+  }
+  delta_free_plan(&plan);
+  munmap(data, file_size);
+  return result;
 }
 
-int display_files(int server_socket, const char *file_path)
+int send_range(int server_socket, FILE *file, const char *message, uint64_t file_size, unsigned stripe,
+               unsigned stripes, uint64_t start, uint64_t end, volatile uint64_t *bytes_sent, int show_progress,
+               char *response)
 {
-  // add null terminator to file path
-  char *file_path_with_null = malloc(strlen(file_path) + 1);
-  strcpy(file_path_with_null, file_path);
-  file_path_with_null[strlen(file_path)] = '\0';
+  // a stripe is named by its index and the number of stripes
+  char args[BUFFER_SIZE];
+  if (stripes > 1)
+    snprintf(args, sizeof(args), "%s %u %u", message, stripe, stripes);
+  else
+    snprintf(args, sizeof(args), "%s", message);
 
-  // send the command and file path to server separated by a space
-  char message[BUFFER_SIZE];
-  sprintf(message, "display %s", file_path);
-  char ack_message[BUFFER_SIZE];
-  if (send_with_acknowledgement(server_socket, message, ack_message) <= 0)
+  // ask the server how much of an earlier attempt it kept, a failed lookup starts from the beginning
+  uint32_t request_id = next_request_id++;
+  if (send_command(server_socket, OP_URESUME, request_id, args) != 0)
   {
+    perror("Failed to send command");
     return -1;
   }
+  int resumed = recv_result(server_socket, response, BUFFER_SIZE);
+  if (resumed < 0)
+  {
+    perror("Failed to receive result");
+    return -1;
+  }
+  uint64_t offset = resumed == 1 ? strtoull(response, NULL, 10) : start;
+  // a text file goes compressed chunk by chunk if the server takes compressed chunks
+  char file_name[BUFFER_SIZE] = "";
+  sscanf(message, "%1023s", file_name);
+  int deflate = resumed == 1 && compress_transfers && compress_worthwhile(file_name) &&
+                strstr(response, " " COMPRESS_CAPABILITY) != NULL;
+  // and the later uploads of its type are linked if the server deduplicates
+  if (resumed == 1)
+    set_server_dedups(file_name, strstr(response, " " BLOB_STORE_CAPABILITY) != NULL);
+  if (offset < start || offset > end)
+    offset = start;
+  if (fseeko(file, offset, SEEK_SET) != 0)
+  {
+    perror("Failed to seek file");
+    return -1;
+  }
+  if (offset > start && show_progress)
+    printf("Resuming upload at byte %llu\n", (unsigned long long)offset);
 
-  // Receive the file size from the server
-  char response[BUFFER_SIZE];
-  if (receive_with_acknowledgement(server_socket, "ack", response) == NULL)
+  // a stripe committed in full is not sent again, the last stripe to complete stores the file
+  *bytes_sent = offset - start;
+  if (stripes > 1 && offset == end)
+  {
+    strcpy(response, "Stripe already received by server");
+    return 1;
+  }
+
+  // send the command frame with the upload and where it continues, then the chunked body right behind it
+  if (stripes > 1)
+    snprintf(args, sizeof(args), "%s %llu %llu %u %u", message, (unsigned long long)file_size,
+             (unsigned long long)offset, stripe, stripes);
+  else
+    snprintf(args, sizeof(args), "%s %llu %llu", message, (unsigned long long)file_size, (unsigned long long)offset);
+
+  request_id = next_request_id++;
+  if (send_command(server_socket, OP_UFILE, request_id, args) != 0)
+  {
+    perror("Failed to send command");
+    return -1;
+  }
+
+  // Read file and send its contents, one chunk at a time
+  static char buffer[TRANSFER_BUFFER_SIZE];
+  uint64_t total_bytes_sent = offset;
+  while (total_bytes_sent < end)
+  {
+    uint64_t chunk_size = end - total_bytes_sent < UPLOAD_CHUNK_SIZE ? end - total_bytes_sent : UPLOAD_CHUNK_SIZE;
+    if (deflate)
+    {
+      // the whole chunk is compressed at once
+      if (send_compressed_chunk(server_socket, file, request_id, chunk_size) != 0)
+      {
+        perror("Failed to send file");
+        return -1;
+      }
+      total_bytes_sent += chunk_size;
+      *bytes_sent = total_bytes_sent - start;
+    }
+    else
+    {
+      // every chunk ends with its checksum, so the server checks it before committing it
+      uint32_t flags = FRAME_FLAG_CHUNKED | (checksum_transfers ? FRAME_FLAG_CHECKSUM : 0);
+      if (send_frame_header(server_socket, OP_DATA, flags, request_id,
+                            chunk_size + (checksum_transfers ? CHECKSUM_SIZE : 0)) != 0)
+      {
+        perror("Failed to send file");
+        return -1;
+      }
+
+      uint32_t crc = 0;
+      uint64_t chunk_end = total_bytes_sent + chunk_size;
+      while (total_bytes_sent < chunk_end)
+      {
+        size_t bytes_to_read = chunk_end - total_bytes_sent < sizeof(buffer) ? chunk_end - total_bytes_sent : sizeof(buffer);
+        size_t bytes_read = fread(buffer, 1, bytes_to_read, file);
+        // send without acknowledgement file content to server
+        if (bytes_read == 0 || send_all(server_socket, buffer, bytes_read, 0) != 0)
+        {
+          perror("Failed to send file");
+          return -1;
+        }
+        crc = crc32c(crc, buffer, bytes_read);
+        total_bytes_sent += bytes_read;
+        *bytes_sent = total_bytes_sent - start;
+      }
+      if (checksum_transfers && send_checksum(server_socket, crc) != 0)
+      {
+        perror("Failed to send file");
+        return -1;
+      }
+    }
+
+    // Calculate and print the percentage of file sent
+    if (show_progress)
+    {
+      double percentage_sent = (double)total_bytes_sent / file_size * 100;
+      printf("\rPercentage of file sent: %.2f%%", percentage_sent);
+      fflush(stdout);
+    }
+  }
+
+  // the zero length chunk ends the body
+  if (send_frame_header(server_socket, OP_DATA, FRAME_FLAG_CHUNKED, request_id, 0) != 0)
+  {
+    perror("Failed to send file");
+    return -1;
+  }
+
+  // receive the end-to-end result from server
+  int result = recv_result(server_socket, response, BUFFER_SIZE);
+  if (result < 0)
+    perror("Failed to receive result");
+  return result;
+}
+
+int send_compressed_chunk(int server_socket, FILE *file, uint32_t request_id, size_t chunk_size)
+{
+  static char chunk[UPLOAD_CHUNK_SIZE];
+  static char compressed[UPLOAD_CHUNK_SIZE + 1024];
+  if (fread(chunk, 1, chunk_size, file) != chunk_size)
+    return -1;
+
+  // a chunk that does not shrink goes as it is, checked unless --no-checksum; a compressed one is checked by zlib
+  size_t compressed_length;
+  if (compress_bound(chunk_size) <= sizeof(compressed) && compress_chunk(chunk, chunk_size, compressed, &compressed_length))
+    return send_frame(server_socket, OP_DATA, FRAME_FLAG_CHUNKED | FRAME_FLAG_COMPRESSED, request_id, compressed,
+                      compressed_length);
+  if (checksum_transfers)
+    return send_checked_frame(server_socket, FRAME_FLAG_CHUNKED, request_id, chunk, chunk_size);
+  return send_chunk(server_socket, request_id, chunk, chunk_size);
+}
+
+int send_file_striped(const char *file_path, const char *message, uint64_t file_size, unsigned stripes,
+                      char *response)
+{
+  // the stripe processes report their progress and result through shared memory
+  struct stripe_status *status = mmap(NULL, stripes * sizeof(struct stripe_status), PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (status == MAP_FAILED)
+  {
+    perror("Failed to map stripe status");
+    return -1;
+  }
+  memset(status, 0, stripes * sizeof(struct stripe_status));
+
+  // the stripes split the file as the servers do
+  uint64_t stripe_size = file_size / stripes + (file_size % stripes != 0);
+  pid_t pids[MAX_STREAMS];
+  fflush(stdout);
+  for (unsigned stripe = 0; stripe < stripes; stripe++)
+  {
+    pids[stripe] = fork();
+    if (pids[stripe] < 0)
+    {
+      perror("Fork failed");
+      continue;
+    }
+    if (pids[stripe] > 0)
+      continue;
+
+    // each stripe has its own connection and its own file position
+    uint64_t start = stripe * stripe_size;
+    uint64_t end = start + stripe_size < file_size ? start + stripe_size : file_size;
+    int result = -1;
+    int stripe_socket = connect_to_smain();
+    FILE *file = fopen(file_path, "rb");
+    if (stripe_socket >= 0 && file != NULL)
+      result = send_range(stripe_socket, file, message, file_size, stripe, stripes, start, end,
+                          &status[stripe].bytes_sent, 0, status[stripe].response);
+    else
+      strcpy(status[stripe].response, "Failed to open stripe");
+    _exit(result == 1 ? 0 : result == 0 ? 1 : 2);
+  }
+
+  // print the progress of all stripes until every one of them finished
+  int result = 1;
+  unsigned running = 0;
+  for (unsigned stripe = 0; stripe < stripes; stripe++)
+    running += pids[stripe] > 0;
+  if (running < stripes)
+  {
+    strcpy(response, "Failed to start stripes");
+    result = -1;
+  }
+  while (running > 0)
+  {
+    usleep(100000);
+    uint64_t total_bytes_sent = 0;
+    for (unsigned stripe = 0; stripe < stripes; stripe++)
+    {
+      total_bytes_sent += status[stripe].bytes_sent;
+
+      int wstatus;
+      if (pids[stripe] <= 0 || waitpid(pids[stripe], &wstatus, WNOHANG) != pids[stripe])
+        continue;
+      pids[stripe] = 0;
+      running--;
+
+      // the result of the first stripe that failed is the result of the upload
+      int stripe_result = WIFEXITED(wstatus) && WEXITSTATUS(wstatus) <= 1 ? 1 - WEXITSTATUS(wstatus) : -1;
+      if (result == 1 && stripe_result != 1)
+      {
+        result = stripe_result;
+        snprintf(response, BUFFER_SIZE, "Stripe %u: %.960s", stripe, status[stripe].response);
+      }
+      else if (result == 1)
+        strcpy(response, status[stripe].response);
+    }
+
+    printf("\rPercentage of file sent: %.2f%%", (double)total_bytes_sent / file_size * 100);
+    fflush(stdout);
+  }
+
+  munmap(status, stripes * sizeof(struct stripe_status));
+  return result;
+}
+
+void make_upload_id(char *upload_id, const char *file_name, const char *destination_path, const struct stat *file_stat,
+                    unsigned stripes)
+{
+  // FNV-1a over the name, the destination, the size, the modification time and the striping
+  char key[BUFFER_SIZE];
+  snprintf(key, sizeof(key), "%s|%s|%llu|%lld|%u", file_name, destination_path, (unsigned long long)file_stat->st_size,
+           (long long)file_stat->st_mtime, stripes);
+
+  uint64_t hash = 14695981039346656037ULL;
+  for (const char *p = key; *p != '\0'; p++)
+  {
+    hash ^= (unsigned char)*p;
+    hash *= 1099511628211ULL;
+  }
+  sprintf(upload_id, "%016llx", (unsigned long long)hash);
+}
+
+int download_file(int server_socket, uint8_t command, const char *args, const char *file_path, int append,
+                  char *response)
+{
+  // send the command frame
+  uint32_t request_id = next_request_id++;
+  if (send_command(server_socket, command, request_id, args) != 0)
+  {
+    perror("Failed to send command");
+    return -1;
+  }
+
+  // Receive the data frame header carrying the file size, or the failure result
+  struct frame_header data;
+  uint64_t file_size;
+  int result = recv_data_frame(server_socket, &data, response, BUFFER_SIZE);
+  if (result < 0)
   {
     perror("Failed to receive file size");
     return -1;
   }
-  size_t file_size = atoi(response);
-  printf("File size: %ld\n", file_size);
+  if (result == 0)
+    return 0;
+  int checked = frame_content_length(&data, &file_size);
+  if (checked < 0)
+    return -1;
+
+  // exract file name from file path
+  char *file_name = strrchr(file_path, '/');
+  if (file_name == NULL)
+    file_name = (char *)file_path;
+  else
+    file_name++;
+
+  printf("File name: %s\n", file_name);
+
+  if (result >= 2)
+  {
+    // A streamed archive, or a compressed file, arrives in chunks, its size is not known up front
+    result = receive_chunked_body(server_socket, file_name, file_size, result, checked, append, response);
+    if (result != 1)
+      return result;
+  }
+  else
+  {
+    if (DEBUG)
+      printf("File size: %llu\n", (unsigned long long)file_size);
+
+    // Receive the file content from the server, a file that was not kept still takes the result off the stream
+    int received = receive_file_body(server_socket, file_name, file_size, checked, append);
+    if (received < 0)
+      return -1;
+    if (received > 0)
+    {
+      recv_result(server_socket, NULL, 0);
+      return -1;
+    }
+  }
+
+  // receive the end-to-end result from server
+  return recv_result(server_socket, response, BUFFER_SIZE);
+}
+
+int remove_file(int server_socket, const char *file_path, char *response)
+{
+  // send the command frame with the file path
+  uint32_t request_id = next_request_id++;
+  if (send_command(server_socket, OP_RMFILE, request_id, file_path) != 0)
+  {
+    perror("Failed to send command");
+    return -1;
+  }
+
+  // receive the result from server
+  return recv_result(server_socket, response, BUFFER_SIZE);
+}
 
-  if (file_size == 0)
+int display_files(int server_socket, const char *args, char *response)
+{
+  // send the command frame with the directory path and the page asked for
+  uint32_t request_id = next_request_id++;
+  if (send_command(server_socket, OP_DISPLAY, request_id, args) != 0)
   {
-    printf("Directory does not exist\n");
+    perror("Failed to send command");
     return -1;
   }
 
+  // Receive the header of the first batch of the listing, or the failure result
+  uint64_t file_size;
+  int result = recv_data_header(server_socket, &file_size, response, BUFFER_SIZE);
+  if (result < 0)
+  {
+    perror("Failed to receive file size");
+    return -1;
+  }
+  if (result == 0)
+  {
+    printf("Directory does not exist\n");
+    return 0;
+  }
+
   char *file_name = "display.txt";
 
   printf("File name: %s\n", file_name);
 
-  // Receive the file content from the server
-  FILE *file = fopen(file_name, "wb");
+  if (result >= 2)
+  {
+    // The listing is streamed in batches, its size is not known up front
+    result = receive_chunked_body(server_socket, file_name, file_size, result, 0, 0, response);
+    if (result != 1)
+      return result;
+  }
+  else
+  {
+    printf("File size: %llu\n", (unsigned long long)file_size);
+
+    // Receive the file content from the server
+    if (receive_file_body(server_socket, file_name, file_size, 0, 0) != 0)
+      return -1;
+  }
+
+  // receive the end-to-end result from server
+  return recv_result(server_socket, response, BUFFER_SIZE);
+}
+
+int show_stats(int server_socket, char *response)
+{
+  uint32_t request_id = next_request_id++;
+  if (send_command(server_socket, OP_STATS, request_id, "") != 0)
+  {
+    perror("Failed to send command");
+    return -1;
+  }
+
+  // the statistics arrive as one data frame of text
+  uint64_t length;
+  int result = recv_data_header(server_socket, &length, response, BUFFER_SIZE);
+  if (result <= 0)
+    return result;
+  if (result != 1)
+  {
+    fprintf(stderr, "Unexpected chunked statistics\n");
+    return -1;
+  }
+
+  char *report = malloc(length + 1);
+  if (report == NULL || recv_all(server_socket, report, length) != 1)
+  {
+    perror("Failed to receive statistics");
+    free(report);
+    return -1;
+  }
+  report[length] = '\0';
+  fputs(report, stdout);
+  free(report);
+
+  // receive the end-to-end result from server
+  return recv_result(server_socket, response, BUFFER_SIZE);
+}
+
+int receive_file_body(int server_socket, const char *file_name, uint64_t file_size, int checked, int append)
+{
+  uint64_t payload = file_size + (checked ? CHECKSUM_SIZE : 0);
+  FILE *file = fopen(file_name, append ? "ab" : "wb");
   if (file == NULL)
   {
     perror("Failed to open file");
-    return -1;
+    return discard_payload(server_socket, payload) == 0 ? 1 : -1;
   }
+  // a resumed download that does not match is cut back to the bytes it resumed from
+  off_t start = append && fseeko(file, 0, SEEK_END) == 0 ? ftello(file) : 0;
 
-  size_t total_bytes_received = 0;
+  uint64_t total_bytes_received = 0;
+  uint32_t crc = 0;
 
   while (total_bytes_received < file_size)
   {
-    char response[BUFFER_SIZE];
-    // receive without acknowledgement file content from server
-    int bytes_read = recv(server_socket, response, BUFFER_SIZE, 0);
-    if (bytes_read < 0)
+    static char response[TRANSFER_BUFFER_SIZE];
+    // never read past the end of the data frame
+    size_t bytes_to_receive = sizeof(response);
+    if (file_size - total_bytes_received < bytes_to_receive)
+      bytes_to_receive = file_size - total_bytes_received;
+
+    if (recv_all(server_socket, response, bytes_to_receive) != 1)
     {
       perror("Failed to receive file");
       fclose(file);
       return -1;
     }
 
-    total_bytes_received += bytes_read;
+    total_bytes_received += bytes_to_receive;
+    crc = crc32c(crc, response, bytes_to_receive);
 
-    if (fwrite(response, 1, bytes_read, file) < 0)
+    if (fwrite(response, 1, bytes_to_receive, file) != bytes_to_receive)
     {
       perror("Failed to write to file");
       fclose(file);
-      return -1;
+      return discard_payload(server_socket, payload - total_bytes_received) == 0 ? 1 : -1;
     }
 
     // Calculate and print the percentage of file received
     double percentage_received = (double)total_bytes_received / file_size * 100;
     printf("\rPercentage of file received: %.2f%%", percentage_received);
     fflush(stdout);
-
-    usleep(1000); // Delay for 1 milliseconds
   }
 
-  if (DEBUG)
-    printf("\nFile received, sending acknowledgement\n");
+  printf("\n");
 
-  // send acknowledgement to server
-  if (send(server_socket, "ack", 3, 0) < 0)
+  int check = checked ? recv_checksum(server_socket, crc) : 1;
+  if (check == 0)
   {
-    perror("Failed to send acknowledgement");
-    fclose(file);
-    return -1;
+    fprintf(stderr, "Download does not match its checksum, not kept\n");
+    if (append && (fflush(file) != 0 || ftruncate(fileno(file), start) != 0))
+      perror("Failed to cut back file");
   }
+  if (fclose(file) != 0 && check == 1)
+  {
+    perror("Failed to write to file");
+    check = 0;
+  }
+  if (check == 0 && !append)
+    remove(file_name);
+  return check == 1 ? 0 : check == 0 ? 1 : -1;
+}
 
+int receive_chunked_body(int server_socket, const char *file_name, uint64_t chunk_size, int frame, int checked,
+                         int append, char *response)
+{
+  FILE *file = fopen(file_name, append ? "ab" : "wb");
+  if (file == NULL)
+    perror("Failed to open file");
+  uint64_t total_bytes_received = 0;
+  int result = 1;
+
+  // A zero length chunk ends the body
+  while (chunk_size > 0)
+  {
+    if (frame == 3)
+    {
+      // A compressed chunk is inflated whole
+      static char chunk[COMPRESS_CHUNK_SIZE];
+      size_t length = 0;
+      int inflated = recv_compressed_chunk(server_socket, chunk_size, chunk, &length);
+      if (inflated < 0)
+      {
+        perror("Failed to receive file");
+        if (file != NULL)
+          fclose(file);
+        // a resumed download keeps every chunk it got, for the next resume
+        if (!append)
+          remove(file_name);
+        return -1;
+      }
+      chunk_size = 0;
+      total_bytes_received += length;
+
+      // keep reading after a corrupt chunk or a local write error, the stream must stay framed
+      if (file != NULL && (inflated != 0 || fwrite(chunk, 1, length, file) != length))
+      {
+        perror("Failed to write to file");
+        fclose(file);
+        file = NULL;
+      }
+    }
+
+    // a chunk that does not match its checksum is cut off again, so a resumed download never keeps it
+    off_t chunk_start = checked && file != NULL && append ? ftello(file) : 0;
+    uint32_t crc = 0;
+    while (chunk_size > 0)
+    {
+      static char buffer[TRANSFER_BUFFER_SIZE];
+      size_t bytes_to_receive = chunk_size < sizeof(buffer) ? chunk_size : sizeof(buffer);
+      if (recv_all(server_socket, buffer, bytes_to_receive) != 1)
+      {
+        perror("Failed to receive file");
+        if (file != NULL)
+          fclose(file);
+        // a resumed download keeps every chunk it got, for the next resume
+        if (!append)
+          remove(file_name);
+        return -1;
+      }
+      chunk_size -= bytes_to_receive;
+      total_bytes_received += bytes_to_receive;
+      crc = crc32c(crc, buffer, bytes_to_receive);
+
+      // keep reading after a local write error, the stream must stay framed
+      if (file != NULL && fwrite(buffer, 1, bytes_to_receive, file) != bytes_to_receive)
+      {
+        perror("Failed to write to file");
+        fclose(file);
+        file = NULL;
+      }
+    }
+    int check = checked ? recv_checksum(server_socket, crc) : 1;
+    if (check < 0)
+    {
+      perror("Failed to receive file");
+      if (file != NULL)
+        fclose(file);
+      if (!append)
+        remove(file_name);
+      return -1;
+    }
+    if (check == 0 && file != NULL)
+    {
+      fprintf(stderr, "Download does not match its checksum, not kept\n");
+      if (append && (fflush(file) != 0 || ftruncate(fileno(file), chunk_start) != 0))
+        perror("Failed to cut back file");
+      fclose(file);
+      file = NULL;
+    }
+
+    printf("\rBytes received: %llu", (unsigned long long)total_bytes_received);
+    fflush(stdout);
+
+    // The server sends its failure result in place of the next chunk
+    struct frame_header data;
+    frame = recv_data_frame(server_socket, &data, response, BUFFER_SIZE);
+    if (frame != 2 && frame != 3)
+    {
+      result = frame == 0 ? 0 : -1;
+      break;
+    }
+    checked = frame_content_length(&data, &chunk_size);
+    if (checked < 0)
+    {
+      result = -1;
+      break;
+    }
+  }
   printf("\n");
 
-  fclose(file);
-  return 0;
+  if (file != NULL)
+    fclose(file);
+  else if (result == 1)
+  {
+    // the body was consumed, take the result off the stream too
+    recv_result(server_socket, NULL, 0);
+    result = -1;
+  }
+  if (result != 1 && !append)
+    remove(file_name);
+  return result;
 }
 
 /* UTILITY FUNCTIONS */
 
-int tokenize_command(char *cmd_str, char *commands[])
+int tokenize_command(char *cmd_str, char *commands[], int max_commands)
 {
   int count = 0; // Initialize a counter to keep track of the number of tokens
 
   // Use strtok to split the input string 'cmd_str' into tokens separated by spaces
   char *token = strtok(cmd_str, " ");
 
-  // Loop through all tokens
-  while (token != NULL)
+  // Loop through all tokens, the commands array never overflows
+  while (token != NULL && count < max_commands)
   {
     // Store the current token in the 'commands' array and increment the counter
     commands[count++] = token;
@@ -626,59 +1869,3 @@ int tokenize_command(char *cmd_str, char *commands[])
   // Return the total number of tokens found
   return count;
 }
-
-int send_with_acknowledgement(int socket, const char *message, char *ack_message)
-{
-  // Attempt to send the message through the socket
-  if (send(socket, message, strlen(message), 0) < 0)
-  {
-    // If sending fails, print an error message and return 0
-    perror("Failed to send message");
-    return 0;
-  }
-
-  // Receive the acknowledgement message from the socket
-  int bytes_received = recv(socket, ack_message, BUFFER_SIZE, 0);
-  if (bytes_received < 0)
-  {
-    // If receiving fails, print an error message and return 0
-    perror("Failed to receive acknowledgement");
-    return 0;
-  }
-
-  // Null-terminate the received acknowledgement message
-  ack_message[bytes_received] = '\0';
-
-  // Return the length of the original message sent
-  return strlen(message);
-}
-
-int receive_with_acknowledgement(int socket, const char *ack_message, char *message)
-{
-  // Attempt to receive a message from the socket
-  int bytes_received = recv(socket, message, BUFFER_SIZE, 0);
-
-  // Check if the receive operation failed
-  if (bytes_received < 0)
-  {
-    // Print an error message to stderr
-    perror("Failed to receive message");
-    // Return 0 to indicate failure
-    return 0;
-  }
-
-  // Null-terminate the received message
-  message[bytes_received] = '\0';
-
-  // Attempt to send an acknowledgement message back through the socket
-  if (send(socket, ack_message, strlen(ack_message), 0) < 0)
-  {
-    // Print an error message to stderr
-    perror("Failed to send acknowledgement");
-    // Return 0 to indicate failure
-    return 0;
-  }
-
-  // Return the number of bytes successfully received
-  return bytes_received;
-}
\ No newline at end of file
@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "protocol.h"
+#include "compress.h"
+#include "checksum.h"
+#include "scheduler.h"
+
+// Start of a packed file, followed by the uncompressed size as 8 bytes in network byte order
+static const unsigned char pack_magic[8] = {0x89, 'S', '2', '4', 'Z', '\r', '\n', 0x1a};
+
+#define PACK_HEADER_SIZE 16
+
+// Every record starts with 4 bytes in network byte order: the stored length, and whether it is compressed
+#define RECORD_HEADER_SIZE 4
+#define RECORD_COMPRESSED 0x80000000u
+
+int compress_level = Z_BEST_SPEED;
+
+int compress_at_rest = 0;
+
+/* CHUNKS */
+
+int compress_worthwhile(const char *file_name)
+{
+  const char *extension = strrchr(file_name, '.');
+  return extension != NULL && (strcmp(extension, ".txt") == 0 || strcmp(extension, ".c") == 0);
+}
+
+size_t compress_bound(size_t length)
+{
+  return compressBound(length);
+}
+
+int compress_chunk(const void *data, size_t length, void *out, size_t *out_length)
+{
+  uLongf bound = compressBound(length);
+  if (compress2(out, &bound, data, length, compress_level) != Z_OK || bound >= length)
+    return 0;
+  *out_length = bound;
+  return 1;
+}
+
+int inflate_chunk(const void *data, size_t length, void *out, size_t *out_length)
+{
+  // a chunk that would inflate past the buffer is rejected, not truncated
+  uLongf inflated = COMPRESS_CHUNK_SIZE;
+  if (uncompress(out, &inflated, data, length) != Z_OK)
+  {
+    fprintf(stderr, "Corrupt compressed chunk\n");
+    return -1;
+  }
+  *out_length = inflated;
+  return 0;
+}
+
+int recv_compressed_chunk(int socket, uint64_t payload_length, void *out, size_t *out_length)
+{
+  if (payload_length > compressBound(COMPRESS_CHUNK_SIZE))
+  {
+    fprintf(stderr, "Compressed chunk too large\n");
+    return discard_payload(socket, payload_length) == 0 ? 1 : -1;
+  }
+
+  unsigned char *payload = malloc(payload_length);
+  if (payload == NULL)
+    return discard_payload(socket, payload_length) == 0 ? 1 : -1;
+  if (recv_all(socket, payload, payload_length) != 1)
+  {
+    free(payload);
+    return -1;
+  }
+  int result = inflate_chunk(payload, payload_length, out, out_length) == 0 ? 0 : 1;
+  free(payload);
+  return result;
+}
+
+/* PACKED FILES */
+
+static void put_u32(unsigned char *p, uint32_t value)
+{
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static int read_all_at(int fd, void *buffer, size_t length, uint64_t offset)
+{
+  char *p = buffer;
+  while (length > 0)
+  {
+    ssize_t bytes_read = pread(fd, p, length, offset);
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0)
+      return -1;
+    p += bytes_read;
+    length -= bytes_read;
+    offset += bytes_read;
+  }
+  return 0;
+}
+
+static int write_all(int fd, const void *buffer, size_t length)
+{
+  const char *p = buffer;
+  while (length > 0)
+  {
+    ssize_t bytes_written = write(fd, p, length);
+    if (bytes_written < 0 && errno == EINTR)
+      continue;
+    if (bytes_written <= 0)
+      return -1;
+    p += bytes_written;
+    length -= bytes_written;
+  }
+  return 0;
+}
+
+int compress_content_size(int fd, uint64_t *size)
+{
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0)
+    return -1;
+  *size = file_stat.st_size;
+
+  unsigned char header[PACK_HEADER_SIZE];
+  if (file_stat.st_size < PACK_HEADER_SIZE || read_all_at(fd, header, sizeof(header), 0) != 0 ||
+      memcmp(header, pack_magic, sizeof(pack_magic)) != 0)
+    return 0;
+  *size = (uint64_t)get_u32(header + 8) << 32 | get_u32(header + 12);
+  return 1;
+}
+
+// Read the next record of a packed file as it is stored, into a buffer of compress_bound(COMPRESS_CHUNK_SIZE) bytes
+static int read_record(int fd, uint64_t *position, unsigned char *record, size_t *length, int *compressed)
+{
+  unsigned char header[RECORD_HEADER_SIZE];
+  if (read_all_at(fd, header, sizeof(header), *position) != 0)
+  {
+    // the end of the file is between records
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == 0 && (uint64_t)file_stat.st_size == *position)
+    {
+      *length = 0;
+      return 0;
+    }
+    return -1;
+  }
+
+  uint32_t value = get_u32(header);
+  *compressed = (value & RECORD_COMPRESSED) != 0;
+  *length = value & ~RECORD_COMPRESSED;
+  if (*length == 0 || *length > compressBound(COMPRESS_CHUNK_SIZE) ||
+      read_all_at(fd, record, *length, *position + RECORD_HEADER_SIZE) != 0)
+    return -1;
+  *position += RECORD_HEADER_SIZE + *length;
+  return 0;
+}
+
+int compress_read_record(int fd, uint64_t *position, void *out, size_t *out_length)
+{
+  if (*position == 0)
+    *position = PACK_HEADER_SIZE;
+
+  unsigned char *record = malloc(compressBound(COMPRESS_CHUNK_SIZE));
+  if (record == NULL)
+    return -1;
+
+  size_t length;
+  int compressed;
+  int result = read_record(fd, position, record, &length, &compressed);
+  if (result == 0 && length > COMPRESS_CHUNK_SIZE && !compressed)
+    result = -1;
+  if (result == 0 && compressed)
+    result = inflate_chunk(record, length, out, out_length);
+  else if (result == 0)
+  {
+    memcpy(out, record, length);
+    *out_length = length;
+  }
+  free(record);
+  if (result != 0)
+    fprintf(stderr, "Corrupt packed file\n");
+  return result;
+}
+
+// Write the packed copy of a file
+static int pack_into(int fd, int packed_fd)
+{
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0)
+    return -1;
+
+  unsigned char header[PACK_HEADER_SIZE];
+  memcpy(header, pack_magic, sizeof(pack_magic));
+  put_u32(header + 8, (uint64_t)file_stat.st_size >> 32);
+  put_u32(header + 12, (uint32_t)file_stat.st_size);
+  if (write_all(packed_fd, header, sizeof(header)) != 0)
+    return -1;
+
+  unsigned char *chunk = malloc(COMPRESS_CHUNK_SIZE);
+  unsigned char *record = malloc(RECORD_HEADER_SIZE + compressBound(COMPRESS_CHUNK_SIZE));
+  int result = chunk != NULL && record != NULL ? 0 : -1;
+
+  // every chunk that does not shrink is stored as it is
+  for (uint64_t offset = 0; result == 0 && offset < (uint64_t)file_stat.st_size;)
+  {
+    size_t length = file_stat.st_size - offset < COMPRESS_CHUNK_SIZE ? file_stat.st_size - offset : COMPRESS_CHUNK_SIZE;
+    size_t stored = length;
+    if (read_all_at(fd, chunk, length, offset) != 0)
+      result = -1;
+    else if (compress_chunk(chunk, length, record + RECORD_HEADER_SIZE, &stored))
+      put_u32(record, stored | RECORD_COMPRESSED);
+    else
+    {
+      memcpy(record + RECORD_HEADER_SIZE, chunk, length);
+      put_u32(record, stored);
+    }
+    if (result == 0 && write_all(packed_fd, record, RECORD_HEADER_SIZE + stored) != 0)
+      result = -1;
+    offset += length;
+  }
+  free(chunk);
+  free(record);
+  return result;
+}
+
+int compress_file(const char *path)
+{
+  if (!compress_at_rest)
+    return 0;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    perror("Failed to open file to pack");
+    return -1;
+  }
+
+  char packed_path[PATH_MAX];
+  snprintf(packed_path, sizeof(packed_path), "%s.z", path);
+  int packed_fd = open(packed_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  int result = packed_fd >= 0 ? pack_into(fd, packed_fd) : -1;
+  if (packed_fd >= 0 && close(packed_fd) != 0)
+    result = -1;
+  close(fd);
+
+  if (result != 0 || rename(packed_path, path) != 0)
+  {
+    perror("Failed to pack file");
+    unlink(packed_path);
+    return -1;
+  }
+  return 0;
+}
+
+/* DOWNLOADS */
+
+// Send one chunk of a chunked body, compressed if it shrinks, with a buffer of compress_bound(COMPRESS_CHUNK_SIZE);
+// a chunk sent as it is to a client that checks the download carries its checksum
+static int send_maybe_compressed(int socket, uint32_t request_id, const void *chunk, size_t length, void *compressed,
+                                 int checked)
+{
+  size_t compressed_length;
+  if (compress_chunk(chunk, length, compressed, &compressed_length))
+    return send_frame(socket, OP_DATA, FRAME_FLAG_CHUNKED | FRAME_FLAG_COMPRESSED, request_id, compressed,
+                      compressed_length);
+  if (checked)
+    return send_checked_frame(socket, FRAME_FLAG_CHUNKED, request_id, chunk, length);
+  return send_chunk(socket, request_id, chunk, length);
+}
+
+// Find the record of a packed file holding a content offset from the record headers alone, every record but the
+// last holding COMPRESS_CHUNK_SIZE bytes of content
+static int seek_record(int fd, uint64_t offset, uint64_t *position, uint64_t *record_start)
+{
+  *position = PACK_HEADER_SIZE;
+  *record_start = 0;
+  while (offset - *record_start >= COMPRESS_CHUNK_SIZE)
+  {
+    unsigned char header[RECORD_HEADER_SIZE];
+    if (read_all_at(fd, header, sizeof(header), *position) != 0)
+      return -1;
+    *position += RECORD_HEADER_SIZE + (get_u32(header) & ~RECORD_COMPRESSED);
+    *record_start += COMPRESS_CHUNK_SIZE;
+  }
+  return 0;
+}
+
+// Send a range of a packed file. A client that accepts compression gets a chunked body, the records wholly inside
+// the range as they are stored; any other client gets a single data frame of the range, inflated on the way, with
+// the checksum of the inflated range after it if the client checks the download.
+static int send_packed(int socket, uint32_t request_id, int fd, uint64_t size, struct byte_range range, int deflate,
+                       int checked)
+{
+  uint32_t frame_flags = checked ? FRAME_FLAG_CHECKSUM : 0;
+  if (!deflate && send_frame_header(socket, OP_DATA, frame_flags, request_id,
+                                    range.length + (checked ? CHECKSUM_SIZE : 0)) != 0)
+    return -1;
+  uint32_t crc = 0;
+
+  unsigned char *record = malloc(compressBound(COMPRESS_CHUNK_SIZE));
+  unsigned char *chunk = malloc(COMPRESS_CHUNK_SIZE);
+  unsigned char *compressed = deflate ? malloc(compressBound(COMPRESS_CHUNK_SIZE)) : NULL;
+  uint64_t position, record_start;
+  int result = record != NULL && chunk != NULL && (!deflate || compressed != NULL) ? 0 : -1;
+  if (result == 0)
+    result = seek_record(fd, range.offset, &position, &record_start);
+
+  uint64_t end = range.offset + range.length;
+  while (result == 0 && record_start < end)
+  {
+    size_t length;
+    int is_compressed;
+    if (read_record(fd, &position, record, &length, &is_compressed) != 0 || length == 0)
+    {
+      fprintf(stderr, "Corrupt packed file\n");
+      result = -1;
+      break;
+    }
+    uint64_t record_size = size - record_start < COMPRESS_CHUNK_SIZE ? size - record_start : COMPRESS_CHUNK_SIZE;
+    size_t from = range.offset > record_start ? range.offset - record_start : 0;
+    size_t to = end - record_start < record_size ? end - record_start : record_size;
+    record_start += record_size;
+    scheduler_pace(to - from);
+
+    if (deflate && from == 0 && to == record_size)
+    {
+      uint32_t flags = FRAME_FLAG_CHUNKED | (is_compressed ? FRAME_FLAG_COMPRESSED : 0);
+      if (checked && !is_compressed)
+        result = send_checked_frame(socket, flags, request_id, record, length);
+      else
+        result = send_frame(socket, OP_DATA, flags, request_id, record, length);
+      continue;
+    }
+
+    // the part of the record in the range is cut from its content
+    const unsigned char *content = record;
+    size_t content_length = length;
+    if (is_compressed)
+    {
+      if (inflate_chunk(record, length, chunk, &content_length) != 0)
+        content_length = 0;
+      content = chunk;
+    }
+    if (content_length != record_size)
+    {
+      fprintf(stderr, "Corrupt packed file\n");
+      result = -1;
+    }
+    else if (deflate)
+      result = send_maybe_compressed(socket, request_id, content + from, to - from, compressed, checked);
+    else
+    {
+      crc = crc32c(crc, content + from, to - from);
+      result = send_all(socket, content + from, to - from, 0);
+    }
+  }
+  free(record);
+  free(chunk);
+  free(compressed);
+  if (result != 0)
+    return -1;
+  if (deflate)
+    return send_chunk(socket, request_id, NULL, 0);
+  return checked ? send_checksum(socket, crc) : 0;
+}
+
+// Send a range of a file that is not packed as a chunked body, compressing every chunk on the way
+static int send_compressed_chunks(int socket, uint32_t request_id, int fd, struct byte_range range, int checked)
+{
+  unsigned char *chunk = malloc(COMPRESS_CHUNK_SIZE);
+  unsigned char *compressed = malloc(compressBound(COMPRESS_CHUNK_SIZE));
+  int result = chunk != NULL && compressed != NULL ? 0 : -1;
+  uint64_t end = range.offset + range.length;
+  for (uint64_t offset = range.offset; result == 0 && offset < end;)
+  {
+    size_t length = end - offset < COMPRESS_CHUNK_SIZE ? end - offset : COMPRESS_CHUNK_SIZE;
+    if (read_all_at(fd, chunk, length, offset) != 0)
+      result = -1;
+    else
+      result = send_maybe_compressed(socket, request_id, chunk, length, compressed, checked);
+    scheduler_pace(length);
+    offset += length;
+  }
+  free(chunk);
+  free(compressed);
+  return result == 0 ? send_chunk(socket, request_id, NULL, 0) : -1;
+}
+
+int send_compressed_file(int socket, uint32_t request_id, int fd, int deflate, int checked, struct byte_range range)
+{
+  uint64_t size;
+  int packed = compress_content_size(fd, &size);
+  if (packed < 0 || (!packed && !deflate))
+    return packed;
+  // nothing is on the wire yet, the request fails with its result
+  if (clamp_range(&range, size) != 0)
+    return -1;
+
+  int result;
+  if (packed)
+    result = send_packed(socket, request_id, fd, size, range, deflate, checked);
+  else
+    result = send_compressed_chunks(socket, request_id, fd, range, checked);
+  if (result != 0)
+  {
+    // part of the body is on the wire, the stream can only be cut
+    perror("Failed to send file");
+    shutdown(socket, SHUT_RDWR);
+    return -1;
+  }
+  return 1;
+}
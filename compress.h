@@ -0,0 +1,154 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "protocol.h"
+
+/*
+ * Compression of text file bodies, on the wire and at rest, with zlib.
+ *
+ * On the wire, every chunk of a chunked body may be compressed on its own
+ * and flagged FRAME_FLAG_COMPRESSED; the payload is then a zlib stream that
+ * inflates to at most COMPRESS_CHUNK_SIZE bytes. Chunks that would not shrink
+ * are sent as they are, so one body can mix both. A relay passes compressed
+ * chunks on untouched, only the ends of a transfer pay for compression.
+ *
+ * Peers opt in per request with the COMPRESS_CAPABILITY word: a server lists
+ * it in the result of uresume when it accepts compressed upload chunks, and a
+ * client appends it to the arguments of dfile when it accepts a compressed
+ * download. Offsets, sizes and resumed uploads always count uncompressed
+ * bytes.
+ *
+ * At rest, with --compress-at-rest, a file is packed once it is complete: a
+ * header holding the uncompressed size, then one record per chunk of the file
+ * in the same per-chunk format as on the wire. A packed file is sent to a
+ * client that accepts compression record by record without inflating it, and
+ * inflated for any other reader. Files that are not packed, such as those
+ * stored before the option was given, are read as they are.
+ */
+
+// Largest number of bytes one compressed chunk or record inflates to
+#define COMPRESS_CHUNK_SIZE (1024 * 1024)
+
+// Word a peer sends to tell it accepts compressed chunks
+#define COMPRESS_CAPABILITY "deflate"
+
+/**
+ * @brief zlib compression level used for chunks and packed files, from 1 (fastest) to 9 (smallest), set with
+ *        --compress-level.
+ */
+extern int compress_level;
+
+/**
+ * @brief Whether complete files are packed in the store, set with --compress-at-rest.
+ */
+extern int compress_at_rest;
+
+/**
+ * @brief Whether a file name is one of the text files that are worth compressing.
+ *
+ * @param file_name The file name or path.
+ * @return int Returns 1 for .txt and .c files, 0 otherwise.
+ */
+int compress_worthwhile(const char *file_name);
+
+/**
+ * @brief Get the size of the buffer compress_chunk may write for a chunk.
+ *
+ * @param length The length of the chunk.
+ * @return size_t The largest compressed size of the chunk.
+ */
+size_t compress_bound(size_t length);
+
+/**
+ * @brief Compress one chunk.
+ *
+ * @param data The chunk, at most COMPRESS_CHUNK_SIZE bytes.
+ * @param length The length of the chunk.
+ * @param out The buffer for the compressed chunk, at least compress_bound(length) bytes.
+ * @param out_length Set to the length of the compressed chunk.
+ * @return int Returns 1 if the chunk was compressed, 0 if it would not shrink and is to be sent as it is.
+ */
+int compress_chunk(const void *data, size_t length, void *out, size_t *out_length);
+
+/**
+ * @brief Inflate one compressed chunk.
+ *
+ * @param data The compressed chunk.
+ * @param length The length of the compressed chunk.
+ * @param out The buffer for the chunk, at least COMPRESS_CHUNK_SIZE bytes.
+ * @param out_length Set to the length of the chunk.
+ * @return int Returns 0 on success, -1 if the chunk is corrupt or inflates to more than COMPRESS_CHUNK_SIZE bytes.
+ */
+int inflate_chunk(const void *data, size_t length, void *out, size_t *out_length);
+
+/**
+ * @brief Receive the payload of a compressed chunk and inflate it.
+ *
+ * The payload is consumed even when it is rejected, unless the connection broke.
+ *
+ * @param socket The socket to receive from.
+ * @param payload_length The length of the payload, as in the chunk's header.
+ * @param out The buffer for the chunk, at least COMPRESS_CHUNK_SIZE bytes.
+ * @param out_length Set to the length of the chunk.
+ * @return int Returns 0 on success, 1 if the payload was consumed but is corrupt, -1 if the connection broke.
+ */
+int recv_compressed_chunk(int socket, uint64_t payload_length, void *out, size_t *out_length);
+
+/**
+ * @brief Get the size of the content of a file of the store, packed or not.
+ *
+ * @param fd The file.
+ * @param size Set to the uncompressed size of the file.
+ * @return int Returns 1 if the file is packed, 0 if it is not, -1 if it cannot be read.
+ */
+int compress_content_size(int fd, uint64_t *size);
+
+/**
+ * @brief Pack a complete file in place, if --compress-at-rest is given.
+ *
+ * The packed copy is written next to the file and renamed over it.
+ *
+ * @param path The file, outside the store.
+ * @return int Returns 0 on success or when packing is off, -1 otherwise.
+ */
+int compress_file(const char *path);
+
+/**
+ * @brief Read the content of a packed file, one record at a time.
+ *
+ * @param fd The packed file.
+ * @param position The offset of the record to read, 0 for the first one; advanced to the next record.
+ * @param out The buffer for the inflated record, at least COMPRESS_CHUNK_SIZE bytes.
+ * @param out_length Set to the length of the inflated record, 0 at the end of the file.
+ * @return int Returns 0 on success, -1 if the file cannot be read or is corrupt.
+ */
+int compress_read_record(int fd, uint64_t *position, void *out, size_t *out_length);
+
+/**
+ * @brief Send a byte range of a file of the store as the body of a download.
+ *
+ * A client that accepts compression gets a chunked body of compressed chunks,
+ * taken from the records of a packed file as they are or compressed on the
+ * way from a file that is not packed. Any other client gets a single data
+ * frame of the uncompressed size of the range, inflated from a packed file on
+ * the way. The records before the range are skipped by their headers, so no
+ * prefix of the file is read. A file that is neither packed nor compressed is
+ * left to the caller, to send through the selected transmit path. A client
+ * that checks the download gets a checksum after every frame that is not
+ * compressed.
+ *
+ * @param socket The socket to send on.
+ * @param request_id The id of the request the file answers.
+ * @param fd The file.
+ * @param deflate 1 if the client accepts compressed chunks, 0 otherwise.
+ * @param checked 1 if the client checks the download, 0 otherwise.
+ * @param range The range of the content to send, cut at the end of the file.
+ * @return int Returns 1 if the range was sent, 0 if the caller sends it, -1 on failure or if the range starts past the
+ *             end of the file. On failure part way the socket is shut down.
+ */
+int send_compressed_file(int socket, uint32_t request_id, int fd, int deflate, int checked, struct byte_range range);
+
+#endif
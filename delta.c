@@ -0,0 +1,567 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+#include "compress.h"
+#include "sha256.h"
+#include "delta.h"
+
+// First byte of every chunk of a delta
+#define INSTRUCTION_COPY 'C'
+#define INSTRUCTION_LITERAL 'L'
+
+// A copy instruction holds its first block as 8 bytes and its number of blocks as 4
+#define COPY_INSTRUCTION_SIZE 13
+
+static void put_u32(unsigned char *p, uint32_t value)
+{
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put_u64(unsigned char *p, uint64_t value)
+{
+  put_u32(p, value >> 32);
+  put_u32(p + 4, (uint32_t)value);
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+  return (uint64_t)get_u32(p) << 32 | get_u32(p + 4);
+}
+
+static int read_all_at(int fd, void *buffer, size_t length, uint64_t offset)
+{
+  char *p = buffer;
+  while (length > 0)
+  {
+    ssize_t bytes_read = pread(fd, p, length, offset);
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0)
+      return -1;
+    p += bytes_read;
+    length -= bytes_read;
+    offset += bytes_read;
+  }
+  return 0;
+}
+
+/* CHECKSUMS */
+
+// The rolling checksum of a window, two sums of which the low 16 bits count
+struct rolling
+{
+  uint32_t a; // Sum of the bytes
+  uint32_t b; // Sum of the bytes weighted by their distance from the end of the window
+};
+
+static void rolling_init(struct rolling *sum, const unsigned char *data, size_t length)
+{
+  sum->a = 0;
+  sum->b = 0;
+  for (size_t i = 0; i < length; i++)
+  {
+    sum->a += data[i];
+    sum->b += (uint32_t)(length - i) * data[i];
+  }
+}
+
+// Slide a window of length bytes on by one byte, out leaving it and in entering it
+static void rolling_roll(struct rolling *sum, unsigned char out, unsigned char in, size_t length)
+{
+  sum->a = sum->a - out + in;
+  sum->b = sum->b - (uint32_t)length * out + sum->a;
+}
+
+static uint32_t rolling_value(const struct rolling *sum)
+{
+  return (sum->a & 0xffff) | sum->b << 16;
+}
+
+// The bit of the signature filter a rolling checksum falls on
+static unsigned filter_bit(uint32_t weak)
+{
+  return (weak ^ weak >> 16) & 0xffff;
+}
+
+static void strong_hash(const unsigned char *data, size_t length, unsigned char strong[DELTA_STRONG_SIZE])
+{
+  struct sha256 hash;
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  sha256_init(&hash);
+  sha256_update(&hash, data, length);
+  sha256_final(&hash, digest);
+  memcpy(strong, digest, DELTA_STRONG_SIZE);
+}
+
+static int valid_block_size(uint32_t block_size)
+{
+  return block_size >= DELTA_MIN_BLOCK_SIZE && block_size <= DELTA_MAX_BLOCK_SIZE &&
+         (block_size & (block_size - 1)) == 0;
+}
+
+uint32_t delta_block_size(uint64_t file_size)
+{
+  // larger files get larger blocks, so their signatures stay small next to the file
+  uint32_t block_size = DELTA_MIN_BLOCK_SIZE;
+  while (file_size / block_size > DELTA_TARGET_BLOCKS && block_size < DELTA_MAX_BLOCK_SIZE)
+    block_size *= 2;
+  return block_size;
+}
+
+/* STORED FILES */
+
+// Open the content of a file of the store, a packed file is unpacked into an unlinked scratch file
+static int open_content(const char *path, uint64_t *size)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  int packed = compress_content_size(fd, size);
+  if (packed <= 0)
+  {
+    if (packed == 0)
+      return fd;
+    close(fd);
+    return -1;
+  }
+
+  FILE *scratch = tmpfile();
+  unsigned char *buffer = malloc(COMPRESS_CHUNK_SIZE);
+  uint64_t position = 0, unpacked = 0;
+  int failed = scratch == NULL || buffer == NULL;
+  while (!failed && unpacked < *size)
+  {
+    size_t length;
+    if (compress_read_record(fd, &position, buffer, &length) != 0 || length == 0 ||
+        fwrite(buffer, 1, length, scratch) != length)
+      failed = 1;
+    unpacked += length;
+  }
+  free(buffer);
+  close(fd);
+
+  int content = !failed && fflush(scratch) == 0 && unpacked == *size ? dup(fileno(scratch)) : -1;
+  if (content < 0)
+    fprintf(stderr, "Failed to unpack %s\n", path);
+  if (scratch != NULL)
+    fclose(scratch);
+  return content;
+}
+
+int delta_send_signatures(int socket, uint32_t request_id, const char *file_path)
+{
+  // a file that cannot be read is as good as missing, the client uploads the whole file
+  uint64_t size;
+  int fd = open_content(file_path, &size);
+  if (fd < 0)
+    return 0;
+
+  // the tail shorter than a block has no signature, it is always sent as a literal
+  uint32_t block_size = delta_block_size(size);
+  uint32_t count = size / block_size;
+  unsigned char *block = malloc(block_size);
+  if (block == NULL)
+  {
+    close(fd);
+    return -1;
+  }
+
+  unsigned char header[DELTA_HEADER_SIZE];
+  put_u32(header, block_size);
+  put_u64(header + 4, size);
+  put_u32(header + 12, count);
+  if (send_frame_header(socket, OP_DATA, 0, request_id, DELTA_HEADER_SIZE + (uint64_t)count * DELTA_SIGNATURE_SIZE) !=
+          0 ||
+      send_all(socket, header, sizeof(header), 0) != 0)
+  {
+    free(block);
+    close(fd);
+    return -1;
+  }
+
+  // signatures are sent in batches as the blocks are read
+  unsigned char batch[1024 * DELTA_SIGNATURE_SIZE];
+  size_t batch_length = 0;
+  int result = 1;
+  for (uint32_t i = 0; i < count && result == 1; i++)
+  {
+    if (read_all_at(fd, block, block_size, (uint64_t)i * block_size) != 0)
+    {
+      perror("Failed to read file");
+      result = -1;
+      break;
+    }
+    struct rolling sum;
+    rolling_init(&sum, block, block_size);
+    put_u32(batch + batch_length, rolling_value(&sum));
+    strong_hash(block, block_size, batch + batch_length + 4);
+    batch_length += DELTA_SIGNATURE_SIZE;
+
+    if ((batch_length == sizeof(batch) || i + 1 == count) && send_all(socket, batch, batch_length, 0) != 0)
+      result = -1;
+    if (batch_length == sizeof(batch))
+      batch_length = 0;
+  }
+  free(block);
+  close(fd);
+
+  // the frame length is already on the wire, so the stream can only be cut
+  if (result != 1)
+    shutdown(socket, SHUT_RDWR);
+  return result;
+}
+
+// Append a run of blocks of the stored file to the new file
+static int copy_blocks(int base, FILE *out, uint64_t offset, uint64_t length, unsigned char *buffer,
+                       struct sha256 *hash)
+{
+  while (length > 0)
+  {
+    size_t piece = length < DELTA_LITERAL_SIZE ? length : DELTA_LITERAL_SIZE;
+    if (read_all_at(base, buffer, piece, offset) != 0 || fwrite(buffer, 1, piece, out) != piece)
+      return -1;
+    sha256_update(hash, buffer, piece);
+    offset += piece;
+    length -= piece;
+  }
+  return 0;
+}
+
+int delta_receive(int socket, const char *base_path, const char *out_path, uint64_t file_size, const char *hex,
+                  uint32_t block_size, unsigned char digest[SHA256_DIGEST_SIZE])
+{
+  // the body is read to its end whatever happens, a delta that does not apply only fails the request
+  uint64_t base_size = 0;
+  int base = valid_block_size(block_size) ? open_content(base_path, &base_size) : -1;
+  FILE *out = base >= 0 ? fopen(out_path, "wb") : NULL;
+  unsigned char *buffer = malloc(DELTA_LITERAL_SIZE);
+  int valid = base >= 0 && out != NULL && buffer != NULL;
+  if (!valid)
+    fprintf(stderr, "Cannot apply delta to %s\n", base_path);
+  uint64_t base_blocks = valid ? base_size / block_size : 0;
+
+  struct sha256 hash;
+  sha256_init(&hash);
+  uint64_t written = 0;
+  int broken = 0;
+  while (!broken)
+  {
+    struct frame_header chunk;
+    if (recv_frame_header(socket, &chunk) != 1 || chunk.opcode != OP_DATA || !(chunk.flags & FRAME_FLAG_CHUNKED))
+    {
+      perror("Delta interrupted");
+      broken = 1;
+      break;
+    }
+    if (chunk.payload_length == 0)
+      break;
+
+    unsigned char type;
+    if (recv_all(socket, &type, 1) != 1)
+    {
+      broken = 1;
+      break;
+    }
+    uint64_t remaining = chunk.payload_length - 1;
+
+    if (valid && type == INSTRUCTION_COPY && remaining == COPY_INSTRUCTION_SIZE - 1 &&
+        !(chunk.flags & FRAME_FLAG_COMPRESSED))
+    {
+      unsigned char copy[COPY_INSTRUCTION_SIZE - 1];
+      if (recv_all(socket, copy, sizeof(copy)) != 1)
+      {
+        broken = 1;
+        break;
+      }
+      remaining = 0;
+      uint64_t first = get_u64(copy), blocks = get_u32(copy + 8);
+      if (first > base_blocks || blocks > base_blocks - first || written + blocks * block_size > file_size ||
+          copy_blocks(base, out, first * block_size, blocks * block_size, buffer, &hash) != 0)
+        valid = 0;
+      else
+        written += blocks * block_size;
+    }
+    else if (valid && type == INSTRUCTION_LITERAL && written + remaining <= file_size &&
+             !(chunk.flags & FRAME_FLAG_COMPRESSED))
+    {
+      while (remaining > 0 && valid)
+      {
+        size_t piece = remaining < DELTA_LITERAL_SIZE ? remaining : DELTA_LITERAL_SIZE;
+        if (recv_all(socket, buffer, piece) != 1)
+        {
+          broken = 1;
+          break;
+        }
+        remaining -= piece;
+        if (fwrite(buffer, 1, piece, out) != piece)
+          valid = 0;
+        sha256_update(&hash, buffer, piece);
+        written += piece;
+      }
+    }
+    else
+      valid = 0;
+
+    // what is left of a rejected instruction is thrown away
+    if (!broken && remaining > 0 && discard_payload(socket, remaining) != 0)
+      broken = 1;
+  }
+
+  free(buffer);
+  if (base >= 0)
+    close(base);
+  if (out != NULL && fclose(out) != 0)
+    valid = 0;
+
+  // the rebuilt file must be the one the client hashed
+  char rebuilt[SHA256_HEX_SIZE + 1] = "";
+  sha256_final(&hash, digest);
+  sha256_hex(digest, rebuilt);
+  if (valid && !broken && (written != file_size || strcmp(rebuilt, hex) != 0))
+  {
+    fprintf(stderr, "Delta does not rebuild %s\n", base_path);
+    valid = 0;
+  }
+  if (!valid || broken)
+  {
+    if (out != NULL)
+      remove(out_path);
+    return -1;
+  }
+  return 1;
+}
+
+/* CLIENT */
+
+static int compare_blocks(const void *a, const void *b)
+{
+  const struct delta_block *x = a, *y = b;
+  if (x->weak != y->weak)
+    return x->weak < y->weak ? -1 : 1;
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+int delta_recv_signatures(int socket, uint64_t payload_length, struct delta_signatures *signatures)
+{
+  memset(signatures, 0, sizeof(*signatures));
+  if (payload_length < DELTA_HEADER_SIZE)
+    return discard_payload(socket, payload_length) == 0 ? 1 : -1;
+
+  unsigned char header[DELTA_HEADER_SIZE];
+  if (recv_all(socket, header, sizeof(header)) != 1)
+    return -1;
+  signatures->block_size = get_u32(header);
+  signatures->file_size = get_u64(header + 4);
+  signatures->count = get_u32(header + 12);
+
+  uint64_t remaining = payload_length - DELTA_HEADER_SIZE;
+  if (!valid_block_size(signatures->block_size) || remaining != (uint64_t)signatures->count * DELTA_SIGNATURE_SIZE ||
+      signatures->count > signatures->file_size / signatures->block_size ||
+      (signatures->blocks = malloc((signatures->count + 1) * sizeof(struct delta_block))) == NULL)
+    return discard_payload(socket, remaining) == 0 ? 1 : -1;
+
+  unsigned char batch[1024 * DELTA_SIGNATURE_SIZE];
+  for (uint32_t i = 0; i < signatures->count;)
+  {
+    uint32_t batch_count = signatures->count - i < 1024 ? signatures->count - i : 1024;
+    if (recv_all(socket, batch, (size_t)batch_count * DELTA_SIGNATURE_SIZE) != 1)
+    {
+      delta_free_signatures(signatures);
+      return -1;
+    }
+    for (uint32_t k = 0; k < batch_count; k++, i++)
+    {
+      struct delta_block *block = &signatures->blocks[i];
+      block->weak = get_u32(batch + k * DELTA_SIGNATURE_SIZE);
+      memcpy(block->strong, batch + k * DELTA_SIGNATURE_SIZE + 4, DELTA_STRONG_SIZE);
+      block->index = i;
+      signatures->filter[filter_bit(block->weak) / 8] |= 1 << filter_bit(block->weak) % 8;
+    }
+  }
+
+  // sorted by rolling checksum for lookups, equal checksums in file order
+  qsort(signatures->blocks, signatures->count, sizeof(struct delta_block), compare_blocks);
+  return 0;
+}
+
+void delta_free_signatures(struct delta_signatures *signatures)
+{
+  free(signatures->blocks);
+  signatures->blocks = NULL;
+  signatures->count = 0;
+}
+
+// Find a block of the stored file equal to the window, preferring the block that continues the last copy
+static const struct delta_block *find_block(const struct delta_signatures *signatures, uint32_t weak,
+                                            const unsigned char *window, uint64_t preferred)
+{
+  if (!(signatures->filter[filter_bit(weak) / 8] & 1 << filter_bit(weak) % 8))
+    return NULL;
+
+  size_t low = 0, high = signatures->count;
+  while (low < high)
+  {
+    size_t middle = low + (high - low) / 2;
+    if (signatures->blocks[middle].weak < weak)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  // the strong hash of the window is only taken when a rolling checksum matches
+  const struct delta_block *found = NULL;
+  unsigned char strong[DELTA_STRONG_SIZE];
+  int hashed = 0;
+  for (size_t i = low; i < signatures->count && signatures->blocks[i].weak == weak; i++)
+  {
+    if (!hashed)
+    {
+      strong_hash(window, signatures->block_size, strong);
+      hashed = 1;
+    }
+    if (memcmp(signatures->blocks[i].strong, strong, DELTA_STRONG_SIZE) != 0)
+      continue;
+    if (signatures->blocks[i].index == preferred)
+      return &signatures->blocks[i];
+    if (found == NULL)
+      found = &signatures->blocks[i];
+  }
+  return found;
+}
+
+static int add_instruction(struct delta_plan *plan, int copy, uint64_t start, uint64_t length)
+{
+  if (plan->count == plan->capacity)
+  {
+    size_t capacity = plan->capacity > 0 ? plan->capacity * 2 : 64;
+    struct delta_instruction *instructions = realloc(plan->instructions, capacity * sizeof(*instructions));
+    if (instructions == NULL)
+      return -1;
+    plan->instructions = instructions;
+    plan->capacity = capacity;
+  }
+  plan->instructions[plan->count++] = (struct delta_instruction){.copy = copy, .start = start, .length = length};
+  return 0;
+}
+
+static int add_literal(struct delta_plan *plan, uint64_t offset, uint64_t length)
+{
+  if (length == 0)
+    return 0;
+  plan->literal_bytes += length;
+  return add_instruction(plan, 0, offset, length);
+}
+
+static int add_copy(struct delta_plan *plan, uint64_t block)
+{
+  // consecutive blocks are copied by one instruction
+  struct delta_instruction *last = plan->count > 0 ? &plan->instructions[plan->count - 1] : NULL;
+  if (last != NULL && last->copy && last->start + last->length == block && last->length < UINT32_MAX)
+  {
+    last->length++;
+    return 0;
+  }
+  return add_instruction(plan, 1, block, 1);
+}
+
+int delta_compute(const unsigned char *data, uint64_t size, const struct delta_signatures *signatures,
+                  struct delta_plan *plan)
+{
+  memset(plan, 0, sizeof(*plan));
+  uint64_t block_size = signatures->block_size;
+  uint64_t position = 0, literal_start = 0;
+  struct rolling sum;
+  int window = 0; // Whether sum holds the checksum of the block at position
+
+  while (signatures->count > 0 && position + block_size <= size)
+  {
+    if (!window)
+    {
+      rolling_init(&sum, data + position, block_size);
+      window = 1;
+    }
+
+    const struct delta_instruction *last = plan->count > 0 ? &plan->instructions[plan->count - 1] : NULL;
+    uint64_t preferred = last != NULL && last->copy ? last->start + last->length : UINT64_MAX;
+    const struct delta_block *match = find_block(signatures, rolling_value(&sum), data + position, preferred);
+    if (match != NULL)
+    {
+      // the bytes since the last match go as a literal, the block as a copy
+      if (add_literal(plan, literal_start, position - literal_start) != 0 || add_copy(plan, match->index) != 0)
+      {
+        delta_free_plan(plan);
+        return -1;
+      }
+      position += block_size;
+      literal_start = position;
+      window = 0;
+      continue;
+    }
+
+    if (position + block_size < size)
+      rolling_roll(&sum, data[position], data[position + block_size], block_size);
+    position++;
+  }
+
+  if (add_literal(plan, literal_start, size - literal_start) != 0)
+  {
+    delta_free_plan(plan);
+    return -1;
+  }
+  return 0;
+}
+
+int delta_send_plan(int socket, uint32_t request_id, const unsigned char *data, const struct delta_plan *plan)
+{
+  for (size_t i = 0; i < plan->count; i++)
+  {
+    const struct delta_instruction *instruction = &plan->instructions[i];
+    if (instruction->copy)
+    {
+      unsigned char copy[COPY_INSTRUCTION_SIZE];
+      copy[0] = INSTRUCTION_COPY;
+      put_u64(copy + 1, instruction->start);
+      put_u32(copy + 9, instruction->length);
+      if (send_chunk(socket, request_id, copy, sizeof(copy)) != 0)
+        return -1;
+      continue;
+    }
+
+    // a long literal is split over several chunks
+    for (uint64_t offset = 0; offset < instruction->length; offset += DELTA_LITERAL_SIZE)
+    {
+      uint64_t piece = instruction->length - offset < DELTA_LITERAL_SIZE ? instruction->length - offset
+                                                                         : DELTA_LITERAL_SIZE;
+      unsigned char type = INSTRUCTION_LITERAL;
+      if (send_frame_header(socket, OP_DATA, FRAME_FLAG_CHUNKED, request_id, piece + 1) != 0 ||
+          send_all(socket, &type, 1, 0) != 0 || send_all(socket, data + instruction->start + offset, piece, 0) != 0)
+        return -1;
+    }
+  }
+
+  // the zero length chunk ends the body
+  return send_chunk(socket, request_id, NULL, 0);
+}
+
+void delta_free_plan(struct delta_plan *plan)
+{
+  free(plan->instructions);
+  plan->instructions = NULL;
+  plan->count = 0;
+  plan->capacity = 0;
+}
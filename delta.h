@@ -0,0 +1,186 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sha256.h"
+
+/*
+ * Delta uploads, rsync style, of files the store holds an older copy of.
+ *
+ * OP_USIG ("fileName /destination/path") asks for the block signatures of the
+ * file stored at the path, answered with a data frame holding a header and
+ * one signature per whole block of the stored content, all in network byte
+ * order:
+ *
+ *   header     4 block size, 8 content size, 4 number of signatures
+ *   signature  4 rolling checksum, DELTA_STRONG_SIZE bytes of the SHA-256 of the block
+ *
+ * and a failed result if there is no file at the path. The client slides a
+ * window of one block over its copy of the file, a byte at a time, looking
+ * the rolling checksum of the window up among the signatures and confirming
+ * a hit with the strong hash, and finds the blocks the server holds already.
+ *
+ * OP_UDELTA ("fileName /destination/path file_size sha256 block_size") is
+ * followed by a chunked body of instructions rebuilding the new file from the
+ * stored one, one instruction per chunk:
+ *
+ *   'C' 8 first block, 4 number of blocks  copy whole blocks of the stored file
+ *   'L' bytes                              literal bytes of the new file
+ *
+ * The server writes the new file into a temporary file, checks that it has
+ * file_size bytes with the SHA-256 given in hexadecimal, and only then moves
+ * it over the path as any other upload, so a delta against a file that
+ * changed in the meantime fails and the client uploads the whole file.
+ *
+ * A file packed at rest is unpacked into a scratch file before its blocks
+ * are read; see compress.h.
+ */
+
+// Smallest and largest block size, a power of two picked from the size of the stored file
+#define DELTA_MIN_BLOCK_SIZE 2048
+#define DELTA_MAX_BLOCK_SIZE (1024 * 1024)
+
+// Number of signatures past which the block size is doubled
+#define DELTA_TARGET_BLOCKS 16384
+
+// Bytes of the SHA-256 of a block kept in its signature
+#define DELTA_STRONG_SIZE 16
+
+// Largest literal sent in one chunk
+#define DELTA_LITERAL_SIZE (256 * 1024)
+
+// Size of the signature header and of one signature on the wire
+#define DELTA_HEADER_SIZE 16
+#define DELTA_SIGNATURE_SIZE (4 + DELTA_STRONG_SIZE)
+
+/**
+ * @brief The signature of one block of the stored file.
+ */
+struct delta_block
+{
+  uint32_t weak;
+  unsigned char strong[DELTA_STRONG_SIZE];
+  uint32_t index; // Position of the block in the file
+};
+
+/**
+ * @brief The block signatures of a stored file, sorted by rolling checksum.
+ */
+struct delta_signatures
+{
+  uint32_t block_size;
+  uint64_t file_size;
+  uint32_t count;
+  struct delta_block *blocks;
+  unsigned char filter[65536 / 8]; // Bit set for every 16-bit fold of a rolling checksum among the blocks
+};
+
+/**
+ * @brief One instruction of a delta, a run of blocks of the stored file or a literal of the new one.
+ */
+struct delta_instruction
+{
+  int copy;        // 1 to copy blocks, 0 for a literal
+  uint64_t start;  // The first block copied, or the offset of the literal in the new file
+  uint64_t length; // The number of blocks copied, or the length of the literal
+};
+
+/**
+ * @brief The instructions rebuilding a new file from the stored one.
+ */
+struct delta_plan
+{
+  struct delta_instruction *instructions;
+  size_t count;
+  size_t capacity;
+  uint64_t literal_bytes; // Bytes of the new file sent as literals
+};
+
+/**
+ * @brief Get the block size the signatures of a file are computed with.
+ *
+ * @param file_size The size of the stored file.
+ * @return uint32_t The block size.
+ */
+uint32_t delta_block_size(uint64_t file_size);
+
+/**
+ * @brief Send the block signatures of a file of the store as the body of a usig.
+ *
+ * @param socket The socket to send on.
+ * @param request_id The id of the request the signatures answer.
+ * @param file_path The path of the file in the store.
+ * @return int Returns 1 if the signatures were sent, 0 if there is no such file and nothing was sent, -1 on failure.
+ *             On failure part way the socket is shut down.
+ */
+int delta_send_signatures(int socket, uint32_t request_id, const char *file_path);
+
+/**
+ * @brief Receive the body of a udelta and rebuild the new file from the stored one.
+ *
+ * The body is consumed even when it is rejected, unless the connection broke.
+ *
+ * @param socket The socket to receive from.
+ * @param base_path The path of the stored file the delta was computed against.
+ * @param out_path The path of the temporary file the new file is written to.
+ * @param file_size The size of the new file.
+ * @param hex The SHA-256 of the new file in hexadecimal.
+ * @param block_size The block size of the signatures the delta was computed against.
+ * @param digest Set to the SHA-256 of the new file.
+ * @return int Returns 1 if the new file was rebuilt and matches its size and hash, -1 otherwise.
+ */
+int delta_receive(int socket, const char *base_path, const char *out_path, uint64_t file_size, const char *hex,
+                  uint32_t block_size, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * @brief Receive the payload of a data frame holding block signatures.
+ *
+ * The payload is consumed even when it is rejected, unless the connection broke.
+ *
+ * @param socket The socket to receive from.
+ * @param payload_length The length of the payload, as in the frame's header.
+ * @param signatures Filled with the signatures, to be released with delta_free_signatures.
+ * @return int Returns 0 on success, 1 if the payload was consumed but is invalid, -1 if the connection broke.
+ */
+int delta_recv_signatures(int socket, uint64_t payload_length, struct delta_signatures *signatures);
+
+/**
+ * @brief Release the signatures filled by delta_recv_signatures.
+ *
+ * @param signatures The signatures.
+ */
+void delta_free_signatures(struct delta_signatures *signatures);
+
+/**
+ * @brief Compute the instructions rebuilding a file from the stored file the signatures belong to.
+ *
+ * @param data The content of the new file.
+ * @param size The size of the new file.
+ * @param signatures The signatures of the stored file.
+ * @param plan Filled with the instructions, to be released with delta_free_plan.
+ * @return int Returns 0 on success, -1 if memory ran out.
+ */
+int delta_compute(const unsigned char *data, uint64_t size, const struct delta_signatures *signatures,
+                  struct delta_plan *plan);
+
+/**
+ * @brief Send the instructions of a delta as the chunked body of a udelta, ended by a zero length chunk.
+ *
+ * @param socket The socket to send on.
+ * @param request_id The id of the udelta.
+ * @param data The content of the new file the literals are taken from.
+ * @param plan The instructions.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int delta_send_plan(int socket, uint32_t request_id, const unsigned char *data, const struct delta_plan *plan);
+
+/**
+ * @brief Release the instructions filled by delta_compute.
+ *
+ * @param plan The instructions.
+ */
+void delta_free_plan(struct delta_plan *plan);
+
+#endif
@@ -0,0 +1,518 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <time.h>
+
+#include "event_loop.h"
+#include "stats.h"
+#include "transfer.h"
+
+enum server_model server_model = SERVER_MODEL_EPOLL;
+
+int event_workers = DEFAULT_EVENT_WORKERS;
+
+int event_cpu_affinity = 1;
+
+enum connection_state
+{
+  CONN_READ_HEADER, // Assembling the command frame header
+  CONN_READ_ARGS,   // Assembling the command arguments
+  CONN_DISPATCH,    // Running the handler: payload transfer and result
+};
+
+struct connection
+{
+  int socket;
+  struct sockaddr_in addr;
+  enum connection_state state;
+  size_t filled; // Bytes of the header or arguments received so far
+  unsigned char header_bytes[FRAME_HEADER_SIZE];
+  struct frame_header request;
+  char args[MAX_ARGS_SIZE];
+  struct connection *prev, *next; // Connections of this worker
+};
+
+int parse_server_model(const char *name, enum server_model *model)
+{
+  if (strcmp(name, "fork") == 0)
+    *model = SERVER_MODEL_FORK;
+  else if (strcmp(name, "epoll") == 0)
+    *model = SERVER_MODEL_EPOLL;
+  else
+    return -1;
+  return 0;
+}
+
+const char *server_model_name(enum server_model model)
+{
+  switch (model)
+  {
+  case SERVER_MODEL_FORK:
+    return "fork";
+  case SERVER_MODEL_EPOLL:
+    return "epoll";
+  }
+  return "unknown";
+}
+
+/* HELPERS */
+
+static int set_blocking(int socket, int blocking)
+{
+  int flags = fcntl(socket, F_GETFL);
+  if (flags < 0)
+    return -1;
+  flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+  return fcntl(socket, F_SETFL, flags);
+}
+
+/**
+ * @brief Read what is available towards a fixed size target.
+ *
+ * @return int Returns 1 once the target is complete, 0 if the socket has no more data for now,
+ * -1 if the peer closed the connection or the read failed.
+ */
+static int fill(int socket, void *buffer, size_t length, size_t *filled)
+{
+  while (*filled < length)
+  {
+    ssize_t bytes_received = recv(socket, (char *)buffer + *filled, length - *filled, 0);
+    if (bytes_received < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      return -1;
+    }
+    if (bytes_received == 0)
+      return -1;
+    *filled += bytes_received;
+  }
+  return 1;
+}
+
+/* CONNECTIONS */
+
+static void add_connection(struct connection **connections, struct connection *conn)
+{
+  conn->prev = NULL;
+  conn->next = *connections;
+  if (*connections != NULL)
+    (*connections)->prev = conn;
+  *connections = conn;
+}
+
+static void remove_connection(struct connection **connections, struct connection *conn)
+{
+  if (conn->prev != NULL)
+    conn->prev->next = conn->next;
+  else
+    *connections = conn->next;
+  if (conn->next != NULL)
+    conn->next->prev = conn->prev;
+}
+
+static void close_connection(int epoll_fd, struct connection *conn)
+{
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+  close(conn->socket);
+  printf("Client disconnected: %s:%d\n", inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port));
+  stats_connection_closed();
+  free(conn);
+}
+
+static void accept_connections(int epoll_fd, int server_socket, struct connection **connections)
+{
+  while (1)
+  {
+    struct sockaddr_in client_addr;
+    socklen_t addr_size = sizeof(client_addr);
+    int client_socket = accept4(server_socket, (struct sockaddr *)&client_addr, &addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_socket < 0)
+    {
+      // EAGAIN: the backlog is drained
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        perror("Accept failed");
+      return;
+    }
+
+    struct connection *conn = calloc(1, sizeof(*conn));
+    if (conn == NULL)
+    {
+      close(client_socket);
+      continue;
+    }
+    conn->socket = client_socket;
+    conn->addr = client_addr;
+    conn->state = CONN_READ_HEADER;
+
+    // Only the blocking payload transfer is affected by the timeouts
+    struct timeval timeout = {.tv_sec = EVENT_TRANSFER_TIMEOUT_SEC};
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event) != 0)
+    {
+      perror("epoll_ctl failed");
+      close(client_socket);
+      free(conn);
+      continue;
+    }
+    add_connection(connections, conn);
+    printf("Client connected: %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+    stats_connection_opened();
+  }
+}
+
+/**
+ * @brief Advance the state machine of a readable connection.
+ *
+ * @return int Returns 0 while the connection stays open, -1 once it must be closed.
+ */
+static int handle_readable(struct connection *conn, command_handler handler)
+{
+  int result;
+  switch (conn->state)
+  {
+  case CONN_READ_HEADER:
+    result = fill(conn->socket, conn->header_bytes, FRAME_HEADER_SIZE, &conn->filled);
+    if (result <= 0)
+      return result;
+    if (decode_frame_header(conn->header_bytes, &conn->request) != 1)
+      return -1;
+    if (conn->request.payload_length >= MAX_ARGS_SIZE)
+    {
+      fprintf(stderr, "Frame payload too large: %llu bytes\n", (unsigned long long)conn->request.payload_length);
+      return -1;
+    }
+    conn->state = CONN_READ_ARGS;
+    conn->filled = 0;
+    // the arguments usually arrived with the header
+    // fall through
+
+  case CONN_READ_ARGS:
+    result = fill(conn->socket, conn->args, conn->request.payload_length, &conn->filled);
+    if (result <= 0)
+      return result;
+    conn->args[conn->request.payload_length] = '\0';
+    conn->state = CONN_DISPATCH;
+    // fall through
+
+  case CONN_DISPATCH:
+    // The handlers stream the payload and the result with blocking I/O, the other connections of the worker wait
+    if (set_blocking(conn->socket, 1) != 0)
+      return -1;
+    if (log_level >= LOG_DEBUG)
+      printf("Command received: %s %s\n", opcode_name(conn->request.opcode), conn->args);
+    handler(conn->socket, &conn->request, conn->args);
+    if (set_blocking(conn->socket, 0) != 0)
+      return -1;
+
+    conn->state = CONN_READ_HEADER;
+    conn->filled = 0;
+    return 0;
+  }
+  return -1;
+}
+
+/* WORKERS */
+
+static int *listeners;  // One SO_REUSEPORT listening socket per worker
+static pid_t *workers;  // Worker process ids, 0 once a worker has drained
+static volatile sig_atomic_t stop_requested;
+
+static void supervisor_stop(int sig)
+{
+  (void)sig;
+  stop_requested = 1;
+  // Ask every worker to drain, kill and close are async-signal-safe. The copies of the listeners kept to restart
+  // workers are closed too, so a listener goes away once its worker stops accepting and the kernel hashes new
+  // connections onto the workers still accepting instead of leaving them in a backlog nobody reads
+  for (int i = 0; i < event_workers; i++)
+  {
+    if (workers[i] > 0)
+      kill(workers[i], SIGTERM);
+    if (listeners[i] >= 0)
+    {
+      close(listeners[i]);
+      listeners[i] = -1;
+    }
+  }
+}
+
+static void worker_stop(int sig)
+{
+  (void)sig;
+  stop_requested = 1;
+}
+
+static int allowed_cpu_count(void)
+{
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    return 1;
+  int count = CPU_COUNT(&allowed);
+  return count > 0 ? count : 1;
+}
+
+static void pin_to_cpu(int index)
+{
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    return;
+
+  // Worker n runs on the n-th CPU this process may use, wrapping around
+  int target = index % CPU_COUNT(&allowed);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+  {
+    if (!CPU_ISSET(cpu, &allowed) || target-- > 0)
+      continue;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == 0)
+      printf("Worker %d pinned to CPU %d\n", getpid(), cpu);
+    return;
+  }
+}
+
+static void close_idle_connections(int epoll_fd, struct connection **connections)
+{
+  struct connection *conn = *connections;
+  while (conn != NULL)
+  {
+    struct connection *next = conn->next;
+    // A connection between requests has nothing in flight
+    if (conn->state == CONN_READ_HEADER && conn->filled == 0)
+    {
+      remove_connection(connections, conn);
+      close_connection(epoll_fd, conn);
+    }
+    conn = next;
+  }
+}
+
+static void run_worker(int index, command_handler handler, const sigset_t *wait_mask)
+{
+  // Do not outlive the supervisor
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+  // SIGINT and SIGTERM are blocked outside epoll_pwait, so a transfer is never interrupted
+  struct sigaction action = {.sa_handler = worker_stop};
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  // A client that goes away mid sendfile/splice must fail the request, not kill the worker
+  signal(SIGPIPE, SIG_IGN);
+
+  int server_socket = listeners[index];
+  for (int i = 0; i < event_workers; i++)
+    if (i != index)
+      close(listeners[i]);
+
+  if (event_cpu_affinity)
+    pin_to_cpu(index);
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0)
+  {
+    perror("epoll_create1 failed");
+    exit(EXIT_FAILURE);
+  }
+
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &event) != 0)
+  {
+    perror("epoll_ctl failed");
+    exit(EXIT_FAILURE);
+  }
+
+  struct connection *connections = NULL;
+  time_t drain_deadline = 0;
+  struct epoll_event events[EVENT_BATCH_SIZE];
+  while (1)
+  {
+    if (stop_requested && server_socket >= 0)
+    {
+      // Stop accepting, requests in flight are finished first
+      close(server_socket);
+      server_socket = -1;
+      drain_deadline = time(NULL) + EVENT_DRAIN_TIMEOUT_SEC;
+      printf("Worker %d draining\n", getpid());
+    }
+    if (server_socket < 0)
+    {
+      close_idle_connections(epoll_fd, &connections);
+      if (connections == NULL || time(NULL) >= drain_deadline)
+        break;
+    }
+
+    int ready = epoll_pwait(epoll_fd, events, EVENT_BATCH_SIZE, server_socket < 0 ? 1000 : -1, wait_mask);
+    if (ready < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait failed");
+      exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < ready; i++)
+    {
+      struct connection *conn = events[i].data.ptr;
+      if (conn == NULL)
+      {
+        if (server_socket >= 0)
+          accept_connections(epoll_fd, server_socket, &connections);
+      }
+      else if (handle_readable(conn, handler) != 0)
+      {
+        remove_connection(&connections, conn);
+        close_connection(epoll_fd, conn);
+      }
+    }
+  }
+
+  while (connections != NULL)
+  {
+    struct connection *conn = connections;
+    remove_connection(&connections, conn);
+    close_connection(epoll_fd, conn);
+  }
+  printf("Worker %d drained\n", getpid());
+
+  // the worker's figures cover every connection it served, to compare the transmit paths as prcclient does
+  print_transfer_stats("Worker");
+  exit(0);
+}
+
+static pid_t start_worker(int index, command_handler handler, const sigset_t *wait_mask)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    run_worker(index, handler, wait_mask);
+    exit(0);
+  }
+  if (pid < 0)
+    perror("Fork failed");
+  return pid;
+}
+
+int open_worker_listeners(int server_port)
+{
+  if (event_workers < 1)
+    event_workers = allowed_cpu_count();
+
+  listeners = calloc(event_workers, sizeof(int));
+  workers = calloc(event_workers, sizeof(pid_t));
+  if (listeners == NULL || workers == NULL)
+    return -1;
+
+  struct sockaddr_in server_addr = {0};
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(server_port);
+  server_addr.sin_addr.s_addr = INADDR_ANY;
+
+  for (int i = 0; i < event_workers; i++)
+  {
+    // The kernel spreads new connections over all sockets bound with SO_REUSEPORT
+    int opt = 1;
+    listeners[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listeners[i] < 0 || setsockopt(listeners[i], SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) != 0 ||
+        bind(listeners[i], (struct sockaddr *)&server_addr, sizeof(server_addr)) != 0 ||
+        listen(listeners[i], SOMAXCONN) != 0)
+    {
+      while (i >= 0)
+        close(listeners[i--]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int run_event_loop(command_handler handler)
+{
+  // Every connection is a descriptor, allow as many as the hard limit does
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+  {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  // Stop signals are only taken while waiting, never in the middle of a fork
+  sigset_t stop_signals, wait_mask;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  sigprocmask(SIG_BLOCK, &stop_signals, &wait_mask);
+
+  struct sigaction action = {.sa_handler = supervisor_stop};
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  for (int i = 0; i < event_workers; i++)
+  {
+    workers[i] = start_worker(i, handler, &wait_mask);
+    if (workers[i] < 0)
+      return -1;
+  }
+
+  // Supervise the workers, restarting any that die until a stop is requested
+  int running = event_workers;
+  sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+  while (running > 0)
+  {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("waitpid failed");
+      return -1;
+    }
+
+    sigprocmask(SIG_BLOCK, &stop_signals, NULL);
+    for (int i = 0; i < event_workers; i++)
+    {
+      if (workers[i] != pid)
+        continue;
+      if (stop_requested)
+      {
+        workers[i] = 0;
+        running--;
+      }
+      else
+      {
+        fprintf(stderr, "Worker %d exited with status %d, restarting\n", pid, status);
+        workers[i] = start_worker(i, handler, &wait_mask);
+      }
+    }
+    sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+  }
+
+  for (int i = 0; i < event_workers; i++)
+    if (listeners[i] >= 0)
+      close(listeners[i]);
+  printf("All workers drained\n");
+  return 0;
+}
@@ -0,0 +1,121 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "protocol.h"
+
+/*
+ * epoll driven server core shared by Smain, Stext and Spdf.
+ *
+ * Instead of forking a process per client, a pool of pre-spawned worker
+ * processes, one per CPU by default and each pinned to its own CPU, runs a
+ * non-blocking epoll loop over its own listening socket and its connections.
+ * The listening sockets share the server port through SO_REUSEPORT, so the
+ * kernel spreads new connections over the workers without a shared accept
+ * queue. Every connection is a small state machine:
+ *
+ *   CONN_READ_HEADER -> CONN_READ_ARGS -> CONN_DISPATCH -> CONN_READ_HEADER
+ *
+ * The command frame is assembled from non-blocking reads, so idle clients and
+ * clients that trickle in a command cost only their connection state. Once a
+ * command frame is complete the server's command handler runs the payload
+ * transfer and sends the result, with the socket switched to blocking mode and
+ * bounded by EVENT_TRANSFER_TIMEOUT_SEC so a stalled client cannot hold the
+ * worker forever.
+ *
+ * Only the command frames are non-blocking: a worker serves one transfer at a
+ * time, and its other connections wait until the transfer is done, up to
+ * EVENT_TRANSFER_TIMEOUT_SEC per stalled read or write behind a slow client.
+ * --workers is therefore the number of transfers a server runs at once; the
+ * default of one per CPU suits fast clients, slow or distant ones need more
+ * workers than CPUs, which then share the CPUs round robin, or the fork model.
+ *
+ * On SIGINT or SIGTERM the workers stop accepting, close connections that are
+ * between requests, finish the requests in flight and exit; a worker still
+ * busy after EVENT_DRAIN_TIMEOUT_SEC drops its remaining connections. The
+ * supervisor closes its copies of the listening sockets at the same time, so
+ * the listener of a draining worker is gone and new connections are refused
+ * rather than left in its backlog. A drained worker prints the bytes it served
+ * and the CPU time it used, see print_transfer_stats().
+ */
+
+// Default number of worker processes in the epoll server model, 0 is one per CPU
+#define DEFAULT_EVENT_WORKERS 0
+
+// Longest a blocked payload transfer or result may stall a worker
+#define EVENT_TRANSFER_TIMEOUT_SEC 30
+
+// Longest a worker waits for requests in flight when asked to stop
+#define EVENT_DRAIN_TIMEOUT_SEC 30
+
+// Events handled per epoll_wait call
+#define EVENT_BATCH_SIZE 64
+
+enum server_model
+{
+  SERVER_MODEL_FORK,  // One forked process per client connection
+  SERVER_MODEL_EPOLL, // Pre-spawned worker processes running an epoll event loop
+};
+
+/**
+ * @brief Server model used by main, selected with --server-model.
+ */
+extern enum server_model server_model;
+
+/**
+ * @brief Number of worker processes in the epoll model, selected with --workers.
+ */
+extern int event_workers;
+
+/**
+ * @brief Whether every worker is pinned to its own CPU, cleared with --no-cpu-affinity.
+ */
+extern int event_cpu_affinity;
+
+/**
+ * @brief Handler run for every complete command frame.
+ *
+ * @param socket The client socket, in blocking mode while the handler runs.
+ * @param request The header of the command frame.
+ * @param args The command arguments.
+ */
+typedef void (*command_handler)(int socket, const struct frame_header *request, char *args);
+
+/**
+ * @brief Parse a server model name ("fork" or "epoll").
+ *
+ * @param name The name given on the command line.
+ * @param model The parsed model.
+ * @return int Returns 0 on success, -1 if the name is unknown.
+ */
+int parse_server_model(const char *name, enum server_model *model);
+
+/**
+ * @brief Get the printable name of a server model.
+ *
+ * @param model The server model.
+ * @return const char* The model name.
+ */
+const char *server_model_name(enum server_model model);
+
+/**
+ * @brief Open one listening socket per worker on the server port.
+ *
+ * Sets event_workers to the number of usable CPUs if it is not positive.
+ *
+ * @param server_port The port to listen on.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int open_worker_listeners(int server_port);
+
+/**
+ * @brief Serve clients with event_workers epoll worker processes.
+ *
+ * The calling process only supervises the workers, restarting any that die,
+ * until SIGINT or SIGTERM asks them to drain.
+ *
+ * @param handler The handler run for every command frame.
+ * @return int Returns 0 once the workers have drained, -1 if they cannot be started.
+ */
+int run_event_loop(command_handler handler);
+
+#endif
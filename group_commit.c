@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+#include "group_commit.h"
+
+// Longest a commit waits for its group before it checks that the leader is still alive
+#define LEADER_CHECK_MS 1000
+
+struct commit_state
+{
+  pthread_mutex_t lock;  // Process-shared
+  pthread_cond_t joined; // Signalled when the open group is full
+  pthread_cond_t synced; // Broadcast when a group is on disk
+  uint64_t requested;    // Commits requested, each numbered by the count at its request
+  uint64_t synced_upto;  // Commits on disk
+  uint64_t errors;       // Failed syncs
+  uint64_t groups;       // Syncs made
+  pid_t leader;          // Process collecting or syncing a group, 0 for none
+};
+
+int durable_writes = 0;
+
+unsigned commit_window_us = COMMIT_WINDOW_US;
+
+unsigned commit_batch = COMMIT_BATCH;
+
+static struct commit_state *state; // Shared by every process forked after group_commit_init
+
+static int store_fd = -1; // Directory on the file system synced
+
+int group_commit_init(const char *store_dir)
+{
+  if (!durable_writes)
+    return 0;
+
+  store_fd = open(store_dir, O_RDONLY | O_DIRECTORY);
+  if (store_fd < 0)
+  {
+    perror("Failed to open store directory");
+    return -1;
+  }
+
+  struct commit_state *shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED)
+  {
+    perror("Failed to map group commit state");
+    return -1;
+  }
+  memset(shared, 0, sizeof(*shared));
+
+  pthread_mutexattr_t mutex_attr;
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&shared->lock, &mutex_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+
+  // the deadlines of the waits are on the monotonic clock
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&shared->joined, &cond_attr);
+  pthread_cond_init(&shared->synced, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  if (commit_batch < 1)
+    commit_batch = 1;
+  state = shared;
+  return 0;
+}
+
+static struct timespec deadline_after(uint64_t us)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  uint64_t ns = deadline.tv_nsec + us * 1000;
+  deadline.tv_sec += ns / 1000000000;
+  deadline.tv_nsec = ns % 1000000000;
+  return deadline;
+}
+
+static int process_alive(pid_t pid)
+{
+  return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+// Collect the open group and sync it, called and returning with the lock held
+static void lead_group(void)
+{
+  state->leader = getpid();
+
+  // the group stays open for the window, or until it is full
+  struct timespec deadline = deadline_after(commit_window_us);
+  while (commit_window_us > 0 && state->requested - state->synced_upto < commit_batch)
+    if (pthread_cond_timedwait(&state->joined, &state->lock, &deadline) == ETIMEDOUT)
+      break;
+
+  // every commit requested so far is in the group, later ones wait for the next
+  uint64_t start = state->synced_upto, end = state->requested;
+  pthread_mutex_unlock(&state->lock);
+  int result = syncfs(store_fd);
+  if (result != 0)
+    perror("Failed to sync store");
+  pthread_mutex_lock(&state->lock);
+
+  if (result != 0)
+    state->errors++;
+  if (end > state->synced_upto)
+    state->synced_upto = end;
+  state->groups++;
+  state->leader = 0;
+  if (log_level >= LOG_DEBUG)
+    printf("Group commit %llu synced %llu commits\n", (unsigned long long)state->groups,
+           (unsigned long long)(end - start));
+  pthread_cond_broadcast(&state->synced);
+}
+
+int group_commit(void)
+{
+  if (!durable_writes || state == NULL)
+    return 0;
+
+  pthread_mutex_lock(&state->lock);
+  uint64_t ticket = ++state->requested;
+  uint64_t errors = state->errors;
+
+  // a full group does not wait out the window
+  if (state->leader != 0 && state->requested - state->synced_upto >= commit_batch)
+    pthread_cond_signal(&state->joined);
+
+  while (state->synced_upto < ticket)
+  {
+    if (state->leader == 0)
+    {
+      lead_group();
+      continue;
+    }
+
+    struct timespec deadline = deadline_after((uint64_t)LEADER_CHECK_MS * 1000);
+    if (pthread_cond_timedwait(&state->synced, &state->lock, &deadline) == ETIMEDOUT && state->leader != 0 &&
+        !process_alive(state->leader))
+    {
+      // the leader died before its group was synced, this commit leads it instead
+      fprintf(stderr, "Group commit leader %d died\n", (int)state->leader);
+      state->leader = 0;
+    }
+  }
+
+  // a sync that failed while this commit waited may have been its own
+  int result = state->errors == errors ? 0 : -1;
+  pthread_mutex_unlock(&state->lock);
+  return result;
+}
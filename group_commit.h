@@ -0,0 +1,66 @@
+#ifndef GROUP_COMMIT_H
+#define GROUP_COMMIT_H
+
+#include <stdint.h>
+
+/*
+ * Durable uploads with group commit, enabled with --durable.
+ *
+ * A durable upload is written to a temporary file outside the store and
+ * renamed over its path, so a crash leaves either the old file or the new
+ * one, and is only acknowledged once the file system holding the store has
+ * been synced. Syncing every upload on its own would cost a disk flush per
+ * file, so uploads completing at about the same time share one: the first
+ * upload to commit leads a group, waits up to --commit-window microseconds
+ * for others to join, or until --commit-batch uploads have, and then syncs
+ * the file system once with syncfs(2) for the whole group, data and renames
+ * alike. Uploads arriving while a group syncs form the next group. A longer
+ * window trades the latency of every acknowledgement for fewer flushes.
+ *
+ * Data written before a rename is flushed by the same sync as the rename,
+ * which keeps the replacement atomic on file systems that write data before
+ * the metadata naming it, as ext4 and XFS do for a file renamed over another.
+ *
+ * The group lives in shared memory created before the server forks, so the
+ * uploads of every client process and event loop worker share it. A leader
+ * that dies while it syncs is replaced by a waiting upload.
+ */
+
+// Default longest time a group stays open for more uploads, in microseconds
+#define COMMIT_WINDOW_US 2000
+
+// Default number of uploads that closes a group before the window ends
+#define COMMIT_BATCH 64
+
+/**
+ * @brief Whether uploads are synced to disk before they are acknowledged, set with --durable.
+ */
+extern int durable_writes;
+
+/**
+ * @brief Longest time a group of commits stays open, in microseconds, set with --commit-window.
+ */
+extern unsigned commit_window_us;
+
+/**
+ * @brief Number of commits that closes a group early, set with --commit-batch.
+ */
+extern unsigned commit_batch;
+
+/**
+ * @brief Set up group commit, to be called before the server forks. Does nothing without --durable.
+ *
+ * @param store_dir A directory on the file system holding the store and the temporary files of uploads.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int group_commit_init(const char *store_dir);
+
+/**
+ * @brief Wait until every write this process made to the store is on disk, syncing it together with the commits of
+ *        the other processes. Does nothing without --durable.
+ *
+ * @return int Returns 0 once the writes are durable, -1 if the sync failed.
+ */
+int group_commit(void);
+
+#endif
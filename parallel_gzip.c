@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "parallel_gzip.h"
+
+// Blocks of the ring per thread: one being compressed while the next is queued
+#define BLOCKS_PER_THREAD 2
+
+enum block_state
+{
+  BLOCK_FREE,   // Filled by the caller's thread
+  BLOCK_QUEUED, // Waiting for a worker
+  BLOCK_BUSY,   // Being compressed
+  BLOCK_DONE,   // Waiting to be written out
+};
+
+struct gzip_block
+{
+  enum block_state state;
+  uint64_t sequence; // Position of the block in the stream
+  int last;          // Ends the stream, with a final deflate block
+  int failed;
+  unsigned char *in;
+  size_t in_length;
+  unsigned char *dictionary; // The end of the block before, PARALLEL_GZIP_DICTIONARY bytes at most
+  size_t dictionary_length;
+  unsigned char *out;
+  size_t out_length;
+  uint32_t crc; // CRC-32 of the input of the block
+};
+
+struct parallel_gzip
+{
+  int level;
+  parallel_gzip_output output;
+  void *arg;
+
+  pthread_mutex_t lock;
+  pthread_cond_t queued; // Signalled when a block is queued, or the workers are stopped
+  pthread_cond_t done;   // Signalled when a block is compressed
+  int stopping;
+  int threads; // Workers started, 0 when the caller's thread compresses
+  pthread_t workers[PARALLEL_GZIP_THREADS_MAX];
+  z_stream inline_stream; // Compresses the blocks when there are no workers
+
+  struct gzip_block *blocks;
+  int ring;
+  size_t out_capacity;
+  uint64_t filling; // Sequence of the block being filled
+  uint64_t writing; // Sequence of the next block to write out
+  uint32_t crc;
+  uint64_t total; // Input bytes written out
+  int failed;
+};
+
+int parallel_gzip_threads = PARALLEL_GZIP_DEFAULT_THREADS;
+
+/* BLOCKS */
+
+static int init_stream(z_stream *stream, int level)
+{
+  memset(stream, 0, sizeof(*stream));
+  // raw deflate, the gzip header and trailer are written around the blocks
+  return deflateInit2(stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK ? 0 : -1;
+}
+
+static int compress_block(z_stream *stream, struct gzip_block *block, size_t out_capacity)
+{
+  if (deflateReset(stream) != Z_OK)
+    return -1;
+  if (block->dictionary_length > 0 &&
+      deflateSetDictionary(stream, block->dictionary, block->dictionary_length) != Z_OK)
+    return -1;
+
+  stream->next_in = block->in;
+  stream->avail_in = block->in_length;
+  stream->next_out = block->out;
+  stream->avail_out = out_capacity;
+  int status = deflate(stream, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+  if (block->last ? status != Z_STREAM_END : status != Z_OK || stream->avail_in != 0 || stream->avail_out == 0)
+    return -1;
+  block->out_length = out_capacity - stream->avail_out;
+  block->crc = crc32(0, block->in, block->in_length);
+  return 0;
+}
+
+static void *run_worker(void *arg)
+{
+  struct parallel_gzip *gzip = arg;
+  z_stream stream;
+  int ready = init_stream(&stream, gzip->level) == 0;
+
+  pthread_mutex_lock(&gzip->lock);
+  while (!gzip->stopping)
+  {
+    // the oldest queued block first, the caller writes them out in order
+    struct gzip_block *block = NULL;
+    for (int i = 0; i < gzip->ring; i++)
+      if (gzip->blocks[i].state == BLOCK_QUEUED && (block == NULL || gzip->blocks[i].sequence < block->sequence))
+        block = &gzip->blocks[i];
+    if (block == NULL)
+    {
+      pthread_cond_wait(&gzip->queued, &gzip->lock);
+      continue;
+    }
+    block->state = BLOCK_BUSY;
+    pthread_mutex_unlock(&gzip->lock);
+
+    int failed = !ready || compress_block(&stream, block, gzip->out_capacity) != 0;
+
+    pthread_mutex_lock(&gzip->lock);
+    block->failed = failed;
+    block->state = BLOCK_DONE;
+    pthread_cond_broadcast(&gzip->done);
+  }
+  pthread_mutex_unlock(&gzip->lock);
+
+  if (ready)
+    deflateEnd(&stream);
+  return NULL;
+}
+
+/* OUTPUT */
+
+static void put_le32(unsigned char *p, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+    p[i] = value >> (8 * i);
+}
+
+// Write out the blocks in order up to a sequence, waiting for their compression
+static int write_blocks(struct parallel_gzip *gzip, uint64_t until)
+{
+  while (gzip->writing < until)
+  {
+    struct gzip_block *block = &gzip->blocks[gzip->writing % gzip->ring];
+    pthread_mutex_lock(&gzip->lock);
+    while (block->state != BLOCK_DONE)
+      pthread_cond_wait(&gzip->done, &gzip->lock);
+    pthread_mutex_unlock(&gzip->lock);
+
+    if (block->failed || gzip->output(gzip->arg, block->out, block->out_length) != 0)
+    {
+      gzip->failed = 1;
+      return -1;
+    }
+    gzip->crc = crc32_combine(gzip->crc, block->crc, block->in_length);
+    gzip->total += block->in_length;
+    block->state = BLOCK_FREE;
+    gzip->writing++;
+  }
+  return 0;
+}
+
+// Hand the block being filled over to be compressed, and make the next one ready to be filled
+static int submit_block(struct parallel_gzip *gzip, int last)
+{
+  struct gzip_block *block = &gzip->blocks[gzip->filling % gzip->ring];
+  block->sequence = gzip->filling;
+  block->last = last;
+  if (gzip->threads == 0)
+  {
+    block->failed = compress_block(&gzip->inline_stream, block, gzip->out_capacity) != 0;
+    block->state = BLOCK_DONE;
+  }
+  else
+  {
+    pthread_mutex_lock(&gzip->lock);
+    block->state = BLOCK_QUEUED;
+    pthread_cond_signal(&gzip->queued);
+    pthread_mutex_unlock(&gzip->lock);
+  }
+  gzip->filling++;
+  if (last)
+    return 0;
+
+  // the next block reuses the oldest one of the ring once it is written out, and is primed with the end of this one
+  if (write_blocks(gzip, gzip->filling + 1 > (uint64_t)gzip->ring ? gzip->filling + 1 - gzip->ring : 0) != 0)
+    return -1;
+  struct gzip_block *next = &gzip->blocks[gzip->filling % gzip->ring];
+  next->dictionary_length = 0;
+  if (gzip->level > 0)
+  {
+    size_t length = block->in_length < PARALLEL_GZIP_DICTIONARY ? block->in_length : PARALLEL_GZIP_DICTIONARY;
+    memmove(next->dictionary, block->in + block->in_length - length, length);
+    next->dictionary_length = length;
+  }
+  next->in_length = 0;
+  return 0;
+}
+
+/* STREAMS */
+
+struct parallel_gzip *parallel_gzip_begin(int level, parallel_gzip_output output, void *arg)
+{
+  struct parallel_gzip *gzip = calloc(1, sizeof(*gzip));
+  if (gzip == NULL)
+    return NULL;
+  gzip->level = level;
+  gzip->output = output;
+  gzip->arg = arg;
+  pthread_mutex_init(&gzip->lock, NULL);
+  pthread_cond_init(&gzip->queued, NULL);
+  pthread_cond_init(&gzip->done, NULL);
+
+  // more threads than CPUs would only take turns
+  int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = parallel_gzip_threads > 0 && parallel_gzip_threads < cpus ? parallel_gzip_threads : cpus;
+  if (threads > PARALLEL_GZIP_THREADS_MAX)
+    threads = PARALLEL_GZIP_THREADS_MAX;
+  if (threads < 1)
+    threads = 1;
+  gzip->ring = threads > 1 ? threads * BLOCKS_PER_THREAD : 1;
+
+  // a sync flush adds an empty stored block to the worst case of deflateBound
+  z_stream probe;
+  if (init_stream(&probe, level) != 0)
+  {
+    parallel_gzip_free(gzip);
+    return NULL;
+  }
+  gzip->out_capacity = deflateBound(&probe, PARALLEL_GZIP_BLOCK_SIZE) + 16;
+  deflateEnd(&probe);
+
+  gzip->blocks = calloc(gzip->ring, sizeof(*gzip->blocks));
+  int result = gzip->blocks != NULL ? 0 : -1;
+  for (int i = 0; result == 0 && i < gzip->ring; i++)
+  {
+    struct gzip_block *block = &gzip->blocks[i];
+    block->in = malloc(PARALLEL_GZIP_BLOCK_SIZE);
+    block->dictionary = malloc(PARALLEL_GZIP_DICTIONARY);
+    block->out = malloc(gzip->out_capacity);
+    if (block->in == NULL || block->dictionary == NULL || block->out == NULL)
+      result = -1;
+  }
+
+  if (result == 0 && threads == 1)
+    result = init_stream(&gzip->inline_stream, level);
+  for (int i = 0; result == 0 && threads > 1 && i < threads; i++)
+  {
+    if (pthread_create(&gzip->workers[i], NULL, run_worker, gzip) != 0)
+    {
+      // the workers started so far are enough to compress the stream
+      if (i == 0)
+        result = -1;
+      break;
+    }
+    gzip->threads++;
+  }
+
+  // magic, deflate, no flags, no modification time, the level hint and Unix
+  unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, level == 9 ? 2 : level == 1 ? 4 : 0, 3};
+  if (result != 0 || output(arg, header, sizeof(header)) != 0)
+  {
+    parallel_gzip_free(gzip);
+    return NULL;
+  }
+  return gzip;
+}
+
+int parallel_gzip_write(struct parallel_gzip *gzip, const void *data, size_t length)
+{
+  if (gzip->failed)
+    return -1;
+  const unsigned char *p = data;
+  while (length > 0)
+  {
+    struct gzip_block *block = &gzip->blocks[gzip->filling % gzip->ring];
+    size_t room = PARALLEL_GZIP_BLOCK_SIZE - block->in_length;
+    size_t n = length < room ? length : room;
+    memcpy(block->in + block->in_length, p, n);
+    block->in_length += n;
+    p += n;
+    length -= n;
+    if (block->in_length == PARALLEL_GZIP_BLOCK_SIZE && submit_block(gzip, 0) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+int parallel_gzip_finish(struct parallel_gzip *gzip)
+{
+  if (gzip->failed || submit_block(gzip, 1) != 0 || write_blocks(gzip, gzip->filling) != 0)
+    return -1;
+
+  // CRC-32 and size modulo 2^32 of the whole input, little-endian
+  unsigned char trailer[8];
+  put_le32(trailer, gzip->crc);
+  put_le32(trailer + 4, (uint32_t)gzip->total);
+  return gzip->output(gzip->arg, trailer, sizeof(trailer));
+}
+
+void parallel_gzip_free(struct parallel_gzip *gzip)
+{
+  if (gzip == NULL)
+    return;
+
+  pthread_mutex_lock(&gzip->lock);
+  gzip->stopping = 1;
+  pthread_cond_broadcast(&gzip->queued);
+  pthread_mutex_unlock(&gzip->lock);
+  for (int i = 0; i < gzip->threads; i++)
+    pthread_join(gzip->workers[i], NULL);
+  if (gzip->inline_stream.state != NULL)
+    deflateEnd(&gzip->inline_stream);
+
+  for (int i = 0; gzip->blocks != NULL && i < gzip->ring; i++)
+  {
+    free(gzip->blocks[i].in);
+    free(gzip->blocks[i].dictionary);
+    free(gzip->blocks[i].out);
+  }
+  free(gzip->blocks);
+  pthread_mutex_destroy(&gzip->lock);
+  pthread_cond_destroy(&gzip->queued);
+  pthread_cond_destroy(&gzip->done);
+  free(gzip);
+}
@@ -0,0 +1,97 @@
+#ifndef PARALLEL_GZIP_H
+#define PARALLEL_GZIP_H
+
+#include <stddef.h>
+
+/*
+ * Multi-threaded gzip compression of a stream, in the manner of pigz, used by dtar.
+ *
+ * The input is cut into PARALLEL_GZIP_BLOCK_SIZE blocks that a pool of worker
+ * threads compresses as raw deflate, each block on its own and primed with
+ * the last PARALLEL_GZIP_DICTIONARY bytes of the block before it, so the
+ * ratio stays close to that of one stream. Every block but the last ends
+ * with a sync flush, which ends it on a byte boundary, so the blocks join
+ * into one deflate stream; the CRC-32 of the blocks are joined with
+ * crc32_combine. The output is a single standard gzip member, read by gunzip
+ * and tar -z as any other.
+ *
+ * The caller's thread fills the blocks and writes the compressed blocks out
+ * in order as they complete, waiting only when every block of the ring is in
+ * flight, so at most 2 blocks per thread are held in memory. With one thread
+ * the blocks are compressed by the caller's thread, with no pool at all.
+ *
+ * Level 0 writes the input in stored deflate blocks, for content that is
+ * compressed already such as PDF files: the archive stays a .tar.gz without
+ * spending CPU time on bytes that would not shrink.
+ */
+
+// Input compressed as one block
+#define PARALLEL_GZIP_BLOCK_SIZE (128 * 1024)
+
+// Bytes of the block before that a block is primed with, the deflate window
+#define PARALLEL_GZIP_DICTIONARY (32 * 1024)
+
+// Threads of every gzip stream unless --gzip-threads is given: every worker process or forked child runs dtars of
+// its own, so concurrent archives must not each take every CPU
+#define PARALLEL_GZIP_DEFAULT_THREADS 2
+
+// Upper bound of --gzip-threads
+#define PARALLEL_GZIP_THREADS_MAX 32
+
+/**
+ * @brief Compression threads of every gzip stream, set with --gzip-threads; PARALLEL_GZIP_DEFAULT_THREADS by default,
+ *        0 for one per CPU, never more than the CPUs.
+ */
+extern int parallel_gzip_threads;
+
+/**
+ * @brief Receives the compressed stream, in order.
+ *
+ * @param arg The argument given to parallel_gzip_begin.
+ * @param data The next bytes of the gzip stream.
+ * @param length The number of bytes.
+ * @return int Returns 0 on success, -1 to fail the stream.
+ */
+typedef int (*parallel_gzip_output)(void *arg, const void *data, size_t length);
+
+/**
+ * @brief A gzip stream being compressed.
+ */
+struct parallel_gzip;
+
+/**
+ * @brief Start a gzip stream, writing its header, and its worker threads.
+ *
+ * @param level The zlib level, from 0 (stored) to 9.
+ * @param output Called with the compressed stream.
+ * @param arg Passed to output.
+ * @return struct parallel_gzip* The stream, or NULL on failure.
+ */
+struct parallel_gzip *parallel_gzip_begin(int level, parallel_gzip_output output, void *arg);
+
+/**
+ * @brief Compress the next bytes of the stream.
+ *
+ * @param gzip The stream.
+ * @param data The bytes.
+ * @param length The number of bytes.
+ * @return int Returns 0 on success, -1 if compressing or writing the output failed.
+ */
+int parallel_gzip_write(struct parallel_gzip *gzip, const void *data, size_t length);
+
+/**
+ * @brief End the stream, writing the rest of it and its trailer.
+ *
+ * @param gzip The stream.
+ * @return int Returns 0 on success, -1 if compressing or writing the output failed.
+ */
+int parallel_gzip_finish(struct parallel_gzip *gzip);
+
+/**
+ * @brief Stop the worker threads and release a stream, finished or not.
+ *
+ * @param gzip The stream, or NULL.
+ */
+void parallel_gzip_free(struct parallel_gzip *gzip);
+
+#endif
@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+
+uint64_t frame_bytes_sent;
+uint64_t frame_bytes_received;
+uint64_t command_trace_id;
+
+/* ENCODING HELPERS */
+
+static void put_u16(unsigned char *p, uint16_t value)
+{
+  p[0] = value >> 8;
+  p[1] = value;
+}
+
+static void put_u32(unsigned char *p, uint32_t value)
+{
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+static void put_u64(unsigned char *p, uint64_t value)
+{
+  put_u32(p, value >> 32);
+  put_u32(p + 4, (uint32_t)value);
+}
+
+static uint16_t get_u16(const unsigned char *p)
+{
+  return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+  return (uint64_t)get_u32(p) << 32 | get_u32(p + 4);
+}
+
+static void encode_header(unsigned char *p, uint8_t opcode, uint32_t flags, uint32_t request_id, uint64_t payload_length)
+{
+  put_u16(p, PROTOCOL_MAGIC);
+  p[2] = PROTOCOL_VERSION;
+  p[3] = opcode;
+  put_u32(p + 4, flags);
+  put_u32(p + 8, request_id);
+  put_u64(p + 12, payload_length);
+  frame_bytes_sent += FRAME_HEADER_SIZE + payload_length;
+}
+
+/* FRAME I/O */
+
+const char *opcode_name(uint8_t opcode)
+{
+  switch (opcode)
+  {
+  case OP_UFILE:
+    return "ufile";
+  case OP_DFILE:
+    return "dfile";
+  case OP_RMFILE:
+    return "rmfile";
+  case OP_DISPLAY:
+    return "display";
+  case OP_DTAR:
+    return "dtar";
+  case OP_URESUME:
+    return "uresume";
+  case OP_BATCH:
+    return "batch";
+  case OP_ULINK:
+    return "ulink";
+  case OP_STATS:
+    return "stats";
+  case OP_USIG:
+    return "usig";
+  case OP_UDELTA:
+    return "udelta";
+  case OP_DATA:
+    return "data";
+  case OP_RESULT:
+    return "result";
+  }
+  return "unknown";
+}
+
+int send_all(int socket, const void *buffer, size_t length, int send_flags)
+{
+  const char *p = buffer;
+  while (length > 0)
+  {
+    ssize_t bytes_sent = send(socket, p, length, send_flags | MSG_NOSIGNAL);
+    if (bytes_sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += bytes_sent;
+    length -= bytes_sent;
+  }
+  return 0;
+}
+
+int recv_all(int socket, void *buffer, size_t length)
+{
+  char *p = buffer;
+  size_t total_bytes_received = 0;
+  while (total_bytes_received < length)
+  {
+    ssize_t bytes_received = recv(socket, p + total_bytes_received, length - total_bytes_received, 0);
+    if (bytes_received < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (bytes_received == 0)
+    {
+      // Orderly shutdown is only clean on a message boundary
+      return total_bytes_received == 0 ? 0 : -1;
+    }
+    total_bytes_received += bytes_received;
+  }
+  return 1;
+}
+
+int send_frame_header(int socket, uint8_t opcode, uint32_t flags, uint32_t request_id, uint64_t payload_length)
+{
+  unsigned char header[FRAME_HEADER_SIZE];
+  encode_header(header, opcode, flags, request_id, payload_length);
+  return send_all(socket, header, sizeof(header), payload_length > 0 ? MSG_MORE : 0);
+}
+
+int send_frame(int socket, uint8_t opcode, uint32_t flags, uint32_t request_id, const void *payload, uint64_t payload_length)
+{
+  unsigned char header[FRAME_HEADER_SIZE];
+  encode_header(header, opcode, flags, request_id, payload_length);
+
+  if (payload_length == 0)
+    return send_all(socket, header, sizeof(header), 0);
+
+  // Header and payload go out in one syscall for the common small frame
+  struct iovec iov[2] = {
+      {.iov_base = header, .iov_len = sizeof(header)},
+      {.iov_base = (void *)payload, .iov_len = payload_length},
+  };
+  struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+  size_t total = sizeof(header) + payload_length;
+  ssize_t bytes_sent;
+  do
+  {
+    bytes_sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+  } while (bytes_sent < 0 && errno == EINTR);
+  if (bytes_sent < 0)
+    return -1;
+  if ((size_t)bytes_sent == total)
+    return 0;
+
+  // Short write, finish the remainder piecewise
+  if ((size_t)bytes_sent < sizeof(header))
+  {
+    if (send_all(socket, header + bytes_sent, sizeof(header) - bytes_sent, MSG_MORE) != 0)
+      return -1;
+    bytes_sent = sizeof(header);
+  }
+  return send_all(socket, (const char *)payload + (bytes_sent - sizeof(header)), total - bytes_sent, 0);
+}
+
+int decode_frame_header(const unsigned char *raw, struct frame_header *header)
+{
+  if (get_u16(raw) != PROTOCOL_MAGIC)
+  {
+    fprintf(stderr, "Bad frame magic 0x%04x\n", get_u16(raw));
+    return -1;
+  }
+  if (raw[2] != PROTOCOL_VERSION)
+  {
+    fprintf(stderr, "Unsupported protocol version %d\n", raw[2]);
+    return -1;
+  }
+
+  header->version = raw[2];
+  header->opcode = raw[3];
+  header->flags = get_u32(raw + 4);
+  header->request_id = get_u32(raw + 8);
+  header->payload_length = get_u64(raw + 12);
+  frame_bytes_received += FRAME_HEADER_SIZE + header->payload_length;
+  return 1;
+}
+
+int recv_frame_header(int socket, struct frame_header *header)
+{
+  unsigned char raw[FRAME_HEADER_SIZE];
+  int result = recv_all(socket, raw, sizeof(raw));
+  if (result <= 0)
+    return result;
+  return decode_frame_header(raw, header);
+}
+
+int recv_frame_payload(int socket, const struct frame_header *header, char *buffer, size_t buffer_size)
+{
+  if (header->payload_length >= buffer_size)
+  {
+    fprintf(stderr, "Frame payload too large: %llu bytes\n", (unsigned long long)header->payload_length);
+    discard_payload(socket, header->payload_length);
+    return -1;
+  }
+
+  if (header->payload_length > 0 && recv_all(socket, buffer, header->payload_length) != 1)
+    return -1;
+
+  buffer[header->payload_length] = '\0';
+  return (int)header->payload_length;
+}
+
+int discard_payload(int socket, uint64_t length)
+{
+  char buffer[4096];
+  while (length > 0)
+  {
+    size_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+    if (recv_all(socket, buffer, chunk) != 1)
+      return -1;
+    length -= chunk;
+  }
+  return 0;
+}
+
+int discard_body(int socket, const struct frame_header *data)
+{
+  struct frame_header chunk = *data;
+  while (1)
+  {
+    if (discard_payload(socket, chunk.payload_length) != 0)
+      return -1;
+    if (!(chunk.flags & FRAME_FLAG_CHUNKED) || chunk.payload_length == 0)
+      return 0;
+    if (recv_frame_header(socket, &chunk) != 1 || chunk.opcode != OP_DATA)
+      return -1;
+  }
+}
+
+int discard_frame(int socket)
+{
+  struct frame_header header;
+  if (recv_frame_header(socket, &header) != 1)
+    return -1;
+  if (header.opcode != OP_DATA)
+    return discard_payload(socket, header.payload_length);
+  return discard_body(socket, &header);
+}
+
+int send_command(int socket, uint8_t opcode, uint32_t request_id, const char *args)
+{
+  size_t length = strlen(args);
+  if (command_trace_id == 0)
+    return send_frame(socket, opcode, 0, request_id, args, length);
+
+  // the trace id follows the arguments and their terminator
+  char payload[MAX_ARGS_SIZE];
+  if (length + 1 + sizeof(uint64_t) >= sizeof(payload))
+    return send_frame(socket, opcode, 0, request_id, args, length);
+  memcpy(payload, args, length + 1);
+  put_u64((unsigned char *)payload + length + 1, command_trace_id);
+  return send_frame(socket, opcode, FRAME_FLAG_TRACED, request_id, payload, length + 1 + sizeof(uint64_t));
+}
+
+uint64_t frame_trace_id(const struct frame_header *header, const char *payload)
+{
+  if (!(header->flags & FRAME_FLAG_TRACED) || header->payload_length < 1 + sizeof(uint64_t))
+    return 0;
+  return get_u64((const unsigned char *)payload + header->payload_length - sizeof(uint64_t));
+}
+
+int send_result(int socket, uint32_t request_id, int success, const char *message)
+{
+  return send_frame(socket, OP_RESULT, success ? 0 : FRAME_FLAG_ERROR, request_id, message, strlen(message));
+}
+
+int send_chunk(int socket, uint32_t request_id, const void *data, uint64_t length)
+{
+  return send_frame(socket, OP_DATA, FRAME_FLAG_CHUNKED, request_id, data, length);
+}
+
+int recv_result(int socket, char *message, size_t message_size)
+{
+  struct frame_header header;
+  if (recv_frame_header(socket, &header) != 1)
+    return -1;
+
+  if (header.opcode != OP_RESULT)
+  {
+    fprintf(stderr, "Expected result frame, got %s\n", opcode_name(header.opcode));
+    return -1;
+  }
+
+  char buffer[MAX_ARGS_SIZE];
+  if (recv_frame_payload(socket, &header, buffer, sizeof(buffer)) < 0)
+    return -1;
+  if (message != NULL && message_size > 0)
+    snprintf(message, message_size, "%s", buffer);
+
+  return (header.flags & FRAME_FLAG_ERROR) ? 0 : 1;
+}
+
+int recv_data_header(int socket, uint64_t *payload_length, char *message, size_t message_size)
+{
+  struct frame_header header;
+  int frame = recv_data_frame(socket, &header, message, message_size);
+  if (frame > 0)
+    *payload_length = header.payload_length;
+  return frame;
+}
+
+int recv_data_frame(int socket, struct frame_header *data, char *message, size_t message_size)
+{
+  struct frame_header header;
+  if (recv_frame_header(socket, &header) != 1)
+    return -1;
+
+  if (header.opcode == OP_DATA)
+  {
+    *data = header;
+    if (!(header.flags & FRAME_FLAG_CHUNKED))
+      return 1;
+    return (header.flags & FRAME_FLAG_COMPRESSED) ? 3 : 2;
+  }
+
+  if (header.opcode != OP_RESULT)
+  {
+    fprintf(stderr, "Expected data frame, got %s\n", opcode_name(header.opcode));
+    return -1;
+  }
+
+  char buffer[MAX_ARGS_SIZE];
+  if (recv_frame_payload(socket, &header, buffer, sizeof(buffer)) < 0)
+    return -1;
+  if (message != NULL && message_size > 0)
+    snprintf(message, message_size, "%s", buffer);
+  return 0;
+}
+
+/* PATHS */
+
+int normalise_path(const char *path, char *out, size_t size)
+{
+  size_t length = 0;
+  while (*path != '\0')
+  {
+    while (*path == '/')
+      path++;
+    const char *end = strchr(path, '/');
+    size_t part = end != NULL ? (size_t)(end - path) : strlen(path);
+    if (part == 2 && path[0] == '.' && path[1] == '.')
+    {
+      while (length > 0 && out[--length] != '/')
+        ;
+    }
+    else if (part > 0 && !(part == 1 && path[0] == '.'))
+    {
+      if (length + 1 + part >= size)
+        return -1;
+      out[length++] = '/';
+      memcpy(out + length, path, part);
+      length += part;
+    }
+    path += part;
+  }
+  out[length] = '\0';
+  return 0;
+}
+
+/* RANGES */
+
+int has_argument(char *commands[], const char *word)
+{
+  for (int i = 2; commands[i] != NULL && strcmp(commands[i], RANGE_ARGUMENT) != 0; i++)
+    if (strcmp(commands[i], word) == 0)
+      return 1;
+  return 0;
+}
+
+int parse_range(char *commands[], struct byte_range *range)
+{
+  range->offset = 0;
+  range->length = UINT64_MAX;
+  for (int i = 2; commands[i] != NULL; i++)
+  {
+    if (strcmp(commands[i], RANGE_ARGUMENT) != 0)
+      continue;
+    if (commands[i + 1] == NULL || commands[i + 2] == NULL)
+      return -1;
+
+    char *end_offset, *end_length;
+    range->offset = strtoull(commands[i + 1], &end_offset, 10);
+    range->length = strtoull(commands[i + 2], &end_length, 10);
+    if (*end_offset != '\0' || *end_length != '\0')
+      return -1;
+    // a length of 0 runs to the end of the file
+    if (range->length == 0)
+      range->length = UINT64_MAX;
+    return 1;
+  }
+  return 0;
+}
+
+int clamp_range(struct byte_range *range, uint64_t size)
+{
+  if (range->offset > size)
+  {
+    fprintf(stderr, "Range starts past the end of the file: %llu > %llu\n", (unsigned long long)range->offset,
+            (unsigned long long)size);
+    return -1;
+  }
+  if (range->length > size - range->offset)
+    range->length = size - range->offset;
+  return 0;
+}
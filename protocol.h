@@ -0,0 +1,399 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Binary framed wire protocol shared by Smain, Stext, Spdf and client24s.
+ *
+ * Every message on the wire is a fixed 20 byte header (all fields in network
+ * byte order) optionally followed by payload_length bytes of payload:
+ *
+ *   offset  size  field
+ *   0       2     magic (PROTOCOL_MAGIC)
+ *   2       1     version (PROTOCOL_VERSION)
+ *   3       1     opcode (enum opcode)
+ *   4       4     flags (FRAME_FLAG_*)
+ *   8       4     request id
+ *   12      8     payload length
+ *
+ * A request is a single command frame whose payload holds the space separated
+ * command arguments, followed by an OP_DATA frame for commands that upload a
+ * body. The peer answers every request with exactly one OP_RESULT frame,
+ * preceded by an OP_DATA frame for commands that download a body. No other
+ * acknowledgements are exchanged, so a whole upload or download is one round trip.
+ *
+ * A body whose size is not known up front (a streamed tar archive) is sent as
+ * a sequence of OP_DATA frames flagged FRAME_FLAG_CHUNKED, each carrying one
+ * chunk, and ended by a zero length chunk. A sender that fails part way sends
+ * an error OP_RESULT frame in place of the next chunk.
+ *
+ * A resumable upload is tagged with an upload id chosen by the client. OP_URESUME
+ * ("fileName /destination/path upload_id") answers with the number of bytes of
+ * the upload the server has committed, as the result message. The OP_UFILE
+ * command then carries "fileName /destination/path upload_id file_size offset"
+ * and is followed by a chunked body holding the file from offset on; the
+ * server commits every chunk it receives whole, so an interrupted upload can
+ * continue from the last committed chunk.
+ *
+ * A striped upload sends every stripe of the file as a resumable upload of its
+ * own, on its own connection, with "stripe stripes" appended to the OP_URESUME
+ * and OP_UFILE arguments; the body then holds the stripe's range of the file
+ * only, and the result message of OP_URESUME is the offset of the file the
+ * stripe has committed up to.
+ *
+ * A batch bundles many ufile, dfile and rmfile requests into one. The OP_BATCH
+ * command frame carries the number of requests, which follow it back to back
+ * as ordinary requests with request ids of their own, so the client streams
+ * the whole batch without waiting on any reply. The server answers only the
+ * download bodies of the requests on the way, each data frame tagged with the
+ * request id of its dfile; a dfile that fails sends nothing. After the last
+ * request it sends a chunked body of "request_id status message" lines, one
+ * per request with status 1 or 0, and the OP_RESULT frame of the batch.
+ *
+ * A server that deduplicates its store can take an upload of known content
+ * without its body. OP_ULINK ("fileName /destination/path sha256 file_size")
+ * links the path to the stored content with that SHA-256 in hexadecimal and
+ * answers with a successful result; a failed result means the content is not
+ * known, and the client uploads the file as usual.
+ *
+ * A client may upload a file the server holds an older copy of as a delta:
+ * OP_USIG asks for the block signatures of the stored file, and OP_UDELTA
+ * sends the blocks that changed, with a chunked body of instructions that
+ * rebuild the file from the stored one. See delta.h.
+ *
+ * A chunk may be compressed on its own, flagged FRAME_FLAG_COMPRESSED, when
+ * the receiver offered it: see compress.h.
+ *
+ * A dfile may ask for a byte range of the file, with "range offset length"
+ * after its other arguments; a length of 0 runs to the end of the file. The
+ * body then holds the bytes of the range only, counted in uncompressed bytes,
+ * and an offset past the end of the file fails the request.
+ *
+ * OP_STATS takes no arguments and is answered with a data frame holding the
+ * statistics table of the server, see stats.h.
+ *
+ * A data frame flagged FRAME_FLAG_CHECKSUM ends with the CRC32C of its
+ * content, which the receiver checks before it acknowledges the request; a
+ * download is checked when the client appends "crc32c" to its arguments. See
+ * checksum.h.
+ *
+ * A command frame flagged FRAME_FLAG_TRACED belongs to a traced request: its
+ * payload is the arguments, a NUL byte and the 8 byte trace id, so a peer
+ * that does not trace still reads the arguments up to the NUL. See trace.h.
+ */
+
+#define PROTOCOL_MAGIC 0xDF5A
+#define PROTOCOL_VERSION 1
+
+#define FRAME_HEADER_SIZE 20
+
+// Largest number of requests in a batch
+#define BATCH_MAX_ITEMS 65536
+
+// Largest argument payload accepted for a command frame
+#define MAX_ARGS_SIZE 1024
+
+// Result frame flags
+#define FRAME_FLAG_ERROR 0x1 // The request failed, the payload holds the reason
+
+// Word of the dfile arguments announcing a byte range, followed by its offset and length
+#define RANGE_ARGUMENT "range"
+
+// Command frame flags
+#define FRAME_FLAG_TRACED 0x8 // The payload ends with a NUL and the trace id of the request
+
+// Data frame flags
+#define FRAME_FLAG_CHUNKED 0x2    // One chunk of a body of unknown length, a zero length chunk ends it
+#define FRAME_FLAG_COMPRESSED 0x4 // The chunk is a zlib stream, see compress.h
+#define FRAME_FLAG_CHECKSUM 0x10  // The payload ends with the CRC32C of the bytes before it, see checksum.h
+
+enum opcode
+{
+  OP_UFILE = 1,
+  OP_DFILE = 2,
+  OP_RMFILE = 3,
+  OP_DISPLAY = 4,
+  OP_DTAR = 5,
+  OP_URESUME = 6, // Ask where a resumable upload continues
+  OP_BATCH = 7,   // Run the requests that follow as one batch
+  OP_ULINK = 8,   // Store known content by its hash, without a body
+  OP_STATS = 9,   // Report the request statistics of the server
+  OP_USIG = 10,   // Ask for the block signatures of a stored file
+  OP_UDELTA = 11, // Upload a file as a delta against the stored one
+
+  OP_DATA = 32,   // File, listing or archive body
+  OP_RESULT = 33, // End-to-end completion status of a request
+};
+
+/**
+ * @brief A byte range of a file, the whole file is {0, UINT64_MAX}.
+ */
+struct byte_range
+{
+  uint64_t offset;
+  uint64_t length;
+};
+
+/**
+ * @brief Decoded frame header.
+ */
+struct frame_header
+{
+  uint8_t version;
+  uint8_t opcode;
+  uint32_t flags;
+  uint32_t request_id;
+  uint64_t payload_length;
+};
+
+/**
+ * @brief Bytes of the frames this process sent and received, headers and payloads, counted from their headers.
+ */
+extern uint64_t frame_bytes_sent;
+extern uint64_t frame_bytes_received;
+
+/**
+ * @brief Trace id attached to every command frame this process sends, 0 for none.
+ */
+extern uint64_t command_trace_id;
+
+/**
+ * @brief Get the printable name of an opcode.
+ *
+ * @param opcode The opcode.
+ * @return const char* The command name ("ufile", "dfile", ...) or "unknown".
+ */
+const char *opcode_name(uint8_t opcode);
+
+/**
+ * @brief Send a whole buffer, retrying on short writes and EINTR.
+ *
+ * @param socket The socket to send on.
+ * @param buffer The data to send.
+ * @param length The number of bytes to send.
+ * @param send_flags Flags passed to send (e.g. MSG_MORE).
+ * @return int Returns 0 if all bytes were sent, -1 otherwise.
+ */
+int send_all(int socket, const void *buffer, size_t length, int send_flags);
+
+/**
+ * @brief Receive exactly length bytes, retrying on short reads and EINTR.
+ *
+ * @param socket The socket to receive from.
+ * @param buffer The buffer to fill.
+ * @param length The number of bytes to receive.
+ * @return int Returns 1 on success, 0 if the peer closed the connection before any byte, -1 otherwise.
+ */
+int recv_all(int socket, void *buffer, size_t length);
+
+/**
+ * @brief Send a frame header.
+ *
+ * The header is sent with MSG_MORE when a payload follows, so that it shares
+ * a segment with the first payload bytes.
+ *
+ * @param socket The socket to send on.
+ * @param opcode The frame opcode.
+ * @param flags The frame flags.
+ * @param request_id The request id the frame belongs to.
+ * @param payload_length The number of payload bytes that will follow the header.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int send_frame_header(int socket, uint8_t opcode, uint32_t flags, uint32_t request_id, uint64_t payload_length);
+
+/**
+ * @brief Send a complete frame (header and payload) in a single call.
+ *
+ * @param socket The socket to send on.
+ * @param opcode The frame opcode.
+ * @param flags The frame flags.
+ * @param request_id The request id the frame belongs to.
+ * @param payload The payload bytes, may be NULL if payload_length is 0.
+ * @param payload_length The number of payload bytes.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int send_frame(int socket, uint8_t opcode, uint32_t flags, uint32_t request_id, const void *payload, uint64_t payload_length);
+
+/**
+ * @brief Decode and validate a frame header received by the caller.
+ *
+ * @param raw The FRAME_HEADER_SIZE bytes of the header as received.
+ * @param header The decoded header.
+ * @return int Returns 1 on success, -1 on bad magic/version.
+ */
+int decode_frame_header(const unsigned char *raw, struct frame_header *header);
+
+/**
+ * @brief Receive and validate a frame header.
+ *
+ * @param socket The socket to receive from.
+ * @param header The decoded header.
+ * @return int Returns 1 on success, 0 if the peer closed the connection, -1 on error or bad magic/version.
+ */
+int recv_frame_header(int socket, struct frame_header *header);
+
+/**
+ * @brief Receive a (small) frame payload as a NUL-terminated string.
+ *
+ * Payloads that do not fit in the buffer are drained from the socket and rejected.
+ *
+ * @param socket The socket to receive from.
+ * @param header The header of the frame whose payload follows.
+ * @param buffer The buffer to store the payload.
+ * @param buffer_size The size of the buffer, including room for the terminator.
+ * @return int Returns the payload length on success, -1 otherwise.
+ */
+int recv_frame_payload(int socket, const struct frame_header *header, char *buffer, size_t buffer_size);
+
+/**
+ * @brief Read and throw away payload bytes.
+ *
+ * @param socket The socket to receive from.
+ * @param length The number of bytes to discard.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int discard_payload(int socket, uint64_t length);
+
+/**
+ * @brief Throw away the body of a data frame whose header was received.
+ *
+ * For a chunked body every following chunk is thrown away too, up to the zero length chunk ending it.
+ *
+ * @param socket The socket to receive from.
+ * @param data The header of the data frame.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int discard_body(int socket, const struct frame_header *data);
+
+/**
+ * @brief Receive a whole frame, or a whole chunked body, and throw it away.
+ *
+ * Used to skip the data frame of an upload that is rejected before its body is read.
+ *
+ * @param socket The socket to receive from.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int discard_frame(int socket);
+
+/**
+ * @brief Send a command frame.
+ *
+ * @param socket The socket to send on.
+ * @param opcode The command opcode.
+ * @param request_id The request id.
+ * @param args The space separated command arguments.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int send_command(int socket, uint8_t opcode, uint32_t request_id, const char *args);
+
+/**
+ * @brief Get the trace id a command frame carries.
+ *
+ * @param header The header of the command frame.
+ * @param payload The payload of the command frame as received, payload_length bytes.
+ * @return uint64_t The trace id, or 0 if the frame is not traced.
+ */
+uint64_t frame_trace_id(const struct frame_header *header, const char *payload);
+
+/**
+ * @brief Send the end-to-end result of a request.
+ *
+ * @param socket The socket to send on.
+ * @param request_id The request id being answered.
+ * @param success 1 if the request succeeded, 0 otherwise.
+ * @param message The human readable result message.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int send_result(int socket, uint32_t request_id, int success, const char *message);
+
+/**
+ * @brief Receive the result frame of a request.
+ *
+ * @param socket The socket to receive from.
+ * @param message The buffer to store the result message, may be NULL.
+ * @param message_size The size of the message buffer.
+ * @return int Returns 1 if the request succeeded, 0 if it failed, -1 on protocol or socket error.
+ */
+int recv_result(int socket, char *message, size_t message_size);
+
+/**
+ * @brief Send one chunk of a chunked body, a zero length chunk ends the body.
+ *
+ * @param socket The socket to send on.
+ * @param request_id The request id the chunk belongs to.
+ * @param data The chunk bytes.
+ * @param length The number of bytes in the chunk.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int send_chunk(int socket, uint32_t request_id, const void *data, uint64_t length);
+
+/**
+ * @brief Receive the frame answering a download request.
+ *
+ * A successful download starts with an OP_DATA frame; a failed one is answered
+ * directly with an error OP_RESULT frame, whose message is stored in message.
+ * The same call receives the header of every following chunk of a chunked body.
+ *
+ * @param socket The socket to receive from.
+ * @param payload_length The length of the data (or chunk) that follows, set on success.
+ * @param message The buffer to store the error message, may be NULL.
+ * @param message_size The size of the message buffer.
+ * @return int Returns 1 if data follows, 2 if a chunk of a chunked body follows, 3 if a compressed chunk follows,
+ * 0 if the request failed, -1 on protocol or socket error.
+ */
+int recv_data_header(int socket, uint64_t *payload_length, char *message, size_t message_size);
+
+/**
+ * @brief Receive the frame answering a download request, keeping its whole header.
+ *
+ * The same as recv_data_header, for callers that need the flags of the data frame.
+ *
+ * @param socket The socket to receive from.
+ * @param data The header of the data frame, set if data follows.
+ * @param message The buffer to store the error message, may be NULL.
+ * @param message_size The size of the message buffer.
+ * @return int Returns the same as recv_data_header.
+ */
+int recv_data_frame(int socket, struct frame_header *data, char *message, size_t message_size);
+
+/**
+ * @brief Normalise a store path given in a command, collapsing repeated slashes, "." and ".." the way the file
+ *        system resolves them, so every spelling of a path names the same file.
+ *
+ * @param path The path, e.g. "docs//./a.txt".
+ * @param out The buffer for the normalised path, e.g. "/docs/a.txt".
+ * @param size The size of the buffer.
+ * @return int Returns 0 on success, -1 if the path does not fit.
+ */
+int normalise_path(const char *path, char *out, size_t size);
+
+/**
+ * @brief Check whether the arguments of a command hold a capability word, such as "deflate" or "crc32c".
+ *
+ * @param commands The tokenized arguments, NULL terminated, starting with the command name and the path.
+ * @param word The word.
+ * @return int Returns 1 if the word is among the arguments after the path and before any range, 0 otherwise.
+ */
+int has_argument(char *commands[], const char *word);
+
+/**
+ * @brief Find the byte range of a dfile in its arguments.
+ *
+ * @param commands The tokenized arguments, NULL terminated, starting with the command name and the path.
+ * @param range Set to the range asked for, or to the whole file if there is none.
+ * @return int Returns 1 if a range was given, 0 if there is none, -1 if the range is invalid.
+ */
+int parse_range(char *commands[], struct byte_range *range);
+
+/**
+ * @brief Fit a byte range to a file, cutting its length at the end of the file.
+ *
+ * @param range The range to fit.
+ * @param size The size of the file.
+ * @return int Returns 0 on success, -1 if the range starts past the end of the file.
+ */
+int clamp_range(struct byte_range *range, uint64_t size);
+
+#endif
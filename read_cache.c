@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+#include "transfer.h"
+#include "compress.h"
+#include "checksum.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "read_cache.h"
+
+struct cache_entry
+{
+  int valid;
+  char path[READ_CACHE_PATH_MAX]; // Normalised path the file is cached under
+  uint64_t size;
+  uint64_t last_used; // Value of the use clock at the last hit, the smallest is evicted first
+  uint64_t object;    // Number the copy is named after in the cache directory
+};
+
+struct cache_state
+{
+  pthread_mutex_t lock; // Process-shared
+  uint64_t generation;  // Bumped by every write through Smain
+  uint64_t clock;
+  uint64_t next_object;
+  uint64_t used; // Bytes held by valid entries
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  struct cache_entry entries[READ_CACHE_ENTRIES];
+};
+
+uint64_t read_cache_capacity = 64ULL * 1024 * 1024;
+
+static struct cache_state *state; // Shared by every process forked after read_cache_init
+
+static char cache_dir[READ_CACHE_PATH_MAX / 2];
+
+static void object_path(char *path, size_t size, uint64_t object)
+{
+  snprintf(path, size, "%s/%llu", cache_dir, (unsigned long long)object);
+}
+
+// Find the entry of a normalised path, with the lock held
+static struct cache_entry *find_entry(const char *path)
+{
+  for (int i = 0; i < READ_CACHE_ENTRIES; i++)
+    if (state->entries[i].valid && strcmp(state->entries[i].path, path) == 0)
+      return &state->entries[i];
+  return NULL;
+}
+
+// Remove an entry and its copy, with the lock held
+static void drop_entry(struct cache_entry *entry)
+{
+  char path[PATH_MAX];
+  object_path(path, sizeof(path), entry->object);
+  unlink(path);
+  state->used -= entry->size;
+  entry->valid = 0;
+}
+
+int read_cache_init(const char *dir)
+{
+  if (read_cache_capacity == 0)
+    return 0;
+  snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+
+  // create every component of the cache directory
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s", dir);
+  for (char *p = path + 1; *p != '\0'; p++)
+  {
+    if (*p != '/')
+      continue;
+    *p = '\0';
+    mkdir(path, 0755);
+    *p = '/';
+  }
+  if (mkdir(path, 0755) != 0 && errno != EEXIST)
+  {
+    perror("Failed to create read cache directory");
+    return -1;
+  }
+
+  // copies of an earlier run may not match the backends any more
+  DIR *cache = opendir(dir);
+  if (cache != NULL)
+  {
+    struct dirent *entry;
+    while ((entry = readdir(cache)) != NULL)
+    {
+      if (entry->d_name[0] == '.')
+        continue;
+      snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+      unlink(path);
+    }
+    closedir(cache);
+  }
+
+  struct cache_state *shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED)
+  {
+    perror("Failed to map read cache state");
+    return -1;
+  }
+  memset(shared, 0, sizeof(*shared));
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&shared->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  state = shared;
+  return 0;
+}
+
+void read_cache_invalidate(const char *path)
+{
+  char key[READ_CACHE_PATH_MAX];
+  if (state == NULL || normalise_path(path, key, sizeof(key)) != 0)
+    return;
+
+  pthread_mutex_lock(&state->lock);
+  state->generation++;
+  struct cache_entry *entry = find_entry(key);
+  if (entry != NULL)
+    drop_entry(entry);
+  pthread_mutex_unlock(&state->lock);
+}
+
+/* HITS */
+
+static int send_cached_file(int socket, uint32_t request_id, int fd, int deflate, int checked,
+                            struct byte_range range)
+{
+  // a compressed download cannot take the zero-copy path
+  int sent = send_compressed_file(socket, request_id, fd, deflate, checked, range);
+  if (sent != 0)
+    return sent;
+
+  // a range is sent from the copy in place
+  struct stat file_stat;
+  uint32_t crc = 0;
+  if (fstat(fd, &file_stat) != 0 || clamp_range(&range, file_stat.st_size) != 0 ||
+      (checked && checksum_file(fd, range, &crc) != 0))
+    return -1;
+  if (send_frame_header(socket, OP_DATA, checked ? FRAME_FLAG_CHECKSUM : 0, request_id,
+                        range.length + (checked ? CHECKSUM_SIZE : 0)) != 0)
+    return -1;
+  if (send_file_data(socket, fd, range.offset, range.length) != 0 || (checked && send_checksum(socket, crc) != 0))
+  {
+    // the frame length is already on the wire, so the stream can only be cut
+    shutdown(socket, SHUT_RDWR);
+    return -1;
+  }
+  return 1;
+}
+
+int read_cache_send(int socket, uint32_t request_id, const char *path, int deflate, int checked,
+                    struct byte_range range)
+{
+  char key[READ_CACHE_PATH_MAX];
+  if (state == NULL || normalise_path(path, key, sizeof(key)) != 0)
+    return 0;
+
+  // open under the lock, so the copy cannot be evicted between the lookup and the open
+  pthread_mutex_lock(&state->lock);
+  struct cache_entry *entry = find_entry(key);
+  int fd = -1;
+  if (entry != NULL)
+  {
+    char copy_path[PATH_MAX];
+    object_path(copy_path, sizeof(copy_path), entry->object);
+    fd = open(copy_path, O_RDONLY | O_CLOEXEC);
+    entry->last_used = ++state->clock;
+  }
+  if (fd >= 0)
+    state->hits++;
+  else
+    state->misses++;
+  unsigned long long hits = state->hits, misses = state->misses, evictions = state->evictions;
+  pthread_mutex_unlock(&state->lock);
+
+  // every dfile passes here, the hot path only logs with --log-level debug
+  if (log_level >= LOG_DEBUG)
+    printf("Read cache %s for %s (hits %llu, misses %llu, evictions %llu)\n", fd >= 0 ? "hit" : "miss", key, hits,
+           misses, evictions);
+
+  if (fd < 0)
+    return 0;
+  int result = send_cached_file(socket, request_id, fd, deflate, checked, range);
+  close(fd);
+  return result;
+}
+
+/* FILLS */
+
+// Stop copying a download that is not to be cached
+static void abandon_fill(struct read_cache_fill *fill)
+{
+  if (fill->fd < 0)
+    return;
+  close(fill->fd);
+  unlink(fill->temp_path);
+  fill->fd = -1;
+}
+
+static void append_to_fill(struct read_cache_fill *fill, const void *data, size_t length)
+{
+  if (fill->fd < 0)
+    return;
+  if (fill->size + length > read_cache_capacity / 4)
+  {
+    abandon_fill(fill);
+    return;
+  }
+
+  const char *p = data;
+  while (length > 0)
+  {
+    ssize_t bytes_written = write(fill->fd, p, length);
+    if (bytes_written < 0 && errno == EINTR)
+      continue;
+    if (bytes_written <= 0)
+    {
+      perror("Failed to write read cache copy");
+      abandon_fill(fill);
+      return;
+    }
+    p += bytes_written;
+    length -= bytes_written;
+    fill->size += bytes_written;
+  }
+}
+
+void read_cache_fill_begin(struct read_cache_fill *fill, const char *path)
+{
+  fill->fd = -1;
+  fill->size = 0;
+  if (state == NULL || normalise_path(path, fill->path, sizeof(fill->path)) != 0)
+    return;
+
+  pthread_mutex_lock(&state->lock);
+  fill->generation = state->generation;
+  uint64_t object = state->next_object++;
+  pthread_mutex_unlock(&state->lock);
+
+  snprintf(fill->temp_path, sizeof(fill->temp_path), "%s/%llu.tmp", cache_dir, (unsigned long long)object);
+  fill->fd = open(fill->temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fill->fd < 0)
+    perror("Failed to create read cache copy");
+}
+
+int read_cache_relay(int from_socket, int to_socket, uint64_t length, int compressed, int checked,
+                     struct read_cache_fill *fill)
+{
+  // a compressed chunk is inflated whole, so the buffer holds the largest one
+  static unsigned char *buffer, *inflated;
+  size_t buffer_size = compress_bound(COMPRESS_CHUNK_SIZE);
+  if (buffer == NULL)
+    buffer = malloc(buffer_size);
+  if (inflated == NULL)
+    inflated = malloc(COMPRESS_CHUNK_SIZE);
+  if (buffer == NULL || inflated == NULL || (compressed && length > buffer_size) || (checked && length < CHECKSUM_SIZE))
+  {
+    abandon_fill(fill);
+    return relay_data(from_socket, to_socket, length);
+  }
+
+  // the checksum trailer is relayed but not cached, and the copy is kept only if it matches
+  uint64_t content = checked ? length - CHECKSUM_SIZE : length;
+  unsigned char trailer[CHECKSUM_SIZE];
+  size_t trailer_used = 0;
+  uint32_t crc = 0;
+  int result = 0;
+  while (length > 0)
+  {
+    size_t part = length < buffer_size ? length : buffer_size;
+    if (recv_all(from_socket, buffer, part) != 1)
+      return RELAY_SOURCE_ERROR;
+    if (result == 0 && send_all(to_socket, buffer, part, 0) != 0)
+    {
+      // keep the source framed even though the sink is gone
+      result = RELAY_SINK_ERROR;
+      abandon_fill(fill);
+    }
+    length -= part;
+    scheduler_pace(part);
+
+    size_t data = content < part ? content : part;
+    if (checked)
+    {
+      crc = crc32c(crc, buffer, data);
+      memcpy(trailer + trailer_used, buffer + data, part - data);
+      trailer_used += part - data;
+    }
+    content -= data;
+
+    size_t inflated_length;
+    if (!compressed)
+      append_to_fill(fill, buffer, data);
+    else if (fill->fd >= 0 && inflate_chunk(buffer, part, inflated, &inflated_length) == 0)
+      append_to_fill(fill, inflated, inflated_length);
+    else
+      abandon_fill(fill);
+  }
+
+  // the client checks the trailer itself, a mismatch only keeps the copy out of the cache
+  uint32_t received;
+  memcpy(&received, trailer, sizeof(received));
+  if (checked && ntohl(received) != crc)
+  {
+    fprintf(stderr, "Checksum mismatch relaying download, not cached\n");
+    abandon_fill(fill);
+  }
+  return result;
+}
+
+void read_cache_fill_end(struct read_cache_fill *fill, int complete)
+{
+  if (fill->fd < 0)
+    return;
+  if (close(fill->fd) != 0)
+    complete = 0;
+  fill->fd = -1;
+
+  pthread_mutex_lock(&state->lock);
+  // publish only if no write passed through Smain while the file was downloaded
+  if (!complete || state->generation != fill->generation)
+  {
+    unlink(fill->temp_path);
+    pthread_mutex_unlock(&state->lock);
+    return;
+  }
+
+  // a concurrent download of the same file may have published first
+  struct cache_entry *entry = find_entry(fill->path);
+  if (entry != NULL)
+    drop_entry(entry);
+
+  // evict the least recently used files until the copy fits
+  while (1)
+  {
+    struct cache_entry *free_entry = NULL, *oldest = NULL;
+    for (int i = 0; i < READ_CACHE_ENTRIES; i++)
+    {
+      struct cache_entry *candidate = &state->entries[i];
+      if (!candidate->valid)
+        free_entry = free_entry != NULL ? free_entry : candidate;
+      else if (oldest == NULL || candidate->last_used < oldest->last_used)
+        oldest = candidate;
+    }
+    if (free_entry != NULL && state->used + fill->size <= read_cache_capacity)
+    {
+      entry = free_entry;
+      break;
+    }
+    drop_entry(oldest);
+    state->evictions++;
+  }
+
+  char path[PATH_MAX];
+  uint64_t object = state->next_object++;
+  object_path(path, sizeof(path), object);
+  if (rename(fill->temp_path, path) == 0)
+  {
+    snprintf(entry->path, sizeof(entry->path), "%s", fill->path);
+    entry->size = fill->size;
+    entry->last_used = ++state->clock;
+    entry->object = object;
+    entry->valid = 1;
+    state->used += fill->size;
+  }
+  else
+    unlink(fill->temp_path);
+  pthread_mutex_unlock(&state->lock);
+}
@@ -0,0 +1,121 @@
+#ifndef READ_CACHE_H
+#define READ_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "protocol.h"
+
+/*
+ * Cache of the files Smain downloads from Stext and Spdf.
+ *
+ * A dfile that misses the cache is relayed from the backend as before, and
+ * the body is copied into the cache directory on the way, inflated if the
+ * backend sent compressed chunks. Later dfiles of the same path are answered
+ * from the copy through the selected transmit path without asking the
+ * backend, compressed on the way for clients that accept it, so hot files stay
+ * in the page cache of a single copy.
+ *
+ * The cache holds at most read_cache_capacity bytes and READ_CACHE_ENTRIES
+ * files; the least recently used files are evicted to make room, and files
+ * larger than a quarter of the capacity are not cached. A ufile, ulink or
+ * rmfile of a path that passes through Smain drops the cached copy of that
+ * path, and a copy whose download overlapped such a write is never published.
+ *
+ * The table of cached files and the hit/miss counters live in shared memory
+ * created before the server forks, so every worker and client process shares
+ * the same copies; with --log-level debug every dfile logs whether it hit and
+ * the counters. Changes made to the backends' stores other than through
+ * Smain are not noticed.
+ */
+
+// Largest number of files kept in the cache
+#define READ_CACHE_ENTRIES 512
+
+// Longest path, as given to dfile, a file is cached under
+#define READ_CACHE_PATH_MAX 256
+
+/**
+ * @brief Largest number of bytes kept in the cache, set with --read-cache-size; 0 disables the cache.
+ */
+extern uint64_t read_cache_capacity;
+
+/**
+ * @brief A copy of a download being added to the cache.
+ */
+struct read_cache_fill
+{
+  int fd;                              // The copy, -1 once it is not to be cached
+  uint64_t generation;                 // Cache generation the download started at
+  uint64_t size;                       // Bytes copied so far
+  char path[READ_CACHE_PATH_MAX];      // The path the copy is cached under
+  char temp_path[READ_CACHE_PATH_MAX]; // Where the copy is written until it is complete
+};
+
+/**
+ * @brief Set up the cache, to be called before the server forks.
+ *
+ * Files left in the cache directory by an earlier run are removed.
+ *
+ * @param cache_dir The directory holding the cached files, outside the store.
+ * @return int Returns 0 on success or when the cache is disabled, -1 if the cache is unavailable.
+ */
+int read_cache_init(const char *cache_dir);
+
+/**
+ * @brief Drop the cached copy of a path, called after a write to the path.
+ *
+ * @param path The path, as given to dfile.
+ */
+void read_cache_invalidate(const char *path);
+
+/**
+ * @brief Send a file, or a byte range of it, from the cache, as the body of a download.
+ *
+ * @param socket The socket to send on.
+ * @param request_id The id of the request the file answers.
+ * @param path The path, as given to dfile.
+ * @param deflate 1 if the client accepts compressed chunks, 0 otherwise.
+ * @param checked 1 to follow the file with its checksum trailer, 0 otherwise.
+ * @param range The byte range of the file to send, {0, UINT64_MAX} for the whole file.
+ * @return int Returns 1 if the file was sent, 0 if it is not cached, -1 if the range starts past the end of the file
+ *             or on failure part way, with the socket shut down.
+ */
+int read_cache_send(int socket, uint32_t request_id, const char *path, int deflate, int checked,
+                    struct byte_range range);
+
+/**
+ * @brief Start copying a download into the cache.
+ *
+ * @param fill The copy to start; its fd is -1 if the file is not to be cached.
+ * @param path The path, as given to dfile.
+ */
+void read_cache_fill_begin(struct read_cache_fill *fill, const char *path);
+
+/**
+ * @brief Relay one data frame of a download from the backend to the client, copying it into the cache.
+ *
+ * Works like relay_data. The copy is dropped when it grows past the largest
+ * file the cache takes, a compressed chunk does not inflate or the frame does
+ * not match its checksum trailer, which is relayed but not copied.
+ *
+ * @param from_socket The socket to read the frame's payload from.
+ * @param to_socket The socket to write the payload to.
+ * @param length The length of the payload.
+ * @param compressed 1 if the frame is a compressed chunk, 0 otherwise.
+ * @param checked 1 if the payload ends with a checksum trailer, 0 otherwise.
+ * @param fill The copy of the download.
+ * @return int Returns 0 on success, RELAY_SOURCE_ERROR or RELAY_SINK_ERROR otherwise.
+ */
+int read_cache_relay(int from_socket, int to_socket, uint64_t length, int compressed, int checked,
+                     struct read_cache_fill *fill);
+
+/**
+ * @brief Finish copying a download, publishing the copy if the download is complete.
+ *
+ * @param fill The copy of the download.
+ * @param complete 1 if the whole file was relayed and the backend reported success, 0 otherwise.
+ */
+void read_cache_fill_end(struct read_cache_fill *fill, int complete);
+
+#endif
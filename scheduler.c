@@ -0,0 +1,378 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "protocol.h"
+#include "scheduler.h"
+
+// I/O priority of a bulk request: the lowest level of the best-effort class, see ioprio_set(2)
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_BULK ((IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7)
+
+// Weight of a client the weights file does not name
+#define DEFAULT_WEIGHT 1
+
+struct client_share
+{
+  uint32_t address;     // IPv4 address in network byte order
+  int used;             // The entry belongs to the client at address
+  uint32_t weight;
+  uint64_t rate;        // Bytes per second, 0 for no limit
+  int64_t tokens;       // Bytes the client may move before it is paced, negative once it is in debt
+  uint64_t refilled_ns; // When the tokens were last refilled
+  int running;          // Bulk requests of the client holding a slot
+  int waiting;          // Bulk requests of the client waiting for one
+  uint64_t served;      // Number of the last slot granted to the client
+};
+
+// A bulk request running or waiting, so the slot of a process that died can be given back
+struct request_entry
+{
+  pid_t pid; // 0 while the entry is free
+  int client;
+  int running;
+};
+
+struct scheduler_state
+{
+  pthread_mutex_t lock;    // Process-shared
+  pthread_cond_t released; // Signalled when a slot is given back
+  unsigned running;        // Bulk requests holding a slot
+  uint64_t grants;         // Slots granted so far
+  struct request_entry requests[SCHEDULER_MAX_REQUESTS];
+  struct client_share clients[SCHEDULER_CLIENTS];
+};
+
+struct client_weight
+{
+  uint32_t address;
+  uint32_t weight;
+  uint64_t rate;
+  int has_rate;
+};
+
+unsigned scheduler_bulk_slots = 0;
+uint64_t scheduler_client_rate = 0;
+const char *scheduler_weights_file = NULL;
+
+static struct scheduler_state *state; // Shared by every process forked after scheduler_init
+
+// read from the weights file before the server forks
+static struct client_weight weights[SCHEDULER_WEIGHTS_MAX];
+static int weight_count;
+
+// the request of this process, -1 outside a bulk request
+static int current_request = -1;
+static int current_client = -1;
+static int saved_ioprio = -1;
+
+static uint64_t now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int read_weights(const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    perror("Failed to open client weights");
+    return -1;
+  }
+
+  char line[256];
+  int line_number = 0, result = 0;
+  while (result == 0 && fgets(line, sizeof(line), file) != NULL)
+  {
+    line_number++;
+    char *p = line + strspn(line, " \t");
+    if (*p == '#' || *p == '\n' || *p == '\0')
+      continue;
+
+    // "address weight" or "address weight megabytes-per-second"
+    char ip[64];
+    unsigned weight;
+    unsigned long long megabytes;
+    int fields = sscanf(p, "%63s %u %llu", ip, &weight, &megabytes);
+    struct in_addr address;
+    if (fields < 2 || weight == 0 || inet_pton(AF_INET, ip, &address) != 1 || weight_count == SCHEDULER_WEIGHTS_MAX)
+    {
+      fprintf(stderr, "Invalid client weight at %s:%d\n", path, line_number);
+      result = -1;
+      break;
+    }
+    weights[weight_count++] = (struct client_weight){
+        .address = address.s_addr, .weight = weight, .rate = fields == 3 ? megabytes * 1024 * 1024 : 0, .has_rate = fields == 3};
+  }
+  fclose(file);
+  return result;
+}
+
+int scheduler_init(void)
+{
+  if (scheduler_weights_file != NULL && read_weights(scheduler_weights_file) != 0)
+    return -1;
+  if (scheduler_bulk_slots == 0 && scheduler_client_rate == 0 && weight_count == 0)
+    return 0;
+  if (scheduler_bulk_slots > SCHEDULER_MAX_REQUESTS)
+    scheduler_bulk_slots = SCHEDULER_MAX_REQUESTS;
+
+  struct scheduler_state *shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED)
+  {
+    perror("Failed to map scheduler state");
+    return -1;
+  }
+  memset(shared, 0, sizeof(*shared));
+
+  pthread_mutexattr_t mutex_attr;
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&shared->lock, &mutex_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&shared->released, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  state = shared;
+  return 0;
+}
+
+int scheduler_is_bulk(uint8_t opcode)
+{
+  switch (opcode)
+  {
+  case OP_UFILE:
+  case OP_DFILE:
+  case OP_DTAR:
+  case OP_UDELTA:
+  case OP_BATCH:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* SHARES */
+
+// Called with the lock held. Clients past SCHEDULER_CLIENTS take over the share of the client idle the longest.
+static int find_client(uint32_t address)
+{
+  int free_entry = -1, idle_entry = -1;
+  for (int probe = 0; probe < SCHEDULER_CLIENTS; probe++)
+  {
+    int i = (ntohl(address) + probe) % SCHEDULER_CLIENTS;
+    struct client_share *share = &state->clients[i];
+    if (!share->used)
+    {
+      free_entry = i;
+      break;
+    }
+    if (share->address == address)
+      return i;
+    if (share->running == 0 && share->waiting == 0 &&
+        (idle_entry < 0 || share->refilled_ns < state->clients[idle_entry].refilled_ns))
+      idle_entry = i;
+  }
+  if (free_entry < 0 && idle_entry < 0)
+  {
+    // every share is in use: the client is folded into the least loaded one, whose bucket and accounting it then
+    // shares, rather than resetting the share of a client that is running
+    int least = 0;
+    for (int i = 1; i < SCHEDULER_CLIENTS; i++)
+      if (state->clients[i].running + state->clients[i].waiting <
+          state->clients[least].running + state->clients[least].waiting)
+        least = i;
+    return least;
+  }
+  int i = free_entry >= 0 ? free_entry : idle_entry;
+  struct client_share *share = &state->clients[i];
+
+  // a new client, or one taking over a share
+  struct client_weight found = {.weight = DEFAULT_WEIGHT};
+  for (int w = 0; w < weight_count; w++)
+    if (weights[w].address == address)
+      found = weights[w];
+  share->address = address;
+  share->used = 1;
+  share->weight = found.weight;
+  share->rate = found.has_rate ? found.rate : scheduler_client_rate;
+  share->tokens = share->rate * SCHEDULER_BURST_MS / 1000;
+  share->refilled_ns = now_ns();
+  share->served = 0;
+  return i;
+}
+
+// A client may start while no waiting client has fewer running requests for its weight, or as few but was served
+// longer ago
+static int may_start(int client)
+{
+  if (scheduler_bulk_slots == 0)
+    return 1;
+  if (state->running >= scheduler_bulk_slots)
+    return 0;
+  struct client_share *share = &state->clients[client];
+  for (int i = 0; i < SCHEDULER_CLIENTS; i++)
+  {
+    struct client_share *other = &state->clients[i];
+    if (i == client || other->waiting == 0)
+      continue;
+    uint64_t mine = (uint64_t)share->running * other->weight, theirs = (uint64_t)other->running * share->weight;
+    if (theirs < mine || (theirs == mine && other->served < share->served))
+      return 0;
+  }
+  return 1;
+}
+
+// Called with the lock held
+static void drop_request(int index)
+{
+  struct request_entry *request = &state->requests[index];
+  struct client_share *share = &state->clients[request->client];
+  if (request->running)
+  {
+    share->running--;
+    state->running--;
+  }
+  else
+    share->waiting--;
+  request->pid = 0;
+  pthread_cond_broadcast(&state->released);
+}
+
+// Called with the lock held
+static void reclaim_dead_requests(void)
+{
+  for (int i = 0; i < SCHEDULER_MAX_REQUESTS; i++)
+    if (state->requests[i].pid != 0 && kill(state->requests[i].pid, 0) != 0 && errno == ESRCH)
+      drop_request(i);
+}
+
+/* REQUESTS */
+
+void scheduler_begin(int socket, uint8_t opcode)
+{
+  if (state == NULL || current_request >= 0 || !scheduler_is_bulk(opcode))
+    return;
+
+  // connections that are not IPv4 share the client of address 0
+  struct sockaddr_in peer;
+  socklen_t peer_size = sizeof(peer);
+  uint32_t address = 0;
+  if (getpeername(socket, (struct sockaddr *)&peer, &peer_size) == 0 && peer.sin_family == AF_INET)
+    address = peer.sin_addr.s_addr;
+
+  pthread_mutex_lock(&state->lock);
+  int client = find_client(address);
+  int index = -1;
+  while (1)
+  {
+    // the entry is taken as soon as one is free, so a dead waiter is found as well; the request only counts as
+    // waiting once it has one, which is what drop_request gives back
+    if (index < 0)
+      for (int i = 0; i < SCHEDULER_MAX_REQUESTS && index < 0; i++)
+        if (state->requests[i].pid == 0)
+        {
+          index = i;
+          state->requests[i] = (struct request_entry){.pid = getpid(), .client = client, .running = 0};
+          state->clients[client].waiting++;
+        }
+    if (index >= 0 && may_start(client))
+      break;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += SCHEDULER_WAIT_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    if (pthread_cond_timedwait(&state->released, &state->lock, &deadline) == ETIMEDOUT)
+      reclaim_dead_requests();
+  }
+  struct client_share *share = &state->clients[client];
+  share->waiting--;
+  share->running++;
+  share->served = ++state->grants;
+  state->running++;
+  state->requests[index].running = 1;
+  pthread_mutex_unlock(&state->lock);
+
+  current_request = index;
+  current_client = client;
+
+  // the disk reads of metadata requests go first where the I/O scheduler honours priorities
+  saved_ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+  if (saved_ioprio >= 0)
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_BULK);
+}
+
+void scheduler_end(void)
+{
+  if (state == NULL || current_request < 0)
+    return;
+  if (saved_ioprio >= 0)
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, saved_ioprio);
+
+  pthread_mutex_lock(&state->lock);
+  if (state->requests[current_request].pid == getpid())
+    drop_request(current_request);
+  pthread_mutex_unlock(&state->lock);
+  current_request = -1;
+  current_client = -1;
+}
+
+/* PACING */
+
+int scheduler_paced(void)
+{
+  return state != NULL && current_client >= 0 && state->clients[current_client].rate > 0;
+}
+
+void scheduler_pace(uint64_t bytes)
+{
+  if (!scheduler_paced())
+    return;
+
+  pthread_mutex_lock(&state->lock);
+  struct client_share *share = &state->clients[current_client];
+  uint64_t rate = share->rate;
+  int64_t burst = rate * SCHEDULER_BURST_MS / 1000;
+
+  // refill for the time since the last charge, the time slept off a debt included
+  uint64_t now = now_ns();
+  double refill = (double)(now - share->refilled_ns) * rate / 1e9;
+  share->tokens = share->tokens + refill > burst ? burst : share->tokens + (int64_t)refill;
+  share->refilled_ns = now;
+
+  share->tokens -= bytes;
+  int64_t debt = -share->tokens;
+  pthread_mutex_unlock(&state->lock);
+
+  if (debt <= 0)
+    return;
+  uint64_t delay_ns = (uint64_t)debt * 1000000000ULL / rate;
+  struct timespec delay = {.tv_sec = delay_ns / 1000000000ULL, .tv_nsec = delay_ns % 1000000000ULL};
+  while (nanosleep(&delay, &delay) != 0 && errno == EINTR)
+    ;
+}
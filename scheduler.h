@@ -0,0 +1,125 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+/*
+ * Fair-share scheduling of the requests of Smain and per-client bandwidth limits.
+ *
+ * process_command classifies every request by its opcode. Bulk transfers
+ * (ufile, dfile, dtar, udelta and batches) move file bodies through the disk
+ * of Smain and its links to the backends; metadata requests (display, rmfile,
+ * stats, uresume, ulink and usig) move a few bytes and are never queued nor
+ * paced. A client is told apart by the IPv4 address of its connection, every
+ * connection from one address is the same client.
+ *
+ * With --bulk-slots, at most that many bulk requests run at once over all the
+ * processes of Smain, the rest wait for a slot. A freed slot goes to the
+ * waiting client with the fewest running requests for its weight, ties to the
+ * client served longest ago, so a client running many transfers cannot crowd
+ * out one running a single transfer and a client of weight 2 gets twice the
+ * slots of one of weight 1 under contention. The slots of a process that died
+ * are given back by the next waiter.
+ *
+ * With --client-bandwidth, the bytes every client moves through file bodies,
+ * in both directions, are paced by a token bucket of that many megabytes per
+ * second holding at most SCHEDULER_BURST_MS of traffic. The transmit paths
+ * charge the bucket of the request after every chunk they move and sleep off
+ * the debt once it is empty, so all the transfers of a client share its rate.
+ *
+ * --client-weights names a file giving some clients another weight or rate:
+ *
+ *   # address     weight  [megabytes per second]
+ *   10.0.0.12     4
+ *   10.0.0.40     1       20
+ *
+ * A bulk request also runs at the lowest best-effort I/O priority, so on I/O
+ * schedulers that honour priorities (bfq) the disk reads of metadata requests
+ * overtake those of bulk transfers.
+ *
+ * The scheduler holds its state in shared memory created before the server
+ * forks, and needs the fork server model: an epoll worker runs one request at
+ * a time, so a bulk request waiting for a slot or being paced would hold the
+ * metadata requests of the other connections of its worker. Smain refuses
+ * --bulk-slots, --client-bandwidth and --client-weights in the epoll model.
+ */
+
+// Upper bound of --bulk-slots, and of the bulk requests running or waiting at once
+#define SCHEDULER_MAX_REQUESTS 1024
+
+// Clients with a share of their own, more clients take over the shares of idle ones, or share the least loaded one
+// while every share is busy
+#define SCHEDULER_CLIENTS 1024
+
+// Clients a --client-weights file may name
+#define SCHEDULER_WEIGHTS_MAX 256
+
+// Traffic a client may move at once before it is paced
+#define SCHEDULER_BURST_MS 250
+
+// Longest a waiting request sleeps before it looks for the slots of dead processes
+#define SCHEDULER_WAIT_MS 100
+
+/**
+ * @brief Bulk requests running at once, 0 for no limit, set with --bulk-slots.
+ */
+extern unsigned scheduler_bulk_slots;
+
+/**
+ * @brief Bytes per second moved by each client, 0 for no limit, set with --client-bandwidth.
+ */
+extern uint64_t scheduler_client_rate;
+
+/**
+ * @brief File of the client weights and rates, set with --client-weights.
+ */
+extern const char *scheduler_weights_file;
+
+/**
+ * @brief Set up the shared state of the scheduler, to be called before the server forks.
+ *        Does nothing when no limit is set.
+ *
+ * @return int Returns 0 on success, -1 if the weights file is invalid or the state unavailable.
+ */
+int scheduler_init(void);
+
+/**
+ * @brief Check whether a request is a bulk transfer.
+ *
+ * @param opcode The opcode of the request.
+ * @return int Returns 1 for a bulk transfer, 0 for a metadata request.
+ */
+int scheduler_is_bulk(uint8_t opcode);
+
+/**
+ * @brief Admit a request, waiting for a bulk slot if it is a bulk transfer.
+ *
+ * The bytes moved until scheduler_end are charged to the client of the socket.
+ *
+ * @param socket The client connection of the request.
+ * @param opcode The opcode of the request.
+ */
+void scheduler_begin(int socket, uint8_t opcode);
+
+/**
+ * @brief Give back the slot of the request admitted by scheduler_begin.
+ */
+void scheduler_end(void);
+
+/**
+ * @brief Charge bytes of a file body to the client of the current request, sleeping if it is over its rate.
+ *
+ * Does nothing outside a bulk request or for a client without a rate.
+ *
+ * @param bytes The number of bytes just moved.
+ */
+void scheduler_pace(uint64_t bytes);
+
+/**
+ * @brief Check whether the current request is paced, so a transfer is moved in chunks that can be charged.
+ *
+ * @return int Returns 1 if it is paced, 0 otherwise.
+ */
+int scheduler_paced(void);
+
+#endif
@@ -0,0 +1,857 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+#include "transfer.h"
+#include "stats.h"
+#include "segment_store.h"
+#include "checksum.h"
+
+// Stale records the index holds at startup, above one per live file, before it is written again
+#define SEGMENT_REWRITE_RECORDS 1024
+
+enum segment_record_type
+{
+  RECORD_PUT = 1,    // The path is at (segment, offset, length)
+  RECORD_DELETE = 2, // The path was removed
+  RECORD_DROP = 3,   // The segment was compacted and removed
+};
+
+// Record flags
+#define RECORD_FLAG_CHECKSUM 0x1 // crc holds the CRC32C of the file
+
+// One record of the index, followed by path_length bytes of path
+struct segment_record
+{
+  uint64_t offset;
+  uint64_t length;
+  int64_t mtime;
+  uint32_t check; // FNV-1a of the record, with check 0, and of the path
+  uint32_t segment;
+  uint16_t path_length;
+  uint8_t type;
+  uint8_t flags;
+  uint32_t crc;
+};
+
+struct segment_entry
+{
+  char *path;
+  uint32_t segment;
+  uint64_t offset;
+  uint64_t length;
+  int64_t mtime;
+  uint32_t crc;
+  int checksummed; // Whether crc is known, records written before checksums were kept have none
+  struct segment_entry *next; // Next entry in the same bucket of the path table
+};
+
+struct segment_info
+{
+  int fd;        // Open segment, -1 until it is first read or written
+  uint64_t live; // Bytes of the segment that live files hold
+  int dropped;
+};
+
+struct segment_shared
+{
+  pthread_mutex_t lock; // Process-shared, held by every append
+  uint64_t index_size;  // Bytes of the index written whole
+  uint32_t active;      // Segment appended to
+  uint64_t active_size;
+};
+
+int segment_store_enabled = 0;
+
+uint64_t segment_max_file = SEGMENT_MAX_FILE;
+
+static struct segment_shared *shared; // Shared by every process forked after segment_store_init
+
+static char segment_dir[PATH_MAX / 2];
+static int index_fd = -1;
+static uint64_t consumed; // Bytes of the index this process has replayed
+static uint64_t replayed; // Records replayed
+
+static struct segment_entry **table; // Path table, chained
+static size_t table_size;
+static size_t entry_count;
+
+static struct segment_info *segments; // Indexed by segment number
+static uint32_t segment_capacity;
+static uint32_t highest_segment; // Highest segment the index names, dropped ones included
+
+/* PATHS */
+
+// Paths are kept with single slashes and without "." components, the servers join them with extra ones
+static int key_path(const char *path, char *key, size_t size)
+{
+  size_t length = 0;
+  for (const char *p = path; *p != '\0'; p++)
+  {
+    int after_slash = length > 0 && key[length - 1] == '/';
+    if (after_slash && *p == '/')
+      continue;
+    if (after_slash && p[0] == '.' && (p[1] == '/' || p[1] == '\0'))
+      continue;
+    if (length + 1 >= size)
+      return -1;
+    key[length++] = *p;
+  }
+  if (length > 1 && key[length - 1] == '/')
+    length--;
+  key[length] = '\0';
+  return 0;
+}
+
+static void segment_path(char *path, size_t size, uint32_t segment)
+{
+  snprintf(path, size, "%s/%08u.seg", segment_dir, segment);
+}
+
+static size_t hash_path(const char *path)
+{
+  // FNV-1a
+  size_t hash = 14695981039346656037ULL;
+  for (const unsigned char *p = (const unsigned char *)path; *p != '\0'; p++)
+    hash = (hash ^ *p) * 1099511628211ULL;
+  return hash;
+}
+
+/* TABLES */
+
+static struct segment_entry **find_slot(const char *path)
+{
+  struct segment_entry **slot = &table[hash_path(path) & (table_size - 1)];
+  while (*slot != NULL && strcmp((*slot)->path, path) != 0)
+    slot = &(*slot)->next;
+  return slot;
+}
+
+static void grow_table(void)
+{
+  size_t new_size = table_size * 2;
+  struct segment_entry **new_table = calloc(new_size, sizeof(*new_table));
+  if (new_table == NULL)
+    return;
+  for (size_t i = 0; i < table_size; i++)
+  {
+    struct segment_entry *entry = table[i];
+    while (entry != NULL)
+    {
+      struct segment_entry *next = entry->next;
+      size_t bucket = hash_path(entry->path) & (new_size - 1);
+      entry->next = new_table[bucket];
+      new_table[bucket] = entry;
+      entry = next;
+    }
+  }
+  free(table);
+  table = new_table;
+  table_size = new_size;
+}
+
+static struct segment_info *segment_info(uint32_t segment)
+{
+  if (segment >= segment_capacity)
+  {
+    uint32_t capacity = segment_capacity > 0 ? segment_capacity : 64;
+    while (capacity <= segment)
+      capacity *= 2;
+    struct segment_info *grown = realloc(segments, capacity * sizeof(*grown));
+    if (grown == NULL)
+      return NULL;
+    for (uint32_t i = segment_capacity; i < capacity; i++)
+      grown[i] = (struct segment_info){.fd = -1};
+    segments = grown;
+    segment_capacity = capacity;
+  }
+  return &segments[segment];
+}
+
+// The segment opened for reading, or for appending with create set; -1 with errno ENOENT for a dropped one
+static int segment_fd(uint32_t segment, int create)
+{
+  struct segment_info *info = segment_info(segment);
+  if (info == NULL || info->dropped)
+  {
+    errno = info == NULL ? ENOMEM : ENOENT;
+    return -1;
+  }
+  if (info->fd < 0)
+  {
+    char path[PATH_MAX];
+    segment_path(path, sizeof(path), segment);
+    info->fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+  }
+  return info->fd;
+}
+
+static void apply_record(const struct segment_record *record, const char *path)
+{
+  if (record->type != RECORD_DELETE && record->segment > highest_segment)
+    highest_segment = record->segment;
+  if (record->type == RECORD_DROP)
+  {
+    struct segment_info *info = segment_info(record->segment);
+    if (info != NULL)
+    {
+      if (info->fd >= 0)
+        close(info->fd);
+      info->fd = -1;
+      info->dropped = 1;
+    }
+    return;
+  }
+
+  struct segment_entry **slot = find_slot(path);
+  struct segment_entry *entry = *slot;
+  if (entry != NULL)
+  {
+    struct segment_info *info = segment_info(entry->segment);
+    if (info != NULL)
+      info->live -= entry->length;
+  }
+
+  if (record->type == RECORD_DELETE)
+  {
+    if (entry != NULL)
+    {
+      *slot = entry->next;
+      free(entry->path);
+      free(entry);
+      entry_count--;
+    }
+    return;
+  }
+
+  if (entry == NULL)
+  {
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL || (entry->path = strdup(path)) == NULL)
+    {
+      perror("Failed to allocate segment index");
+      free(entry);
+      return;
+    }
+    *slot = entry;
+    if (++entry_count > table_size)
+      grow_table();
+  }
+  entry->segment = record->segment;
+  entry->offset = record->offset;
+  entry->length = record->length;
+  entry->mtime = record->mtime;
+  entry->crc = record->crc;
+  entry->checksummed = (record->flags & RECORD_FLAG_CHECKSUM) != 0;
+  struct segment_info *info = segment_info(record->segment);
+  if (info != NULL)
+    info->live += record->length;
+}
+
+/* INDEX */
+
+static uint32_t record_check(const struct segment_record *record, const char *path)
+{
+  struct segment_record copy = *record;
+  copy.check = 0;
+  uint32_t hash = 2166136261U;
+  for (size_t i = 0; i < sizeof(copy); i++)
+    hash = (hash ^ ((const unsigned char *)&copy)[i]) * 16777619U;
+  for (size_t i = 0; i < record->path_length; i++)
+    hash = (hash ^ (unsigned char)path[i]) * 16777619U;
+  return hash;
+}
+
+// Lay a record and its path out in buffer, which holds sizeof(struct segment_record) + PATH_MAX bytes
+static size_t encode_record(char *buffer, struct segment_record record, const char *path)
+{
+  record.path_length = strlen(path);
+  record.check = record_check(&record, path);
+  memcpy(buffer, &record, sizeof(record));
+  memcpy(buffer + sizeof(record), path, record.path_length);
+  return sizeof(record) + record.path_length;
+}
+
+static int read_all_at(int fd, void *buffer, size_t length, uint64_t position)
+{
+  char *p = buffer;
+  while (length > 0)
+  {
+    ssize_t bytes_read = pread(fd, p, length, position);
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0)
+      return -1;
+    p += bytes_read;
+    length -= bytes_read;
+    position += bytes_read;
+  }
+  return 0;
+}
+
+static int write_all_at(int fd, const void *buffer, size_t length, uint64_t position)
+{
+  const char *p = buffer;
+  while (length > 0)
+  {
+    ssize_t bytes_written = pwrite(fd, p, length, position);
+    if (bytes_written < 0 && errno == EINTR)
+      continue;
+    if (bytes_written <= 0)
+      return -1;
+    p += bytes_written;
+    length -= bytes_written;
+    position += bytes_written;
+  }
+  return 0;
+}
+
+// Apply the records of the index up to end, -1 at a record that is torn or corrupt
+static int replay(uint64_t end)
+{
+  while (consumed < end)
+  {
+    struct segment_record record;
+    char path[PATH_MAX];
+    if (end - consumed < sizeof(record) || read_all_at(index_fd, &record, sizeof(record), consumed) != 0 ||
+        record.path_length >= sizeof(path) || end - consumed - sizeof(record) < record.path_length ||
+        read_all_at(index_fd, path, record.path_length, consumed + sizeof(record)) != 0)
+      return -1;
+    path[record.path_length] = '\0';
+    if (record_check(&record, path) != record.check)
+      return -1;
+
+    apply_record(&record, path);
+    consumed += sizeof(record) + record.path_length;
+    replayed++;
+  }
+  return 0;
+}
+
+// Replay the records other processes appended since this process last did
+static int catch_up(void)
+{
+  pthread_mutex_lock(&shared->lock);
+  uint64_t end = shared->index_size;
+  pthread_mutex_unlock(&shared->lock);
+  if (replay(end) != 0)
+  {
+    fprintf(stderr, "Failed to read segment index\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Append a record and apply it, called with the lock held
+static int append_record(struct segment_record record, const char *path)
+{
+  char buffer[sizeof(struct segment_record) + PATH_MAX];
+  size_t size = encode_record(buffer, record, path);
+  if (write(index_fd, buffer, size) != (ssize_t)size)
+  {
+    perror("Failed to write segment index");
+    // a partial record would hide every record appended after it
+    if (ftruncate(index_fd, shared->index_size) != 0)
+      perror("Failed to cut segment index");
+    return -1;
+  }
+  shared->index_size += size;
+  return replay(shared->index_size);
+}
+
+// Append a file to the active segment and record it with its checksum, called with the lock held
+static int append_file(const char *key, const void *data, uint64_t length, int64_t mtime, uint32_t crc)
+{
+  if (shared->active_size > 0 && shared->active_size + length > SEGMENT_SIZE)
+  {
+    shared->active++;
+    shared->active_size = 0;
+  }
+
+  uint32_t segment = shared->active;
+  uint64_t offset = shared->active_size;
+  int fd = segment_fd(segment, 1);
+  if (fd < 0 || write_all_at(fd, data, length, offset) != 0)
+  {
+    perror("Failed to write segment");
+    return -1;
+  }
+  // the bytes are garbage if the record cannot be appended, they are never written over
+  shared->active_size += length;
+  struct segment_record record = {.offset = offset, .length = length, .mtime = mtime, .segment = segment,
+                                  .type = RECORD_PUT, .flags = RECORD_FLAG_CHECKSUM, .crc = crc};
+  return append_record(record, key);
+}
+
+// Write the index again with one record per live file, into a new file renamed over the old one
+static int rewrite_index(void)
+{
+  char path[PATH_MAX], temp_path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/index", segment_dir);
+  snprintf(temp_path, sizeof(temp_path), "%s/index.new", segment_dir);
+  int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+  {
+    perror("Failed to rewrite segment index");
+    return -1;
+  }
+
+  uint64_t size = 0;
+  int result = 0;
+  char buffer[sizeof(struct segment_record) + PATH_MAX];
+  for (size_t i = 0; i < table_size && result == 0; i++)
+    for (struct segment_entry *entry = table[i]; entry != NULL && result == 0; entry = entry->next)
+    {
+      struct segment_record record = {.offset = entry->offset, .length = entry->length, .mtime = entry->mtime,
+                                      .segment = entry->segment, .type = RECORD_PUT,
+                                      .flags = entry->checksummed ? RECORD_FLAG_CHECKSUM : 0, .crc = entry->crc};
+      size_t length = encode_record(buffer, record, entry->path);
+      result = write_all_at(fd, buffer, length, size);
+      size += length;
+    }
+  // the new index replaces the old one only once it is on disk
+  if (result != 0 || fsync(fd) != 0 || close(fd) != 0 || rename(temp_path, path) != 0)
+  {
+    perror("Failed to rewrite segment index");
+    remove(temp_path);
+    return -1;
+  }
+
+  int new_fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+  if (new_fd < 0)
+  {
+    perror("Failed to open segment index");
+    return -1;
+  }
+  close(index_fd);
+  index_fd = new_fd;
+  consumed = size;
+  shared->index_size = size;
+  return 0;
+}
+
+// Remove the segments no live file is in, and start a new one to append to, past every segment on disk or in the
+// index: a dropped segment is gone from disk but its number stays dropped
+static void open_active_segment(void)
+{
+  uint32_t last = highest_segment;
+  DIR *dir = opendir(segment_dir);
+  struct dirent *entry;
+  while (dir != NULL && (entry = readdir(dir)) != NULL)
+  {
+    unsigned segment;
+    char suffix[8];
+    if (sscanf(entry->d_name, "%8u.%7s", &segment, suffix) != 2 || strcmp(suffix, "seg") != 0)
+      continue;
+    if (segment > last)
+      last = segment;
+    struct segment_info *info = segment_info(segment);
+    if (info != NULL && info->live == 0)
+    {
+      char path[PATH_MAX];
+      segment_path(path, sizeof(path), segment);
+      unlink(path);
+      info->dropped = 1;
+    }
+  }
+  if (dir != NULL)
+    closedir(dir);
+  shared->active = last + 1;
+  shared->active_size = 0;
+}
+
+/* COMPACTION */
+
+// Move the live files of a segment to the active one, then drop it
+static void compact_segment(uint32_t segment)
+{
+  // the files are moved one at a time, so appends are never held up for a whole segment
+  size_t count = 0;
+  char **paths = malloc(entry_count * sizeof(*paths) + 1);
+  for (size_t i = 0; paths != NULL && i < table_size; i++)
+    for (struct segment_entry *entry = table[i]; entry != NULL; entry = entry->next)
+      if (entry->segment == segment && (paths[count] = strdup(entry->path)) != NULL)
+        count++;
+  if (paths == NULL)
+    return;
+
+  int result = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    pthread_mutex_lock(&shared->lock);
+    struct segment_entry *entry = result == 0 && replay(shared->index_size) == 0 ? *find_slot(paths[i]) : NULL;
+    // the file may have been replaced or removed since the segment was picked
+    if (entry != NULL && entry->segment == segment)
+    {
+      // a file that no longer matches its checksum is moved all the same, its downloads fail their checks
+      char *data = malloc(entry->length + 1);
+      int fd = segment_fd(segment, 0);
+      if (data == NULL || fd < 0 || read_all_at(fd, data, entry->length, entry->offset) != 0)
+        result = -1;
+      uint32_t crc = result == 0 ? crc32c(0, data, entry->length) : 0;
+      if (result == 0 && entry->checksummed && crc != entry->crc)
+      {
+        fprintf(stderr, "Segment file %s does not match its checksum\n", paths[i]);
+        crc = entry->crc;
+      }
+      if (result == 0 && append_file(paths[i], data, entry->length, entry->mtime, crc) != 0)
+        result = -1;
+      free(data);
+    }
+    pthread_mutex_unlock(&shared->lock);
+    free(paths[i]);
+  }
+  free(paths);
+  if (result != 0)
+  {
+    fprintf(stderr, "Failed to compact segment %u\n", segment);
+    return;
+  }
+
+  pthread_mutex_lock(&shared->lock);
+  struct segment_info *info = segment_info(segment);
+  if (replay(shared->index_size) == 0 && info != NULL && info->live == 0 &&
+      append_record((struct segment_record){.segment = segment, .type = RECORD_DROP}, "") == 0)
+  {
+    char path[PATH_MAX];
+    segment_path(path, sizeof(path), segment);
+    unlink(path);
+    // the compactor is never stopped cleanly, so its output is not left buffered
+    if (log_level >= LOG_DEBUG)
+    {
+      printf("Compacted segment %u, %zu files moved\n", segment, count);
+      fflush(stdout);
+    }
+  }
+  pthread_mutex_unlock(&shared->lock);
+}
+
+static void run_compactor(void)
+{
+  while (1)
+  {
+    sleep(SEGMENT_COMPACT_INTERVAL);
+    if (catch_up() != 0)
+      continue;
+
+    pthread_mutex_lock(&shared->lock);
+    uint32_t active = shared->active;
+    pthread_mutex_unlock(&shared->lock);
+
+    for (uint32_t segment = 1; segment < active && segment < segment_capacity; segment++)
+    {
+      struct stat st;
+      int fd = segments[segment].dropped ? -1 : segment_fd(segment, 0);
+      if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+        continue;
+      uint64_t garbage = st.st_size - segments[segment].live;
+      if (garbage * 100 >= (uint64_t)st.st_size * SEGMENT_GARBAGE_PERCENT)
+        compact_segment(segment);
+    }
+  }
+}
+
+static int start_compactor(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    perror("Failed to start segment compactor");
+    return -1;
+  }
+  if (pid == 0)
+  {
+    // the compactor lives as long as the server, which stops it on exit
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_DFL);
+    run_compactor();
+  }
+  return 0;
+}
+
+/* SEGMENT STORE */
+
+int segment_store_init(const char *dir)
+{
+  if (!segment_store_enabled)
+    return 0;
+  if (segment_max_file > SEGMENT_SIZE)
+    segment_max_file = SEGMENT_SIZE;
+  snprintf(segment_dir, sizeof(segment_dir), "%s", dir);
+
+  // create every component of the segment directory
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s", dir);
+  for (char *p = path + 1; *p != '\0'; p++)
+  {
+    if (*p != '/')
+      continue;
+    *p = '\0';
+    mkdir(path, 0755);
+    *p = '/';
+  }
+  if (mkdir(path, 0755) != 0 && errno != EEXIST)
+  {
+    perror("Failed to create segment directory");
+    return -1;
+  }
+
+  snprintf(path, sizeof(path), "%s/index", dir);
+  index_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  struct stat index_stat;
+  if (index_fd < 0 || fstat(index_fd, &index_stat) != 0)
+  {
+    perror("Failed to open segment index");
+    return -1;
+  }
+
+  struct segment_shared *state = mmap(NULL, sizeof(*state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (state == MAP_FAILED)
+  {
+    perror("Failed to map segment store state");
+    return -1;
+  }
+  memset(state, 0, sizeof(*state));
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&state->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  shared = state;
+
+  table_size = 1024;
+  table = calloc(table_size, sizeof(*table));
+  if (table == NULL)
+  {
+    perror("Failed to allocate segment index");
+    return -1;
+  }
+
+  // a record torn by a crash is cut off, with everything after it
+  if (replay(index_stat.st_size) != 0)
+  {
+    fprintf(stderr, "Segment index cut at %llu bytes\n", (unsigned long long)consumed);
+    if (ftruncate(index_fd, consumed) != 0)
+    {
+      perror("Failed to cut segment index");
+      return -1;
+    }
+  }
+  shared->index_size = consumed;
+  if (replayed > 2 * entry_count + SEGMENT_REWRITE_RECORDS && rewrite_index() != 0)
+    return -1;
+
+  open_active_segment();
+  printf("Segment store: %zu files\n", entry_count);
+  return start_compactor();
+}
+
+int segment_store_accepts(uint64_t size)
+{
+  return segment_store_enabled && size <= segment_max_file;
+}
+
+// Store a file whose checksum is known
+static int put_checked(const char *path, const void *data, uint64_t length, uint32_t crc)
+{
+  char key[PATH_MAX];
+  if (key_path(path, key, sizeof(key)) != 0)
+    return -1;
+
+  pthread_mutex_lock(&shared->lock);
+  int result = replay(shared->index_size) == 0 ? append_file(key, data, length, time(NULL), crc) : -1;
+  pthread_mutex_unlock(&shared->lock);
+
+  // the file on disk the path had until now is replaced by the copy in the segment
+  if (result == 0 && unlink(path) != 0 && errno != ENOENT)
+    perror("Failed to remove replaced file");
+  return result;
+}
+
+int segment_store_put(const char *path, const void *data, uint64_t length)
+{
+  return put_checked(path, data, length, crc32c(0, data, length));
+}
+
+int segment_store_receive(int socket, const char *path, uint64_t length, int checked)
+{
+  char *data = malloc(length + 1);
+  if (data == NULL)
+  {
+    perror("Failed to allocate file");
+    discard_payload(socket, length + (checked ? CHECKSUM_SIZE : 0));
+    return -1;
+  }
+  if (recv_all(socket, data, length) != 1)
+  {
+    perror("Failed to receive file");
+    free(data);
+    return -1;
+  }
+
+  // the checksum the file is stored with is the one it arrived with
+  uint32_t crc = crc32c(0, data, length);
+  int result = -1;
+  if (!checked || recv_checksum(socket, crc) == 1)
+    result = put_checked(path, data, length, crc) == 0 ? 1 : -1;
+  free(data);
+  return result;
+}
+
+int segment_store_put_file(const char *path, const char *source_path)
+{
+  int fd = open(source_path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    perror("Failed to open file");
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  char *data = malloc(st.st_size + 1);
+  int result = data != NULL && read_all_at(fd, data, st.st_size, 0) == 0 ? 0 : -1;
+  close(fd);
+  if (result == 0)
+    result = segment_store_put(path, data, st.st_size);
+  else
+    perror("Failed to read file");
+  free(data);
+  if (result == 0)
+    remove(source_path);
+  return result;
+}
+
+int segment_store_remove(const char *path)
+{
+  char key[PATH_MAX];
+  if (!segment_store_enabled || key_path(path, key, sizeof(key)) != 0)
+    return 0;
+
+  pthread_mutex_lock(&shared->lock);
+  int result = replay(shared->index_size) == 0 ? *find_slot(key) != NULL : -1;
+  if (result == 1 && append_record((struct segment_record){.type = RECORD_DELETE}, key) != 0)
+    result = -1;
+  pthread_mutex_unlock(&shared->lock);
+  return result;
+}
+
+int segment_store_lookup(const char *path, struct segment_object *object)
+{
+  char key[PATH_MAX];
+  if (!segment_store_enabled || key_path(path, key, sizeof(key)) != 0)
+    return 0;
+
+  for (int attempt = 0; attempt < 2; attempt++)
+  {
+    if (catch_up() != 0)
+      return -1;
+    struct segment_entry *entry = *find_slot(key);
+    if (entry == NULL)
+      return 0;
+
+    int fd = segment_fd(entry->segment, 0);
+    if (fd >= 0)
+    {
+      *object = (struct segment_object){.fd = fd,
+                                        .offset = entry->offset,
+                                        .length = entry->length,
+                                        .mtime = entry->mtime,
+                                        .crc = entry->crc,
+                                        .checksummed = entry->checksummed};
+      return 1;
+    }
+    if (errno != ENOENT)
+      break;
+    // the segment was compacted since this process last caught up, the index tells where the file went
+  }
+  perror("Failed to open segment");
+  return -1;
+}
+
+int segment_store_send(int socket, uint32_t request_id, const char *path, struct byte_range range, int checked)
+{
+  struct segment_object object;
+  int found = segment_store_lookup(path, &object);
+  if (found != 1)
+    return found;
+
+  if (clamp_range(&range, object.length) != 0)
+    return -1;
+
+  // the checksum of a whole file comes from the index, a range is read
+  uint32_t crc = object.crc;
+  if (checked && !(object.checksummed && range.offset == 0 && range.length == object.length) &&
+      checksum_read(object.fd, object.offset + range.offset, range.length, &crc) != 0)
+    return -1;
+
+  // send data frame header carrying the size of the range
+  if (send_frame_header(socket, OP_DATA, checked ? FRAME_FLAG_CHECKSUM : 0, request_id,
+                        range.length + (checked ? CHECKSUM_SIZE : 0)) != 0)
+  {
+    perror("Failed to send file size");
+    return -1;
+  }
+
+  // the range is sent out of the segment through the selected transmit path
+  if (send_file_data(socket, object.fd, object.offset + range.offset, range.length) != 0 ||
+      (checked && send_checksum(socket, crc) != 0))
+  {
+    // the frame length is already on the wire, so the stream can only be cut
+    perror("Failed to send file");
+    shutdown(socket, SHUT_RDWR);
+    return -1;
+  }
+
+  if (log_level >= LOG_DEBUG)
+    printf("File sent from segment\n");
+  return 1;
+}
+
+int segment_store_walk(const char *dir_path, int (*visit)(const char *path, void *arg), void *arg)
+{
+  char prefix[PATH_MAX];
+  if (!segment_store_enabled || key_path(dir_path, prefix, sizeof(prefix) - 1) != 0)
+    return 0;
+  strcat(prefix, "/");
+  size_t prefix_len = strlen(prefix);
+  if (catch_up() != 0)
+    return -1;
+
+  // the paths are copied out first, as every lookup replays the index into the table
+  size_t count = 0;
+  char **paths = malloc(entry_count * sizeof(*paths) + 1);
+  if (paths == NULL)
+    return -1;
+  for (size_t i = 0; i < table_size; i++)
+    for (struct segment_entry *entry = table[i]; entry != NULL; entry = entry->next)
+      if (strncmp(entry->path, prefix, prefix_len) == 0 && (paths[count] = strdup(entry->path)) != NULL)
+        count++;
+
+  int result = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    if (result == 0)
+      result = visit(paths[i], arg);
+    free(paths[i]);
+  }
+  free(paths);
+  return result;
+}
@@ -0,0 +1,172 @@
+#ifndef SEGMENT_STORE_H
+#define SEGMENT_STORE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "protocol.h"
+
+/*
+ * Log-structured store for small files, enabled with --segment-store.
+ *
+ * Without it every file of the store is an inode of its own, with a directory
+ * per component of its path: millions of small files cost as many inodes and
+ * dentries, and are scattered over the disk. With it, files of at most
+ * --segment-max-file bytes are appended back to back to large segment files
+ * instead, and an index log records where each of them is:
+ *
+ *   <segment dir>/index         records, in host byte order
+ *   <segment dir>/NNNNNNNN.seg  the contents of the files
+ *
+ * A record puts a path at a (segment, offset, length) with the CRC32C of its
+ * content, deletes a path, or drops a segment; the last record of a path
+ * wins. Every process of a server keeps a table from path to location, read
+ * from the index at startup and inherited when it is forked, and replays the
+ * records appended since before every lookup. Appends are made under a process-shared lock, data first and
+ * record second; a record torn by a crash is cut off at the next start.
+ *
+ * A path is either in the segment store or a file on disk, never both:
+ * storing it in one removes it from the other. Downloads are sent straight
+ * out of the segment through the transmit path of --send-mode, and display
+ * and dtar list the files of the segment store with the files on disk.
+ *
+ * Overwritten and removed files leave garbage behind. A compactor process
+ * copies the live files out of every segment no longer appended to that is
+ * at least SEGMENT_GARBAGE_PERCENT garbage, checking them against their
+ * checksums on the way, then drops the segment; processes that still have it
+ * open read their copy until they replay the drop. The index is written
+ * again without its stale records at startup, once most of them are.
+ *
+ * Files packed at rest or deduplicated, striped uploads and files rebuilt
+ * from a delta always go to disk.
+ */
+
+// Size past which a new segment is started
+#define SEGMENT_SIZE (64ULL * 1024 * 1024)
+
+// Default largest file kept in a segment
+#define SEGMENT_MAX_FILE (64 * 1024)
+
+// Seconds between two passes of the compactor
+#define SEGMENT_COMPACT_INTERVAL 10
+
+// Share of a segment that has to be garbage before it is compacted
+#define SEGMENT_GARBAGE_PERCENT 50
+
+/**
+ * @brief Whether small files are appended to segments, set with --segment-store.
+ */
+extern int segment_store_enabled;
+
+/**
+ * @brief Largest file appended to a segment, set with --segment-max-file.
+ */
+extern uint64_t segment_max_file;
+
+/**
+ * @brief A file of the segment store, as found by segment_store_lookup.
+ */
+struct segment_object
+{
+  int fd;          // The segment, owned by the segment store and valid until its next call
+  uint64_t offset; // Where the file starts in the segment
+  uint64_t length;
+  time_t mtime;
+  uint32_t crc;    // The CRC32C of the file, if checksummed
+  int checksummed;
+};
+
+/**
+ * @brief Open the segment store and start its compactor, to be called before the server forks.
+ *        Does nothing without --segment-store.
+ *
+ * @param segment_dir The directory of the segments and their index, e.g. "./segments/stext".
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int segment_store_init(const char *segment_dir);
+
+/**
+ * @brief Check whether a file of a given size goes to the segment store.
+ *
+ * @param size The size of the file.
+ * @return int Returns 1 if it does, 0 if it is stored as a file on disk.
+ */
+int segment_store_accepts(uint64_t size);
+
+/**
+ * @brief Store a file in the segment store, removing the file on disk at the same path.
+ *
+ * @param path The path of the file in the store, e.g. "./stext/docs/a.txt".
+ * @param data The content of the file.
+ * @param length The size of the file.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int segment_store_put(const char *path, const void *data, uint64_t length);
+
+/**
+ * @brief Receive the payload of a data frame into the segment store.
+ *
+ * A file that does not match the checksum trailer following it is not stored.
+ *
+ * @param socket The socket to receive from.
+ * @param path The path of the file in the store.
+ * @param length The length of the payload, without its checksum trailer.
+ * @param checked 1 if a checksum trailer follows the content, 0 otherwise.
+ * @return int Returns 1 if the file was stored, -1 otherwise.
+ */
+int segment_store_receive(int socket, const char *path, uint64_t length, int checked);
+
+/**
+ * @brief Move a complete file, e.g. a finished resumable upload, into the segment store.
+ *
+ * The source file is removed once it is stored.
+ *
+ * @param path The path of the file in the store.
+ * @param source_path The file holding the content.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int segment_store_put_file(const char *path, const char *source_path);
+
+/**
+ * @brief Remove a path from the segment store.
+ *
+ * @param path The path of the file in the store.
+ * @return int Returns 1 if the path was removed, 0 if it is not in the segment store, -1 on failure.
+ */
+int segment_store_remove(const char *path);
+
+/**
+ * @brief Find a file in the segment store.
+ *
+ * @param path The path of the file in the store.
+ * @param object Filled with where the file is.
+ * @return int Returns 1 if the file was found, 0 if it is not in the segment store, -1 on failure.
+ */
+int segment_store_lookup(const char *path, struct segment_object *object);
+
+/**
+ * @brief Send a range of a file of the segment store as a data frame, straight out of its segment.
+ *
+ * @param socket The socket to send on.
+ * @param request_id The id of the request the file answers.
+ * @param path The path of the file in the store.
+ * @param range The byte range asked for.
+ * @param checked 1 to follow the range with its checksum trailer, 0 otherwise.
+ * @return int Returns 1 if the file was sent, 0 if it is not in the segment store and nothing was sent, -1 on failure.
+ *             On failure part way the socket is shut down.
+ */
+int segment_store_send(int socket, uint32_t request_id, const char *path, struct byte_range range, int checked);
+
+/**
+ * @brief Call a function for every path of the segment store under a directory.
+ *
+ * The paths are collected first, so the function may look them up.
+ *
+ * @param dir_path The directory, e.g. "./stext".
+ * @param visit The function, called with the path and arg; a non-zero return stops the walk.
+ * @param arg Passed to visit.
+ * @return int Returns 0 once every path was visited, the return of visit if it stopped the walk, -1 on failure.
+ */
+int segment_store_walk(const char *dir_path, int (*visit)(const char *path, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * SHA-256, the content hash of the deduplicated blob store.
+ *
+ * The hash is computed incrementally, so a server hashes an upload chunk by
+ * chunk while it writes it, and the client hashes a file while it reads it.
+ */
+
+// Size of a digest, and of its hexadecimal form without the terminator
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_HEX_SIZE (2 * SHA256_DIGEST_SIZE)
+
+struct sha256
+{
+  uint32_t state[8];
+  uint64_t length;       // Bytes hashed so far
+  unsigned char block[64];
+  size_t block_length;   // Bytes waiting in block
+};
+
+/**
+ * @brief Start a hash.
+ *
+ * @param hash The hash.
+ */
+void sha256_init(struct sha256 *hash);
+
+/**
+ * @brief Add bytes to a hash.
+ *
+ * @param hash The hash.
+ * @param data The bytes to add.
+ * @param length The number of bytes.
+ */
+void sha256_update(struct sha256 *hash, const void *data, size_t length);
+
+/**
+ * @brief Finish a hash.
+ *
+ * @param hash The hash, which must be started again before it is reused.
+ * @param digest Set to the digest.
+ */
+void sha256_final(struct sha256 *hash, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * @brief Format a digest as lowercase hexadecimal.
+ *
+ * @param digest The digest.
+ * @param hex The buffer to store the hexadecimal digest, at least SHA256_HEX_SIZE + 1 bytes.
+ */
+void sha256_hex(const unsigned char digest[SHA256_DIGEST_SIZE], char *hex);
+
+#endif
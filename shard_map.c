@@ -0,0 +1,505 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "protocol.h"
+#include "backend_pool.h"
+#include "shard_map.h"
+
+struct shard_address
+{
+  char ip[64];
+  int port;
+};
+
+struct shard_membership
+{
+  int count[SHARD_TYPES];
+  struct shard_address nodes[SHARD_TYPES][SHARD_NODES_MAX];
+};
+
+struct shard_state
+{
+  pthread_mutex_t lock;           // Process-shared
+  uint64_t generation;            // Bumped by every change of membership and by the end of a rebalance
+  struct timespec registry_mtime; // Modification time of the registry file last read
+  int rebalancing;
+  pid_t rebalancer; // The process moving files while rebalancing, 0 until it is started
+  struct shard_membership current;
+  struct shard_membership previous;
+};
+
+struct ring_point
+{
+  uint64_t hash;
+  struct shard_node *node;
+};
+
+struct ring
+{
+  int count;
+  struct ring_point points[SHARD_NODES_MAX * SHARD_VNODES];
+};
+
+static struct shard_state *state; // Shared by every process forked after shard_map_init
+
+static const char *registry_path; // NULL without --nodes
+
+static int pool_size[SHARD_TYPES];
+
+static shard_rebalancer rebalance_files;
+
+static const char *type_names[SHARD_TYPES] = {"stext", "spdf"};
+
+// The calling process's view of the membership, rebuilt when the generation changes; [1] is the previous membership
+static uint64_t local_generation;
+static int local_rebalancing;
+static struct shard_members local_members[2][SHARD_TYPES];
+static struct ring rings[2][SHARD_TYPES];
+
+/* RINGS */
+
+static uint64_t hash_string(const char *s)
+{
+  // FNV-1a, with a final mix so that similar strings spread over the ring
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *s != '\0'; s++)
+  {
+    hash ^= (unsigned char)*s;
+    hash *= 1099511628211ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static int compare_points(const void *a, const void *b)
+{
+  const struct ring_point *pa = a, *pb = b;
+  return pa->hash < pb->hash ? -1 : pa->hash > pb->hash;
+}
+
+static void build_ring(struct ring *ring, const struct shard_members *members)
+{
+  // a node's points follow from its address, so every process builds the same ring
+  ring->count = 0;
+  for (int i = 0; i < members->count; i++)
+  {
+    for (int point = 0; point < SHARD_VNODES; point++)
+    {
+      char key[96];
+      snprintf(key, sizeof(key), "%s:%d#%d", members->nodes[i]->ip, members->nodes[i]->port, point);
+      ring->points[ring->count].hash = hash_string(key);
+      ring->points[ring->count].node = members->nodes[i];
+      ring->count++;
+    }
+  }
+  qsort(ring->points, ring->count, sizeof(ring->points[0]), compare_points);
+}
+
+static struct shard_node *ring_lookup(const struct ring *ring, const char *path)
+{
+  char key[1024];
+  if (normalise_path(path, key, sizeof(key)) != 0)
+    snprintf(key, sizeof(key), "%s", path);
+  uint64_t hash = hash_string(key);
+
+  // the first point at or after the hash, wrapping around to the first point of the ring
+  int low = 0, high = ring->count;
+  while (low < high)
+  {
+    int middle = low + (high - low) / 2;
+    if (ring->points[middle].hash < hash)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return ring->points[low < ring->count ? low : 0].node;
+}
+
+/* MEMBERSHIP */
+
+static int read_registry(const char *path, struct shard_membership *membership, struct timespec *mtime)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    perror("Failed to open node registry");
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fileno(file), &st) == 0)
+    *mtime = st.st_mtim;
+
+  // zeroed, so that memberships compare with memcmp
+  memset(membership, 0, sizeof(*membership));
+  char line[256];
+  int line_number = 0, result = 0;
+  while (result == 0 && fgets(line, sizeof(line), file) != NULL)
+  {
+    line_number++;
+    char *p = line + strspn(line, " \t");
+    if (*p == '#' || *p == '\n' || *p == '\0')
+      continue;
+
+    // "txt host:port" or "pdf host:port"
+    char type_name[8], ip[64];
+    int port;
+    if (sscanf(p, "%7s %63[^: \t]:%d", type_name, ip, &port) != 3 || port <= 0 || port > 65535)
+    {
+      fprintf(stderr, "Invalid node at %s:%d\n", path, line_number);
+      result = -1;
+      break;
+    }
+    int type = strcmp(type_name, "txt") == 0 ? SHARD_TEXT : strcmp(type_name, "pdf") == 0 ? SHARD_PDF : -1;
+    if (type < 0 || membership->count[type] == SHARD_NODES_MAX)
+    {
+      fprintf(stderr, "Invalid node type or too many nodes at %s:%d\n", path, line_number);
+      result = -1;
+      break;
+    }
+    struct shard_address *address = &membership->nodes[type][membership->count[type]++];
+    snprintf(address->ip, sizeof(address->ip), "%s", ip);
+    address->port = port;
+  }
+  fclose(file);
+
+  for (int type = 0; type < SHARD_TYPES && result == 0; type++)
+  {
+    if (membership->count[type] == 0)
+    {
+      fprintf(stderr, "Node registry %s names no %s node\n", path, type_names[type]);
+      result = -1;
+    }
+  }
+  return result;
+}
+
+static struct shard_node *find_node(struct shard_members members[2][SHARD_TYPES], int type,
+                                    const struct shard_address *address)
+{
+  for (int previous = 0; previous < 2; previous++)
+    for (int i = 0; i < members[previous][type].count; i++)
+      if (members[previous][type].nodes[i]->port == address->port &&
+          strcmp(members[previous][type].nodes[i]->ip, address->ip) == 0)
+        return members[previous][type].nodes[i];
+  return NULL;
+}
+
+static int contains_node(struct shard_node *const nodes[], int count, const struct shard_node *node)
+{
+  for (int i = 0; i < count; i++)
+    if (nodes[i] == node)
+      return 1;
+  return 0;
+}
+
+static struct shard_node *create_node(int type, const struct shard_address *address)
+{
+  // connections are opened lazily, so processes forked later never share a socket
+  struct shard_node *node = calloc(1, sizeof(*node));
+  if (node != NULL)
+  {
+    snprintf(node->name, sizeof(node->name), "%s %s:%d", type_names[type], address->ip, address->port);
+    snprintf(node->ip, sizeof(node->ip), "%s", address->ip);
+    node->port = address->port;
+    node->pool = backend_pool_create(node->name, node->ip, node->port, pool_size[type]);
+  }
+  if (node == NULL || node->pool == NULL)
+  {
+    perror("Failed to create connection pool");
+    exit(EXIT_FAILURE);
+  }
+  return node;
+}
+
+// Rebuild the view of the calling process, keeping the pools of nodes that stay
+static void sync_local(const struct shard_membership *current, const struct shard_membership *previous, int rebalancing)
+{
+  const struct shard_membership *memberships[2] = {current, previous};
+  struct shard_members next[2][SHARD_TYPES];
+  memset(next, 0, sizeof(next));
+  for (int m = 0; m < 2; m++)
+  {
+    for (int type = 0; type < SHARD_TYPES; type++)
+    {
+      for (int i = 0; i < memberships[m]->count[type]; i++)
+      {
+        const struct shard_address *address = &memberships[m]->nodes[type][i];
+        struct shard_node *node = find_node(next, type, address);
+        if (node == NULL)
+          node = find_node(local_members, type, address);
+        if (node == NULL)
+          node = create_node(type, address);
+        next[m][type].nodes[next[m][type].count++] = node;
+      }
+    }
+  }
+
+  // nodes of neither membership are dropped with their connections, each one once
+  for (int type = 0; type < SHARD_TYPES; type++)
+  {
+    struct shard_node *old[2 * SHARD_NODES_MAX];
+    int old_count = 0;
+    for (int m = 0; m < 2; m++)
+      for (int i = 0; i < local_members[m][type].count; i++)
+        if (!contains_node(old, old_count, local_members[m][type].nodes[i]))
+          old[old_count++] = local_members[m][type].nodes[i];
+    for (int i = 0; i < old_count; i++)
+    {
+      if (contains_node(next[0][type].nodes, next[0][type].count, old[i]) ||
+          contains_node(next[1][type].nodes, next[1][type].count, old[i]))
+        continue;
+      backend_pool_destroy(old[i]->pool);
+      free(old[i]);
+    }
+  }
+
+  memcpy(local_members, next, sizeof(next));
+  for (int m = 0; m < 2; m++)
+    for (int type = 0; type < SHARD_TYPES; type++)
+      build_ring(&rings[m][type], &local_members[m][type]);
+  local_rebalancing = rebalancing;
+}
+
+int shard_map_init(const char *nodes_file, const char *default_ip, const int default_ports[SHARD_TYPES],
+                   const int pool_sizes[SHARD_TYPES], shard_rebalancer rebalancer)
+{
+  struct shard_membership membership;
+  struct timespec mtime = {0};
+  if (nodes_file != NULL)
+  {
+    if (read_registry(nodes_file, &membership, &mtime) != 0)
+      return -1;
+  }
+  else
+  {
+    memset(&membership, 0, sizeof(membership));
+    for (int type = 0; type < SHARD_TYPES; type++)
+    {
+      membership.count[type] = 1;
+      snprintf(membership.nodes[type][0].ip, sizeof(membership.nodes[type][0].ip), "%s", default_ip);
+      membership.nodes[type][0].port = default_ports[type];
+    }
+  }
+
+  struct shard_state *shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED)
+  {
+    perror("Failed to map node registry");
+    return -1;
+  }
+  memset(shared, 0, sizeof(*shared));
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&shared->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  shared->current = membership;
+  shared->previous = membership;
+  shared->registry_mtime = mtime;
+  state = shared;
+
+  registry_path = nodes_file;
+  for (int type = 0; type < SHARD_TYPES; type++)
+    pool_size[type] = pool_sizes[type];
+  rebalance_files = rebalancer;
+
+  sync_local(&membership, &membership, 0);
+  local_generation = state->generation;
+  for (int type = 0; type < SHARD_TYPES; type++)
+    for (int i = 0; i < local_members[0][type].count; i++)
+      printf("Node %s\n", local_members[0][type].nodes[i]->name);
+  return 0;
+}
+
+/* REBALANCING */
+
+static void run_rebalancer(void)
+{
+  // the server's signal handling is not for this process, and its pooled connections belong to the server
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  sigset_t none;
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, NULL);
+  for (int m = 0; m < 2; m++)
+    for (int type = 0; type < SHARD_TYPES; type++)
+      for (int i = 0; i < local_members[m][type].count; i++)
+        backend_pool_close(local_members[m][type].nodes[i]->pool);
+
+  rebalance_files();
+  shard_rebalance_done();
+}
+
+static void start_rebalancer(void)
+{
+  // the rebalancer is orphaned at once, so no server process has to reap it
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    pid_t rebalancer = fork();
+    if (rebalancer == 0)
+    {
+      run_rebalancer();
+      exit(0);
+    }
+    pthread_mutex_lock(&state->lock);
+    if (rebalancer > 0)
+      state->rebalancer = rebalancer;
+    else
+    {
+      state->rebalancing = 0;
+      state->generation++;
+    }
+    pthread_mutex_unlock(&state->lock);
+    _exit(0);
+  }
+  if (pid < 0)
+  {
+    perror("Failed to start rebalancer");
+    pthread_mutex_lock(&state->lock);
+    state->rebalancing = 0;
+    state->generation++;
+    pthread_mutex_unlock(&state->lock);
+    return;
+  }
+  waitpid(pid, NULL, 0);
+}
+
+// Publish the membership of a changed registry file, returns 1 if the caller has to start the rebalancer
+static int check_registry(void)
+{
+  struct stat st;
+  if (registry_path == NULL || stat(registry_path, &st) != 0)
+    return 0;
+
+  pthread_mutex_lock(&state->lock);
+  int changed = !state->rebalancing && (st.st_mtim.tv_sec != state->registry_mtime.tv_sec ||
+                                        st.st_mtim.tv_nsec != state->registry_mtime.tv_nsec);
+  pthread_mutex_unlock(&state->lock);
+  if (!changed)
+    return 0;
+
+  struct shard_membership membership;
+  struct timespec mtime = st.st_mtim;
+  int valid = read_registry(registry_path, &membership, &mtime) == 0;
+
+  pthread_mutex_lock(&state->lock);
+  // another process may have taken the same change meanwhile
+  int publish = !state->rebalancing && (mtime.tv_sec != state->registry_mtime.tv_sec ||
+                                        mtime.tv_nsec != state->registry_mtime.tv_nsec);
+  if (publish)
+    state->registry_mtime = mtime;
+  // an invalid registry keeps the membership, and is not read again until it changes
+  publish = publish && valid && memcmp(&membership, &state->current, sizeof(membership)) != 0;
+  if (publish)
+  {
+    state->previous = state->current;
+    state->current = membership;
+    state->rebalancing = 1;
+    state->rebalancer = 0;
+    state->generation++;
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  if (publish)
+    printf("Node registry changed, rebalancing\n");
+  return publish;
+}
+
+void shard_map_refresh(void)
+{
+  if (state == NULL)
+    return;
+  int rebalance = check_registry();
+
+  pthread_mutex_lock(&state->lock);
+  // a rebalancer that died part way leaves the files it did not move where they are
+  if (state->rebalancing && state->rebalancer > 0 && kill(state->rebalancer, 0) != 0 && errno == ESRCH)
+  {
+    fprintf(stderr, "Rebalancer exited before it was done\n");
+    state->rebalancing = 0;
+    state->generation++;
+  }
+  int changed = state->generation != local_generation;
+  struct shard_membership current = state->current, previous = state->previous;
+  int rebalancing = state->rebalancing;
+  local_generation = state->generation;
+  pthread_mutex_unlock(&state->lock);
+
+  if (changed)
+    sync_local(&current, &previous, rebalancing);
+  if (rebalance)
+    start_rebalancer();
+}
+
+void shard_rebalance_done(void)
+{
+  pthread_mutex_lock(&state->lock);
+  state->rebalancing = 0;
+  state->generation++;
+  pthread_mutex_unlock(&state->lock);
+  printf("Rebalance complete\n");
+}
+
+/* PLACEMENT */
+
+int shard_type_of(const char *path)
+{
+  const char *extension = strrchr(path, '.');
+  if (extension != NULL && strcmp(extension, ".txt") == 0)
+    return SHARD_TEXT;
+  if (extension != NULL && strcmp(extension, ".pdf") == 0)
+    return SHARD_PDF;
+  return -1;
+}
+
+struct shard_node *shard_owner(int type, const char *path)
+{
+  return ring_lookup(&rings[0][type], path);
+}
+
+struct shard_node *shard_previous_owner(int type, const char *path)
+{
+  if (!local_rebalancing)
+    return NULL;
+  struct shard_node *previous = ring_lookup(&rings[1][type], path);
+  return previous != shard_owner(type, path) ? previous : NULL;
+}
+
+const struct shard_members *shard_members(int type, int previous)
+{
+  return &local_members[previous ? 1 : 0][type];
+}
+
+void shard_all_members(int type, struct shard_members *members)
+{
+  *members = local_members[0][type];
+  for (int i = 0; local_rebalancing && i < local_members[1][type].count; i++)
+  {
+    struct shard_node *node = local_members[1][type].nodes[i];
+    if (!contains_node(local_members[0][type].nodes, local_members[0][type].count, node))
+      members->nodes[members->count++] = node;
+  }
+}
+
+int shard_same_node(const struct shard_node *a, const struct shard_node *b)
+{
+  return a->port == b->port && strcmp(a->ip, b->ip) == 0;
+}
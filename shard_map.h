@@ -0,0 +1,146 @@
+#ifndef SHARD_MAP_H
+#define SHARD_MAP_H
+
+/*
+ * Placement of the files of Stext and Spdf over several backend nodes.
+ *
+ * The nodes of each type are listed in a registry file given with --nodes,
+ * one "txt host:port" or "pdf host:port" line per node; without it Smain has
+ * one node of each type at the compiled-in ports. Paths are placed with
+ * consistent hashing: every node is hashed onto a ring of its type at
+ * SHARD_VNODES points, and a path belongs to the node of the first point at or
+ * after the hash of the normalised path. A node joining or leaving only moves
+ * the files between it and its neighbours on the ring.
+ *
+ * The registry is re-read when the file changes. The new membership is
+ * published in shared memory created before the server forks, and every
+ * process picks it up at its next request and opens pools to the new nodes.
+ * The process that noticed the change starts a rebalancer, which lists the
+ * files of every node of the previous membership and moves every file the new
+ * ring places elsewhere: download, upload to the new owner, remove from the
+ * old one. While it runs the previous membership is kept: dfile falls back to
+ * the previous owner of a path, ufile and rmfile clear the path there too,
+ * and display and dtar cover the nodes of both, so a file may be listed twice
+ * until its move completes. An upload of a path that races the move of the
+ * same path may be overwritten by the older copy. The registry is not
+ * re-read again before the rebalancer is done.
+ */
+
+// Largest number of nodes of one type
+#define SHARD_NODES_MAX 16
+
+// Points every node is hashed onto its ring at
+#define SHARD_VNODES 64
+
+// Types of backend nodes, by the files they store
+enum shard_type
+{
+  SHARD_TEXT, // .txt files, served by Stext
+  SHARD_PDF,  // .pdf files, served by Spdf
+  SHARD_TYPES,
+};
+
+/**
+ * @brief A backend node as seen by the calling process.
+ */
+struct shard_node
+{
+  char name[96]; // "stext 127.0.0.1:4014", used in log messages
+  char ip[64];
+  int port;
+  struct backend_pool *pool; // Connections of the calling process to the node
+};
+
+/**
+ * @brief The nodes of one type in one membership, or in both while a rebalance runs.
+ */
+struct shard_members
+{
+  int count;
+  struct shard_node *nodes[2 * SHARD_NODES_MAX];
+};
+
+/**
+ * @brief Function moving the files whose owner changed, run by the rebalancer process.
+ */
+typedef void (*shard_rebalancer)(void);
+
+/**
+ * @brief Set up the node registry, to be called before the server forks.
+ *
+ * @param nodes_file The registry file, or NULL for one node of each type on default_ip at the default ports.
+ * @param default_ip The IP address of the default nodes.
+ * @param default_ports The port of the default node of each type.
+ * @param pool_sizes The maximum number of connections per node, for each type.
+ * @param rebalancer The function moving files after a change of membership.
+ * @return int Returns 0 on success, -1 if the registry cannot be read or names no node of a type.
+ */
+int shard_map_init(const char *nodes_file, const char *default_ip, const int default_ports[SHARD_TYPES],
+                   const int pool_sizes[SHARD_TYPES], shard_rebalancer rebalancer);
+
+/**
+ * @brief Pick up changes of the registry file and of the published membership, called before every request.
+ *
+ * A process that finds the registry file changed publishes the new membership and starts the rebalancer.
+ */
+void shard_map_refresh(void);
+
+/**
+ * @brief Get the type of node a file is stored on.
+ *
+ * @param path The file name or path.
+ * @return int Returns SHARD_TEXT for .txt files, SHARD_PDF for .pdf files, -1 for files Smain keeps itself.
+ */
+int shard_type_of(const char *path);
+
+/**
+ * @brief Get the node a path is placed on.
+ *
+ * @param type The type of the node.
+ * @param path The path of the file in the store, e.g. "/docs/a.txt".
+ * @return struct shard_node* The node owning the path in the current membership.
+ */
+struct shard_node *shard_owner(int type, const char *path);
+
+/**
+ * @brief Get the node a path was placed on before the last change of membership, while it is being rebalanced.
+ *
+ * @param type The type of the node.
+ * @param path The path of the file in the store.
+ * @return struct shard_node* The previous owner, or NULL if no rebalance is running or the owner did not change.
+ */
+struct shard_node *shard_previous_owner(int type, const char *path);
+
+/**
+ * @brief Get the nodes of a type.
+ *
+ * @param type The type of the nodes.
+ * @param previous 1 for the membership before the last change, 0 for the current one.
+ * @return const struct shard_members* The nodes.
+ */
+const struct shard_members *shard_members(int type, int previous);
+
+/**
+ * @brief Get every node of a type display and dtar have to cover: the current ones and, while a rebalance runs,
+ *        the previous ones that left.
+ *
+ * @param type The type of the nodes.
+ * @param members Set to the nodes.
+ */
+void shard_all_members(int type, struct shard_members *members);
+
+/**
+ * @brief Whether two nodes are the same server.
+ *
+ * @param a A node.
+ * @param b Another node.
+ * @return int Returns 1 if both have the same address, 0 otherwise.
+ */
+int shard_same_node(const struct shard_node *a, const struct shard_node *b);
+
+/**
+ * @brief Tell the other processes the rebalance is complete, called by the rebalancer.
+ */
+void shard_rebalance_done(void);
+
+#endif
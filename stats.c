@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "protocol.h"
+#include "stats.h"
+
+struct histogram
+{
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t buckets[STATS_BUCKETS];
+};
+
+// The counters one process adds to, on cache lines of their own
+struct stats_slot
+{
+  pid_t owner; // Process adding to the slot, 0 while the slot was never claimed
+  struct histogram commands[STATS_OPCODES];
+  struct histogram backend;
+  uint64_t bytes_received;
+  uint64_t bytes_sent;
+  uint64_t connections_opened;
+  uint64_t connections_closed;
+} __attribute__((aligned(64)));
+
+struct stats_state
+{
+  char server[16];
+  uint64_t started; // stats_now at stats_init
+  struct stats_slot slots[STATS_SLOTS];
+};
+
+enum log_level log_level = LOG_INFO;
+
+static struct stats_state *state; // Shared by every process forked after stats_init
+
+static struct stats_slot *slot;              // Slot of this process
+static pid_t slot_owner;                     // Process slot was picked for
+static uint64_t folded_sent, folded_received; // Frame bytes already added to the slot
+
+int parse_log_level(const char *name, enum log_level *level)
+{
+  if (strcmp(name, "info") == 0)
+    *level = LOG_INFO;
+  else if (strcmp(name, "debug") == 0)
+    *level = LOG_DEBUG;
+  else
+    return -1;
+  return 0;
+}
+
+int stats_init(const char *server)
+{
+  struct stats_state *shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED)
+  {
+    perror("Failed to map request statistics");
+    return -1;
+  }
+  memset(shared, 0, sizeof(*shared));
+  snprintf(shared->server, sizeof(shared->server), "%s", server);
+  shared->started = stats_now();
+  state = shared;
+  return 0;
+}
+
+uint64_t stats_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* RECORDING */
+
+static struct stats_slot *own_slot(void)
+{
+  if (state == NULL)
+    return NULL;
+
+  // a forked child claims a slot of its own, one never claimed or else one of a process that exited; the counts
+  // of the slot stay, they are only ever summed
+  pid_t pid = getpid();
+  if (slot == NULL || slot_owner != pid)
+  {
+    int saved_errno = errno;
+    slot = NULL;
+    for (int pass = 0; pass < 2 && slot == NULL; pass++)
+      for (int i = 0; i < STATS_SLOTS && slot == NULL; i++)
+      {
+        pid_t owner = __atomic_load_n(&state->slots[i].owner, __ATOMIC_RELAXED);
+        if (pass == 0 ? owner != 0 : owner == 0 || kill(owner, 0) == 0 || errno != ESRCH)
+          continue;
+        if (__atomic_compare_exchange_n(&state->slots[i].owner, &owner, pid, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+          slot = &state->slots[i];
+      }
+    // with every slot held by a live process, the additions are shared with another one
+    if (slot == NULL)
+      slot = &state->slots[pid % STATS_SLOTS];
+    slot_owner = pid;
+    errno = saved_errno;
+  }
+  return slot;
+}
+
+static void add(uint64_t *counter, uint64_t value)
+{
+  __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static void record_duration(struct histogram *histogram, uint64_t start)
+{
+  uint64_t elapsed = stats_now() - start;
+  uint64_t micros = elapsed / 1000;
+  int bucket = micros == 0 ? 0 : 64 - __builtin_clzll(micros);
+  if (bucket >= STATS_BUCKETS)
+    bucket = STATS_BUCKETS - 1;
+
+  add(&histogram->count, 1);
+  add(&histogram->total_ns, elapsed);
+  add(&histogram->buckets[bucket], 1);
+}
+
+// Add the frame bytes moved since the last fold to the slot
+static void fold_bytes(struct stats_slot *own)
+{
+  add(&own->bytes_sent, frame_bytes_sent - folded_sent);
+  add(&own->bytes_received, frame_bytes_received - folded_received);
+  folded_sent = frame_bytes_sent;
+  folded_received = frame_bytes_received;
+}
+
+void stats_record_command(uint8_t opcode, uint64_t start)
+{
+  struct stats_slot *own = own_slot();
+  if (own == NULL)
+    return;
+  record_duration(&own->commands[opcode < STATS_OPCODES ? opcode : 0], start);
+  fold_bytes(own);
+}
+
+void stats_record_backend(uint64_t start)
+{
+  struct stats_slot *own = own_slot();
+  if (own != NULL)
+    record_duration(&own->backend, start);
+}
+
+void stats_connection_opened(void)
+{
+  struct stats_slot *own = own_slot();
+  if (own != NULL)
+    add(&own->connections_opened, 1);
+}
+
+void stats_connection_closed(void)
+{
+  struct stats_slot *own = own_slot();
+  if (own == NULL)
+    return;
+  add(&own->connections_closed, 1);
+  fold_bytes(own);
+}
+
+/* REPORTS */
+
+static uint64_t load(const uint64_t *counter)
+{
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Sum a histogram over every slot, the slots are added to while they are read
+static void sum_histogram(size_t offset, struct histogram *sum)
+{
+  memset(sum, 0, sizeof(*sum));
+  for (int i = 0; i < STATS_SLOTS; i++)
+  {
+    const struct histogram *histogram = (const struct histogram *)((const char *)&state->slots[i] + offset);
+    sum->count += load(&histogram->count);
+    sum->total_ns += load(&histogram->total_ns);
+    for (int b = 0; b < STATS_BUCKETS; b++)
+      sum->buckets[b] += load(&histogram->buckets[b]);
+  }
+}
+
+static uint64_t sum_counter(size_t offset)
+{
+  uint64_t sum = 0;
+  for (int i = 0; i < STATS_SLOTS; i++)
+    sum += load((const uint64_t *)((const char *)&state->slots[i] + offset));
+  return sum;
+}
+
+// Estimate a quantile in microseconds, interpolating inside its bucket
+static double quantile(const struct histogram *histogram, double q)
+{
+  uint64_t total = 0;
+  for (int b = 0; b < STATS_BUCKETS; b++)
+    total += histogram->buckets[b];
+  if (total == 0)
+    return 0;
+
+  double rank = q * total;
+  uint64_t below = 0;
+  for (int b = 0; b < STATS_BUCKETS; b++)
+  {
+    if (histogram->buckets[b] > 0 && below + histogram->buckets[b] >= rank)
+    {
+      double low = b == 0 ? 0 : (double)(1ULL << (b - 1));
+      double high = (double)(1ULL << b);
+      return low + (high - low) * (rank - below) / histogram->buckets[b];
+    }
+    below += histogram->buckets[b];
+  }
+  return (double)(1ULL << (STATS_BUCKETS - 1));
+}
+
+// Append to a report, cutting it at the end of the buffer
+static void append(char *buffer, size_t size, size_t *length, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void append(char *buffer, size_t size, size_t *length, const char *format, ...)
+{
+  if (*length + 1 >= size)
+    return;
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(buffer + *length, size - *length, format, args);
+  va_end(args);
+  if (written > 0)
+    *length = *length + written < size ? *length + written : size - 1;
+}
+
+static void format_table_row(char *buffer, size_t size, size_t *length, const char *name,
+                             const struct histogram *histogram)
+{
+  append(buffer, size, length, "%-10s %10llu %10.0f %10.0f %10.0f %10.0f\n", name,
+         (unsigned long long)histogram->count,
+         histogram->count > 0 ? histogram->total_ns / 1000.0 / histogram->count : 0, quantile(histogram, 0.5),
+         quantile(histogram, 0.99), quantile(histogram, 0.999));
+}
+
+static void format_histogram(char *buffer, size_t size, size_t *length, const char *metric, const char *labels,
+                             const struct histogram *histogram)
+{
+  uint64_t cumulative = 0;
+  for (int b = 0; b < STATS_BUCKETS - 1; b++)
+  {
+    cumulative += histogram->buckets[b];
+    append(buffer, size, length, "%s_bucket{%s,le=\"%g\"} %llu\n", metric, labels, (double)(1ULL << b) / 1e6,
+           (unsigned long long)cumulative);
+  }
+  // the count is read apart from the buckets, so it is taken from them to keep the series consistent
+  cumulative += histogram->buckets[STATS_BUCKETS - 1];
+  append(buffer, size, length, "%s_bucket{%s,le=\"+Inf\"} %llu\n", metric, labels, (unsigned long long)cumulative);
+  append(buffer, size, length, "%s_sum{%s} %.9f\n", metric, labels, histogram->total_ns / 1e9);
+  append(buffer, size, length, "%s_count{%s} %llu\n", metric, labels, (unsigned long long)cumulative);
+}
+
+size_t stats_format(char *buffer, size_t size, int prometheus)
+{
+  size_t length = 0;
+  buffer[0] = '\0';
+  if (state == NULL)
+  {
+    append(buffer, size, &length, "Statistics are not available\n");
+    return length;
+  }
+
+  uint64_t opened = sum_counter(offsetof(struct stats_slot, connections_opened));
+  uint64_t closed = sum_counter(offsetof(struct stats_slot, connections_closed));
+  uint64_t received = sum_counter(offsetof(struct stats_slot, bytes_received));
+  uint64_t sent = sum_counter(offsetof(struct stats_slot, bytes_sent));
+  uint64_t active = opened > closed ? opened - closed : 0;
+  struct histogram backend;
+  sum_histogram(offsetof(struct stats_slot, backend), &backend);
+
+  if (!prometheus)
+  {
+    append(buffer, size, &length, "Server %s, up %llu s, %llu active connections, %llu connections served\n",
+           state->server, (unsigned long long)((stats_now() - state->started) / 1000000000),
+           (unsigned long long)active, (unsigned long long)opened);
+    append(buffer, size, &length, "Frame bytes received %llu, sent %llu\n", (unsigned long long)received,
+           (unsigned long long)sent);
+    append(buffer, size, &length, "%-10s %10s %10s %10s %10s %10s\n", "operation", "count", "mean us", "p50 us",
+           "p99 us", "p999 us");
+    for (int op = 0; op < STATS_OPCODES; op++)
+    {
+      struct histogram histogram;
+      sum_histogram(offsetof(struct stats_slot, commands) + op * sizeof(struct histogram), &histogram);
+      if (histogram.count > 0)
+        format_table_row(buffer, size, &length, opcode_name(op), &histogram);
+    }
+    if (backend.count > 0)
+      format_table_row(buffer, size, &length, "backend", &backend);
+    return length;
+  }
+
+  append(buffer, size, &length, "# TYPE dfs_connections_active gauge\ndfs_connections_active{server=\"%s\"} %llu\n",
+         state->server, (unsigned long long)active);
+  append(buffer, size, &length, "# TYPE dfs_connections_total counter\ndfs_connections_total{server=\"%s\"} %llu\n",
+         state->server, (unsigned long long)opened);
+  append(buffer, size, &length,
+         "# TYPE dfs_frame_bytes_received_total counter\ndfs_frame_bytes_received_total{server=\"%s\"} %llu\n",
+         state->server, (unsigned long long)received);
+  append(buffer, size, &length,
+         "# TYPE dfs_frame_bytes_sent_total counter\ndfs_frame_bytes_sent_total{server=\"%s\"} %llu\n",
+         state->server, (unsigned long long)sent);
+
+  char labels[64];
+  append(buffer, size, &length, "# TYPE dfs_request_duration_seconds histogram\n");
+  for (int op = 0; op < STATS_OPCODES; op++)
+  {
+    struct histogram histogram;
+    sum_histogram(offsetof(struct stats_slot, commands) + op * sizeof(struct histogram), &histogram);
+    if (histogram.count == 0)
+      continue;
+    snprintf(labels, sizeof(labels), "server=\"%s\",op=\"%s\"", state->server, opcode_name(op));
+    format_histogram(buffer, size, &length, "dfs_request_duration_seconds", labels, &histogram);
+  }
+  if (backend.count > 0)
+  {
+    append(buffer, size, &length, "# TYPE dfs_backend_call_duration_seconds histogram\n");
+    snprintf(labels, sizeof(labels), "server=\"%s\"", state->server);
+    format_histogram(buffer, size, &length, "dfs_backend_call_duration_seconds", labels, &backend);
+  }
+  return length;
+}
+
+int send_stats(int socket, uint32_t request_id)
+{
+  char *report = malloc(STATS_REPORT_SIZE);
+  if (report == NULL)
+    return -1;
+  size_t length = stats_format(report, STATS_REPORT_SIZE, 0);
+  int result = send_frame(socket, OP_DATA, 0, request_id, report, length) == 0 ? 1 : -1;
+  free(report);
+  return result;
+}
+
+/* METRICS ENDPOINT */
+
+static void serve_metrics(int server_socket)
+{
+  char *report = malloc(STATS_REPORT_SIZE);
+  if (report == NULL)
+    exit(EXIT_FAILURE);
+
+  while (1)
+  {
+    int client_socket = accept(server_socket, NULL, NULL);
+    if (client_socket < 0)
+    {
+      if (errno != EINTR)
+        perror("Metrics accept failed");
+      continue;
+    }
+
+    // a client that sends nothing, or reads nothing, cannot stall the endpoint for the next one
+    struct timeval timeout = {.tv_sec = STATS_METRICS_TIMEOUT_SEC};
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // every request is answered with the metrics, whatever its path
+    char request[1024];
+    recv(client_socket, request, sizeof(request), 0);
+
+    size_t length = stats_format(report, STATS_REPORT_SIZE, 1);
+    char header[128];
+    int header_length = snprintf(header, sizeof(header),
+                                 "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                 "Content-Length: %zu\r\n\r\n",
+                                 length);
+    if (send_all(client_socket, header, header_length, MSG_MORE) == 0)
+      send_all(client_socket, report, length, 0);
+    close(client_socket);
+  }
+}
+
+int stats_start_metrics(int port)
+{
+  int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server_socket < 0)
+  {
+    perror("Metrics socket creation failed");
+    return -1;
+  }
+  int opt = 1;
+  setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+  struct sockaddr_in server_addr = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = INADDR_ANY};
+  if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 ||
+      listen(server_socket, SOMAXCONN) < 0)
+  {
+    perror("Metrics bind failed");
+    close(server_socket);
+    return -1;
+  }
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    perror("Failed to start metrics process");
+    close(server_socket);
+    return -1;
+  }
+  if (pid == 0)
+  {
+    // the metrics process lives as long as the server, which stops it on exit
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_DFL);
+    serve_metrics(server_socket);
+  }
+
+  close(server_socket);
+  printf("Metrics served on port %d\n", port);
+  return 0;
+}
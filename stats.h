@@ -0,0 +1,128 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/*
+ * Request statistics shared by Smain, Stext and Spdf, and the log level.
+ *
+ * process_command records the duration of every command in a histogram of its
+ * opcode, with buckets of powers of two microseconds, together with the bytes
+ * of the frames the process sent and received in the meantime. Smain also
+ * records how long each backend connection was checked out. The counters live
+ * in shared memory created before the server forks, split into STATS_SLOTS
+ * cache-line aligned slots; a process claims a slot of its own the first time
+ * it records, taking over the slot of a process that exited once every slot
+ * was claimed, and only ever adds to it with relaxed atomic additions, so
+ * recording takes no lock and worker processes do not contend on one cache
+ * line. A reader sums the slots.
+ *
+ * The stats command answers with a table of the counters and of the p50, p99
+ * and p999 latency of every opcode. With --metrics-port, a metrics process
+ * answers HTTP requests on that port with the same counters in the Prometheus
+ * text format.
+ */
+
+// Number of counter slots, more live processes share slots by their pids modulo it
+#define STATS_SLOTS 64
+
+// Longest the metrics process waits on one client to send its request or read the answer
+#define STATS_METRICS_TIMEOUT_SEC 5
+
+// Latency buckets, bucket i counts durations below 2^i microseconds, the last one every longer duration
+#define STATS_BUCKETS 32
+
+// Opcodes with their own histogram, OP_STATS included
+#define STATS_OPCODES 16
+
+// Size of the buffer a report is formatted into
+#define STATS_REPORT_SIZE (64 * 1024)
+
+enum log_level
+{
+  LOG_INFO,  // connections and errors
+  LOG_DEBUG, // every command and the steps of its processing
+};
+
+/**
+ * @brief Log level of the server, set with --log-level.
+ */
+extern enum log_level log_level;
+
+/**
+ * @brief Parse a log level name ("info" or "debug").
+ *
+ * @param name The name given on the command line.
+ * @param level The parsed level.
+ * @return int Returns 0 on success, -1 if the name is unknown.
+ */
+int parse_log_level(const char *name, enum log_level *level);
+
+/**
+ * @brief Set up the shared counters, to be called before the server forks.
+ *
+ * @param server The name of the server, used to label the counters.
+ * @return int Returns 0 on success, -1 if the counters are unavailable (nothing is recorded then).
+ */
+int stats_init(const char *server);
+
+/**
+ * @brief Get the time a duration starts at.
+ *
+ * @return uint64_t The monotonic time in nanoseconds.
+ */
+uint64_t stats_now(void);
+
+/**
+ * @brief Record a command finished, with the frame bytes moved since the last record.
+ *
+ * @param opcode The opcode of the command.
+ * @param start The time the command started at, from stats_now.
+ */
+void stats_record_command(uint8_t opcode, uint64_t start);
+
+/**
+ * @brief Record a call to a backend finished.
+ *
+ * @param start The time the call started at, from stats_now.
+ */
+void stats_record_backend(uint64_t start);
+
+/**
+ * @brief Count a client connection opened.
+ */
+void stats_connection_opened(void);
+
+/**
+ * @brief Count a client connection closed, with the frame bytes moved since the last record.
+ */
+void stats_connection_closed(void);
+
+/**
+ * @brief Format the counters as a table, or in the Prometheus text format.
+ *
+ * @param buffer The buffer to format into.
+ * @param size The size of the buffer.
+ * @param prometheus 1 for the Prometheus text format, 0 for the table.
+ * @return size_t The length of the report, cut at size - 1.
+ */
+size_t stats_format(char *buffer, size_t size, int prometheus);
+
+/**
+ * @brief Send the table of the counters as a data frame, answering the stats command.
+ *
+ * @param socket The socket to send on.
+ * @param request_id The id of the request.
+ * @return int Returns 1 if the table was sent, -1 otherwise.
+ */
+int send_stats(int socket, uint32_t request_id);
+
+/**
+ * @brief Start the metrics process serving the counters over HTTP, to be called after stats_init.
+ *
+ * @param port The port to listen on.
+ * @return int Returns 0 if the process started, -1 otherwise.
+ */
+int stats_start_metrics(int port);
+
+#endif
@@ -0,0 +1,663 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+#include "segment_store.h"
+#include "store_index.h"
+
+int store_index_inotify = 0;
+
+struct index_node
+{
+  char *path;       // Relative to the store, "" for the store itself
+  const char *name; // Last component of path
+  int is_dir;
+  struct index_node *parent;
+  struct index_node *first_child;
+  struct index_node *last_child;
+  struct index_node *prev_sibling;
+  struct index_node *next_sibling;
+  struct index_node *hash_next; // Next node in the same bucket of the path table
+};
+
+struct index_journal
+{
+  pthread_mutex_t lock; // Process-shared
+  uint64_t next;        // Sequence number of the next change
+  char paths[INDEX_JOURNAL_SIZE][INDEX_PATH_MAX]; // Change n is kept at n % INDEX_JOURNAL_SIZE
+};
+
+static struct index_journal *journal; // Shared by every process forked after store_index_init
+static uint64_t applied;              // Changes of the journal this process has replayed
+
+static char store_dir[INDEX_PATH_MAX];  // The store as given, for paths on disk
+static char store_path[INDEX_PATH_MAX]; // The store, normalized
+
+static struct index_node *root;
+static struct index_node **table; // Path table, chained
+static size_t table_size;
+static size_t node_count;
+
+static char **watch_paths; // Relative path of the directory behind every inotify watch descriptor
+static int watch_count;
+
+/* PATHS */
+
+// Join the components of a path, dropping empty and "." components and resolving ".."
+static int normalize_path(const char *path, char *out, size_t size)
+{
+  size_t base = path[0] == '/' ? 1 : 0;
+  size_t len = base;
+  if (size <= base)
+    return -1;
+  memcpy(out, "/", base);
+  out[len] = '\0';
+
+  const char *p = path;
+  while (*p != '\0')
+  {
+    while (*p == '/')
+      p++;
+    const char *end = strchrnul(p, '/');
+    size_t n = end - p;
+
+    if (n == 0 || (n == 1 && p[0] == '.'))
+    {
+      // nothing to add
+    }
+    else if (n == 2 && p[0] == '.' && p[1] == '.')
+    {
+      if (len == base)
+        return -1;
+      while (len > base && out[len - 1] != '/')
+        len--;
+      if (len > base)
+        len--;
+      out[len] = '\0';
+    }
+    else
+    {
+      size_t separator = len > base ? 1 : 0;
+      if (len + separator + n >= size)
+        return -1;
+      if (separator)
+        out[len++] = '/';
+      memcpy(out + len, p, n);
+      len += n;
+      out[len] = '\0';
+    }
+    p = end;
+  }
+  return 0;
+}
+
+// Path of a file relative to the store, -1 if it is not under the store
+static int relative_path(const char *path, char *rel, size_t size)
+{
+  char normalized[PATH_MAX];
+  if (normalize_path(path, normalized, sizeof(normalized)) != 0)
+    return -1;
+
+  size_t root_len = strlen(store_path);
+  const char *rest;
+  if (root_len == 0)
+    rest = normalized;
+  else if (strncmp(normalized, store_path, root_len) != 0)
+    return -1;
+  else if (normalized[root_len] == '\0')
+    rest = "";
+  else if (normalized[root_len] == '/')
+    rest = normalized + root_len + 1;
+  else
+    return -1;
+
+  if ((size_t)snprintf(rel, size, "%s", rest) >= size)
+    return -1;
+  return 0;
+}
+
+static void disk_path(char *path, size_t size, const char *rel)
+{
+  snprintf(path, size, "%s%s%s", store_dir, rel[0] != '\0' ? "/" : "", rel);
+}
+
+/* PATH TABLE */
+
+static size_t hash_path(const char *path)
+{
+  // FNV-1a
+  size_t hash = 14695981039346656037ULL;
+  for (const unsigned char *p = (const unsigned char *)path; *p != '\0'; p++)
+    hash = (hash ^ *p) * 1099511628211ULL;
+  return hash;
+}
+
+static struct index_node *lookup_node(const char *path)
+{
+  struct index_node *node = table[hash_path(path) & (table_size - 1)];
+  while (node != NULL && strcmp(node->path, path) != 0)
+    node = node->hash_next;
+  return node;
+}
+
+static void grow_table(void)
+{
+  size_t new_size = table_size * 2;
+  struct index_node **new_table = calloc(new_size, sizeof(*new_table));
+  if (new_table == NULL)
+    return; // keep the longer chains
+
+  for (size_t i = 0; i < table_size; i++)
+  {
+    struct index_node *node = table[i];
+    while (node != NULL)
+    {
+      struct index_node *next = node->hash_next;
+      size_t bucket = hash_path(node->path) & (new_size - 1);
+      node->hash_next = new_table[bucket];
+      new_table[bucket] = node;
+      node = next;
+    }
+  }
+  free(table);
+  table = new_table;
+  table_size = new_size;
+}
+
+/* TREE */
+
+static struct index_node *add_node(struct index_node *parent, const char *name, int is_dir)
+{
+  struct index_node *node = calloc(1, sizeof(*node));
+  if (node == NULL)
+    return NULL;
+
+  if (parent == NULL || parent->path[0] == '\0')
+    node->path = strdup(name);
+  else if (asprintf(&node->path, "%s/%s", parent->path, name) < 0)
+    node->path = NULL;
+  if (node->path == NULL)
+  {
+    free(node);
+    return NULL;
+  }
+  node->name = node->path + strlen(node->path) - strlen(name);
+  node->is_dir = is_dir;
+
+  // children are listed in the order they were added
+  node->parent = parent;
+  if (parent != NULL)
+  {
+    node->prev_sibling = parent->last_child;
+    if (parent->last_child != NULL)
+      parent->last_child->next_sibling = node;
+    else
+      parent->first_child = node;
+    parent->last_child = node;
+  }
+
+  if (node_count >= table_size)
+    grow_table();
+  size_t bucket = hash_path(node->path) & (table_size - 1);
+  node->hash_next = table[bucket];
+  table[bucket] = node;
+  node_count++;
+  return node;
+}
+
+static void remove_children(struct index_node *node);
+
+static void remove_node(struct index_node *node)
+{
+  remove_children(node);
+
+  struct index_node **link = &table[hash_path(node->path) & (table_size - 1)];
+  while (*link != node)
+    link = &(*link)->hash_next;
+  *link = node->hash_next;
+  node_count--;
+
+  struct index_node *parent = node->parent;
+  if (node->prev_sibling != NULL)
+    node->prev_sibling->next_sibling = node->next_sibling;
+  else
+    parent->first_child = node->next_sibling;
+  if (node->next_sibling != NULL)
+    node->next_sibling->prev_sibling = node->prev_sibling;
+  else
+    parent->last_child = node->prev_sibling;
+
+  free(node->path);
+  free(node);
+}
+
+static void remove_children(struct index_node *node)
+{
+  while (node->first_child != NULL)
+    remove_node(node->first_child);
+}
+
+// Find or add the node of a path, adding its parent directories as needed
+static struct index_node *ensure_node(const char *rel, int is_dir)
+{
+  struct index_node *node = root;
+  char prefix[INDEX_PATH_MAX];
+  const char *p = rel;
+  while (*p != '\0')
+  {
+    const char *end = strchrnul(p, '/');
+    int last = *end == '\0';
+    snprintf(prefix, sizeof(prefix), "%.*s", (int)(end - rel), rel);
+
+    int want_dir = last ? is_dir : 1;
+    struct index_node *child = lookup_node(prefix);
+    if (child != NULL && child->is_dir != want_dir)
+    {
+      // replaced by an entry of the other kind
+      remove_node(child);
+      child = NULL;
+    }
+    if (child == NULL)
+    {
+      char name[INDEX_PATH_MAX];
+      snprintf(name, sizeof(name), "%.*s", (int)(end - p), p);
+      child = add_node(node, name, want_dir);
+      if (child == NULL)
+        return NULL;
+    }
+    node = child;
+    p = last ? end : end + 1;
+  }
+  return node;
+}
+
+// Add everything below a directory node from disk
+static void scan_directory(struct index_node *node)
+{
+  char path[PATH_MAX];
+  disk_path(path, sizeof(path), node->path);
+  DIR *dir = opendir(path);
+  if (dir == NULL)
+  {
+    perror("Failed to open directory");
+    return;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+
+    int type = entry->d_type;
+    if (type == DT_UNKNOWN)
+    {
+      char entry_path[PATH_MAX + NAME_MAX + 2];
+      struct stat entry_stat;
+      snprintf(entry_path, sizeof(entry_path), "%s/%s", path, entry->d_name);
+      if (lstat(entry_path, &entry_stat) != 0)
+        continue;
+      type = S_ISDIR(entry_stat.st_mode) ? DT_DIR : S_ISREG(entry_stat.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+    if (type != DT_DIR && type != DT_REG)
+      continue;
+
+    struct index_node *child = add_node(node, entry->d_name, type == DT_DIR);
+    if (child != NULL && child->is_dir)
+      scan_directory(child);
+  }
+  closedir(dir);
+}
+
+static int add_segment_file(const char *path, void *arg)
+{
+  (void)arg;
+  char rel[INDEX_PATH_MAX];
+  if (relative_path(path, rel, sizeof(rel)) == 0)
+    ensure_node(rel, 0);
+  return 0;
+}
+
+// Read everything below a directory node again, the files on disk and those of the segment store
+static void rescan_directory(struct index_node *node)
+{
+  char path[PATH_MAX];
+  disk_path(path, sizeof(path), node->path);
+  remove_children(node);
+  scan_directory(node);
+  segment_store_walk(path, add_segment_file, NULL);
+}
+
+// Bring the node of a path in line with what is on disk now
+static void apply_change(const char *rel)
+{
+  char path[PATH_MAX];
+  struct stat path_stat;
+  struct segment_object object;
+  disk_path(path, sizeof(path), rel);
+  int exists = lstat(path, &path_stat) == 0;
+
+  if (exists && S_ISREG(path_stat.st_mode))
+  {
+    ensure_node(rel, 0);
+  }
+  else if (exists && S_ISDIR(path_stat.st_mode))
+  {
+    // a directory may have been moved in with its contents, read it again
+    struct index_node *node = ensure_node(rel, 1);
+    if (node != NULL)
+      rescan_directory(node);
+  }
+  else if (segment_store_lookup(path, &object) == 1)
+  {
+    ensure_node(rel, 0);
+  }
+  else
+  {
+    struct index_node *node = lookup_node(rel);
+    if (node == root)
+      remove_children(node);
+    else if (node != NULL)
+      remove_node(node);
+  }
+}
+
+/* JOURNAL */
+
+static void record_change(const char *rel)
+{
+  pthread_mutex_lock(&journal->lock);
+  snprintf(journal->paths[journal->next % INDEX_JOURNAL_SIZE], INDEX_PATH_MAX, "%s", rel);
+  journal->next++;
+  pthread_mutex_unlock(&journal->lock);
+}
+
+void store_index_update(const char *path)
+{
+  char rel[INDEX_PATH_MAX];
+  if (journal == NULL || relative_path(path, rel, sizeof(rel)) != 0)
+    return;
+  record_change(rel);
+}
+
+void store_index_sync(void)
+{
+  if (journal == NULL)
+    return;
+
+  // copy the pending changes out, they are checked on disk without holding the lock
+  char(*paths)[INDEX_PATH_MAX] = NULL;
+  pthread_mutex_lock(&journal->lock);
+  uint64_t next = journal->next;
+  uint64_t pending = next - applied;
+  if (pending > 0 && pending <= INDEX_JOURNAL_SIZE)
+  {
+    paths = malloc(pending * INDEX_PATH_MAX);
+    for (uint64_t seq = applied; paths != NULL && seq < next; seq++)
+      memcpy(paths[seq - applied], journal->paths[seq % INDEX_JOURNAL_SIZE], INDEX_PATH_MAX);
+  }
+  pthread_mutex_unlock(&journal->lock);
+
+  if (pending == 0)
+    return;
+
+  if (paths != NULL)
+  {
+    for (uint64_t i = 0; i < pending; i++)
+      apply_change(paths[i]);
+    free(paths);
+  }
+  else
+  {
+    // the journal no longer holds every change this process missed, read the whole store again
+    rescan_directory(root);
+  }
+  applied = next;
+}
+
+/* INOTIFY WATCHER */
+
+static void watch_directory(int inotify_fd, const char *rel)
+{
+  char path[PATH_MAX];
+  disk_path(path, sizeof(path), rel);
+  int wd = inotify_add_watch(inotify_fd, path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+  if (wd < 0)
+  {
+    if (errno != ENOENT && errno != ENOTDIR)
+      perror("Failed to watch directory");
+    return;
+  }
+
+  // a directory moved within the store keeps its watch descriptor under the new path
+  if (wd >= watch_count)
+  {
+    int new_count = wd * 2 + 16;
+    char **new_paths = realloc(watch_paths, new_count * sizeof(*new_paths));
+    if (new_paths == NULL)
+      return;
+    memset(new_paths + watch_count, 0, (new_count - watch_count) * sizeof(*new_paths));
+    watch_paths = new_paths;
+    watch_count = new_count;
+  }
+  free(watch_paths[wd]);
+  watch_paths[wd] = strdup(rel);
+
+  DIR *dir = opendir(path);
+  if (dir == NULL)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    if (entry->d_type != DT_DIR || strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    char child[INDEX_PATH_MAX];
+    if ((size_t)snprintf(child, sizeof(child), "%s%s%s", rel, rel[0] != '\0' ? "/" : "", entry->d_name) < sizeof(child))
+      watch_directory(inotify_fd, child);
+  }
+  closedir(dir);
+}
+
+static void run_watcher(int inotify_fd)
+{
+  char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (1)
+  {
+    ssize_t bytes_read = read(inotify_fd, buffer, sizeof(buffer));
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0)
+    {
+      perror("Failed to read store changes");
+      exit(EXIT_FAILURE);
+    }
+
+    const struct inotify_event *event;
+    for (char *p = buffer; p < buffer + bytes_read; p += sizeof(*event) + event->len)
+    {
+      event = (const struct inotify_event *)p;
+      if (event->mask & IN_Q_OVERFLOW)
+      {
+        // changes were lost, every process reads the whole store again
+        record_change("");
+        continue;
+      }
+      if (event->wd < 0 || event->wd >= watch_count || watch_paths[event->wd] == NULL)
+        continue;
+      if (event->mask & IN_IGNORED)
+      {
+        free(watch_paths[event->wd]);
+        watch_paths[event->wd] = NULL;
+        continue;
+      }
+      if (event->len == 0)
+        continue;
+
+      const char *dir = watch_paths[event->wd];
+      char rel[INDEX_PATH_MAX];
+      if ((size_t)snprintf(rel, sizeof(rel), "%s%s%s", dir, dir[0] != '\0' ? "/" : "", event->name) >= sizeof(rel))
+      {
+        // too long for the journal, have the directory read again instead
+        record_change(dir);
+        continue;
+      }
+
+      // watch new directories before publishing them, so nothing created in them afterwards is missed
+      if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+        watch_directory(inotify_fd, rel);
+      record_change(rel);
+    }
+  }
+}
+
+static int start_watcher(void)
+{
+  int inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (inotify_fd < 0)
+  {
+    perror("Failed to initialize inotify");
+    return -1;
+  }
+  watch_directory(inotify_fd, "");
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    perror("Failed to start store watcher");
+    close(inotify_fd);
+    return -1;
+  }
+  if (pid == 0)
+  {
+    // the watcher lives as long as the server, which stops it on exit
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_DFL);
+    run_watcher(inotify_fd);
+  }
+
+  close(inotify_fd);
+  for (int i = 0; i < watch_count; i++)
+    free(watch_paths[i]);
+  free(watch_paths);
+  watch_paths = NULL;
+  watch_count = 0;
+  return 0;
+}
+
+/* INDEX */
+
+int store_index_init(const char *store)
+{
+  snprintf(store_dir, sizeof(store_dir), "%s", store);
+  if (normalize_path(store, store_path, sizeof(store_path)) != 0)
+  {
+    fprintf(stderr, "Invalid store path: %s\n", store);
+    return -1;
+  }
+
+  struct index_journal *shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED)
+  {
+    perror("Failed to map store index journal");
+    return -1;
+  }
+  memset(shared, 0, sizeof(*shared));
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&shared->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  journal = shared;
+
+  table_size = 1024;
+  table = calloc(table_size, sizeof(*table));
+  if (table == NULL || (root = add_node(NULL, "", 1)) == NULL)
+  {
+    perror("Failed to allocate store index");
+    return -1;
+  }
+
+  // watch before reading the store, so nothing changed in between is missed
+  if (store_index_inotify && start_watcher() != 0)
+    return -1;
+
+  rescan_directory(root);
+  return 0;
+}
+
+int store_index_send_listing(int socket, uint32_t request_id, const char *dir_path, uint64_t offset, uint64_t limit,
+                              uint64_t *count)
+{
+  *count = 0;
+  store_index_sync();
+
+  char rel[INDEX_PATH_MAX];
+  struct index_node *dir = NULL;
+  if (journal != NULL && relative_path(dir_path, rel, sizeof(rel)) == 0)
+    dir = lookup_node(rel);
+  if (dir == NULL || !dir->is_dir)
+    return 0;
+
+  // lines are collected into batches of at most INDEX_BATCH_SIZE, so memory does not grow with the listing
+  char batch[INDEX_BATCH_SIZE];
+  size_t length = 0;
+  uint64_t skipped = 0;
+  size_t prefix_len = strlen(dir->path);
+
+  // walk the subtree in order, without recursion
+  struct index_node *node = dir->first_child;
+  while (node != NULL && (limit == 0 || *count < limit))
+  {
+    if (!node->is_dir && skipped < offset)
+      skipped++;
+    else if (!node->is_dir)
+    {
+      // "name - path\n", the path relative to the directory listed
+      const char *slash = prefix_len == 0 ? "/" : "";
+      size_t line_len = strlen(node->name) + strlen(slash) + strlen(node->path + prefix_len) + 4;
+      // snprintf also needs room for its terminator, past the line
+      if (line_len >= sizeof(batch))
+        fprintf(stderr, "Path too long to list: %s\n", node->path);
+      else
+      {
+        if (length + line_len >= sizeof(batch))
+        {
+          if (send_chunk(socket, request_id, batch, length) != 0)
+            return -1;
+          length = 0;
+        }
+        length += snprintf(batch + length, sizeof(batch) - length, "%s - %s%s\n", node->name, slash, node->path + prefix_len);
+        (*count)++;
+      }
+    }
+
+    if (node->first_child != NULL)
+    {
+      node = node->first_child;
+      continue;
+    }
+    while (node != dir && node->next_sibling == NULL)
+      node = node->parent;
+    node = node == dir ? NULL : node->next_sibling;
+  }
+
+  if (length > 0 && send_chunk(socket, request_id, batch, length) != 0)
+    return -1;
+  return 0;
+}
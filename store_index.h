@@ -0,0 +1,89 @@
+#ifndef STORE_INDEX_H
+#define STORE_INDEX_H
+
+#include <stdint.h>
+
+/*
+ * In-memory index of the files in a server's store, answering display.
+ *
+ * The directory tree of the store is walked once at startup into a tree of
+ * nodes, with a table from relative path to node, so a listing is a lookup of
+ * the directory followed by a walk of its subtree: the cost is proportional
+ * to the number of files listed, not to the size of the store, and no
+ * directory is read from disk. Listings are sent in batches as the subtree is
+ * walked, so a request needs the same memory for any number of files, and can
+ * be limited to a page of files starting at an offset. The files of the
+ * segment store are indexed with the files on disk; see segment_store.h.
+ *
+ * Every process of a server keeps its own copy of the index, inherited when
+ * it is forked. Changes are published through a journal in shared memory: a
+ * process that changes the store records the path it touched, and every
+ * process replays the paths recorded since its last listing before it lists,
+ * checking each of them on disk, so replays are idempotent and the order of
+ * concurrent writers does not matter. A process that fell more than
+ * INDEX_JOURNAL_SIZE changes behind rebuilds its index from disk.
+ *
+ * With --inotify, a watcher process also records the changes other programs
+ * make to the store, so files copied into the store directory by hand show up
+ * too.
+ */
+
+// Changes kept in the journal before lagging processes have to rebuild their index
+#define INDEX_JOURNAL_SIZE 1024
+
+// Longest path, relative to the store, kept in the journal
+#define INDEX_PATH_MAX 256
+
+// Largest chunk a listing is sent in
+#define INDEX_BATCH_SIZE (16 * 1024)
+
+/**
+ * @brief Whether changes made to the store by other programs are followed with inotify, set with --inotify.
+ */
+extern int store_index_inotify;
+
+/**
+ * @brief Build the index of a store, to be called before the server forks.
+ *
+ * Starts the inotify watcher process if store_index_inotify is set.
+ *
+ * @param root The store directory, e.g. "./stext".
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int store_index_init(const char *root);
+
+/**
+ * @brief Record that a path of the store was created, replaced or removed.
+ *
+ * @param path The path on disk, under the store directory.
+ */
+void store_index_update(const char *path);
+
+/**
+ * @brief Bring the index of the calling process up to date with the journal.
+ *
+ * Called by the fork model server before every fork, so the clients' processes
+ * start with a current index.
+ */
+void store_index_sync(void);
+
+/**
+ * @brief Send the files under a directory of the store as chunks of a chunked data frame body.
+ *
+ * Every file gets a "name - path\n" line, the path relative to the directory
+ * listed; a chunk holds whole lines only. A directory that is not in the store
+ * has an empty listing. The zero length chunk ending the body is left to the
+ * caller, which may append more chunks.
+ *
+ * @param socket The socket to send on.
+ * @param request_id The id of the request the listing answers.
+ * @param dir_path The directory on disk, under the store directory.
+ * @param offset The number of files to skip.
+ * @param limit The largest number of files to send, 0 for all.
+ * @param count Set to the number of files sent.
+ * @return int Returns 0 on success, -1 if the listing could not be sent.
+ */
+int store_index_send_listing(int socket, uint32_t request_id, const char *dir_path, uint64_t offset, uint64_t limit,
+                              uint64_t *count);
+
+#endif
@@ -0,0 +1,573 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+#include "transfer.h"
+#include "compress.h"
+#include "checksum.h"
+#include "segment_store.h"
+#include "scheduler.h"
+#include "parallel_gzip.h"
+#include "tar_stream.h"
+
+// Largest value the 11 octal digits of a ustar numeric field can hold
+#define TAR_OCTAL_MAX 077777777777ULL
+
+struct tar_writer
+{
+  int socket;
+  uint32_t request_id;
+  struct parallel_gzip *gzip; // Compresses the archive, NULL for a plain archive
+  int checked;                // Every chunk ends with its checksum
+  unsigned char *chunk; // Pending output, sent once TAR_CHUNK_SIZE bytes are buffered
+  size_t used;
+  int broken;  // A chunk was cut short, the stream can only be shut down
+  int copy_fd; // File the archive is also written to, -1 once copying failed
+};
+
+/* OUTPUT */
+
+static void stop_copy(struct tar_writer *writer)
+{
+  perror("Failed to copy archive");
+  writer->copy_fd = -1;
+}
+
+static void copy_bytes(struct tar_writer *writer, const void *data, size_t length)
+{
+  if (writer->copy_fd < 0)
+    return;
+
+  const char *p = data;
+  while (length > 0)
+  {
+    ssize_t bytes_written = write(writer->copy_fd, p, length);
+    if (bytes_written < 0 && errno == EINTR)
+      continue;
+    if (bytes_written <= 0)
+    {
+      stop_copy(writer);
+      return;
+    }
+    p += bytes_written;
+    length -= bytes_written;
+  }
+}
+
+static void copy_file(struct tar_writer *writer, int fd, uint64_t start, uint64_t size)
+{
+  if (writer->copy_fd < 0)
+    return;
+
+  // File to file in the kernel, falling back to a buffer when the file systems refuse
+  loff_t offset = start;
+  uint64_t end = start + size;
+  while ((uint64_t)offset < end)
+  {
+    ssize_t bytes_copied = copy_file_range(fd, &offset, writer->copy_fd, NULL, end - offset, 0);
+    if (bytes_copied < 0 && errno == EINTR)
+      continue;
+    if (bytes_copied > 0)
+      continue;
+    if (bytes_copied == 0 || (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP))
+    {
+      stop_copy(writer);
+      return;
+    }
+
+    char buffer[TAR_BLOCK_SIZE * 16];
+    while ((uint64_t)offset < end)
+    {
+      size_t want = end - offset < sizeof(buffer) ? end - offset : sizeof(buffer);
+      ssize_t bytes_read = pread(fd, buffer, want, offset);
+      if (bytes_read < 0 && errno == EINTR)
+        continue;
+      if (bytes_read <= 0)
+      {
+        stop_copy(writer);
+        return;
+      }
+      copy_bytes(writer, buffer, bytes_read);
+      if (writer->copy_fd < 0)
+        return;
+      offset += bytes_read;
+    }
+  }
+}
+
+static int flush_chunk(struct tar_writer *writer)
+{
+  if (writer->used == 0)
+    return 0;
+  if ((writer->checked
+           ? send_checked_frame(writer->socket, FRAME_FLAG_CHUNKED, writer->request_id, writer->chunk, writer->used)
+           : send_chunk(writer->socket, writer->request_id, writer->chunk, writer->used)) != 0)
+  {
+    writer->broken = 1;
+    return -1;
+  }
+  copy_bytes(writer, writer->chunk, writer->used);
+  scheduler_pace(writer->used);
+  writer->used = 0;
+  return 0;
+}
+
+// Append bytes to the chunks as they go on the wire, the output of the gzip stream of a compressed archive
+static int append_bytes(void *arg, const void *data, size_t length)
+{
+  struct tar_writer *writer = arg;
+  const unsigned char *p = data;
+  while (length > 0)
+  {
+    size_t room = TAR_CHUNK_SIZE - writer->used;
+    size_t n = length < room ? length : room;
+    memcpy(writer->chunk + writer->used, p, n);
+    writer->used += n;
+    p += n;
+    length -= n;
+    if (writer->used == TAR_CHUNK_SIZE && flush_chunk(writer) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Append bytes to the archive, compressing them if requested
+static int write_bytes(struct tar_writer *writer, const void *data, size_t length)
+{
+  if (writer->gzip)
+    return parallel_gzip_write(writer->gzip, data, length);
+  return append_bytes(writer, data, length);
+}
+
+static int write_padding(struct tar_writer *writer, uint64_t size)
+{
+  static const char zeros[TAR_BLOCK_SIZE];
+  size_t remainder = size % TAR_BLOCK_SIZE;
+  if (remainder == 0)
+    return 0;
+  return write_bytes(writer, zeros, TAR_BLOCK_SIZE - remainder);
+}
+
+/* HEADERS */
+
+static void put_octal(char *field, size_t size, uint64_t value)
+{
+  // size includes the terminating NUL
+  uint64_t max = (1ULL << (3 * (size - 1))) - 1;
+  snprintf(field, size, "%0*llo", (int)size - 1, (unsigned long long)(value > max ? max : value));
+}
+
+static void put_size(char *field, uint64_t size)
+{
+  if (size <= TAR_OCTAL_MAX)
+  {
+    put_octal(field, 12, size);
+    return;
+  }
+  // base-256: high bit set, big-endian binary in the remaining bytes
+  field[0] = (char)0x80;
+  for (int i = 11; i > 0; i--)
+  {
+    field[i] = size & 0xff;
+    size >>= 8;
+  }
+}
+
+/**
+ * @brief Fit a path into the ustar name (100 bytes) and prefix (155 bytes) fields.
+ *
+ * @return int Returns 0 if it fits, -1 if it needs a pax path record.
+ */
+static int split_name(const char *path, char *name, char *prefix)
+{
+  size_t length = strlen(path);
+  if (length <= 100)
+  {
+    memcpy(name, path, length);
+    return 0;
+  }
+
+  // Split at the first slash that leaves at most 100 bytes for the name
+  for (size_t i = length > 101 ? length - 101 : 0; i < length && i <= 155; i++)
+  {
+    if (path[i] != '/' || i == 0 || length - i - 1 == 0 || length - i - 1 > 100)
+      continue;
+    memcpy(prefix, path, i);
+    memcpy(name, path + i + 1, length - i - 1);
+    return 0;
+  }
+  return -1;
+}
+
+static int write_raw_header(struct tar_writer *writer, char *header, const struct stat *st, char type, uint64_t size)
+{
+  put_octal(header + 100, 8, st->st_mode & 07777);
+  put_octal(header + 108, 8, st->st_uid);
+  put_octal(header + 116, 8, st->st_gid);
+  put_size(header + 124, size);
+  put_octal(header + 136, 12, st->st_mtime);
+  header[156] = type;
+  memcpy(header + 257, "ustar", 6);
+  memcpy(header + 263, "00", 2);
+
+  // The checksum is computed with its own field filled with spaces
+  memset(header + 148, ' ', 8);
+  unsigned int sum = 0;
+  for (int i = 0; i < TAR_BLOCK_SIZE; i++)
+    sum += (unsigned char)header[i];
+  snprintf(header + 148, 8, "%06o", sum);
+  header[155] = ' ';
+
+  return write_bytes(writer, header, TAR_BLOCK_SIZE);
+}
+
+static int write_pax_path(struct tar_writer *writer, const char *path, const struct stat *st)
+{
+  // A record is "<length> path=<path>\n", where length counts its own digits
+  size_t base = strlen(" path=") + strlen(path) + 1;
+  size_t length = base + 1;
+  while (snprintf(NULL, 0, "%zu", length) + base != length)
+    length = snprintf(NULL, 0, "%zu", length) + base;
+
+  char *record = malloc(length + 1);
+  if (record == NULL)
+    return -1;
+  snprintf(record, length + 1, "%zu path=%s\n", length, path);
+
+  char header[TAR_BLOCK_SIZE] = {0};
+  const char *base_name = strrchr(path, '/');
+  snprintf(header, 100, "./PaxHeaders/%.80s", base_name != NULL ? base_name + 1 : path);
+  int result = write_raw_header(writer, header, st, 'x', length);
+  if (result == 0)
+    result = write_bytes(writer, record, length);
+  if (result == 0)
+    result = write_padding(writer, length);
+  free(record);
+  return result;
+}
+
+static int write_header(struct tar_writer *writer, const char *path, const struct stat *st, char type, uint64_t size)
+{
+  char header[TAR_BLOCK_SIZE] = {0};
+  if (split_name(path, header, header + 345) != 0)
+  {
+    if (write_pax_path(writer, path, st) != 0)
+      return -1;
+    // Readers without pax support still get a truncated name
+    memcpy(header, path, 100);
+  }
+  return write_raw_header(writer, header, st, type, size);
+}
+
+/* ENTRIES */
+
+// The body of a file is the size bytes of fd from start, a file of the segment store is only part of its segment
+static int write_file_body(struct tar_writer *writer, int fd, uint64_t start, uint64_t size)
+{
+  if (size == 0)
+    return 0;
+
+  if (!writer->gzip)
+  {
+    // The whole file is one chunk, sent through the selected transmit path, its checksum the one stored with it
+    uint32_t crc = 0;
+    if (flush_chunk(writer) != 0 || (writer->checked && checksum_file(fd, (struct byte_range){start, size}, &crc) != 0))
+      return -1;
+    uint32_t flags = FRAME_FLAG_CHUNKED | (writer->checked ? FRAME_FLAG_CHECKSUM : 0);
+    if (send_frame_header(writer->socket, OP_DATA, flags, writer->request_id,
+                          size + (writer->checked ? CHECKSUM_SIZE : 0)) != 0 ||
+        send_file_data(writer->socket, fd, start, size) != 0 || (writer->checked && send_checksum(writer->socket, crc) != 0))
+    {
+      writer->broken = 1;
+      return -1;
+    }
+    copy_file(writer, fd, start, size);
+    return 0;
+  }
+
+  unsigned char *buffer = malloc(TAR_CHUNK_SIZE);
+  if (buffer == NULL)
+    return -1;
+
+  int result = 0;
+  uint64_t offset = 0;
+  while (offset < size)
+  {
+    size_t want = size - offset < TAR_CHUNK_SIZE ? size - offset : TAR_CHUNK_SIZE;
+    ssize_t bytes_read = pread(fd, buffer, want, start + offset);
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0)
+    {
+      // The file shrank underneath us, its header already promised size bytes
+      fprintf(stderr, "Short read while archiving\n");
+      result = -1;
+      break;
+    }
+    if (parallel_gzip_write(writer->gzip, buffer, bytes_read) != 0)
+    {
+      result = -1;
+      break;
+    }
+    offset += bytes_read;
+  }
+  free(buffer);
+  return result;
+}
+
+// A file packed at rest is archived with its uncompressed content
+static int write_packed_body(struct tar_writer *writer, int fd, uint64_t size)
+{
+  unsigned char *buffer = malloc(COMPRESS_CHUNK_SIZE);
+  if (buffer == NULL)
+    return -1;
+
+  int result = 0;
+  uint64_t position = 0, written = 0;
+  while (result == 0 && written < size)
+  {
+    size_t length;
+    if (compress_read_record(fd, &position, buffer, &length) != 0 || length == 0 || length > size - written)
+    {
+      fprintf(stderr, "Short read while archiving\n");
+      result = -1;
+    }
+    else
+    {
+      result = write_bytes(writer, buffer, length);
+      written += length;
+    }
+  }
+  free(buffer);
+  return result;
+}
+
+static int write_tree(struct tar_writer *writer, const char *path)
+{
+  struct stat st;
+  if (lstat(path, &st) != 0)
+  {
+    // Removed while the tree was walked
+    return errno == ENOENT ? 0 : -1;
+  }
+
+  if (S_ISDIR(st.st_mode))
+  {
+    char dir_name[PATH_MAX];
+    if (snprintf(dir_name, sizeof(dir_name), "%s/", path) >= (int)sizeof(dir_name))
+      return 0;
+    if (write_header(writer, dir_name, &st, '5', 0) != 0)
+      return -1;
+
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+      return errno == ENOENT ? 0 : -1;
+
+    int result = 0;
+    struct dirent *entry;
+    while (result == 0 && (entry = readdir(dir)) != NULL)
+    {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        continue;
+      char child[PATH_MAX];
+      if (snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= (int)sizeof(child))
+        continue;
+      result = write_tree(writer, child);
+    }
+    closedir(dir);
+    return result;
+  }
+
+  if (!S_ISREG(st.st_mode))
+    return 0;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return errno == ENOENT ? 0 : -1;
+
+  // Archive the file as it is now, not as it was when the directory was listed
+  int result = -1;
+  uint64_t size;
+  int packed = fstat(fd, &st) == 0 ? compress_content_size(fd, &size) : -1;
+  if (packed >= 0 && write_header(writer, path, &st, '0', size) == 0 &&
+      (packed ? write_packed_body(writer, fd, size) : write_file_body(writer, fd, 0, size)) == 0 &&
+      write_padding(writer, size) == 0)
+    result = 0;
+  close(fd);
+  return result;
+}
+
+// Files of the segment store are archived after the files on disk, out of their segments
+static int write_segment_file(const char *path, void *arg)
+{
+  struct tar_writer *writer = arg;
+  struct segment_object object;
+  int found = segment_store_lookup(path, &object);
+  if (found <= 0)
+  {
+    // Removed while the tree was walked
+    return found;
+  }
+
+  struct stat st = {.st_mode = S_IFREG | 0644, .st_uid = getuid(), .st_gid = getgid(), .st_mtime = object.mtime};
+  if (write_header(writer, path, &st, '0', object.length) != 0 ||
+      write_file_body(writer, object.fd, object.offset, object.length) != 0 || write_padding(writer, object.length) != 0)
+    return -1;
+  return 0;
+}
+
+static int finish_archive(struct tar_writer *writer)
+{
+  // Two zero blocks end a tar archive
+  static const char end_of_archive[2 * TAR_BLOCK_SIZE];
+  if (write_bytes(writer, end_of_archive, sizeof(end_of_archive)) != 0)
+    return -1;
+  if (writer->gzip && parallel_gzip_finish(writer->gzip) != 0)
+    return -1;
+  if (flush_chunk(writer) != 0)
+    return -1;
+
+  // The zero length chunk ends the body
+  if (send_chunk(writer->socket, writer->request_id, NULL, 0) != 0)
+  {
+    writer->broken = 1;
+    return -1;
+  }
+  return 0;
+}
+
+int tar_compression_argument(const char *argument, int default_level)
+{
+  if (strncmp(argument, "-z", 2) != 0)
+    return TAR_PLAIN;
+  if (argument[2] == '\0')
+    return default_level;
+  if (argument[2] >= '0' && argument[2] <= '9' && argument[3] == '\0')
+    return argument[2] - '0';
+  return TAR_PLAIN;
+}
+
+int send_tar_stream(int socket, uint32_t request_id, const char *source_path, int level, int copy_fd, int checked)
+{
+  struct stat st;
+  if (stat(source_path, &st) != 0 || !S_ISDIR(st.st_mode))
+  {
+    fprintf(stderr, "Cannot archive %s\n", source_path);
+    return -1;
+  }
+
+  struct tar_writer writer = {.socket = socket, .request_id = request_id, .checked = checked, .copy_fd = copy_fd};
+  writer.chunk = malloc(TAR_CHUNK_SIZE);
+  if (writer.chunk == NULL)
+    return -1;
+  if (level != TAR_PLAIN && (writer.gzip = parallel_gzip_begin(level, append_bytes, &writer)) == NULL)
+  {
+    free(writer.chunk);
+    return -1;
+  }
+
+  int result = write_tree(&writer, source_path);
+  if (result == 0)
+    result = segment_store_walk(source_path, write_segment_file, &writer);
+  if (result == 0)
+    result = finish_archive(&writer);
+
+  parallel_gzip_free(writer.gzip);
+  free(writer.chunk);
+
+  // A partial chunk is on the wire, the result frame cannot follow it
+  if (writer.broken)
+    shutdown(socket, SHUT_RDWR);
+  if (result != 0)
+    return -1;
+  return (copy_fd >= 0 && writer.copy_fd < 0) ? 0 : 1;
+}
+
+/* MERGED ARCHIVES */
+
+// The end of an archive is held back, as it is only known to be the end once the archive is complete
+#define TAR_END_SIZE (2 * TAR_BLOCK_SIZE)
+
+struct tar_merge
+{
+  struct tar_writer writer;
+  unsigned char held[TAR_END_SIZE]; // Last bytes of the current archive
+  size_t held_length;
+};
+
+struct tar_merge *tar_merge_begin(int socket, uint32_t request_id, int level, int checked)
+{
+  struct tar_merge *merge = calloc(1, sizeof(*merge));
+  if (merge == NULL)
+    return NULL;
+  merge->writer.socket = socket;
+  merge->writer.request_id = request_id;
+  merge->writer.checked = checked;
+  merge->writer.copy_fd = -1;
+  merge->writer.chunk = malloc(TAR_CHUNK_SIZE);
+  if (merge->writer.chunk == NULL ||
+      (level != TAR_PLAIN && (merge->writer.gzip = parallel_gzip_begin(level, append_bytes, &merge->writer)) == NULL))
+  {
+    free(merge->writer.chunk);
+    free(merge);
+    return NULL;
+  }
+  return merge;
+}
+
+int tar_merge_append(struct tar_merge *merge, const void *data, size_t length)
+{
+  const unsigned char *p = data;
+  if (merge->held_length + length > TAR_END_SIZE)
+  {
+    // write everything before the last TAR_END_SIZE bytes, the held bytes first
+    size_t emit = merge->held_length + length - TAR_END_SIZE;
+    size_t from_held = emit < merge->held_length ? emit : merge->held_length;
+    if (write_bytes(&merge->writer, merge->held, from_held) != 0 ||
+        write_bytes(&merge->writer, p, emit - from_held) != 0)
+      return -1;
+    memmove(merge->held, merge->held + from_held, merge->held_length - from_held);
+    merge->held_length -= from_held;
+    p += emit - from_held;
+    length -= emit - from_held;
+  }
+  memcpy(merge->held + merge->held_length, p, length);
+  merge->held_length += length;
+  return 0;
+}
+
+int tar_merge_next(struct tar_merge *merge)
+{
+  static const unsigned char end_of_archive[TAR_END_SIZE];
+  int ended = merge->held_length == TAR_END_SIZE && memcmp(merge->held, end_of_archive, TAR_END_SIZE) == 0;
+  merge->held_length = 0;
+  if (!ended)
+  {
+    fprintf(stderr, "Archive to merge is cut short\n");
+    return -1;
+  }
+  return 0;
+}
+
+int tar_merge_finish(struct tar_merge *merge)
+{
+  return finish_archive(&merge->writer);
+}
+
+void tar_merge_free(struct tar_merge *merge)
+{
+  parallel_gzip_free(merge->writer.gzip);
+  free(merge->writer.chunk);
+  if (merge->writer.broken)
+    shutdown(merge->writer.socket, SHUT_RDWR);
+  free(merge);
+}
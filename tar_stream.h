@@ -0,0 +1,125 @@
+#ifndef TAR_STREAM_H
+#define TAR_STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * In-process tar writer used by dtar.
+ *
+ * The archive of a directory tree is generated while the tree is walked and
+ * streamed onto the socket as a chunked data frame body (FRAME_FLAG_CHUNKED),
+ * since its size is not known up front. Nothing is staged on disk. Without
+ * compression, file bodies are sent as whole chunks through the transmit path
+ * selected with --send-mode; with compression the archive goes through a
+ * gzip stream compressed by a pool of threads, see parallel_gzip.h, at the
+ * level the request asks for with "-z0" to "-z9". Files packed at rest are
+ * archived inflated. A checked
+ * archive ends every chunk with its checksum trailer, see checksum.h. The files
+ * of the segment store under the directory follow the files on disk; see
+ * segment_store.h.
+ *
+ * Entries are POSIX ustar. Names that do not fit the ustar name/prefix fields
+ * get a pax extended header, and sizes beyond the 11 octal digits of the size
+ * field use the base-256 encoding understood by GNU and BSD tar.
+ */
+
+// Size of the chunks the archive headers (or the compressed archive) are sent in
+#define TAR_CHUNK_SIZE (64 * 1024)
+
+// Size of a tar block
+#define TAR_BLOCK_SIZE 512
+
+// Compression of an archive: TAR_PLAIN, or a gzip level from TAR_GZIP_STORED to 9
+#define TAR_PLAIN -1
+#define TAR_GZIP_STORED 0
+
+// Level of a "-z" without a level, zlib's default; pdf archives are stored, their files are compressed already
+#define TAR_GZIP_DEFAULT 6
+
+/**
+ * @brief Parse a compression argument of dtar, "-z" or "-z0" to "-z9".
+ *
+ * @param argument The argument.
+ * @param default_level The level of a "-z" without a level.
+ * @return int The gzip level, TAR_PLAIN if the argument is not a compression argument.
+ */
+int tar_compression_argument(const char *argument, int default_level);
+
+/**
+ * @brief Stream a tar archive of a directory tree as a chunked data frame body.
+ *
+ * Entries are named after source_path as given, e.g. "./stext/docs/a.txt".
+ * On failure nothing more is sent, the caller answers with an error result,
+ * unless the failure cut a chunk short, in which case the socket is shut down.
+ *
+ * The archive can also be written to a file as it is sent, to cache it. A
+ * failure to write the copy does not fail the transfer.
+ *
+ * @param socket The socket to send on.
+ * @param request_id The id of the request the archive answers.
+ * @param source_path The directory to archive.
+ * @param level The gzip level of the archive, TAR_PLAIN to send a plain tar archive.
+ * @param copy_fd File descriptor to also write the archive to, or -1.
+ * @param checked 1 to end every chunk with its checksum trailer, 0 otherwise.
+ * @return int Returns 1 if the whole archive was sent (and copied), 0 if it was sent but the copy failed,
+ * -1 otherwise.
+ */
+int send_tar_stream(int socket, uint32_t request_id, const char *source_path, int level, int copy_fd, int checked);
+
+/**
+ * @brief An archive streamed as a chunked data frame body, joined from the plain tar archives of several servers.
+ *
+ * The two zero blocks ending every archive are held back and dropped, so the
+ * entries of all of them end up in one archive, gzipped on the way if
+ * requested.
+ */
+struct tar_merge;
+
+/**
+ * @brief Start a merged archive.
+ *
+ * @param socket The socket to send on.
+ * @param request_id The id of the request the archive answers.
+ * @param level The gzip level of the archive, TAR_PLAIN to send a plain tar archive.
+ * @param checked 1 to end every chunk with its checksum trailer, 0 otherwise.
+ * @return struct tar_merge* The merged archive, or NULL on failure.
+ */
+struct tar_merge *tar_merge_begin(int socket, uint32_t request_id, int level, int checked);
+
+/**
+ * @brief Append the next bytes of the current plain tar archive.
+ *
+ * @param merge The merged archive.
+ * @param data The bytes.
+ * @param length The number of bytes.
+ * @return int Returns 0 on success, -1 if the socket failed.
+ */
+int tar_merge_append(struct tar_merge *merge, const void *data, size_t length);
+
+/**
+ * @brief End the current archive, dropping its end-of-archive blocks.
+ *
+ * @param merge The merged archive.
+ * @return int Returns 0 on success, -1 if the archive did not end with two zero blocks.
+ */
+int tar_merge_next(struct tar_merge *merge);
+
+/**
+ * @brief End the merged archive and its chunked body.
+ *
+ * @param merge The merged archive.
+ * @return int Returns 0 on success, -1 if the socket failed.
+ */
+int tar_merge_finish(struct tar_merge *merge);
+
+/**
+ * @brief Release a merged archive, finished or not.
+ *
+ * The socket is shut down if a chunk was cut short, as the result frame cannot follow it.
+ *
+ * @param merge The merged archive.
+ */
+void tar_merge_free(struct tar_merge *merge);
+
+#endif
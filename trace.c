@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "trace.h"
+
+struct span
+{
+  const char *name;
+  uint64_t ns;
+};
+
+struct trace
+{
+  uint64_t id; // 0 while no request is traced
+  uint32_t request_id;
+  uint8_t opcode;
+  uint64_t started;   // Start of the request
+  uint64_t span_start; // End of the last span
+  struct span spans[TRACE_MAX_SPANS];
+  int span_count;
+};
+
+static char trace_server[16];
+static unsigned trace_sample;      // One in every trace_sample requests is traced, 0 for none
+static int trace_fd = STDOUT_FILENO;
+static unsigned long untraced;     // Requests without a trace id seen since the last sampled one
+static uint64_t ids_issued;        // Trace ids this process started
+
+static struct trace current;
+
+static uint64_t trace_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// A trace id unique across the processes of every server, never 0
+static uint64_t new_trace_id(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  uint64_t id = ((uint64_t)now.tv_sec << 32 | (uint64_t)now.tv_nsec) ^ ((uint64_t)getpid() << 44);
+  // spread consecutive ids of one process over the whole range
+  id ^= ++ids_issued * 0x9E3779B97F4A7C15ULL;
+  return id != 0 ? id : 1;
+}
+
+int trace_init(const char *server, unsigned sample, const char *path)
+{
+  snprintf(trace_server, sizeof(trace_server), "%s", server);
+  trace_sample = sample;
+  if (path == NULL)
+    return 0;
+
+  // O_APPEND keeps the single write of every line whole next to the other processes' lines
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0)
+  {
+    perror("Failed to open trace file");
+    return -1;
+  }
+  trace_fd = fd;
+  return 0;
+}
+
+void trace_begin(const struct frame_header *request, const char *args)
+{
+  uint64_t id = frame_trace_id(request, args);
+  if (id == 0 && trace_sample > 0 && ++untraced >= trace_sample)
+  {
+    untraced = 0;
+    id = new_trace_id();
+  }
+
+  current.id = id;
+  command_trace_id = id;
+  if (id == 0)
+    return;
+  current.request_id = request->request_id;
+  current.opcode = request->opcode;
+  current.started = trace_now();
+  current.span_start = current.started;
+  current.span_count = 0;
+}
+
+void trace_span(const char *name)
+{
+  if (current.id == 0)
+    return;
+
+  uint64_t now = trace_now();
+  if (current.span_count < TRACE_MAX_SPANS)
+    current.spans[current.span_count++] = (struct span){.name = name, .ns = now - current.span_start};
+  else
+    current.spans[TRACE_MAX_SPANS - 1].ns += now - current.span_start;
+  current.span_start = now;
+}
+
+void trace_end(void)
+{
+  if (current.id == 0)
+    return;
+  trace_span("reply");
+
+  char line[1024];
+  size_t length = snprintf(line, sizeof(line), "trace=%016llx server=%s pid=%d request=%u op=%s total_us=%llu",
+                           (unsigned long long)current.id, trace_server, (int)getpid(), current.request_id,
+                           opcode_name(current.opcode),
+                           (unsigned long long)((current.span_start - current.started) / 1000));
+  for (int i = 0; i < current.span_count && length < sizeof(line); i++)
+    length += snprintf(line + length, sizeof(line) - length, " %s=%llu", current.spans[i].name,
+                       (unsigned long long)(current.spans[i].ns / 1000));
+  if (length >= sizeof(line) - 1)
+    length = sizeof(line) - 2;
+  line[length++] = '\n';
+
+  // standard output may hold log lines buffered before this one
+  if (trace_fd == STDOUT_FILENO)
+    fflush(stdout);
+  while (write(trace_fd, line, length) < 0 && errno == EINTR)
+    ;
+
+  current.id = 0;
+  command_trace_id = 0;
+}
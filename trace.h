@@ -0,0 +1,68 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+/*
+ * Request tracing across the Smain to Stext/Spdf hop.
+ *
+ * A traced request carries a 64-bit trace id on its command frame (see
+ * FRAME_FLAG_TRACED in protocol.h). Smain starts a trace for one in every
+ * --trace-sample requests it receives, and for every request a client sent
+ * with a trace id; while it runs, every command Smain sends to a backend
+ * carries the same id, so the backend traces its part of the request too.
+ *
+ * Each server splits the time of a traced request into consecutive spans
+ * ("parse", "receive", "relay", "backend", ...), each ended by trace_span,
+ * and at the end writes one line for the request:
+ *
+ *   trace=<id> server=smain pid=<pid> request=<id> op=ufile total_us=<n> parse=<n> ... reply=<n>
+ *
+ * The lines of every server sharing a trace id show where the request spent
+ * its time on each hop. Lines go to standard output, or are appended to the
+ * --trace-file with a single write each, so the processes of a server can
+ * share one file.
+ */
+
+// Largest number of spans recorded for a request, later spans are added to the last one
+#define TRACE_MAX_SPANS 16
+
+/**
+ * @brief Set up tracing, to be called once at startup.
+ *
+ * @param server The name of the server, written on every trace line.
+ * @param sample Trace one in every sample requests that arrive without a trace id, 0 for none.
+ * @param path The file trace lines are appended to, or NULL for standard output.
+ * @return int Returns 0 on success, -1 if the file cannot be opened.
+ */
+int trace_init(const char *server, unsigned sample, const char *path);
+
+/**
+ * @brief Start the trace of a request if it carries a trace id or is sampled.
+ *
+ * A started trace is attached to every command frame this process sends until trace_end.
+ *
+ * @param request The header of the command frame.
+ * @param args The payload of the command frame as received.
+ */
+void trace_begin(const struct frame_header *request, const char *args);
+
+/**
+ * @brief End the current span of the traced request, the next span starts now.
+ *
+ * Does nothing when the request is not traced.
+ *
+ * @param name The name of the span, a string literal.
+ */
+void trace_span(const char *name);
+
+/**
+ * @brief End the trace of the request and write its line, the time since the last span is the "reply" span.
+ *
+ * Does nothing when the request is not traced.
+ */
+void trace_end(void);
+
+#endif
@@ -0,0 +1,341 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+
+#include "protocol.h"
+#include "transfer.h"
+#include "uring_io.h"
+#include "scheduler.h"
+
+// Returned by a zero-copy path when the kernel does not support the descriptors, same as URING_UNSUPPORTED
+#define TRANSFER_UNSUPPORTED -3
+
+enum send_mode file_send_mode = SEND_MODE_SENDFILE;
+
+static uint64_t bytes_served; // Bytes sent by send_file_data in this process
+
+int parse_send_mode(const char *name, enum send_mode *mode)
+{
+  if (strcmp(name, "sendfile") == 0)
+    *mode = SEND_MODE_SENDFILE;
+  else if (strcmp(name, "splice") == 0)
+    *mode = SEND_MODE_SPLICE;
+  else if (strcmp(name, "buffered") == 0)
+    *mode = SEND_MODE_BUFFERED;
+  else
+    return -1;
+  return 0;
+}
+
+const char *send_mode_name(enum send_mode mode)
+{
+  switch (mode)
+  {
+  case SEND_MODE_SENDFILE:
+    return "sendfile";
+  case SEND_MODE_SPLICE:
+    return "splice";
+  case SEND_MODE_BUFFERED:
+    return "buffered";
+  }
+  return "unknown";
+}
+
+/* TRANSMIT PATHS */
+
+static int send_with_sendfile(int socket, int fd, uint64_t *offset, uint64_t *remaining)
+{
+  while (*remaining > 0)
+  {
+    off_t file_offset = *offset;
+    size_t chunk = *remaining > 0x7ffff000 ? 0x7ffff000 : *remaining;
+    ssize_t bytes_sent = sendfile(socket, fd, &file_offset, chunk);
+    if (bytes_sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EINVAL || errno == ENOSYS)
+        return TRANSFER_UNSUPPORTED;
+      return -1;
+    }
+    if (bytes_sent == 0)
+    {
+      // File shrank underneath us
+      errno = EIO;
+      return -1;
+    }
+    *offset += bytes_sent;
+    *remaining -= bytes_sent;
+  }
+  return 0;
+}
+
+static int send_with_splice(int socket, int fd, uint64_t *offset, uint64_t *remaining)
+{
+  int pipe_fds[2];
+  if (pipe2(pipe_fds, O_CLOEXEC) != 0)
+    return TRANSFER_UNSUPPORTED;
+
+  // A bigger pipe means fewer splice round trips, the default size is fine if refused
+  fcntl(pipe_fds[1], F_SETPIPE_SZ, 1024 * 1024);
+
+  int result = 0;
+  while (*remaining > 0)
+  {
+    loff_t file_offset = *offset;
+    size_t chunk = *remaining > 1024 * 1024 ? 1024 * 1024 : *remaining;
+    ssize_t bytes_in = splice(fd, &file_offset, pipe_fds[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (bytes_in < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      result = (errno == EINVAL || errno == ENOSYS) ? TRANSFER_UNSUPPORTED : -1;
+      break;
+    }
+    if (bytes_in == 0)
+    {
+      errno = EIO;
+      result = -1;
+      break;
+    }
+
+    // Drain the pipe into the socket
+    ssize_t bytes_pending = bytes_in;
+    while (bytes_pending > 0)
+    {
+      ssize_t bytes_out = splice(pipe_fds[0], NULL, socket, NULL, bytes_pending, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (bytes_out < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        // Bytes are stuck in the pipe, there is no clean way to fall back
+        result = -1;
+        break;
+      }
+      bytes_pending -= bytes_out;
+    }
+    if (result != 0)
+      break;
+
+    *offset += bytes_in;
+    *remaining -= bytes_in;
+  }
+
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+  return result;
+}
+
+static int send_with_buffer(int socket, int fd, uint64_t *offset, uint64_t *remaining)
+{
+  char *buffer = malloc(TRANSFER_BUFFER_SIZE);
+  if (buffer == NULL)
+    return -1;
+
+  int result = 0;
+  while (*remaining > 0)
+  {
+    size_t chunk = *remaining > TRANSFER_BUFFER_SIZE ? TRANSFER_BUFFER_SIZE : *remaining;
+    ssize_t bytes_read = pread(fd, buffer, chunk, *offset);
+    if (bytes_read < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      result = -1;
+      break;
+    }
+    if (bytes_read == 0)
+    {
+      errno = EIO;
+      result = -1;
+      break;
+    }
+    if (send_all(socket, buffer, bytes_read, *remaining > (uint64_t)bytes_read ? MSG_MORE : 0) != 0)
+    {
+      result = -1;
+      break;
+    }
+    *offset += bytes_read;
+    *remaining -= bytes_read;
+  }
+
+  free(buffer);
+  return result;
+}
+
+static int send_file_range(int socket, int fd, uint64_t offset, uint64_t length)
+{
+  uint64_t remaining = length;
+  int result = TRANSFER_UNSUPPORTED;
+
+  // the io_uring engine takes precedence, the send mode is its fallback
+  if (file_io_engine == IO_ENGINE_URING)
+    result = uring_send_data(socket, fd, &offset, &remaining);
+
+  if (result == TRANSFER_UNSUPPORTED && file_send_mode == SEND_MODE_SENDFILE)
+    result = send_with_sendfile(socket, fd, &offset, &remaining);
+  else if (result == TRANSFER_UNSUPPORTED && file_send_mode == SEND_MODE_SPLICE)
+    result = send_with_splice(socket, fd, &offset, &remaining);
+
+  // Buffered mode, or a zero-copy path the kernel refused for these descriptors
+  if (result == TRANSFER_UNSUPPORTED)
+    result = send_with_buffer(socket, fd, &offset, &remaining);
+
+  bytes_served += length - remaining;
+  return result == 0 ? 0 : -1;
+}
+
+int send_file_data(int socket, int fd, uint64_t offset, uint64_t length)
+{
+  if (!scheduler_paced())
+    return send_file_range(socket, fd, offset, length);
+
+  // a paced client is sent a buffer at a time, sleeping between buffers keeps it at its rate
+  while (length > 0)
+  {
+    uint64_t chunk = length > TRANSFER_BUFFER_SIZE ? TRANSFER_BUFFER_SIZE : length;
+    if (send_file_range(socket, fd, offset, chunk) != 0)
+      return -1;
+    scheduler_pace(chunk);
+    offset += chunk;
+    length -= chunk;
+  }
+  return 0;
+}
+
+/* RELAY */
+
+static int relay_with_splice(int from_socket, int to_socket, uint64_t *remaining)
+{
+  int pipe_fds[2];
+  if (pipe2(pipe_fds, O_CLOEXEC) != 0)
+    return TRANSFER_UNSUPPORTED;
+
+  // The pipe is the relay buffer, its capacity bounds the bytes in flight
+  fcntl(pipe_fds[1], F_SETPIPE_SZ, TRANSFER_BUFFER_SIZE);
+
+  int result = 0;
+  while (*remaining > 0)
+  {
+    size_t chunk = *remaining > TRANSFER_BUFFER_SIZE ? TRANSFER_BUFFER_SIZE : *remaining;
+    ssize_t bytes_in = splice(from_socket, NULL, pipe_fds[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (bytes_in < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      result = (errno == EINVAL || errno == ENOSYS) ? TRANSFER_UNSUPPORTED : RELAY_SOURCE_ERROR;
+      break;
+    }
+    if (bytes_in == 0)
+    {
+      // Source closed in the middle of the body
+      result = RELAY_SOURCE_ERROR;
+      break;
+    }
+    *remaining -= bytes_in;
+
+    // Blocking here is the backpressure on the source
+    ssize_t bytes_pending = bytes_in;
+    while (bytes_pending > 0)
+    {
+      ssize_t bytes_out = splice(pipe_fds[0], NULL, to_socket, NULL, bytes_pending,
+                                 SPLICE_F_MOVE | (*remaining > 0 ? SPLICE_F_MORE : 0));
+      if (bytes_out < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        result = RELAY_SINK_ERROR;
+        break;
+      }
+      bytes_pending -= bytes_out;
+    }
+    if (result != 0)
+      break;
+    scheduler_pace(bytes_in);
+  }
+
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+  return result;
+}
+
+static int relay_with_buffer(int from_socket, int to_socket, uint64_t *remaining)
+{
+  char *buffer = malloc(TRANSFER_BUFFER_SIZE);
+  if (buffer == NULL)
+    return RELAY_SINK_ERROR;
+
+  int result = 0;
+  while (*remaining > 0)
+  {
+    size_t chunk = *remaining > TRANSFER_BUFFER_SIZE ? TRANSFER_BUFFER_SIZE : *remaining;
+    // forward whatever has arrived instead of waiting for a full buffer
+    ssize_t bytes_in = recv(from_socket, buffer, chunk, 0);
+    if (bytes_in < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      result = RELAY_SOURCE_ERROR;
+      break;
+    }
+    if (bytes_in == 0)
+    {
+      result = RELAY_SOURCE_ERROR;
+      break;
+    }
+    *remaining -= bytes_in;
+
+    if (send_all(to_socket, buffer, bytes_in, *remaining > 0 ? MSG_MORE : 0) != 0)
+    {
+      result = RELAY_SINK_ERROR;
+      break;
+    }
+    scheduler_pace(bytes_in);
+  }
+
+  free(buffer);
+  return result;
+}
+
+int relay_data(int from_socket, int to_socket, uint64_t length)
+{
+  uint64_t remaining = length;
+  int result = TRANSFER_UNSUPPORTED;
+
+  if (file_send_mode != SEND_MODE_BUFFERED)
+    result = relay_with_splice(from_socket, to_socket, &remaining);
+
+  if (result == TRANSFER_UNSUPPORTED)
+    result = relay_with_buffer(from_socket, to_socket, &remaining);
+
+  // Keep the source framed even though the sink is gone
+  if (result == RELAY_SINK_ERROR && discard_payload(from_socket, remaining) != 0)
+    result = RELAY_SOURCE_ERROR;
+
+  bytes_served += length - remaining;
+  return result;
+}
+
+void print_transfer_stats(const char *label)
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return;
+
+  double user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+  double sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+  double gigabytes = bytes_served / 1e9;
+
+  printf("%s: served %llu bytes via %s (io engine %s), cpu user %.3fs sys %.3fs", label,
+         (unsigned long long)bytes_served, send_mode_name(file_send_mode), io_engine_name(file_io_engine), user, sys);
+  if (gigabytes > 0)
+    printf(" (%.3f cpu s/GB)", (user + sys) / gigabytes);
+  printf("\n");
+}
@@ -0,0 +1,87 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdint.h>
+
+/*
+ * Transmit path for file bodies shared by Smain, Stext and Spdf.
+ *
+ * The bytes of a data frame are moved from a file descriptor to a socket with
+ * sendfile(2), splice(2) through a pipe, or large buffered reads. Zero-copy
+ * modes fall back to buffered reads when the kernel refuses the descriptors.
+ * Socket to socket relays splice through a pipe, or use a buffer in buffered mode.
+ * Both charge the bytes they move to the client of the request, see scheduler.h.
+ */
+
+// Buffer size used by the buffered transmit path
+#define TRANSFER_BUFFER_SIZE (256 * 1024)
+
+// relay_data failures, telling which side of the relay broke
+#define RELAY_SOURCE_ERROR -1
+#define RELAY_SINK_ERROR -2
+
+enum send_mode
+{
+  SEND_MODE_SENDFILE, // sendfile(2) straight from the page cache
+  SEND_MODE_SPLICE,   // splice(2) file -> pipe -> socket
+  SEND_MODE_BUFFERED, // pread(2) into a user-space buffer, then send
+};
+
+/**
+ * @brief Transmit path used by send_file_data, selected with --send-mode.
+ */
+extern enum send_mode file_send_mode;
+
+/**
+ * @brief Parse a transmit path name ("sendfile", "splice" or "buffered").
+ *
+ * @param name The name given on the command line.
+ * @param mode The parsed mode.
+ * @return int Returns 0 on success, -1 if the name is unknown.
+ */
+int parse_send_mode(const char *name, enum send_mode *mode);
+
+/**
+ * @brief Get the name of a transmit path.
+ *
+ * @param mode The mode.
+ * @return const char* The mode name.
+ */
+const char *send_mode_name(enum send_mode mode);
+
+/**
+ * @brief Send a range of a file to a socket using the selected transmit path.
+ *
+ * @param socket The socket to send on.
+ * @param fd The file descriptor to read from.
+ * @param offset The file offset of the first byte to send.
+ * @param length The number of bytes to send.
+ * @return int Returns 0 if all bytes were sent, -1 otherwise.
+ */
+int send_file_data(int socket, int fd, uint64_t offset, uint64_t length);
+
+/**
+ * @brief Relay a data frame body from one socket to another as it arrives.
+ *
+ * Bytes are spliced through a pipe (or a TRANSFER_BUFFER_SIZE buffer in
+ * buffered mode), so at most one buffer is held in flight and a slow sink
+ * applies backpressure to the source. If the sink fails, the rest of the
+ * body is still drained from the source so its stream stays framed.
+ *
+ * @param from_socket The socket to read the body from.
+ * @param to_socket The socket to write the body to.
+ * @param length The number of bytes to relay.
+ * @return int Returns 0 on success, RELAY_SOURCE_ERROR or RELAY_SINK_ERROR otherwise.
+ */
+int relay_data(int from_socket, int to_socket, uint64_t length);
+
+/**
+ * @brief Print the bytes served and the CPU time used by this process.
+ *
+ * Used to compare the CPU cost per GB of the transmit paths.
+ *
+ * @param label The label printed in front of the statistics.
+ */
+void print_transfer_stats(const char *label);
+
+#endif
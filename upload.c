@@ -0,0 +1,508 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+#include "checksum.h"
+#include "blob_store.h"
+#include "compress.h"
+#include "upload.h"
+#include "transfer.h"
+#include "uring_io.h"
+#include "scheduler.h"
+
+static char upload_dir[PATH_MAX / 2];
+
+// Upload ids name files, only hexadecimal digits are accepted
+static int valid_upload_id(const char *upload_id)
+{
+  size_t len = strlen(upload_id);
+  if (len == 0 || len > UPLOAD_ID_MAX)
+    return 0;
+  for (size_t i = 0; i < len; i++)
+    if (!isxdigit((unsigned char)upload_id[i]))
+      return 0;
+  return 1;
+}
+
+static void partial_path(char *path, size_t size, const char *upload_id)
+{
+  snprintf(path, size, "%s/%s.part", upload_dir, upload_id);
+}
+
+// The stripes of a striped upload share one data file, each stripe records its committed end in a file of its own
+static void stripes_path(char *path, size_t size, const char *upload_id)
+{
+  snprintf(path, size, "%s/%s.stripes", upload_dir, upload_id);
+}
+
+static void progress_path(char *path, size_t size, const char *upload_id, unsigned stripe)
+{
+  snprintf(path, size, "%s/%s.%u", upload_dir, upload_id, stripe);
+}
+
+static void stripe_range(uint64_t file_size, unsigned stripe, unsigned stripes, uint64_t *start, uint64_t *end)
+{
+  uint64_t stripe_size = file_size / stripes + (file_size % stripes != 0);
+  *start = (uint64_t)stripe * stripe_size < file_size ? (uint64_t)stripe * stripe_size : file_size;
+  *end = *start + stripe_size < file_size ? *start + stripe_size : file_size;
+}
+
+// Read the committed end of a stripe, 0 if the stripe was never started
+static uint64_t read_progress(const char *path)
+{
+  char value[32] = {0};
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  ssize_t length = read(fd, value, sizeof(value) - 1);
+  close(fd);
+  return length > 0 ? strtoull(value, NULL, 10) : 0;
+}
+
+static int write_progress(int fd, uint64_t committed)
+{
+  // fixed width, so a smaller value overwrites the whole of a larger one
+  char value[32];
+  int length = snprintf(value, sizeof(value), "%020llu\n", (unsigned long long)committed);
+  return pwrite(fd, value, length, 0) == length ? 0 : -1;
+}
+
+int upload_init(const char *dir)
+{
+  snprintf(upload_dir, sizeof(upload_dir), "%s", dir);
+
+  // create every component of the upload directory
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s", dir);
+  for (char *p = path + 1; *p != '\0'; p++)
+  {
+    if (*p != '/')
+      continue;
+    *p = '\0';
+    mkdir(path, 0755);
+    *p = '/';
+  }
+  if (mkdir(path, 0755) != 0 && errno != EEXIST)
+  {
+    perror("Failed to create upload directory");
+    return -1;
+  }
+  return 0;
+}
+
+void upload_temp_path(char *path, size_t size)
+{
+  // upload ids are hexadecimal, so the name never collides with a partial upload
+  static unsigned temp_counter;
+  snprintf(path, size, "%s/delta.%d.%u", upload_dir, (int)getpid(), temp_counter++);
+}
+
+int upload_offset(const char *upload_id, unsigned stripe, unsigned stripes, uint64_t *offset)
+{
+  if (!valid_upload_id(upload_id) || stripes == 0 || stripes > UPLOAD_STRIPES_MAX || stripe >= stripes)
+    return -1;
+
+  char path[PATH_MAX];
+  if (stripes > 1)
+  {
+    progress_path(path, sizeof(path), upload_id, stripe);
+    *offset = read_progress(path);
+    return 1;
+  }
+
+  struct stat partial_stat;
+  partial_path(path, sizeof(path), upload_id);
+  *offset = stat(path, &partial_stat) == 0 ? (uint64_t)partial_stat.st_size : 0;
+  return 1;
+}
+
+static int write_all_at(int fd, const char *buffer, size_t length, uint64_t position)
+{
+  while (length > 0)
+  {
+    ssize_t written = pwrite(fd, buffer, length, position);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return -1;
+    buffer += written;
+    length -= written;
+    position += written;
+  }
+  return 0;
+}
+
+// Throw away the chunks that follow the one just received
+static void discard_next_chunks(int socket)
+{
+  struct frame_header chunk;
+  if (recv_frame_header(socket, &chunk) == 1 && chunk.opcode == OP_DATA)
+    discard_body(socket, &chunk);
+}
+
+/*
+ * Receive the payload of a compressed chunk of upload_id and write it inflated into fd at *position, advancing it; a
+ * chunk that would inflate past end is rejected. The inflated bytes are added to hash unless it is NULL, and the
+ * payload is charged to the client's rate. Returns 1 if the chunk was written, 0 if it was consumed but rejected
+ * (corrupt, too large or not written), -1 if the connection broke.
+ */
+static int receive_compressed(int socket, const char *upload_id, const struct frame_header *chunk, int fd,
+                              uint64_t *position, uint64_t end, struct sha256 *hash)
+{
+  char *buffer = malloc(COMPRESS_CHUNK_SIZE);
+  if (buffer == NULL)
+    return discard_payload(socket, chunk->payload_length) == 0 ? 0 : -1;
+
+  size_t length;
+  int result = recv_compressed_chunk(socket, chunk->payload_length, buffer, &length);
+  if (result == 0 && *position + length > end)
+  {
+    fprintf(stderr, "Upload %s is larger than %llu bytes\n", upload_id, (unsigned long long)end);
+    result = 1;
+  }
+  else if (result == 0 && write_all_at(fd, buffer, length, *position) != 0)
+  {
+    perror("Failed to write partial upload");
+    result = 1;
+  }
+  else if (result == 0)
+  {
+    if (hash != NULL)
+      sha256_update(hash, buffer, length);
+    *position += length;
+    scheduler_pace(chunk->payload_length);
+  }
+  free(buffer);
+  return result == 0 ? 1 : result == 1 ? 0 : -1;
+}
+
+/*
+ * Receive chunks into fd at *committed up to end, advancing *committed after every whole chunk; a stripe also records
+ * it in progress_fd. The bytes are added to hash as they are written, unless it is NULL. Returns 1 once the zero
+ * length chunk arrived, -1 otherwise, the stream consumed unless it broke.
+ */
+static int receive_chunks(int socket, const char *upload_id, struct frame_header *chunk, int fd, int progress_fd,
+                          uint64_t *committed, uint64_t end, struct sha256 *hash)
+{
+  // a zero length chunk ends the body
+  while (chunk->payload_length > 0)
+  {
+    int write_failed = 0;
+    uint64_t position = *committed;
+    uint64_t remaining;
+    int checked = frame_content_length(chunk, &remaining);
+    uint32_t crc = 0;
+    if (checked < 0)
+    {
+      discard_body(socket, chunk);
+      return -1;
+    }
+    if (chunk->flags & FRAME_FLAG_COMPRESSED)
+    {
+      // the size of a compressed chunk is only known once it is inflated
+      int result = receive_compressed(socket, upload_id, chunk, fd, &position, end, hash);
+      if (result < 0)
+      {
+        perror("Upload interrupted");
+        if (progress_fd < 0 && ftruncate(fd, *committed) != 0)
+          perror("Failed to cut back partial upload");
+        return -1;
+      }
+      write_failed = result == 0;
+      remaining = 0;
+    }
+    else if (*committed + remaining > end)
+    {
+      fprintf(stderr, "Upload %s is larger than %llu bytes\n", upload_id, (unsigned long long)end);
+      discard_body(socket, chunk);
+      return -1;
+    }
+
+    // the io_uring engine writes the chunk while its next bytes are received, a paced client is received a buffer at
+    // a time
+    if (remaining > 0 && file_io_engine == IO_ENGINE_URING && !scheduler_paced())
+    {
+      int result = uring_receive_data(socket, fd, position, remaining, hash, checked ? &crc : NULL);
+      if (result == RELAY_SOURCE_ERROR)
+      {
+        perror("Upload interrupted");
+        if (progress_fd < 0 && ftruncate(fd, *committed) != 0)
+          perror("Failed to cut back partial upload");
+        return -1;
+      }
+      if (result == RELAY_SINK_ERROR)
+      {
+        perror("Failed to write partial upload");
+        write_failed = 1;
+      }
+      if (result != URING_UNSUPPORTED)
+      {
+        position += remaining;
+        remaining = 0;
+      }
+    }
+
+    while (remaining > 0)
+    {
+      char buffer[64 * 1024];
+      size_t bytes_to_receive = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+      if (recv_all(socket, buffer, bytes_to_receive) != 1)
+      {
+        // the connection dropped inside the chunk, keep only the committed chunks
+        perror("Upload interrupted");
+        if (progress_fd < 0 && ftruncate(fd, *committed) != 0)
+          perror("Failed to cut back partial upload");
+        return -1;
+      }
+      // keep reading after a write error, the stream must stay framed
+      if (!write_failed && write_all_at(fd, buffer, bytes_to_receive, position) != 0)
+      {
+        perror("Failed to write partial upload");
+        write_failed = 1;
+      }
+      if (hash != NULL)
+        sha256_update(hash, buffer, bytes_to_receive);
+      if (checked)
+        crc = crc32c(crc, buffer, bytes_to_receive);
+      position += bytes_to_receive;
+      scheduler_pace(bytes_to_receive);
+      remaining -= bytes_to_receive;
+    }
+
+    // a chunk that does not match its checksum is not committed
+    if (checked)
+    {
+      int check = recv_checksum(socket, crc);
+      if (check < 0)
+      {
+        perror("Upload interrupted");
+        if (progress_fd < 0 && ftruncate(fd, *committed) != 0)
+          perror("Failed to cut back partial upload");
+        return -1;
+      }
+      if (check == 0)
+        write_failed = 1;
+    }
+
+    if (write_failed)
+    {
+      if (progress_fd < 0 && ftruncate(fd, *committed) != 0)
+        perror("Failed to cut back partial upload");
+      discard_next_chunks(socket);
+      return -1;
+    }
+    *committed = position;
+    if (progress_fd >= 0 && write_progress(progress_fd, *committed) != 0)
+    {
+      perror("Failed to record upload progress");
+      discard_next_chunks(socket);
+      return -1;
+    }
+
+    int header = recv_frame_header(socket, chunk);
+    if (header != 1 || chunk->opcode != OP_DATA || !(chunk->flags & FRAME_FLAG_CHUNKED))
+    {
+      // the sender went away or gave up between chunks, everything received is committed
+      if (header == 1)
+        discard_payload(socket, chunk->payload_length);
+      fprintf(stderr, "Upload %s interrupted at %llu bytes\n", upload_id, (unsigned long long)*committed);
+      return -1;
+    }
+  }
+  return 1;
+}
+
+// Store the file of a striped upload if every stripe is committed, the caller holds the lock of the data file
+static void store_stripes(const char *upload_id, uint64_t file_size, unsigned stripes, int fd, const char *path,
+                          const char *file_path)
+{
+  char progress[PATH_MAX];
+  for (unsigned stripe = 0; stripe < stripes; stripe++)
+  {
+    uint64_t start, end;
+    stripe_range(file_size, stripe, stripes, &start, &end);
+    progress_path(progress, sizeof(progress), upload_id, stripe);
+    // a stripe without data is complete from the start
+    if (end > start && read_progress(progress) != end)
+      return;
+  }
+
+  // the stripes arrived out of order, so only the complete file can be hashed
+  unsigned char digest[SHA256_DIGEST_SIZE] = {0};
+  if (blob_store_enabled)
+  {
+    struct sha256 hash;
+    sha256_init(&hash);
+    if (blob_store_hash_range(fd, 0, file_size, &hash) != 0)
+    {
+      perror("Failed to hash upload");
+      return;
+    }
+    sha256_final(&hash, digest);
+  }
+  if (compress_file(path) != 0 || blob_store_commit(path, digest, file_path) != 0)
+    return;
+  for (unsigned stripe = 0; stripe < stripes; stripe++)
+  {
+    progress_path(progress, sizeof(progress), upload_id, stripe);
+    unlink(progress);
+  }
+}
+
+static int receive_stripe(int socket, const char *upload_id, struct frame_header *chunk, uint64_t file_size,
+                          uint64_t offset, unsigned stripe, unsigned stripes, const char *file_path)
+{
+  char path[PATH_MAX], progress[PATH_MAX];
+  stripes_path(path, sizeof(path), upload_id);
+  progress_path(progress, sizeof(progress), upload_id, stripe);
+
+  // one writer per stripe, the stripes of an upload are written at the same time
+  int progress_fd = open(progress, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (progress_fd < 0 || flock(progress_fd, LOCK_EX | LOCK_NB) != 0)
+  {
+    fprintf(stderr, "Stripe %u of upload %s is already in progress\n", stripe, upload_id);
+    discard_body(socket, chunk);
+    if (progress_fd >= 0)
+      close(progress_fd);
+    return -1;
+  }
+
+  // the client may restart anywhere in the committed part of its stripe
+  uint64_t start, end;
+  stripe_range(file_size, stripe, stripes, &start, &end);
+  uint64_t committed = read_progress(progress);
+  if (committed < start)
+    committed = start;
+  if (offset < start || offset > committed || offset > end)
+  {
+    fprintf(stderr, "Stripe %u of upload %s cannot continue at %llu, %llu bytes are committed\n", stripe, upload_id,
+            (unsigned long long)offset, (unsigned long long)committed);
+    discard_body(socket, chunk);
+    close(progress_fd);
+    return -1;
+  }
+  committed = offset;
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+  {
+    perror("Failed to open partial upload");
+    discard_body(socket, chunk);
+    close(progress_fd);
+    return -1;
+  }
+
+  int result = receive_chunks(socket, upload_id, chunk, fd, progress_fd, &committed, end, NULL);
+  close(progress_fd);
+  if (result == 1 && committed != end)
+  {
+    fprintf(stderr, "Stripe %u of upload %s incomplete: %llu of %llu bytes\n", stripe, upload_id,
+            (unsigned long long)(committed - start), (unsigned long long)(end - start));
+    result = -1;
+  }
+
+  // the stripe that completes last moves the file into the store
+  if (result == 1)
+  {
+    flock(fd, LOCK_EX);
+    store_stripes(upload_id, file_size, stripes, fd, path, file_path);
+  }
+  close(fd);
+  return result;
+}
+
+int receive_upload(int socket, const char *upload_id, uint64_t file_size, uint64_t offset, unsigned stripe,
+                   unsigned stripes, const char *file_path)
+{
+  struct frame_header chunk;
+  if (recv_frame_header(socket, &chunk) != 1 || chunk.opcode != OP_DATA)
+  {
+    perror("Failed to receive upload");
+    return -1;
+  }
+  if (!(chunk.flags & FRAME_FLAG_CHUNKED) || !valid_upload_id(upload_id) || stripes == 0 ||
+      stripes > UPLOAD_STRIPES_MAX || stripe >= stripes)
+  {
+    fprintf(stderr, "Invalid resumable upload: %s\n", upload_id);
+    discard_body(socket, &chunk);
+    return -1;
+  }
+  if (stripes > 1)
+    return receive_stripe(socket, upload_id, &chunk, file_size, offset, stripe, stripes, file_path);
+
+  char path[PATH_MAX];
+  partial_path(path, sizeof(path), upload_id);
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+  {
+    perror("Failed to open partial upload");
+    discard_body(socket, &chunk);
+    return -1;
+  }
+
+  // one writer per upload, the lock goes away with the descriptor
+  struct stat partial_stat;
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &partial_stat) != 0)
+  {
+    fprintf(stderr, "Upload %s is already in progress\n", upload_id);
+    discard_body(socket, &chunk);
+    close(fd);
+    return -1;
+  }
+
+  // the client may restart before the committed size, never after it
+  uint64_t committed = partial_stat.st_size;
+  if (offset > committed || offset > file_size || (offset < committed && ftruncate(fd, offset) != 0))
+  {
+    fprintf(stderr, "Upload %s cannot continue at %llu, %llu bytes are committed\n", upload_id, (unsigned long long)offset,
+            (unsigned long long)committed);
+    discard_body(socket, &chunk);
+    close(fd);
+    return -1;
+  }
+  committed = offset;
+
+  // a deduplicated upload is hashed as it arrives, after what an earlier attempt committed
+  struct sha256 hash;
+  sha256_init(&hash);
+  if (blob_store_enabled && blob_store_hash_range(fd, 0, committed, &hash) != 0)
+  {
+    perror("Failed to hash partial upload");
+    discard_body(socket, &chunk);
+    close(fd);
+    return -1;
+  }
+
+  if (receive_chunks(socket, upload_id, &chunk, fd, -1, &committed, file_size, blob_store_enabled ? &hash : NULL) != 1)
+  {
+    close(fd);
+    return -1;
+  }
+
+  if (committed != file_size)
+  {
+    fprintf(stderr, "Upload %s incomplete: %llu of %llu bytes\n", upload_id, (unsigned long long)committed,
+            (unsigned long long)file_size);
+    close(fd);
+    return -1;
+  }
+
+  // the whole file is there, move it into the store; the lock is kept until it has left the upload directory
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  sha256_final(&hash, digest);
+  int stored = compress_file(path) == 0 && blob_store_commit(path, digest, file_path) == 0;
+  if (close(fd) != 0 || !stored)
+  {
+    perror("Failed to store upload");
+    return -1;
+  }
+  return 1;
+}
@@ -0,0 +1,90 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Resumable uploads shared by Smain, Stext and Spdf.
+ *
+ * A resumable upload is received into a partial file named after its upload
+ * id in the server's upload directory, outside the store, so display and
+ * dtar never see it. Every chunk of the upload is written at its offset and
+ * counts as committed once it was received whole: when the connection drops
+ * part way through a chunk, the partial file is cut back to the last
+ * committed chunk. The size of the partial file is the offset the next
+ * attempt continues at. Once the partial file holds the whole upload it is
+ * renamed into the store.
+ *
+ * A partial file is locked while an upload writes it, so two clients using
+ * the same upload id cannot interleave. Partial files of uploads that are
+ * never resumed are kept.
+ *
+ * A striped upload splits the file into equal ranges, one per stripe, which
+ * the client sends over separate connections at the same time. The stripes
+ * are written into one shared data file at their offsets, and each stripe
+ * records its committed end in a small progress file next to it, since the
+ * size of the data file no longer tells how much arrived. Each stripe is
+ * resumed on its own, and the stripe that completes last renames the data
+ * file into the store.
+ *
+ * With --dedup, complete files are committed through the blob store instead
+ * of renamed; see blob_store.h. With --compress-at-rest they are packed
+ * first; see compress.h. Compressed chunks are inflated as they arrive.
+ */
+
+// Longest upload id, ids are made of hexadecimal digits
+#define UPLOAD_ID_MAX 32
+
+// Largest number of stripes an upload is split into
+#define UPLOAD_STRIPES_MAX 64
+
+/**
+ * @brief Set up the directory partial uploads are kept in.
+ *
+ * @param upload_dir The upload directory, on the same file system as the store.
+ * @return int Returns 0 on success, -1 otherwise.
+ */
+int upload_init(const char *upload_dir);
+
+/**
+ * @brief Get the number of bytes of an upload, or the end of a stripe, the server has committed.
+ *
+ * @param upload_id The upload id.
+ * @param stripe The stripe of a striped upload, 0 otherwise.
+ * @param stripes The number of stripes of the upload, 1 for an upload that is not striped.
+ * @param offset Set to the committed size, or the offset of the file the stripe has committed up to; 0 for an upload
+ *               or stripe that was never started.
+ * @return int Returns 1 on success, -1 if the upload id or stripe is invalid.
+ */
+int upload_offset(const char *upload_id, unsigned stripe, unsigned stripes, uint64_t *offset);
+
+/**
+ * @brief Get a new path in the upload directory for a file completed outside the store, such as a file rebuilt
+ *        from a delta (see delta.h) or a small file on its way to the segment store (see segment_store.h).
+ *
+ * @param path The buffer to store the path.
+ * @param size The size of the path buffer.
+ */
+void upload_temp_path(char *path, size_t size);
+
+/**
+ * @brief Receive the chunked body of a resumable upload into its partial file.
+ *
+ * The body is consumed even when it is rejected, unless the sender broke the stream.
+ * The body of a stripe covers the stripe's range of the file only.
+ *
+ * @param socket The socket to receive from.
+ * @param upload_id The upload id.
+ * @param file_size The size of the whole file.
+ * @param offset The offset the body continues at, at most the committed size.
+ * @param stripe The stripe of a striped upload, 0 otherwise.
+ * @param stripes The number of stripes of the upload, 1 for an upload that is not striped.
+ * @param file_path The path the complete file is stored at.
+ * @return int Returns 1 if the file, or the stripe, is complete, -1 otherwise. The file is stored once all of its
+ *             stripes are complete.
+ */
+int receive_upload(int socket, const char *upload_id, uint64_t file_size, uint64_t offset, unsigned stripe,
+                   unsigned stripes, const char *file_path);
+
+#endif
@@ -0,0 +1,582 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "protocol.h"
+#include "checksum.h"
+#include "transfer.h"
+#include "uring_io.h"
+
+// Submission queue entries, enough for one operation per buffer plus the socket operation
+#define URING_ENTRIES (2 * URING_BUFFERS)
+
+// Operation kinds, kept in the low bits of the user data next to the buffer index
+#define URING_OP_RECV 1
+#define URING_OP_WRITE 2
+#define URING_OP_READ 3
+#define URING_OP_SEND 4
+
+enum io_engine file_io_engine = IO_ENGINE_STDIO;
+
+struct uring
+{
+  int fd;
+  pid_t owner; // a ring is never shared with forked children
+  int fixed;   // whether the buffers are registered
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  unsigned queued; // entries queued since the last io_uring_enter
+  char *buffers;
+};
+
+// One buffer of a transfer
+enum slot_state
+{
+  SLOT_FREE,
+  SLOT_FILLING, // receive: a socket receive fills it
+  SLOT_WRITING, // receive: its bytes are being written to the file
+  SLOT_READING, // send: a file read fills it
+  SLOT_READY,   // send: waiting for its turn on the socket
+  SLOT_SENDING, // send: its bytes are being sent
+};
+
+struct slot
+{
+  enum slot_state state;
+  uint64_t file_offset; // file offset of the first byte of the buffer
+  size_t length;        // bytes held, or to be read into the buffer
+  size_t done;          // bytes written, read or sent so far
+};
+
+static struct uring *process_ring;
+
+int parse_io_engine(const char *name, enum io_engine *engine)
+{
+  if (strcmp(name, "stdio") == 0)
+    *engine = IO_ENGINE_STDIO;
+  else if (strcmp(name, "uring") == 0)
+    *engine = IO_ENGINE_URING;
+  else
+    return -1;
+  return 0;
+}
+
+const char *io_engine_name(enum io_engine engine)
+{
+  switch (engine)
+  {
+  case IO_ENGINE_STDIO:
+    return "stdio";
+  case IO_ENGINE_URING:
+    return "uring";
+  }
+  return "unknown";
+}
+
+/* RING */
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_destroy(struct uring *ring)
+{
+  // closing the ring cancels whatever is still in flight
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  free(ring->buffers);
+  free(ring);
+}
+
+// Whether the kernel implements every operation a transfer uses
+static int uring_supports_operations(int fd)
+{
+  size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, size);
+  if (probe == NULL)
+    return 0;
+
+  int supported = 0;
+  if (io_uring_register(fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0)
+  {
+    static const int operations[] = {IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ, IORING_OP_WRITE,
+                                     IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED};
+    supported = 1;
+    for (size_t i = 0; i < sizeof(operations) / sizeof(operations[0]); i++)
+      if (operations[i] > probe->last_op || !(probe->ops[operations[i]].flags & IO_URING_OP_SUPPORTED))
+        supported = 0;
+  }
+  free(probe);
+  return supported;
+}
+
+static struct uring *uring_create(void)
+{
+  struct uring *ring = calloc(1, sizeof(*ring));
+  if (ring == NULL)
+    return NULL;
+  ring->fd = -1;
+  ring->owner = getpid();
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = io_uring_setup(URING_ENTRIES, &params);
+  if (ring->fd < 0 || !uring_supports_operations(ring->fd))
+  {
+    uring_destroy(ring);
+    return NULL;
+  }
+
+  // map the submission and completion rings, a single mapping on kernels that share it
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                       IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+  {
+    uring_destroy(ring);
+    return NULL;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ring = ring->sq_ring;
+  else
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                    IORING_OFF_SQES);
+  if (ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+  {
+    uring_destroy(ring);
+    return NULL;
+  }
+
+  char *sq = ring->sq_ring;
+  char *cq = ring->cq_ring;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  ring->buffers = aligned_alloc(4096, (size_t)URING_BUFFERS * TRANSFER_BUFFER_SIZE);
+  if (ring->buffers == NULL)
+  {
+    uring_destroy(ring);
+    return NULL;
+  }
+
+  // registered buffers spare the kernel mapping the pages on every file operation,
+  // plain reads and writes are used if the locked memory limit refuses them
+  struct iovec iovecs[URING_BUFFERS];
+  for (int i = 0; i < URING_BUFFERS; i++)
+  {
+    iovecs[i].iov_base = ring->buffers + (size_t)i * TRANSFER_BUFFER_SIZE;
+    iovecs[i].iov_len = TRANSFER_BUFFER_SIZE;
+  }
+  ring->fixed = io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovecs, URING_BUFFERS) == 0;
+  return ring;
+}
+
+// Get the ring of this process, set up on first use
+static struct uring *uring_get(void)
+{
+  static int unavailable;
+  if (unavailable)
+    return NULL;
+
+  if (process_ring != NULL && process_ring->owner != getpid())
+  {
+    // inherited over fork, the ring belongs to the parent
+    uring_destroy(process_ring);
+    process_ring = NULL;
+  }
+  if (process_ring == NULL)
+  {
+    process_ring = uring_create();
+    if (process_ring == NULL)
+    {
+      fprintf(stderr, "io_uring is not available, using the stdio engine\n");
+      unavailable = 1;
+    }
+  }
+  return process_ring;
+}
+
+// Give up on a ring whose state is no longer known, the next transfer sets up a new one
+static void uring_discard(struct uring *ring)
+{
+  if (ring == process_ring)
+    process_ring = NULL;
+  uring_destroy(ring);
+}
+
+static char *slot_buffer(struct uring *ring, unsigned index)
+{
+  return ring->buffers + (size_t)index * TRANSFER_BUFFER_SIZE;
+}
+
+// Queue an operation, submitted with the others by the next uring_wait
+static void uring_queue(struct uring *ring, int opcode, int fd, unsigned index, size_t done, size_t length,
+                        uint64_t offset, int flags, int kind)
+{
+  unsigned tail = *ring->sq_tail;
+  unsigned sqe_index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[sqe_index];
+  memset(sqe, 0, sizeof(*sqe));
+
+  int fixed = ring->fixed && (opcode == IORING_OP_READ || opcode == IORING_OP_WRITE);
+  if (fixed)
+    opcode = opcode == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)(slot_buffer(ring, index) + done);
+  sqe->len = length;
+  sqe->off = offset;
+  if (fixed)
+    sqe->buf_index = index;
+  if (opcode == IORING_OP_SEND || opcode == IORING_OP_RECV)
+    sqe->msg_flags = flags;
+  sqe->user_data = ((uint64_t)index << 8) | kind;
+
+  ring->sq_array[sqe_index] = sqe_index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->queued++;
+}
+
+// Submit the queued operations and wait for at least one completion
+static int uring_wait(struct uring *ring)
+{
+  for (;;)
+  {
+    int submitted = io_uring_enter(ring->fd, ring->queued, 1, IORING_ENTER_GETEVENTS);
+    if (submitted >= 0)
+    {
+      ring->queued -= submitted;
+      return 0;
+    }
+    if (errno != EINTR)
+      return -1;
+  }
+}
+
+// Take the next completion, 0 if none is left
+static int uring_reap(struct uring *ring, uint64_t *user_data, int *res)
+{
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+
+  struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+  *user_data = cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/* TRANSFERS */
+
+int uring_receive_data(int socket, int fd, uint64_t offset, uint64_t length, struct sha256 *hash, uint32_t *crc)
+{
+  struct uring *ring = uring_get();
+  if (ring == NULL)
+    return URING_UNSUPPORTED;
+
+  struct slot slots[URING_BUFFERS];
+  memset(slots, 0, sizeof(slots));
+
+  uint64_t received = 0;  // bytes taken from the socket
+  unsigned filling = 0;   // sequence number of the buffer being received into
+  int receiving = 0;      // whether the socket receive is in flight
+  unsigned in_flight = 0;
+  int result = 0;
+
+  for (;;)
+  {
+    // keep one receive in flight, the socket delivers its bytes in order only to one reader
+    struct slot *slot = &slots[filling % URING_BUFFERS];
+    if (result == 0 && !receiving && received < length && slot->state != SLOT_WRITING)
+    {
+      if (slot->state == SLOT_FREE)
+      {
+        slot->state = SLOT_FILLING;
+        slot->file_offset = offset + received;
+        slot->length = 0;
+      }
+      size_t chunk = TRANSFER_BUFFER_SIZE - slot->length;
+      if (length - received < chunk)
+        chunk = length - received;
+      uring_queue(ring, IORING_OP_RECV, socket, filling % URING_BUFFERS, slot->length, chunk, 0, 0, URING_OP_RECV);
+      receiving = 1;
+      in_flight++;
+    }
+
+    if (in_flight == 0)
+      break;
+    if (uring_wait(ring) != 0)
+    {
+      perror("Failed to wait for io_uring");
+      uring_discard(ring);
+      return RELAY_SOURCE_ERROR;
+    }
+
+    uint64_t user_data;
+    int res;
+    while (uring_reap(ring, &user_data, &res))
+    {
+      unsigned index = user_data >> 8;
+      struct slot *done = &slots[index];
+      in_flight--;
+
+      if ((user_data & 0xff) == URING_OP_RECV)
+      {
+        receiving = 0;
+        if (res == -EINTR || res == -EAGAIN)
+          continue;
+        if (res <= 0)
+        {
+          // the sender went away, or closed in the middle of the body
+          errno = res < 0 ? -res : ECONNRESET;
+          result = RELAY_SOURCE_ERROR;
+          continue;
+        }
+        received += res;
+        done->length += res;
+        if (done->length < TRANSFER_BUFFER_SIZE && received < length)
+          continue;
+
+        // the buffer is full, write it while the next one is received
+        if (hash != NULL)
+          sha256_update(hash, slot_buffer(ring, index), done->length);
+        if (crc != NULL)
+          *crc = crc32c(*crc, slot_buffer(ring, index), done->length);
+        filling++;
+        if (result != 0)
+        {
+          done->state = SLOT_FREE;
+          continue;
+        }
+        done->state = SLOT_WRITING;
+        done->done = 0;
+        uring_queue(ring, IORING_OP_WRITE, fd, index, 0, done->length, done->file_offset, 0, URING_OP_WRITE);
+        in_flight++;
+        continue;
+      }
+
+      // a file write
+      if (res > 0)
+        done->done += res;
+      if (res == -EINTR || res == -EAGAIN || (res > 0 && done->done < done->length && result == 0))
+      {
+        uring_queue(ring, IORING_OP_WRITE, fd, index, done->done, done->length - done->done,
+                    done->file_offset + done->done, 0, URING_OP_WRITE);
+        in_flight++;
+        continue;
+      }
+      if (res <= 0 && result == 0)
+      {
+        errno = res < 0 ? -res : EIO;
+        result = RELAY_SINK_ERROR;
+      }
+      done->state = SLOT_FREE;
+    }
+  }
+
+  // Keep the source framed even though the file is gone
+  if (result == RELAY_SINK_ERROR && discard_payload(socket, length - received) != 0)
+    result = RELAY_SOURCE_ERROR;
+  return result;
+}
+
+int uring_receive_file(int socket, const char *file_path, uint64_t file_size, struct sha256 *hash, uint32_t *crc)
+{
+  if (uring_get() == NULL)
+    return URING_UNSUPPORTED;
+
+  int fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0)
+  {
+    perror("Failed to create file");
+    discard_payload(socket, file_size);
+    return -1;
+  }
+
+  int result = uring_receive_data(socket, fd, 0, file_size, hash, crc);
+  if (result == RELAY_SOURCE_ERROR)
+  {
+    // the sender went away, do not keep a truncated file
+    perror("Failed to receive file");
+    close(fd);
+    remove(file_path);
+    return -1;
+  }
+  if (result != 0)
+  {
+    perror("Failed to write to file");
+    close(fd);
+    return -1;
+  }
+  if (close(fd) != 0)
+  {
+    perror("Failed to write to file");
+    return -1;
+  }
+  return 1;
+}
+
+int uring_send_data(int socket, int fd, uint64_t *offset, uint64_t *remaining)
+{
+  struct uring *ring = uring_get();
+  if (ring == NULL)
+    return URING_UNSUPPORTED;
+
+  struct slot slots[URING_BUFFERS];
+  memset(slots, 0, sizeof(slots));
+
+  uint64_t read_offset = *offset; // file offset of the next read
+  uint64_t unread = *remaining;   // bytes not yet read ahead
+  unsigned reading = 0;           // sequence number of the next buffer to read into
+  unsigned sending = 0;           // sequence number of the next buffer to send, in file order
+  int send_busy = 0;
+  unsigned in_flight = 0;
+  int result = 0;
+
+  for (;;)
+  {
+    // read ahead into every free buffer
+    while (result == 0 && unread > 0 && slots[reading % URING_BUFFERS].state == SLOT_FREE)
+    {
+      struct slot *slot = &slots[reading % URING_BUFFERS];
+      slot->state = SLOT_READING;
+      slot->file_offset = read_offset;
+      slot->length = unread > TRANSFER_BUFFER_SIZE ? TRANSFER_BUFFER_SIZE : unread;
+      slot->done = 0;
+      uring_queue(ring, IORING_OP_READ, fd, reading % URING_BUFFERS, 0, slot->length, read_offset, 0, URING_OP_READ);
+      read_offset += slot->length;
+      unread -= slot->length;
+      reading++;
+      in_flight++;
+    }
+
+    // send the oldest buffer once it is read
+    struct slot *next = &slots[sending % URING_BUFFERS];
+    if (result == 0 && !send_busy && next->state == SLOT_READY)
+    {
+      size_t pending = next->length - next->done;
+      int flags = MSG_NOSIGNAL | (*remaining > pending ? MSG_MORE : 0);
+      uring_queue(ring, IORING_OP_SEND, socket, sending % URING_BUFFERS, next->done, pending, 0, flags, URING_OP_SEND);
+      next->state = SLOT_SENDING;
+      send_busy = 1;
+      in_flight++;
+    }
+
+    if (in_flight == 0)
+      break;
+    if (uring_wait(ring) != 0)
+    {
+      perror("Failed to wait for io_uring");
+      uring_discard(ring);
+      return -1;
+    }
+
+    uint64_t user_data;
+    int res;
+    while (uring_reap(ring, &user_data, &res))
+    {
+      unsigned index = user_data >> 8;
+      struct slot *done = &slots[index];
+      in_flight--;
+
+      if ((user_data & 0xff) == URING_OP_READ)
+      {
+        if (res > 0)
+          done->done += res;
+        if (res == -EINTR || res == -EAGAIN || (res > 0 && done->done < done->length && result == 0))
+        {
+          uring_queue(ring, IORING_OP_READ, fd, index, done->done, done->length - done->done,
+                      done->file_offset + done->done, 0, URING_OP_READ);
+          in_flight++;
+          continue;
+        }
+        if (res <= 0)
+        {
+          // a read of 0 means the file shrank underneath us
+          if (result == 0)
+            errno = res < 0 ? -res : EIO;
+          result = -1;
+          done->state = SLOT_FREE;
+          continue;
+        }
+        done->state = SLOT_READY;
+        done->done = 0;
+        continue;
+      }
+
+      // a socket send
+      send_busy = 0;
+      if (res == -EINTR || res == -EAGAIN)
+      {
+        done->state = SLOT_READY;
+        continue;
+      }
+      if (res <= 0)
+      {
+        if (result == 0)
+          errno = res < 0 ? -res : EPIPE;
+        result = -1;
+        done->state = SLOT_FREE;
+        continue;
+      }
+      done->done += res;
+      *offset += res;
+      *remaining -= res;
+      if (done->done < done->length)
+      {
+        done->state = SLOT_READY;
+        continue;
+      }
+      done->state = SLOT_FREE;
+      sending++;
+    }
+  }
+  return result;
+}
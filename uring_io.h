@@ -0,0 +1,102 @@
+#ifndef URING_IO_H
+#define URING_IO_H
+
+#include <stdint.h>
+
+#include "sha256.h"
+
+/*
+ * io_uring I/O engine for file bodies, selected with --io-engine uring.
+ *
+ * A receive keeps one socket receive in flight while the buffers received
+ * before it are written to the file, so the network and the disk overlap and
+ * a slow disk only stalls the socket once every buffer is waiting on a write.
+ * A send reads ahead into every free buffer while the oldest one is sent, in
+ * file order. Each process sets up one ring on first use, with URING_BUFFERS
+ * buffers of TRANSFER_BUFFER_SIZE registered as fixed buffers for the file
+ * reads and writes, and every pass of the loop queues all the operations it can
+ * before a single io_uring_enter submits them and waits for a completion.
+ *
+ * The ring is driven with the raw system calls, so no liburing is needed. When
+ * the kernel refuses io_uring, or lacks one of the operations, the callers fall
+ * back to the stdio path.
+ */
+
+// Number of buffers, and so of operations in flight, per ring
+#define URING_BUFFERS 8
+
+// Returned when io_uring is not available, before any byte was moved
+#define URING_UNSUPPORTED -3
+
+enum io_engine
+{
+  IO_ENGINE_STDIO, // blocking recv/fwrite and the --send-mode transmit path
+  IO_ENGINE_URING, // pipelined io_uring receives, writes, reads and sends
+};
+
+/**
+ * @brief I/O engine used for file bodies, selected with --io-engine.
+ */
+extern enum io_engine file_io_engine;
+
+/**
+ * @brief Parse an I/O engine name ("stdio" or "uring").
+ *
+ * @param name The name given on the command line.
+ * @param engine The parsed engine.
+ * @return int Returns 0 on success, -1 if the name is unknown.
+ */
+int parse_io_engine(const char *name, enum io_engine *engine);
+
+/**
+ * @brief Get the name of an I/O engine.
+ *
+ * @param engine The engine.
+ * @return const char* The engine name.
+ */
+const char *io_engine_name(enum io_engine engine);
+
+/**
+ * @brief Receive bytes of a data frame body from a socket into a file at an offset through the ring.
+ *
+ * If the file cannot be written, the rest of the bytes are still drained from
+ * the socket so its stream stays framed.
+ *
+ * @param socket The socket to read the bytes from.
+ * @param fd The file descriptor to write to.
+ * @param offset The file offset of the first byte.
+ * @param length The number of bytes to receive.
+ * @param hash Updated with the bytes in order, or NULL.
+ * @param crc Extended with the CRC32C of the bytes in order, or NULL.
+ * @return int Returns 0 on success, RELAY_SOURCE_ERROR, RELAY_SINK_ERROR or URING_UNSUPPORTED otherwise.
+ */
+int uring_receive_data(int socket, int fd, uint64_t offset, uint64_t length, struct sha256 *hash, uint32_t *crc);
+
+/**
+ * @brief Receive a data frame body from a socket into a new file through the ring.
+ *
+ * A file that was only partly received is removed. If the file cannot be
+ * written, the rest of the body is still drained from the socket so its stream
+ * stays framed.
+ *
+ * @param socket The socket to read the body from.
+ * @param file_path The path of the file to create.
+ * @param file_size The number of bytes to receive.
+ * @param hash Updated with the body in order, or NULL.
+ * @param crc Extended with the CRC32C of the body in order, or NULL.
+ * @return int Returns 1 on success, -1 on failure, URING_UNSUPPORTED if nothing was received.
+ */
+int uring_receive_file(int socket, const char *file_path, uint64_t file_size, struct sha256 *hash, uint32_t *crc);
+
+/**
+ * @brief Send a range of a file to a socket through the ring.
+ *
+ * @param socket The socket to send on.
+ * @param fd The file descriptor to read from.
+ * @param offset The file offset of the first byte to send, advanced by the bytes sent.
+ * @param remaining The number of bytes to send, decreased by the bytes sent.
+ * @return int Returns 0 if all bytes were sent, -1 or URING_UNSUPPORTED otherwise.
+ */
+int uring_send_data(int socket, int fd, uint64_t *offset, uint64_t *remaining);
+
+#endif